@@ -12,6 +12,7 @@
 #include "rundata.h"
 
 #include <iostream>
+#include <math.h>
 #include <string>
 
 using namespace std;
@@ -30,6 +31,28 @@ ConvergenceDetector *ConvergenceDetector::NewFromName(const string &name)
 void ConvergenceDetector::Initialize(FabberRunData &params)
 {
     m_log = params.GetLogger();
+    m_jacobian_refresh = params.GetIntDefault("jacobian-refresh", 1);
+    if (m_jacobian_refresh <= 0)
+        throw InvalidOptionValue(
+            "jacobian-refresh", stringify(m_jacobian_refresh), "Must be positive");
+    ResetJacobian();
+}
+
+bool ConvergenceDetector::NeedFullJacobian(double F)
+{
+    ++m_jacobian_its;
+    bool full = (m_jacobian_its >= m_jacobian_refresh) || NeedRevert()
+        || (UseF() && (F < m_jacobian_f));
+    if (full)
+        m_jacobian_its = 0;
+    m_jacobian_f = F;
+    return full;
+}
+
+void ConvergenceDetector::ResetJacobian()
+{
+    m_jacobian_its = 0;
+    m_jacobian_f = -99e99;
 }
 void CountingConvergenceDetector::Initialize(FabberRunData &params)
 {
@@ -63,6 +86,7 @@ void CountingConvergenceDetector::Reset(double F)
 {
     m_its = 0;
     m_reason = "";
+    ResetJacobian();
 }
 
 void FchangeConvergenceDetector::Initialize(FabberRunData &params)
@@ -214,6 +238,69 @@ void TrialModeConvergenceDetector::Dump(ostream &out, const string &indent) cons
     out << indent << "Previous Free Energy == " << m_prev_f << endl;
 }
 
+void PchangeConvergenceDetector::Initialize(FabberRunData &params)
+{
+    TrialModeConvergenceDetector::Initialize(params);
+
+    m_min_pchange = params.GetDoubleDefault("min-pchange", 0.01);
+    if (m_min_pchange <= 0)
+        throw InvalidOptionValue("min-pchange", stringify(m_min_pchange), "Must be positive");
+    Reset();
+}
+
+void PchangeConvergenceDetector::Reset(double F)
+{
+    TrialModeConvergenceDetector::Reset(F);
+    m_prev_means.clear();
+    m_pchange = -1;
+    m_saved = 0;
+}
+
+bool PchangeConvergenceDetector::Test(double F, const MVNDist &posterior)
+{
+    // F change, trial mode and iteration budget first so that the save and
+    // revert flags reflect this iteration
+    if (TrialModeConvergenceDetector::Test(F))
+        return true;
+
+    const int nparams = posterior.means.Nrows();
+    bool first = (int(m_prev_means.size()) != nparams);
+    m_pchange = 0;
+    if (!first)
+    {
+        const NEWMAT::SymmetricMatrix &cov = posterior.GetCovariance();
+        for (int p = 1; p <= nparams; p++)
+        {
+            double change = fabs(posterior.means(p) - m_prev_means[p - 1]);
+            if (cov(p, p) > 0)
+                change /= sqrt(cov(p, p));
+            if (change > m_pchange)
+                m_pchange = change;
+        }
+    }
+    m_prev_means.resize(nparams);
+    for (int p = 1; p <= nparams; p++)
+    {
+        m_prev_means[p - 1] = posterior.means(p);
+    }
+
+    if (!first && (m_pchange < m_min_pchange))
+    {
+        m_reason = "Parameter change less than minimum";
+        m_saved = m_max_its - m_its;
+        return true;
+    }
+    return false;
+}
+
+void PchangeConvergenceDetector::Dump(ostream &out, const string &indent) const
+{
+    out << indent << "Iteration " << m_its << " of at most " << m_max_its << " : " << m_reason
+        << endl;
+    out << indent << "Previous Free Energy == " << m_prev_f << endl;
+    out << indent << "Largest parameter change == " << m_pchange << " std" << endl;
+}
+
 void LMConvergenceDetector::Initialize(FabberRunData &params)
 {
     ConvergenceDetector::Initialize(params);
@@ -238,6 +325,7 @@ void LMConvergenceDetector::Reset(double F)
     m_alpha = 0.0;
     m_alphamax = 1e6;
     m_LM = false;
+    ResetJacobian();
 }
 
 bool LMConvergenceDetector::Test(double F)
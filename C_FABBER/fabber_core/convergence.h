@@ -8,11 +8,13 @@
 
 #pragma once
 
+#include "dist_mvn.h"
 #include "factories.h"
 #include "rundata.h"
 
 #include <ostream>
 #include <string>
+#include <vector>
 
 /**
  * Abstract base class for method of testing whether the free energy maximisation algorithm has
@@ -25,6 +27,12 @@ public:
 
     static ConvergenceDetector *NewFromName(const std::string &name);
 
+    ConvergenceDetector()
+        : m_jacobian_refresh(1)
+        , m_jacobian_its(0)
+        , m_jacobian_f(-99e99)
+    {
+    }
     virtual ~ConvergenceDetector()
     {
     }
@@ -40,6 +48,27 @@ public:
      */
     virtual bool Test(double F) = 0;
 
+    /**
+     * Test for convergence given the current parameter posterior as well as the free energy
+     *
+     * Detectors which look at the parameters override this. By default the
+     * posterior is ignored
+     */
+    virtual bool Test(double F, const MVNDist &posterior)
+    {
+        return Test(F);
+    }
+
+    /**
+     * Number of iterations saved by stopping before the iteration limit because
+     * the parameters stopped changing, for reporting. Only non-zero for detectors
+     * which look at the parameters
+     */
+    virtual int IterationsSaved() const
+    {
+        return 0;
+    }
+
     /**
      * Reset as if algorithm was starting from scratch
      */
@@ -76,6 +105,28 @@ public:
     {
         return 0.0;
     }
+    /**
+     * Does the next linearization need a full recalculation of the Jacobian?
+     *
+     * Called at each linearization update. If false, the Jacobian can instead
+     * be corrected with a rank-one (Broyden) update. With jacobian-refresh=N
+     * the Jacobian is recalculated in full every N iterations, and also if F
+     * has decreased since the previous call or the detector is reverting to
+     * saved parameters (e.g. a Levenberg-Marquardt step). The default of 1
+     * always recalculates.
+     *
+     * @param F Current free energy. Ignored unless the detector uses F
+     */
+    virtual bool NeedFullJacobian(double F);
+    /**
+     * Does NeedFullJacobian need to be given the current free energy?
+     *
+     * If not, the caller can skip calculating F before the linearization update
+     */
+    bool NeedJacobianF() const
+    {
+        return UseF() && (m_jacobian_refresh > 1);
+    }
     /**
      * Reason convergence reached
      *
@@ -92,7 +143,22 @@ public:
     virtual void Dump(std::ostream &out, const std::string &indent = "") const = 0;
 
 protected:
+    /**
+     * Start counting iterations between full Jacobian recalculations again.
+     * Called by Reset
+     */
+    void ResetJacobian();
+
     std::string m_reason;
+
+    /** Number of iterations between full Jacobian recalculations */
+    int m_jacobian_refresh;
+
+    /** Number of linearizations since the last full recalculation */
+    int m_jacobian_its;
+
+    /** Free energy at the last linearization */
+    double m_jacobian_f;
 };
 
 /**
@@ -115,6 +181,14 @@ public:
      */
     virtual void Reset(double F = -99e99);
 
+    /**
+     * Set the number of iterations already done, e.g. when resuming a run
+     */
+    void SetIterations(int its)
+    {
+        m_its = its;
+    }
+
     virtual void Dump(std::ostream &out, const std::string &indent = "") const;
 
 protected:
@@ -238,6 +312,49 @@ protected:
     bool m_trialmode;
 };
 
+/**
+ * Convergence detector which also stops when the parameters stop changing
+ *
+ * Behaves as TrialModeConvergenceDetector, but also converges when the change
+ * in every posterior mean since the previous iteration is less than min-pchange
+ * posterior standard deviations. max-iterations is the budget of iterations for
+ * each voxel, including iterations which are reverted.
+ *
+ * If F has just decreased the detector still reverts to the best saved
+ * parameters, as for trial mode
+ */
+class PchangeConvergenceDetector : public TrialModeConvergenceDetector
+{
+public:
+    static ConvergenceDetector *NewInstance()
+    {
+        return new PchangeConvergenceDetector();
+    }
+    virtual void Initialize(FabberRunData &params);
+
+    using TrialModeConvergenceDetector::Test;
+    virtual bool Test(double F, const MVNDist &posterior);
+
+    virtual void Reset(double F = -99e99);
+
+    virtual int IterationsSaved() const
+    {
+        return m_saved;
+    }
+    virtual void Dump(std::ostream &out, const std::string &indent = "") const;
+
+protected:
+    double m_min_pchange;
+
+    /** Largest change in a posterior mean at the last test, in posterior standard deviations */
+    double m_pchange;
+
+    /** Posterior means at the previous test, empty before the first */
+    std::vector<double> m_prev_means;
+
+    int m_saved;
+};
+
 /**
  * Convergence detector which gives a variable amount of time
  * for F to increase after a decrease.
@@ -23,6 +23,7 @@ MVNDist::MVNDist(EasyLog *log)
     , m_size(-1)
     , precisionsValid(false)
     , covarianceValid(false)
+    , logDetValid(false)
 {
 }
 
@@ -31,6 +32,7 @@ MVNDist::MVNDist(int dim, EasyLog *log)
     , m_size(-1)
     , precisionsValid(false)
     , covarianceValid(false)
+    , logDetValid(false)
 {
     SetSize(dim);
 }
@@ -40,6 +42,7 @@ MVNDist::MVNDist(const MVNDist &from)
     , m_size(-1)
     , precisionsValid(false)
     , covarianceValid(false)
+    , logDetValid(false)
 {
     *this = from;
 }
@@ -49,6 +52,7 @@ MVNDist::MVNDist(const string filename, EasyLog *log)
     , m_size(-1)
     , precisionsValid(false)
     , covarianceValid(false)
+    , logDetValid(false)
 {
     LoadFromMatrix(filename);
 }
@@ -58,6 +62,7 @@ MVNDist::MVNDist(const MVNDist &from1, const MVNDist &from2)
     , m_size(-1)
     , precisionsValid(false)
     , covarianceValid(false)
+    , logDetValid(false)
 {
     SetSize(from1.m_size + from2.m_size);
 
@@ -86,7 +91,7 @@ MVNDist &MVNDist::operator=(const MVNDist &from)
     if (from.m_size == -1)
     {
         m_size = -1;
-        precisionsValid = covarianceValid = false;
+        precisionsValid = covarianceValid = logDetValid = false;
         // Free any memory from previous instance
         SetSize(1);
         return *this;
@@ -104,6 +109,10 @@ MVNDist &MVNDist::operator=(const MVNDist &from)
     if (covarianceValid)
         covariance = from.covariance;
 
+    logDetValid = from.logDetValid;
+    logDetPrecisions = from.logDetPrecisions;
+    logDetSign = from.logDetSign;
+
     assert(means.Nrows() == m_size);
     return *this;
 }
@@ -126,6 +135,7 @@ void MVNDist::CopyFromSubmatrix(const MVNDist &from, int first, int last, bool c
 
     if (covarianceValid)
         covariance = from.covariance.SymSubMatrix(first, last);
+    logDetValid = false;
 
     assert(means.Nrows() == m_size);
 
@@ -163,6 +173,7 @@ void MVNDist::SetSize(int dim)
     }
     precisionsValid = true;
     covarianceValid = true;
+    logDetValid = false;
 
     assert(means.Nrows() == m_size);
     assert(precisions.Nrows() == m_size);
@@ -246,6 +257,7 @@ void MVNDist::SetPrecisions(const SymmetricMatrix &from)
     precisions = from;
     precisionsValid = true;
     covarianceValid = false;
+    logDetValid = false;
     assert(means.Nrows() == m_size);
 }
 
@@ -256,9 +268,24 @@ void MVNDist::SetCovariance(const SymmetricMatrix &from)
     covariance = from;
     covarianceValid = true;
     precisionsValid = false;
+    logDetValid = false;
     assert(means.Nrows() == m_size);
 }
 
+double MVNDist::GetLogDetPrecisions(int *sign) const
+{
+    if (!logDetValid)
+    {
+        LogAndSign ld = GetPrecisions().LogDeterminant();
+        logDetPrecisions = ld.LogValue();
+        logDetSign = ld.Sign();
+        logDetValid = true;
+    }
+    if (sign)
+        *sign = logDetSign;
+    return logDetPrecisions;
+}
+
 void MVNDist::LoadFromMatrix(const string &filename)
 {
     LOG << "MVNDist::Reading MVN from file '" << filename << "'...\n";
@@ -182,6 +182,17 @@ public:
      */
     void SetCovariance(const NEWMAT::SymmetricMatrix &from);
 
+    /**
+     * Get the log of the determinant of the precision matrix
+     *
+     * This is cached until the precisions or covariances are next set,
+     * so an update which checks the determinant and the free energy
+     * calculation which follows only need to calculate it once
+     *
+     * @param sign If not NULL, set to the sign of the determinant
+     */
+    double GetLogDetPrecisions(int *sign = NULL) const;
+
     /**
      * Load from matrix file
      *
@@ -217,6 +228,9 @@ private:
     mutable NEWMAT::SymmetricMatrix covariance;
     mutable bool precisionsValid;
     mutable bool covarianceValid;
+    mutable double logDetPrecisions;
+    mutable int logDetSign;
+    mutable bool logDetValid;
 };
 
 inline std::ostream &operator<<(std::ostream &out, const MVNDist &dist)
@@ -8,6 +8,8 @@
 
 #include "easylog.h"
 
+#include "threads.h"
+
 #include <assert.h>
 #include <errno.h>
 #include <fstream>
@@ -21,11 +23,13 @@ using namespace std;
 EasyLog::EasyLog()
     : m_stream(0)
     , m_outdir("")
+    , m_warn_mutex(new Mutex())
 {
 }
 
 EasyLog::~EasyLog()
 {
+    delete m_warn_mutex;
 }
 void EasyLog::StartLog(const string &outDir)
 {
@@ -104,18 +108,21 @@ std::ostream &EasyLog::LogStream()
 
 void EasyLog::WarnOnce(const string &text)
 {
+    ScopedLock lock(*m_warn_mutex);
     if (++m_warncount[text] == 1)
         LogStream() << "WARNING ONCE: " << text << std::endl;
 }
 
 void EasyLog::WarnAlways(const string &text)
 {
+    ScopedLock lock(*m_warn_mutex);
     ++m_warncount[text];
     LogStream() << "WARNING ALWAYS: " << text << std::endl;
 }
 
 void EasyLog::ReissueWarnings()
 {
+    ScopedLock lock(*m_warn_mutex);
     if (m_warncount.size() == 0)
         return; // avoid issuing pointless message
 
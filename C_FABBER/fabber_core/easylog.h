@@ -32,9 +32,15 @@
     if (m_log)                                                                                     \
     m_log->WarnAlways(x)
 
+class Mutex;
+
 /**
  * Sends logging information to an output stream
  *
+ * Each run should have its own log. Warnings may be issued from multiple
+ * threads working on the same run, however other output should only be
+ * written from one thread at a time.
+ *
  * StartLog() is used to tell the logger where to put the output - any log
  * calls made before this are stored in a temporary stringstream and then
  * flushed to the log once StartLog is called.
@@ -117,10 +123,17 @@ public:
     void ReissueWarnings();
 
 private:
+    // Not copyable
+    EasyLog(const EasyLog &);
+    EasyLog &operator=(const EasyLog &);
+
     std::ostream *m_stream;
     std::stringstream m_templog;
     std::string m_outdir;
     std::map<std::string, int> m_warncount;
+
+    /** Protects warnings issued from worker threads */
+    Mutex *m_warn_mutex;
 };
 
 class Loggable
@@ -15,9 +15,12 @@
 #include "inference.h"
 #include "rundata_array.h"
 #include "setup.h"
+#include "threads.h"
 
 #include "newmat.h"
 
+#include <algorithm>
+#include <limits>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -42,12 +45,282 @@ static int fabber_err(int code, const char *msg, char *err_buf)
     return code;
 }
 
+namespace
+{
+/**
+ * Run fabber, capturing the log and any error
+ *
+ * @param err_buf Buffer for error message, not NULL
+ * @return 0 on success, <0 on failure
+ */
+int run_fabber(FabberRunDataArray &rundata, ProgressCheck *progress, string &log_out, char *err_buf)
+{
+    EasyLog log;
+    int ret = 0;
+    rundata.SetLogger(&log);
+    stringstream logstr;
+    try
+    {
+        log.StartLog(logstr);
+        rundata.Run(progress);
+        log.ReissueWarnings();
+    }
+    catch (const FabberError &e)
+    {
+        log.ReissueWarnings();
+        log.LogStream() << e.what() << endl;
+        ret = fabber_err(FABBER_ERR_FATAL, e.what(), err_buf);
+    }
+    catch (const exception &e)
+    {
+        log.ReissueWarnings();
+        log.LogStream() << "STL exception caught in fabber:\n  " << e.what() << endl;
+        ret = fabber_err(FABBER_ERR_FATAL, e.what(), err_buf);
+    }
+    catch (NEWMAT::Exception &e)
+    {
+        log.ReissueWarnings();
+        log.LogStream() << "NEWMAT exception caught in fabber:\n  " << e.what() << endl;
+        ret = fabber_err(FABBER_ERR_NEWMAT, e.what(), err_buf);
+    }
+    catch (...)
+    {
+        log.ReissueWarnings();
+        log.LogStream() << "Some other exception caught in fabber!" << endl;
+        ret = fabber_err(FABBER_ERR_FATAL, "Unrecognized exception", err_buf);
+    }
+
+    log.StopLog();
+    rundata.SetLogger(NULL);
+    log_out = logstr.str();
+    return ret;
+}
+
+/**
+ * A run started by fabber_dorun_async
+ *
+ * The run thread reports progress and the caller's thread polls it and may
+ * ask for the run to be cancelled, so all state is accessed under a lock
+ */
+class AsyncRun : public Thread, public ProgressCheck
+{
+public:
+    explicit AsyncRun(FabberRunDataArray &rundata)
+        : m_rundata(rundata)
+        , m_voxel(0)
+        , m_nvoxels(0)
+        , m_iteration(0)
+        , m_mean_F(0)
+        , m_cancel(false)
+        , m_done(false)
+        , m_ret(0)
+    {
+        m_err[0] = '\0';
+    }
+
+    void Progress(int voxel, int nvoxels)
+    {
+        ScopedLock lock(m_mutex);
+        m_voxel = voxel;
+        m_nvoxels = nvoxels;
+    }
+
+    void Iteration(int iteration, double mean_F)
+    {
+        ScopedLock lock(m_mutex);
+        m_iteration = iteration;
+        m_mean_F = mean_F;
+    }
+
+    bool Cancelled()
+    {
+        ScopedLock lock(m_mutex);
+        return m_cancel;
+    }
+
+    void Cancel()
+    {
+        ScopedLock lock(m_mutex);
+        m_cancel = true;
+    }
+
+    /**
+     * Get the current state of the run
+     *
+     * Output pointers may be NULL
+     *
+     * @return true if the run has finished
+     */
+    bool Poll(int *voxel, int *nvoxels, int *iteration, double *mean_F)
+    {
+        ScopedLock lock(m_mutex);
+        if (voxel)
+            *voxel = m_voxel;
+        if (nvoxels)
+            *nvoxels = m_nvoxels;
+        if (iteration)
+            *iteration = m_iteration;
+        if (mean_F)
+            *mean_F = m_mean_F;
+        return m_done;
+    }
+
+    // The following may only be used once Poll has returned true
+
+    /** @return 0 on success, FABBER_RUN_CANCELLED or <0 on failure */
+    int Result() const
+    {
+        return ((m_ret == 0) && m_cancel) ? FABBER_RUN_CANCELLED : m_ret;
+    }
+    const string &Log() const
+    {
+        return m_log;
+    }
+    const char *Error() const
+    {
+        return m_err;
+    }
+
+protected:
+    void Run()
+    {
+        int ret = run_fabber(m_rundata, this, m_log, m_err);
+        ScopedLock lock(m_mutex);
+        m_ret = ret;
+        m_done = true;
+    }
+
+private:
+    FabberRunDataArray &m_rundata;
+    Mutex m_mutex;
+    int m_voxel, m_nvoxels, m_iteration;
+    double m_mean_F;
+    bool m_cancel, m_done;
+    int m_ret;
+    string m_log;
+    char m_err[FABBER_ERR_MAXC];
+};
+
+/**
+ * Evaluates the model for each sample in a batch
+ *
+ * Each thread has its own model and working vectors
+ */
+class BatchEvaluateWork : public ParallelWork
+{
+public:
+    BatchEvaluateWork(const vector<FwdModel *> &models, unsigned int n_params,
+        const float *params, unsigned int n_ts, const float *indata, const float *coords,
+        float *output)
+        : m_models(models)
+        , m_n_params(n_params)
+        , m_params(params)
+        , m_n_ts(n_ts)
+        , m_indata(indata)
+        , m_coords(coords)
+        , m_output(output)
+        , m_p(models.size(), NEWMAT::ColumnVector(n_params))
+        , m_data(models.size(), NEWMAT::ColumnVector(n_ts))
+        , m_c(models.size(), NEWMAT::ColumnVector(3))
+        , m_result(models.size())
+    {
+    }
+
+    virtual void Process(int sample, int thread)
+    {
+        NEWMAT::ColumnVector &p = m_p[thread];
+        NEWMAT::ColumnVector &data = m_data[thread];
+        NEWMAT::ColumnVector &c = m_c[thread];
+        NEWMAT::ColumnVector &result = m_result[thread];
+        float *output = m_output + size_t(sample) * m_n_ts;
+
+        const float *sample_params = m_params + size_t(sample) * m_n_params;
+        for (unsigned int i = 0; i < m_n_params; i++)
+        {
+            p(i + 1) = sample_params[i];
+        }
+        for (unsigned int i = 0; i < m_n_ts; i++)
+        {
+            data(i + 1) = m_indata ? m_indata[size_t(sample) * m_n_ts + i] : 0;
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            c(i + 1) = m_coords ? m_coords[size_t(sample) * 3 + i] : 1;
+        }
+
+        try
+        {
+            m_models[thread]->PassData(data, c);
+            m_models[thread]->EvaluateModel(p, result);
+            for (unsigned int i = 0; i < m_n_ts; i++)
+            {
+                // Model may not return the same number of timepoints as passed in!
+                output[i] = (int(i) < result.Nrows()) ? result(i + 1) : 0;
+            }
+        }
+        catch (...)
+        {
+            // Model may not be defined for all parameter values - a failed sample
+            // should not lose the rest of the batch
+            fill(output, output + m_n_ts, numeric_limits<float>::quiet_NaN());
+        }
+    }
+
+private:
+    const vector<FwdModel *> &m_models;
+    unsigned int m_n_params;
+    const float *m_params;
+    unsigned int m_n_ts;
+    const float *m_indata;
+    const float *m_coords;
+    float *m_output;
+    vector<NEWMAT::ColumnVector> m_p, m_data, m_c, m_result;
+};
+
+/**
+ * Run data for a context created by fabber_new, with its asynchronous run if any
+ */
+class FabberContext : public FabberRunDataArray
+{
+public:
+    FabberContext()
+        : FabberRunDataArray(false)
+        , async(NULL)
+    {
+    }
+
+    ~FabberContext()
+    {
+        if (async)
+        {
+            async->Cancel();
+            async->Join();
+            delete async;
+        }
+    }
+
+    /** @return true if an asynchronous run has been started and has not finished */
+    bool Running()
+    {
+        return async && !async->Poll(NULL, NULL, NULL, NULL);
+    }
+
+    AsyncRun *async;
+};
+}
+
+// API calls which use the run data must not be made while an asynchronous
+// run is using it
+#define CHECK_NOT_RUNNING(fab, err_buf)                                                            \
+    if (((FabberContext *)(FabberRunDataArray *)(fab))->Running())                                 \
+        return fabber_err(FABBER_ERR_FATAL, "Asynchronous run in progress", err_buf);
+
 void *fabber_new(char *err_buf)
 {
     try
     {
         FabberSetup::SetupDefaults();
-        FabberRunDataArray *rundata = new FabberRunDataArray(false);
+        FabberRunDataArray *rundata = new FabberContext();
         return rundata;
     }
     catch (...)
@@ -81,6 +354,7 @@ int fabber_set_extent(
 {
     if (!fab)
         return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
+    CHECK_NOT_RUNNING(fab, err_buf);
     if (!mask)
         return fabber_err(FABBER_ERR_FATAL, "Mask is NULL", err_buf);
     if ((nx <= 0) || (ny <= 0) || (nz <= 0))
@@ -110,6 +384,7 @@ int fabber_set_opt(void *fab, const char *key, const char *value, char *err_buf)
 {
     if (!fab)
         return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
+    CHECK_NOT_RUNNING(fab, err_buf);
 
     if (!key || !value)
         return fabber_err(FABBER_ERR_FATAL, "Option key or value is NULL", err_buf);
@@ -131,6 +406,7 @@ int fabber_set_data(
 {
     if (!fab)
         return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
+    CHECK_NOT_RUNNING(fab, err_buf);
     if (!data)
         return fabber_err(FABBER_ERR_FATAL, "Data buffer is NULL", err_buf);
     if (!name)
@@ -154,10 +430,69 @@ int fabber_set_data(
     return 0;
 }
 
+int fabber_set_data_ref(void *fab, const char *name, unsigned int data_size, const float *data,
+    const long *strides, char *err_buf)
+{
+    if (!fab)
+        return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
+    CHECK_NOT_RUNNING(fab, err_buf);
+    if (!data)
+        return fabber_err(FABBER_ERR_FATAL, "Data buffer is NULL", err_buf);
+    if (!name)
+        return fabber_err(FABBER_ERR_FATAL, "Data name is NULL", err_buf);
+    if (data_size <= 0)
+        return fabber_err(FABBER_ERR_FATAL, "Data size must be >0", err_buf);
+
+    FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
+    try
+    {
+        rundata->SetVoxelDataRef(name, data_size, data, strides);
+    }
+    catch (exception &e)
+    {
+        return fabber_err(FABBER_ERR_FATAL, e.what(), err_buf);
+    }
+    catch (...)
+    {
+        return fabber_err(FABBER_ERR_FATAL, "Error setting data", err_buf);
+    }
+    return 0;
+}
+
+int fabber_set_output_buffer(void *fab, const char *name, unsigned int data_size, float *data_buf,
+    const long *strides, char *err_buf)
+{
+    if (!fab)
+        return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
+    CHECK_NOT_RUNNING(fab, err_buf);
+    if (!data_buf)
+        return fabber_err(FABBER_ERR_FATAL, "Data buffer is NULL", err_buf);
+    if (!name)
+        return fabber_err(FABBER_ERR_FATAL, "Data name is NULL", err_buf);
+    if (data_size <= 0)
+        return fabber_err(FABBER_ERR_FATAL, "Data size must be >0", err_buf);
+
+    FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
+    try
+    {
+        rundata->SetOutputArray(name, data_size, data_buf, strides);
+    }
+    catch (exception &e)
+    {
+        return fabber_err(FABBER_ERR_FATAL, e.what(), err_buf);
+    }
+    catch (...)
+    {
+        return fabber_err(FABBER_ERR_FATAL, "Error setting output buffer", err_buf);
+    }
+    return 0;
+}
+
 int fabber_get_data_size(void *fab, const char *name, char *err_buf)
 {
     if (!fab)
         return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
+    CHECK_NOT_RUNNING(fab, err_buf);
     if (!name)
         return fabber_err(FABBER_ERR_FATAL, "Data name is NULL", err_buf);
 
@@ -180,6 +515,7 @@ int fabber_get_data(void *fab, const char *name, float *data_buf, char *err_buf)
 {
     if (!fab)
         return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
+    CHECK_NOT_RUNNING(fab, err_buf);
     if (!name)
         return fabber_err(FABBER_ERR_FATAL, "Data name is NULL", err_buf);
     if (!data_buf)
@@ -204,8 +540,6 @@ int fabber_get_data(void *fab, const char *name, float *data_buf, char *err_buf)
 int fabber_dorun(void *fab, unsigned int log_bufsize, char *log_buf, char *err_buf,
     void (*progress_cb)(int, int))
 {
-    EasyLog log;
-
     if (!fab)
         return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
     if (!log_buf)
@@ -214,66 +548,100 @@ int fabber_dorun(void *fab, unsigned int log_bufsize, char *log_buf, char *err_b
         return fabber_err(FABBER_ERR_FATAL, "Error buffer is NULL", err_buf);
     if (log_bufsize > 0 && !log_buf)
         return fabber_err(FABBER_ERR_FATAL, "Log buffer is NULL", err_buf);
+    CHECK_NOT_RUNNING(fab, err_buf);
 
-    int ret = 0;
     FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
-    rundata->SetLogger(&log);
-    stringstream logstr;
-    try
+    string log;
+    int ret;
+    if (progress_cb)
     {
-        log.StartLog(logstr);
-        if (progress_cb)
-        {
-            CallbackProgressCheck prog(progress_cb);
-            rundata->Run(&prog);
-        }
-        else
-        {
-            rundata->Run();
-        }
-        log.ReissueWarnings();
+        CallbackProgressCheck prog(progress_cb);
+        ret = run_fabber(*rundata, &prog, log, err_buf);
     }
-    catch (const FabberError &e)
-    {
-        log.ReissueWarnings();
-        log.LogStream() << e.what() << endl;
-        ret = fabber_err(FABBER_ERR_FATAL, e.what(), err_buf);
-    }
-    catch (const exception &e)
+    else
     {
-        log.ReissueWarnings();
-        log.LogStream() << "STL exception caught in fabber:\n  " << e.what() << endl;
-        ret = fabber_err(FABBER_ERR_FATAL, e.what(), err_buf);
+        ret = run_fabber(*rundata, NULL, log, err_buf);
     }
-    catch (NEWMAT::Exception &e)
+
+    strncpy(log_buf, log.c_str(), log_bufsize - 1);
+    log_buf[log_bufsize - 1] = '\0';
+
+    return ret;
+}
+
+int fabber_dorun_async(void *fab, char *err_buf)
+{
+    if (!fab)
+        return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
+    CHECK_NOT_RUNNING(fab, err_buf);
+
+    FabberContext *context = (FabberContext *)(FabberRunDataArray *)fab;
+    try
     {
-        log.ReissueWarnings();
-        log.LogStream() << "NEWMAT exception caught in fabber:\n  " << e.what() << endl;
-        ret = fabber_err(FABBER_ERR_NEWMAT, e.what(), err_buf);
+        if (context->async)
+        {
+            // Previous run has finished but may not have been joined
+            context->async->Join();
+            delete context->async;
+            context->async = NULL;
+        }
+        context->async = new AsyncRun(*context);
+        context->async->Start();
+        return 0;
     }
-    catch (...)
+    catch (exception &e)
     {
-        log.ReissueWarnings();
-        log.LogStream() << "Some other exception caught in fabber!" << endl;
-        ret = fabber_err(FABBER_ERR_FATAL, "Unrecognized exception", err_buf);
+        delete context->async;
+        context->async = NULL;
+        return fabber_err(FABBER_ERR_FATAL, e.what(), err_buf);
     }
+}
 
-    log.StopLog();
+int fabber_poll(void *fab, int *voxel, int *nvoxels, int *iteration, double *mean_F,
+    unsigned int log_bufsize, char *log_buf, char *err_buf)
+{
+    if (!fab)
+        return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
 
-    strncpy(log_buf, logstr.str().c_str(), log_bufsize - 1);
-    log_buf[log_bufsize - 1] = '\0';
+    FabberContext *context = (FabberContext *)(FabberRunDataArray *)fab;
+    if (!context->async)
+        return fabber_err(FABBER_ERR_FATAL, "No asynchronous run has been started", err_buf);
+    if (!context->async->Poll(voxel, nvoxels, iteration, mean_F))
+        return FABBER_RUN_RUNNING;
 
+    // Finished, so the thread is exiting and the results are no longer changing
+    context->async->Join();
+    if (log_buf && (log_bufsize > 0))
+    {
+        strncpy(log_buf, context->async->Log().c_str(), log_bufsize - 1);
+        log_buf[log_bufsize - 1] = '\0';
+    }
+    int ret = context->async->Result();
+    if (ret < 0)
+        fabber_err(ret, context->async->Error(), err_buf);
     return ret;
 }
 
+int fabber_cancel(void *fab, char *err_buf)
+{
+    if (!fab)
+        return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
+
+    FabberContext *context = (FabberContext *)(FabberRunDataArray *)fab;
+    if (!context->async)
+        return fabber_err(FABBER_ERR_FATAL, "No asynchronous run has been started", err_buf);
+    context->async->Cancel();
+    return 0;
+}
+
 void fabber_destroy(void *fab)
 {
     if (fab)
     {
-        // Get rid of registered models etc
-        FabberSetup::Destroy();
-        FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
-        delete rundata;
+        // Any asynchronous run is cancelled and waited for. Registered models are
+        // shared with other contexts so they are kept
+        FabberContext *context = (FabberContext *)(FabberRunDataArray *)fab;
+        delete context;
     }
 }
 
@@ -414,6 +782,7 @@ int fabber_get_model_params(void *fab, unsigned int out_bufsize, char *out_buf,
 {
     if (!fab)
         return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
+    CHECK_NOT_RUNNING(fab, err_buf);
     if (!out_buf)
         return fabber_err(FABBER_ERR_FATAL, "Output buffer is NULL", err_buf);
 
@@ -455,6 +824,7 @@ int fabber_get_model_outputs(void *fab, unsigned int out_bufsize, char *out_buf,
 {
     if (!fab)
         return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
+    CHECK_NOT_RUNNING(fab, err_buf);
     if (!out_buf)
         return fabber_err(FABBER_ERR_FATAL, "Output buffer is NULL", err_buf);
 
@@ -498,6 +868,7 @@ int fabber_model_evaluate(void *fab, unsigned int n_params, float *params, unsig
 {
     if (!fab)
         return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
+    CHECK_NOT_RUNNING(fab, err_buf);
     if (!params)
         return fabber_err(FABBER_ERR_FATAL, "Params array is NULL", err_buf);
     if (!output)
@@ -522,6 +893,9 @@ int fabber_model_evaluate(void *fab, unsigned int n_params, float *params, unsig
         for (unsigned int i = 0; i < n_params; i++)
         {
             p_vec(i + 1) = params[i];
+        }
+        for (unsigned int i = 0; i < n_ts; i++)
+        {
             if (indata)
                 data_vec(i + 1) = indata[i];
             else
@@ -563,3 +937,72 @@ int fabber_model_evaluate(void *fab, unsigned int n_params, float *params, unsig
 
     return ret;
 }
+
+int fabber_model_evaluate_batch(void *fab, unsigned int n_samples, unsigned int n_params,
+    const float *params, unsigned int n_ts, const float *indata, const float *coords,
+    float *output, int n_threads, char *err_buf)
+{
+    if (!fab)
+        return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
+    CHECK_NOT_RUNNING(fab, err_buf);
+    if (!params)
+        return fabber_err(FABBER_ERR_FATAL, "Params array is NULL", err_buf);
+    if (!output)
+        return fabber_err(FABBER_ERR_FATAL, "Output buffer is NULL", err_buf);
+    if (n_threads < 0)
+        return fabber_err(FABBER_ERR_FATAL, "Number of threads must be >=0", err_buf);
+    if (n_samples == 0)
+        return 0;
+
+    if (n_threads == 0)
+        n_threads = NumProcessors();
+    n_threads = min(n_threads, int(n_samples));
+
+    EasyLog log;
+    stringstream logstr;
+    log.StartLog(logstr);
+    vector<FwdModel *> models;
+    int ret = 0;
+    try
+    {
+        // Models are initialized in this thread as initialization may not be thread safe
+        FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
+        for (int t = 0; t < n_threads; t++)
+        {
+            FwdModel *model = FwdModel::NewFromName(rundata->GetString("model"));
+            models.push_back(model);
+            model->SetLogger(&log);
+            model->Initialize(*rundata);
+        }
+
+        vector<Parameter> model_params;
+        models[0]->GetParameters(*rundata, model_params);
+        if (model_params.size() != n_params)
+        {
+            throw FabberRunDataError("Model has " + stringify(model_params.size())
+                + " parameters but " + stringify(n_params) + " were given");
+        }
+
+        BatchEvaluateWork work(models, n_params, params, n_ts, indata, coords, output);
+        ParallelFor(work, n_samples, n_threads, 64);
+    }
+    catch (exception &e)
+    {
+        ret = fabber_err(FABBER_ERR_FATAL, e.what(), err_buf);
+    }
+    catch (NEWMAT::Exception &e)
+    {
+        ret = fabber_err(FABBER_ERR_NEWMAT, e.what(), err_buf);
+    }
+    catch (...)
+    {
+        ret = fabber_err(FABBER_ERR_FATAL, "Error in fabber_model_evaluate_batch", err_buf);
+    }
+
+    for (unsigned int t = 0; t < models.size(); t++)
+    {
+        delete models[t];
+    }
+    log.StopLog();
+    return ret;
+}
@@ -29,9 +29,18 @@ extern "C" {
 #define FABBER_ERR_FATAL -255
 #define FABBER_ERR_NEWMAT -254
 
+// Status returned by fabber_poll other than 0 (finished) or an error code
+#define FABBER_RUN_RUNNING 1
+#define FABBER_RUN_CANCELLED 2
+
 /**
  * Create a new context for running fabber.
  *
+ * Contexts are independent, so different contexts may be used at the same time from
+ * different threads, e.g. to run several fits from a thread pool. A single context must
+ * only be used by one thread at a time, apart from fabber_poll and fabber_cancel during
+ * an asynchronous run. Models loaded with fabber_load_models are available to all contexts.
+ *
  * @param err_buf Optional buffer for error message. Max message length=FABBER_ERR_MAXC
  *
  * @return A handle to the context. This should not be used for any purpose apart from
@@ -73,7 +82,8 @@ FABBER_DLL_API int fabber_set_extent(
 /**
  * Destroy fabber context previously created in fabber_new
  *
- * Will not return any errors.
+ * Will not return any errors. If an asynchronous run is in progress it is
+ * cancelled and this waits for it to stop.
  *
  * @param fab Fabber context, returned by fabber_new. NULL will be ignored. Anything
  *            else will probably cause a crash.
@@ -109,6 +119,51 @@ FABBER_DLL_API int fabber_set_opt(void *fab, const char *key, const char *value,
 FABBER_DLL_API int fabber_set_data(
     void *fab, const char *name, unsigned int data_size, const float *data, char *err_buf);
 
+/**
+ * Set voxel data from a caller-owned buffer without copying it
+ *
+ * The buffer is not copied when this is called. It is read once, directly into the
+ * masked voxel data used by the run, when the data is first needed. It must therefore
+ * remain valid and unchanged until the run has finished or the data is replaced.
+ *
+ * @param fab Fabber context, returned by fabber_new
+ * @param name Name of data. Main timeseries has name 'data'. Not null, not empty
+ * @param data_size Data size in 4th dimension, i.e. number of t-slices for the main
+ *                  timeseries, 1 for simple image data.
+ * @param data Array containing nx*ny*nz*data_size values, including masked voxels
+ * @param strides Array of 4 values giving the number of floats between successive elements
+ *                in the x, y, z and 4th dimensions. This allows any memory layout, e.g. C order
+ *                or a view of a larger array. If NULL, column-major order is used as for
+ *                fabber_set_data
+ * @param err_buf Optional buffer for error message. Max message length=FABBER_ERR_MAXC
+ *
+ * @return 0 on success, <0 on failure
+ */
+FABBER_DLL_API int fabber_set_data_ref(void *fab, const char *name, unsigned int data_size,
+    const float *data, const long *strides, char *err_buf);
+
+/**
+ * Set a caller-owned buffer to receive output voxel data
+ *
+ * When the run saves the named output it is written directly into the buffer, with
+ * masked voxels set to zero, rather than being kept for fabber_get_data. The buffer must
+ * remain valid until the run has finished. If the output does not have data_size values
+ * per voxel the run fails. After the run, fabber_get_data_size fails for the output
+ * if it was never written to the buffer.
+ *
+ * @param fab Fabber context, returned by fabber_new
+ * @param name Name of output data, e.g. mean_c0. Not null, not empty
+ * @param data_size Data size in 4th dimension, 1 for simple image data
+ * @param data_buf Array with space for nx*ny*nz*data_size values
+ * @param strides Array of 4 values giving the number of floats between successive elements
+ *                in the x, y, z and 4th dimensions, or NULL for column-major order
+ * @param err_buf Optional buffer for error message. Max message length=FABBER_ERR_MAXC
+ *
+ * @return 0 on success, <0 on failure
+ */
+FABBER_DLL_API int fabber_set_output_buffer(void *fab, const char *name, unsigned int data_size,
+    float *data_buf, const long *strides, char *err_buf);
+
 /**
  * Get the size of output voxel data
  *
@@ -149,6 +204,60 @@ FABBER_DLL_API int fabber_get_data(void *fab, const char *name, float *data_buf,
 FABBER_DLL_API int fabber_dorun(void *fab, unsigned int log_bufsize, char *log_buf, char *err_buf,
     void (*progress_cb)(int, int));
 
+/**
+ * Start Fabber model fitting in a background thread and return immediately
+ *
+ * Use fabber_poll to monitor the run and find out when it has finished, and
+ * fabber_cancel to stop it early. While the run is in progress, other API calls which
+ * use the context's options or data will fail. When it has finished, output data is
+ * available from fabber_get_data as for fabber_dorun.
+ *
+ * @param fab Fabber context, returned by fabber_new
+ * @param err_buf Optional buffer for error message. Max message length=FABBER_ERR_MAXC
+ *
+ * @return 0 if the run was started, <0 on failure
+ */
+FABBER_DLL_API int fabber_dorun_async(void *fab, char *err_buf);
+
+/**
+ * Get the progress of a run started with fabber_dorun_async
+ *
+ * @param fab Fabber context, returned by fabber_new
+ * @param voxel If not NULL, receives the number of voxels processed (voxelwise methods)
+ *              or the spatial iteration number (spatial VB)
+ * @param nvoxels If not NULL, receives the total for voxel
+ * @param iteration If not NULL, receives the number of iterations done for the last voxel
+ *                  fitted, or for the whole volume in spatial VB
+ * @param mean_F If not NULL, receives the mean free energy of the voxels fitted so far.
+ *               This is 0 if the method is not calculating the free energy
+ * @param log_bufsize Size of the log buffer
+ * @param log_buf Optional char buffer of size log_bufsize to receive the output log when the
+ *                run has finished
+ * @param err_buf Optional buffer for error message. Max message length=FABBER_ERR_MAXC
+ *
+ * @return FABBER_RUN_RUNNING if the run is still in progress, 0 if it finished successfully,
+ *         FABBER_RUN_CANCELLED if it was stopped by fabber_cancel and the output contains the
+ *         results so far, <0 if it failed
+ */
+FABBER_DLL_API int fabber_poll(void *fab, int *voxel, int *nvoxels, int *iteration,
+    double *mean_F, unsigned int log_bufsize, char *log_buf, char *err_buf);
+
+/**
+ * Ask a run started with fabber_dorun_async to stop
+ *
+ * This returns immediately. Methods which support cancellation (currently VB) stop after
+ * the current voxel or spatial iteration (or, with multistart, the voxels currently being
+ * fitted) and save the results so far. Voxels which were not fitted keep their initial
+ * values. Other methods run to completion. Use fabber_poll to find out when the run has
+ * stopped.
+ *
+ * @param fab Fabber context, returned by fabber_new
+ * @param err_buf Optional buffer for error message. Max message length=FABBER_ERR_MAXC
+ *
+ * @return 0 on success, <0 on failure
+ */
+FABBER_DLL_API int fabber_cancel(void *fab, char *err_buf);
+
 /**
  * Get fabber options, optionally for a specific method or model
  *
@@ -242,4 +351,33 @@ FABBER_DLL_API int fabber_get_model_outputs(
  */
 FABBER_DLL_API int fabber_model_evaluate(void *fab, unsigned int n_params, float *params,
     unsigned int n_ts, float *indata, float *output, char *err_buf);
+
+/**
+ * Evaluate the model for many sets of parameters
+ *
+ * This is equivalent to calling fabber_model_evaluate for each sample, but the model is
+ * only initialized once per thread and samples are evaluated in parallel. All arrays are
+ * in C order with one row per sample.
+ *
+ * @param fab Fabber context, returned by fabber_new
+ * @param n_samples Number of parameter sets to evaluate
+ * @param n_params Number of parameters in each set
+ * @param params Array of n_samples*n_params values. Each row contains parameter values in
+ *               the order returned by fabber_get_model_params
+ * @param n_ts Number of t-points to evaluate for each sample
+ * @param indata Array of n_samples*n_ts values giving the voxel data for each sample, or
+ *               NULL if the model does not need any
+ * @param coords Array of n_samples*3 values giving voxel co-ordinates for each sample, or
+ *               NULL to use (1, 1, 1) as fabber_model_evaluate does
+ * @param output Array buffer of n_samples*n_ts values for output data. If the model returns
+ *               fewer than n_ts values the remainder are set to zero. If the model fails
+ *               for a sample, its output is set to NaN
+ * @param n_threads Number of threads to use, or 0 for one per processor
+ * @param err_buf Optional buffer for error message. Max message length=FABBER_ERR_MAXC
+ *
+ * @return 0 on success, <0 on failure
+ */
+FABBER_DLL_API int fabber_model_evaluate_batch(void *fab, unsigned int n_samples,
+    unsigned int n_params, const float *params, unsigned int n_ts, const float *indata,
+    const float *coords, float *output, int n_threads, char *err_buf);
 }
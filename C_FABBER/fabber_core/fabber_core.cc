@@ -7,6 +7,7 @@
 /*  CCOPYRIGHT */
 
 #include "fabber_core.h"
+#include "fabber_server.h"
 #include "fwdmodel.h"
 #include "inference.h"
 #include "rundata_newimage.h"
@@ -54,6 +55,15 @@ static void Usage()
     {
         cout << options[i] << endl;
     }
+
+    cout << endl << "Server options " << endl << endl;
+
+    options.clear();
+    FabberServer::GetOptions(options);
+    for (unsigned int i = 0; i < options.size(); i++)
+    {
+        cout << options[i] << endl;
+    }
 }
 
 #ifdef _WIN32
@@ -151,6 +161,18 @@ int execute(int argc, char **argv)
 
             return 0;
         }
+        else if (params->GetBool("server"))
+        {
+            // Jobs have their own logfiles - server messages go to stderr
+            FabberServer server(*params);
+            server.Serve();
+            return 0;
+        }
+        else if (params->GetStringDefault("batch", "") != "")
+        {
+            FabberServer server(*params);
+            return (server.RunBatch(params->GetString("batch")) == 0) ? 0 : 1;
+        }
 
         // Make sure command line tool creates a parameter names file
         params->SetBool("dump-param-names");
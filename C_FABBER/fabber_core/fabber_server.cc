@@ -0,0 +1,636 @@
+/*  fabber_server.cc - Persistent server which runs queued Fabber jobs
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "fabber_server.h"
+
+#include "easylog.h"
+#include "rundata.h"
+#include "rundata_newimage.h"
+#include "threads.h"
+
+#include <newmat.h>
+
+#include <algorithm>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <signal.h>
+#include <sstream>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+static OptionSpec OPTIONS[] = {
+    { "server", OPT_BOOL, "Run as a server which processes jobs submitted through the spool "
+                          "directory and/or UNIX socket until interrupted",
+        OPT_NONREQ, "" },
+    { "spool", OPT_STR, "Directory to watch for job files with the extension .fab", OPT_NONREQ,
+        "" },
+    { "socket", OPT_STR, "Path of UNIX socket on which to accept jobs", OPT_NONREQ, "" },
+    { "max-cores", OPT_INT,
+        "Maximum total number of threads used by running jobs. 0=one per processor", OPT_NONREQ,
+        "0" },
+    { "batch", OPT_FILE, "Run all the jobs listed in this file and exit. Each line gives the "
+                         "options for one job in command line form, e.g. -f base.fab "
+                         "--output=out2 --inferR2p",
+        OPT_NONREQ, "" },
+    { "image-cache-size", OPT_INT, "Maximum number of images kept in memory between jobs",
+        OPT_NONREQ, "32" },
+    { "" },
+};
+
+namespace
+{
+// Time to wait for a connection before checking the spool directory and running jobs
+const int POLL_INTERVAL_MS = 500;
+
+// Largest job request accepted through the socket
+const size_t MAX_REQUEST_SIZE = 1 << 20;
+
+// Extension added to spool files while the job is queued or running
+const string RUNNING_EXT = ".running";
+
+volatile sig_atomic_t stop_requested = 0;
+
+extern "C" void RequestStop(int)
+{
+    stop_requested = 1;
+}
+
+bool EndsWith(const string &str, const string &suffix)
+{
+    return (str.size() >= suffix.size())
+        && (str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0);
+}
+
+#ifndef _WIN32
+void Reply(int client, const string &msg)
+{
+    if (client < 0)
+        return;
+
+    // Replies are single lines
+    string line = msg;
+    replace(line.begin(), line.end(), '\n', ' ');
+    line += "\n";
+    const char *buf = line.c_str();
+    size_t left = line.size();
+    while (left > 0)
+    {
+        ssize_t n = write(client, buf, left);
+        if (n <= 0)
+        {
+            if ((n < 0) && (errno == EINTR))
+                continue;
+            // Client has gone away - the job still runs
+            return;
+        }
+        buf += n;
+        left -= n;
+    }
+}
+#endif
+}
+
+/**
+ * A job being run by the server
+ *
+ * The run data is set up by the server thread before the job is started. Once
+ * started, the job thread has sole use of it until Done() returns true.
+ */
+class ServerJob : public Thread
+{
+public:
+    ServerJob(int id, ImageCache &cache)
+        : id(id)
+        , rundata(true)
+        , cores(1)
+        , client(-1)
+        , m_done(false)
+    {
+        rundata.SetLogger(&m_log);
+        rundata.SetImageCache(&cache);
+    }
+
+    /** @return true if the job has finished running */
+    bool Done()
+    {
+        ScopedLock lock(m_mutex);
+        return m_done;
+    }
+
+    /** Error message if the job failed, otherwise empty. Only valid after Done() */
+    const string &Error() const
+    {
+        return m_job_error;
+    }
+
+    /** Output directory. Only valid after Done() */
+    const string &OutputDir() const
+    {
+        return m_outdir;
+    }
+
+    int id;
+    FabberRunDataNewimage rundata;
+
+    /** Number of threads used by this job */
+    int cores;
+
+    /** Socket connection to send the result to, or -1 */
+    int client;
+
+    /** Spool file with the .running extension, or empty if not from the spool directory */
+    string spool_file;
+
+protected:
+    void Run()
+    {
+        bool gzip = false;
+        try
+        {
+            m_outdir = rundata.GetOutputDir();
+            m_log.StartLog(m_outdir);
+            rundata.SetExtentFromData();
+            rundata.Run();
+            m_log.ReissueWarnings();
+            gzip = rundata.GetBool("gzip-log");
+        }
+        catch (const exception &e)
+        {
+            m_job_error = e.what();
+        }
+        catch (NEWMAT::Exception &e)
+        {
+            m_job_error = string("NEWMAT exception: ") + e.what();
+        }
+        catch (...)
+        {
+            m_job_error = "Unknown error";
+        }
+
+        if (m_log.LogStarted())
+        {
+            if (m_job_error != "")
+            {
+                m_log.ReissueWarnings();
+                m_log.LogStream() << "Exception caught in fabber:\n  " << m_job_error << endl;
+            }
+            m_log.StopLog(gzip);
+        }
+
+        ScopedLock lock(m_mutex);
+        m_done = true;
+    }
+
+private:
+    EasyLog m_log;
+    string m_outdir;
+    string m_job_error;
+    Mutex m_mutex;
+    bool m_done;
+};
+
+void FabberServer::GetOptions(vector<OptionSpec> &opts)
+{
+    for (int i = 0; OPTIONS[i].name != ""; i++)
+    {
+        opts.push_back(OPTIONS[i]);
+    }
+}
+
+FabberServer::FabberServer(FabberRunData &options)
+    : m_spool(options.GetStringDefault("spool", ""))
+    , m_socket_path(options.GetStringDefault("socket", ""))
+    , m_socket(-1)
+    , m_max_cores(options.GetIntDefault("max-cores", 0, 0))
+    , m_cores_used(0)
+    , m_next_id(1)
+    , m_failed(0)
+    , m_cache(options.GetIntDefault("image-cache-size", 32, 1))
+{
+#ifdef _WIN32
+    throw FabberRunDataError("Server mode is not supported on Windows");
+#endif
+    if (m_max_cores == 0)
+    {
+        m_max_cores = NumProcessors();
+    }
+#ifndef _WIN32
+    if (m_spool != "")
+    {
+        DIR *dir = opendir(m_spool.c_str());
+        if (!dir)
+        {
+            throw InvalidOptionValue("spool", m_spool, "Failed to open spool directory");
+        }
+        closedir(dir);
+    }
+#endif
+}
+
+FabberServer::~FabberServer()
+{
+    CloseSocket();
+}
+
+void FabberServer::Serve()
+{
+#ifndef _WIN32
+    if ((m_spool == "") && (m_socket_path == ""))
+    {
+        throw InvalidOptionValue("server", "", "Must specify spool directory and/or socket");
+    }
+    OpenSocket();
+    stop_requested = 0;
+    signal(SIGINT, RequestStop);
+    signal(SIGTERM, RequestStop);
+    // Don't die if a client closes its connection before the reply
+    signal(SIGPIPE, SIG_IGN);
+
+    LOG << "FabberServer::Running with up to " << m_max_cores << " cores" << endl;
+    if (m_spool != "")
+        LOG << "FabberServer::Watching spool directory " << m_spool << endl;
+    if (m_socket_path != "")
+        LOG << "FabberServer::Listening on " << m_socket_path << endl;
+
+    while (!stop_requested)
+    {
+        WaitForConnection(POLL_INTERVAL_MS);
+        ScanSpool();
+        ReapJobs();
+        StartJobs();
+    }
+
+    LOG << "FabberServer::Stopping - waiting for " << m_running.size() << " running jobs" << endl;
+    CloseSocket();
+    for (unsigned int i = 0; i < m_running.size(); i++)
+    {
+        m_running[i]->Join();
+    }
+    ReapJobs();
+
+    // Jobs which were never started go back to the spool directory to be
+    // picked up next time
+    while (!m_queue.empty())
+    {
+        ServerJob *job = m_queue.front();
+        m_queue.pop_front();
+        if (job->spool_file != "")
+        {
+            string fab = job->spool_file.substr(0, job->spool_file.size() - RUNNING_EXT.size());
+            rename(job->spool_file.c_str(), fab.c_str());
+        }
+        Reply(job->client, "FAILED Server stopped before job started");
+        if (job->client >= 0)
+            close(job->client);
+        delete job;
+    }
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    LOG << "FabberServer::Stopped" << endl;
+#endif
+}
+
+void FabberServer::Stop()
+{
+    stop_requested = 1;
+}
+
+int FabberServer::RunBatch(const string &filename)
+{
+    ifstream is(filename.c_str());
+    if (!is.good())
+    {
+        throw InvalidOptionValue("batch", filename, "Couldn't read batch file");
+    }
+
+    // All the jobs are parsed before any are run so a mistake in the batch
+    // file is found straight away
+    vector<ServerJob *> jobs;
+    try
+    {
+        string line;
+        while (getline(is, line))
+        {
+            vector<string> args(1, "fabber");
+            stringstream words(line);
+            string word;
+            while ((words >> word) && (word[0] != '#'))
+            {
+                args.push_back(word);
+            }
+            if (args.size() == 1)
+                continue;
+
+            vector<char *> argv;
+            for (unsigned int i = 0; i < args.size(); i++)
+            {
+                argv.push_back(const_cast<char *>(args[i].c_str()));
+            }
+            jobs.push_back(new ServerJob(m_next_id++, m_cache));
+            jobs.back()->rundata.Parse(int(argv.size()), &argv[0]);
+        }
+    }
+    catch (...)
+    {
+        for (unsigned int i = 0; i < jobs.size(); i++)
+        {
+            delete jobs[i];
+        }
+        throw;
+    }
+
+    LOG << "FabberServer::Running " << jobs.size() << " jobs with up to " << m_max_cores
+        << " cores" << endl;
+    for (unsigned int i = 0; i < jobs.size(); i++)
+    {
+        Submit(jobs[i]);
+    }
+    StartJobs();
+    while (!m_running.empty())
+    {
+        WaitForConnection(POLL_INTERVAL_MS);
+        ReapJobs();
+        StartJobs();
+    }
+    LOG << "FabberServer::" << jobs.size() - m_failed << " jobs finished, " << m_failed
+        << " failed" << endl;
+    return m_failed;
+}
+
+void FabberServer::OpenSocket()
+{
+#ifndef _WIN32
+    if (m_socket_path == "")
+        return;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (m_socket_path.size() >= sizeof(addr.sun_path))
+    {
+        throw InvalidOptionValue("socket", m_socket_path, "Path is too long");
+    }
+    strncpy(addr.sun_path, m_socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+    m_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_socket < 0)
+    {
+        throw FabberInternalError(string("Failed to create socket: ") + strerror(errno));
+    }
+
+    // Remove a socket left behind by a previous server
+    unlink(m_socket_path.c_str());
+    if ((bind(m_socket, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        || (listen(m_socket, 16) != 0))
+    {
+        string err = strerror(errno);
+        close(m_socket);
+        m_socket = -1;
+        throw InvalidOptionValue("socket", m_socket_path, "Failed to listen on socket: " + err);
+    }
+#endif
+}
+
+void FabberServer::CloseSocket()
+{
+#ifndef _WIN32
+    if (m_socket >= 0)
+    {
+        close(m_socket);
+        unlink(m_socket_path.c_str());
+        m_socket = -1;
+    }
+#endif
+}
+
+void FabberServer::WaitForConnection(int timeout_ms)
+{
+#ifndef _WIN32
+    fd_set fds;
+    FD_ZERO(&fds);
+    if (m_socket >= 0)
+        FD_SET(m_socket, &fds);
+
+    struct timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+    // Returns early on a connection or a signal
+    int ret = select(m_socket + 1, &fds, NULL, NULL, &timeout);
+    if ((ret > 0) && (m_socket >= 0) && FD_ISSET(m_socket, &fds))
+    {
+        AcceptConnection();
+    }
+#endif
+}
+
+void FabberServer::AcceptConnection()
+{
+#ifndef _WIN32
+    int client = accept(m_socket, NULL, NULL);
+    if (client < 0)
+        return;
+
+    // A client which stops sending should not hold up the server for long
+    struct timeval timeout;
+    timeout.tv_sec = 10;
+    timeout.tv_usec = 0;
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    string request;
+    char buf[4096];
+    while (request.size() < MAX_REQUEST_SIZE)
+    {
+        ssize_t n = read(client, buf, sizeof(buf));
+        if ((n < 0) && (errno == EINTR))
+            continue;
+        if (n <= 0)
+            break;
+        request.append(buf, n);
+    }
+
+    ServerJob *job = new ServerJob(m_next_id++, m_cache);
+    job->client = client;
+    try
+    {
+        stringstream options;
+        stringstream lines(request);
+        string line;
+        while (getline(lines, line))
+        {
+            if (line.compare(0, 3, "-f ") == 0)
+            {
+                job->rundata.ParseParamFile(line.substr(3));
+            }
+            else
+            {
+                options << line << endl;
+            }
+        }
+        job->rundata.ParseParams(options);
+        Submit(job);
+    }
+    catch (const exception &e)
+    {
+        LOG << "FabberServer::Rejected job " << job->id << " from socket: " << e.what() << endl;
+        Reply(client, string("FAILED ") + e.what());
+        close(client);
+        delete job;
+    }
+#endif
+}
+
+void FabberServer::ScanSpool()
+{
+#ifndef _WIN32
+    if (m_spool == "")
+        return;
+
+    DIR *dir = opendir(m_spool.c_str());
+    if (!dir)
+    {
+        // Could be temporarily unavailable, e.g. a network file system
+        LOG << "FabberServer::Failed to open spool directory " << m_spool << endl;
+        return;
+    }
+    vector<string> names;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        string name = entry->d_name;
+        if ((name[0] != '.') && EndsWith(name, ".fab"))
+            names.push_back(name);
+    }
+    closedir(dir);
+    sort(names.begin(), names.end());
+
+    for (unsigned int i = 0; i < names.size(); i++)
+    {
+        // Renaming claims the job so it is only picked up once
+        string fab = m_spool + "/" + names[i];
+        string running = fab + RUNNING_EXT;
+        if (rename(fab.c_str(), running.c_str()) != 0)
+            continue;
+
+        ServerJob *job = new ServerJob(m_next_id++, m_cache);
+        job->spool_file = running;
+        try
+        {
+            job->rundata.ParseParamFile(running);
+            Submit(job);
+        }
+        catch (const exception &e)
+        {
+            LOG << "FabberServer::Rejected job " << names[i] << ": " << e.what() << endl;
+            rename(running.c_str(), (fab + ".failed").c_str());
+            ofstream error((fab + ".error").c_str());
+            error << e.what() << endl;
+            delete job;
+        }
+    }
+#endif
+}
+
+void FabberServer::Submit(ServerJob *job)
+{
+    // Same behaviour as the command line tool
+    job->rundata.SetBool("dump-param-names");
+
+    // Jobs which would use more threads than the budget are limited to it,
+    // otherwise they could never start
+    job->cores = min(GetNumThreads(job->rundata), m_max_cores);
+    job->rundata.Set("num-threads", job->cores);
+
+    m_queue.push_back(job);
+    LOG << "FabberServer::Queued job " << job->id << " (" << job->cores << " cores)" << endl;
+#ifndef _WIN32
+    Reply(job->client, "QUEUED " + stringify(job->id));
+#endif
+}
+
+void FabberServer::StartJobs()
+{
+    // Jobs start in order, so a large job is not held back indefinitely by
+    // smaller jobs submitted after it
+    while (!m_queue.empty() && (m_cores_used + m_queue.front()->cores <= m_max_cores))
+    {
+        ServerJob *job = m_queue.front();
+        m_queue.pop_front();
+        LOG << "FabberServer::Starting job " << job->id << endl;
+        job->Start();
+        m_running.push_back(job);
+        m_cores_used += job->cores;
+    }
+}
+
+void FabberServer::ReapJobs()
+{
+    vector<ServerJob *> still_running;
+    for (unsigned int i = 0; i < m_running.size(); i++)
+    {
+        ServerJob *job = m_running[i];
+        if (job->Done())
+        {
+            job->Join();
+            m_cores_used -= job->cores;
+            Finish(job);
+            delete job;
+        }
+        else
+        {
+            still_running.push_back(job);
+        }
+    }
+    m_running = still_running;
+}
+
+void FabberServer::Finish(ServerJob *job)
+{
+#ifndef _WIN32
+    bool ok = (job->Error() == "");
+    if (!ok)
+        m_failed++;
+    if (ok)
+    {
+        LOG << "FabberServer::Job " << job->id << " finished: " << job->OutputDir() << endl;
+        Reply(job->client, "DONE " + job->OutputDir());
+    }
+    else
+    {
+        LOG << "FabberServer::Job " << job->id << " failed: " << job->Error() << endl;
+        Reply(job->client, "FAILED " + job->Error());
+    }
+    if (job->client >= 0)
+        close(job->client);
+
+    if (job->spool_file != "")
+    {
+        string fab = job->spool_file.substr(0, job->spool_file.size() - RUNNING_EXT.size());
+        rename(job->spool_file.c_str(), (fab + (ok ? ".done" : ".failed")).c_str());
+        if (!ok)
+        {
+            ofstream error((fab + ".error").c_str());
+            error << job->Error() << endl;
+        }
+    }
+#endif
+}
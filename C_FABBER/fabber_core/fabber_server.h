@@ -0,0 +1,131 @@
+/*  fabber_server.h - Persistent server which runs queued Fabber jobs
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+#pragma once
+
+#include "easylog.h"
+#include "rundata.h"
+#include "rundata_newimage.h"
+
+#include <deque>
+#include <string>
+#include <vector>
+
+class ServerJob;
+
+/**
+ * Runs Fabber jobs submitted to a long running process
+ *
+ * Jobs are option sets in the same format as a .fab file. They can be
+ * submitted in two ways:
+ *
+ *  - By placing a file with the extension .fab in the spool directory.
+ *    When the job starts the file is renamed to .fab.running, and when it
+ *    finishes to .fab.done or .fab.failed. If the job failed the error is
+ *    written to a .fab.error file.
+ *
+ *  - By connecting to the UNIX socket and sending the options, followed by
+ *    closing the sending side of the connection. A line '-f <file>' reads
+ *    options from a .fab file. The server replies 'QUEUED <id>' when the
+ *    options have been accepted, then 'DONE <output dir>' or 'FAILED <error>'
+ *    when the job finishes.
+ *
+ * Relative paths in jobs are relative to the working directory of the server.
+ *
+ * Jobs run concurrently, in the order they were submitted, as long as the
+ * total number of threads they use (from their num-threads option) is within
+ * the core budget. Models loaded with loadmodels stay loaded, and images are
+ * read through a cache shared by all jobs which is keyed by filename and
+ * modification time, so a mask or data set used by many jobs is only read once.
+ *
+ * A fixed list of jobs can also be run in the same way using RunBatch().
+ *
+ * The server runs until it receives SIGINT or SIGTERM. Running jobs are then
+ * allowed to finish, and jobs which have not started are returned to the spool
+ * directory or failed.
+ */
+class FabberServer : public Loggable
+{
+public:
+    static void GetOptions(std::vector<OptionSpec> &opts);
+
+    /**
+     * @param options Options for the server (spool, socket, max-cores, image-cache-size).
+     *                Not supported on Windows
+     */
+    explicit FabberServer(FabberRunData &options);
+    ~FabberServer();
+
+    /**
+     * Run jobs until the process is interrupted
+     */
+    void Serve();
+
+    /**
+     * Stop a server running in Serve(), as if it had received SIGTERM
+     *
+     * May be called from another thread
+     */
+    static void Stop();
+
+    /**
+     * Run a list of jobs and return when they have all finished
+     *
+     * Each line of the file gives the options for one job in command line form,
+     * e.g. '-f base.fab --output=out_r2p --inferR2p'. Blank lines and text after
+     * a '#' are ignored. The jobs are run in the same way as jobs submitted to
+     * the server, so images used by several jobs are loaded once and jobs run
+     * concurrently within the core budget, each writing to its own output directory.
+     *
+     * @param filename File listing the jobs
+     * @return Number of jobs which failed
+     */
+    int RunBatch(const std::string &filename);
+
+private:
+    // Not copyable
+    FabberServer(const FabberServer &);
+    FabberServer &operator=(const FabberServer &);
+
+    void OpenSocket();
+    void CloseSocket();
+    void WaitForConnection(int timeout_ms);
+    void AcceptConnection();
+    void ScanSpool();
+    void Submit(ServerJob *job);
+    void StartJobs();
+    void ReapJobs();
+    void Finish(ServerJob *job);
+
+    /** Directory watched for .fab files, or empty */
+    std::string m_spool;
+
+    /** Path of UNIX socket to listen on, or empty */
+    std::string m_socket_path;
+
+    /** Listening socket, or -1 */
+    int m_socket;
+
+    /** Maximum number of threads used by running jobs */
+    int m_max_cores;
+
+    /** Number of threads used by currently running jobs */
+    int m_cores_used;
+
+    /** ID of next job submitted */
+    int m_next_id;
+
+    /** Number of jobs which have failed */
+    int m_failed;
+
+    /** Images shared between jobs */
+    ImageCache m_cache;
+
+    /** Jobs waiting to run, in submission order */
+    std::deque<ServerJob *> m_queue;
+
+    /** Jobs currently running */
+    std::vector<ServerJob *> m_running;
+};
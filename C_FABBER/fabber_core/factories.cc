@@ -13,6 +13,13 @@
 
 using namespace std;
 
+Mutex &FactoryMutex()
+{
+    // Created on first use, as factories are populated during static initialization
+    static Mutex mutex;
+    return mutex;
+}
+
 Dispatcher::Dispatcher()
 {
     // No-op.
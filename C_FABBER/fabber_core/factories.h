@@ -7,17 +7,30 @@
 
 #pragma once
 
+#include "threads.h"
+
 #include <iostream>
 #include <map>
 #include <string>
 #include <vector>
 
+/**
+ * Lock held while any factory is read or modified
+ *
+ * Factories are shared by all runs in the process, which may be on different threads
+ */
+Mutex &FactoryMutex();
+
 /**
  * Template factory class.
  *
  * Manages a map from names to function pointers. Each function
  * pointer is assumed to point to a function that returns a pointer to
  * an object of type T.
+ *
+ * Once a name has been registered its function is never changed, so
+ * registering the defaults again, or loading the same models twice, has
+ * no effect. All methods are thread safe.
  */
 template <class T> class TemplateFactory
 {
@@ -34,7 +47,7 @@ public:
     /**
      * Add a mapping from a given name to a function pointer.
      * @param name Name by which the function pointer can be
-     * accessed.
+     * accessed. If already registered the existing function is kept.
      * @param function Function pointer.
      */
     void Add(const std::string &name, Function function);
@@ -74,6 +87,7 @@ template <class T> TemplateFactory<T>::~TemplateFactory()
 }
 template <class T> std::vector<std::string> TemplateFactory<T>::GetNames()
 {
+    ScopedLock lock(FactoryMutex());
     std::vector<std::string> names;
     for (typename std::map<std::string, Function>::iterator it = functionMap_.begin();
          it != functionMap_.end(); ++it)
@@ -85,21 +99,26 @@ template <class T> std::vector<std::string> TemplateFactory<T>::GetNames()
 
 template <class T> bool TemplateFactory<T>::HasName(const std::string &name)
 {
+    ScopedLock lock(FactoryMutex());
     return (functionMap_.find(name) != functionMap_.end());
 }
 
 template <class T> void TemplateFactory<T>::Add(const std::string &name, Function function)
 {
-    functionMap_[name] = function;
+    ScopedLock lock(FactoryMutex());
+    functionMap_.insert(std::make_pair(name, function));
 }
 
 template <class T> T *TemplateFactory<T>::Create(const std::string &name)
 {
-    if (functionMap_.count(name))
+    Function function = NULL;
     {
-        return functionMap_[name]();
+        ScopedLock lock(FactoryMutex());
+        typename std::map<std::string, Function>::const_iterator it = functionMap_.find(name);
+        if (it != functionMap_.end())
+            function = it->second;
     }
-    return NULL;
+    return function ? function() : NULL;
 }
 
 /**
@@ -117,6 +136,8 @@ public:
     static SingletonFactory *GetInstance();
     /**
      * Delete the singleton instance.
+     *
+     * This must not be called while any run is in progress
      */
     static void Destroy();
 
@@ -134,6 +155,7 @@ template <class T> SingletonFactory<T>::SingletonFactory()
 
 template <class T> void SingletonFactory<T>::Destroy()
 {
+    ScopedLock lock(FactoryMutex());
     if (singleton_ != NULL)
     {
         delete singleton_;
@@ -145,6 +167,7 @@ template <class T> SingletonFactory<T> *SingletonFactory<T>::singleton_ = NULL;
 
 template <class T> SingletonFactory<T> *SingletonFactory<T>::GetInstance()
 {
+    ScopedLock lock(FactoryMutex());
     if (singleton_ == NULL)
     {
         singleton_ = new SingletonFactory<T>();
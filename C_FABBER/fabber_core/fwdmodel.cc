@@ -11,6 +11,7 @@
 #include "easylog.h"
 #include "priors.h"
 #include "rundata.h"
+#include "threads.h"
 #include "transforms.h"
 
 #include <newmatio.h>
@@ -62,6 +63,12 @@ string GetLastErrorAsString()
 
 void FwdModel::LoadFromDynamicLibrary(const std::string &filename, EasyLog *log)
 {
+    // Loading is serialized. Libraries stay loaded for the life of the process and
+    // models which are already registered are skipped, so a long running process
+    // (e.g. the server) can load the same library for every job
+    static Mutex load_mutex;
+    ScopedLock lock(load_mutex);
+
     FwdModelFactory *factory = FwdModelFactory::GetInstance();
     GetNumModelsFptr get_num_models;
     GetModelNameFptr get_model_name;
@@ -112,6 +119,11 @@ void FwdModel::LoadFromDynamicLibrary(const std::string &filename, EasyLog *log)
             throw InvalidOptionValue("loadmodels", filename,
                 "Dynamic library failed to return model name for index " + stringify(i));
         }
+        else if (factory->HasName(model_name))
+        {
+            if (log)
+                log->LogStream() << "Model " << model_name << " already loaded" << endl;
+        }
         else
         {
             if (log)
@@ -364,6 +376,38 @@ void FwdModel::EvaluateFabber(
     }
 }
 
+bool FwdModel::GradientFabber(const NEWMAT::ColumnVector &params, NEWMAT::Matrix &grad) const
+{
+    assert((m_params.size() == 0) || (int(m_params.size()) == params.Nrows()));
+    if (m_params.size() == 0)
+    {
+        return Gradient(params, grad);
+    }
+
+    NEWMAT::ColumnVector tparams(params.Nrows());
+    for (int i = 1; i <= params.Nrows(); i++)
+    {
+        tparams(i) = m_params[i - 1].transform->ToModel(params(i));
+    }
+    if (!Gradient(tparams, grad))
+        return false;
+
+    // Chain rule for the transforms. Transforms are cheap scalar functions
+    // so their derivative is found numerically
+    for (int i = 1; i <= params.Nrows(); i++)
+    {
+        const Transform *t = m_params[i - 1].transform;
+        if (t == TRANSFORM_IDENTITY())
+            continue;
+        double delta = fabs(params(i)) * 1e-5;
+        if (delta < 1e-10)
+            delta = 1e-10;
+        double deriv = (t->ToModel(params(i) + delta) - t->ToModel(params(i) - delta)) / (2 * delta);
+        grad.Column(i) = grad.Column(i) * deriv;
+    }
+    return true;
+}
+
 void FwdModel::DumpParameters(const NEWMAT::ColumnVector &params, const string &indent) const
 {
     LOG << indent << "Parameters:" << endl;
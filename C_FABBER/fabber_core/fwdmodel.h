@@ -147,6 +147,23 @@ public:
         Evaluate(params, result);
     }
 
+    /**
+     * Evaluate the gradient (Jacobian) of the model in model parameter space
+     *
+     * Models which can calculate their gradient analytically (or more cheaply
+     * than by numerical differentiation) can override this. The default
+     * returns false, in which case numerical differentiation is used.
+     *
+     * @param params Model parameter values
+     * @param grad Will be populated with the derivative of each timepoint (rows)
+     *             with respect to each parameter (columns)
+     * @return true if the gradient was calculated, false if not supported
+     */
+    virtual bool Gradient(const NEWMAT::ColumnVector &params, NEWMAT::Matrix &grad) const
+    {
+        return false;
+    }
+
     /**
      * Get parameter descriptions for this model.
      *
@@ -159,6 +176,16 @@ public:
      */
     void GetParameters(FabberRunData &rundata, std::vector<Parameter> &params);
 
+    /**
+     * Get the model's own parameter descriptions, without any priors or
+     * transforms specified in the options.
+     *
+     * Models override this to describe their parameters. Fabber's inference
+     * uses GetParameters instead, however the defaults are needed by models
+     * which wrap another model. Initialize must be called before this method.
+     */
+    virtual void GetParameterDefaults(std::vector<Parameter> &params) const;
+
     /**
      * For models that need the data and supplementary data values in the voxel to calculate
      *
@@ -213,6 +240,19 @@ public:
     void EvaluateFabber(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result,
         const std::string &key = "") const;
 
+    /**
+     * Evaluate the gradient of the model in Fabber internal parameter space
+     *
+     * This calls the model-specific Gradient method, applying the chain rule
+     * for any parameter transforms.
+     *
+     * @param params Model parameter values in Fabber internal space.
+     * @param grad Will be populated with the derivative of each timepoint (rows)
+     *             with respect to each parameter (columns)
+     * @return true if the gradient was calculated, false if not supported by the model
+     */
+    bool GradientFabber(const NEWMAT::ColumnVector &params, NEWMAT::Matrix &grad) const;
+
     /**
      * Transform an MVN containing model values to Fabber internal values.
      *
@@ -343,8 +383,6 @@ public:
 #endif
 
 protected:
-    virtual void GetParameterDefaults(std::vector<Parameter> &params) const;
-
     // Your derived classes should have storage for all constants that are
     // implicitly part of g() -- e.g. pulse sequence parameters, any parameters
     // that are assumed to take known values, and basis functions.  Given these
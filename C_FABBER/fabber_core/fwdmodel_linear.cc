@@ -17,6 +17,8 @@
 #include <newmatio.h>
 
 #include <iostream>
+#include <math.h>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <vector>
@@ -25,6 +27,27 @@ using fabber::read_matrix_file;
 using namespace std;
 using namespace NEWMAT;
 
+namespace
+{
+// Relative precision assumed for model evaluations when tuning finite difference
+// steps. Allows for some loss of precision in the model calculation
+const double MODEL_PRECISION = 1e-12;
+
+// Order of the truncation error of each differencing method
+int Order(FiniteDifferences::Method method)
+{
+    switch (method)
+    {
+    case FiniteDifferences::FORWARD:
+        return 1;
+    case FiniteDifferences::RICHARDSON:
+        return 4;
+    default:
+        return 2;
+    }
+}
+}
+
 FwdModel *LinearFwdModel::NewInstance()
 {
     return new LinearFwdModel();
@@ -95,6 +118,37 @@ void LinearFwdModel::EvaluateModel(
     result = m_jacobian * (params - m_centre) + m_offset;
 }
 
+void FiniteDifferences::Initialize(FabberRunData &args, int nparams)
+{
+    string value = args.GetStringDefault("fd-method", "central");
+    methods.clear();
+    istringstream is(value);
+    string item;
+    while (getline(is, item, ','))
+    {
+        if (item == "forward")
+            methods.push_back(FORWARD);
+        else if (item == "central")
+            methods.push_back(CENTRAL);
+        else if (item == "richardson")
+            methods.push_back(RICHARDSON);
+        else
+            throw InvalidOptionValue(
+                "fd-method", value, "Must be forward, central or richardson");
+    }
+    if (methods.size() == 1)
+    {
+        methods.resize(nparams, methods[0]);
+    }
+    else if (int(methods.size()) != nparams)
+    {
+        throw InvalidOptionValue("fd-method", value,
+            "Must give a single method or one for each of the " + stringify(nparams)
+                + " parameters");
+    }
+    adaptive = args.GetBool("fd-adaptive");
+}
+
 LinearizedFwdModel::LinearizedFwdModel(const FwdModel *model)
     : m_model(model)
 {
@@ -104,6 +158,8 @@ LinearizedFwdModel::LinearizedFwdModel(const FwdModel *model)
 LinearizedFwdModel::LinearizedFwdModel(const LinearizedFwdModel &from)
     : LinearFwdModel(from)
     , m_model(from.m_model)
+    , m_fd(from.m_fd)
+    , m_step_scale(from.m_step_scale)
 {
     SetLogger(from.GetLogger());
 }
@@ -127,35 +183,155 @@ void LinearizedFwdModel::ReCentre(const ColumnVector &about)
     // Calculate the Jacobian numerically.  jacobian is len(y)-by-len(m)
     m_jacobian.ReSize(m_offset.Nrows(), m_centre.Nrows());
 
-    // Try and get the gradient matrix (Jacobian) from the model first
-    // FIXME this is broken when transforms are used
-    // int gradfrommodel = m_model->Gradient(m_centre, m_jacobian);
-
+    // Try and get the gradient matrix (Jacobian) from the model first.
     // If the gradient is not supported by the model, use
     // numerical differentiation to calculate it.
-    if (true)
+    if (!m_model->GradientFabber(m_centre, m_jacobian))
     {
-        ColumnVector centre2, centre3;
-        ColumnVector offset2, offset3;
-        for (int i = 1; i <= m_centre.Nrows(); i++)
+        const int nparams = m_centre.Nrows();
+        vector<FiniteDifferences::Method> methods = m_fd.methods;
+        methods.resize(nparams, FiniteDifferences::CENTRAL);
+        if (m_fd.adaptive && (int(m_step_scale.size()) != nparams))
+        {
+            m_step_scale.assign(nparams, 1.0);
+            for (int i = 1; i <= nparams; i++)
+            {
+                TuneStep(i, methods[i - 1]);
+            }
+        }
+
+        ColumnVector deriv;
+        for (int i = 1; i <= nparams; i++)
         {
-            double delta = m_centre(i) * 1e-5;
-            if (delta < 0)
-                delta = -delta;
-            if (delta < 1e-10)
-                delta = 1e-10;
-
-            // Take derivative numerically
-            centre3 = m_centre;
-            centre2 = m_centre;
-            centre2(i) += delta;
-            centre3(i) -= delta;
-            m_model->EvaluateFabber(centre2, offset2);
-            m_model->EvaluateFabber(centre3, offset3);
-            m_jacobian.Column(i) = (offset2 - offset3) / (centre2(i) - centre3(i));
+            Derivative(i, methods[i - 1], Step(i), deriv);
+            m_jacobian.Column(i) = deriv;
         }
     }
 
+    CheckFinite(about);
+}
+
+void LinearizedFwdModel::BroydenUpdate(const ColumnVector &about)
+{
+    if ((m_jacobian.Ncols() != about.Nrows()) || (m_centre.Nrows() != about.Nrows()))
+    {
+        ReCentre(about);
+        return;
+    }
+
+    ColumnVector step = about - m_centre;
+    double step2 = step.SumSquare();
+    if (step2 == 0)
+        return;
+
+    ColumnVector offset;
+    m_model->EvaluateFabber(about, offset);
+    if (0 * offset != 0 * offset)
+    {
+        LOG_ERR("LinearizedFwdModel::about:\n" << about);
+        LOG_ERR("LinearizedFwdModel::offset:\n" << offset.t());
+        throw FabberInternalError(
+            "LinearizedFwdModel::BroydenUpdate: Non-finite values found in offset");
+    }
+
+    // J += (g(new) - g(old) - J * step) * step' / |step|^2
+    ColumnVector err = offset - m_offset - m_jacobian * step;
+    m_jacobian += err * (step.t() / step2);
+    m_centre = about;
+    m_offset = offset;
+
+    CheckFinite(about);
+}
+
+void LinearizedFwdModel::SetDifferencing(const FiniteDifferences &fd)
+{
+    m_fd = fd;
+    m_step_scale.clear();
+}
+
+double LinearizedFwdModel::Step(int i) const
+{
+    double delta = fabs(m_centre(i)) * 1e-5;
+    if (delta < 1e-10)
+        delta = 1e-10;
+    if (!m_step_scale.empty())
+        delta *= m_step_scale[i - 1];
+    return delta;
+}
+
+void LinearizedFwdModel::Derivative(
+    int i, FiniteDifferences::Method method, double step, ColumnVector &deriv) const
+{
+    ColumnVector centre2 = m_centre, centre3 = m_centre;
+    ColumnVector offset2, offset3;
+    if (method == FiniteDifferences::FORWARD)
+    {
+        // Uses the offset already evaluated at the centre
+        centre2(i) += step;
+        m_model->EvaluateFabber(centre2, offset2);
+        deriv = (offset2 - m_offset) / (centre2(i) - m_centre(i));
+    }
+    else if (method == FiniteDifferences::CENTRAL)
+    {
+        centre2(i) += step;
+        centre3(i) -= step;
+        m_model->EvaluateFabber(centre2, offset2);
+        m_model->EvaluateFabber(centre3, offset3);
+        deriv = (offset2 - offset3) / (centre2(i) - centre3(i));
+    }
+    else
+    {
+        // Eliminates the leading error term of central differences
+        ColumnVector deriv_half;
+        Derivative(i, FiniteDifferences::CENTRAL, step, deriv);
+        Derivative(i, FiniteDifferences::CENTRAL, step / 2, deriv_half);
+        deriv = (deriv_half * 4 - deriv) / 3;
+    }
+}
+
+void LinearizedFwdModel::TuneStep(int i, FiniteDifferences::Method method)
+{
+    // Truncation error is about C * h^p and rounding error about eps * |f| / h, so
+    // the best step is (eps * |f| / (p * C))^(1 / (p + 1)). C is estimated by
+    // comparing derivatives with steps h and h/2
+    const int p = Order(method);
+    const double h = Step(i);
+    ColumnVector deriv, deriv_half;
+    Derivative(i, method, h, deriv);
+    Derivative(i, method, h / 2, deriv_half);
+
+    double trunc = (deriv - deriv_half).MaximumAbsoluteValue() * pow(2.0, p) / (pow(2.0, p) - 1);
+    double C = trunc / pow(h, p);
+    double fmax = m_offset.MaximumAbsoluteValue();
+    if ((C > 0) && (fmax > 0) && (C - C == 0))
+    {
+        double best = pow(MODEL_PRECISION * fmax / (p * C), 1.0 / (p + 1));
+        double scale = best / h;
+        if (scale < 1e-3)
+            scale = 1e-3;
+        if (scale > 1e3)
+            scale = 1e3;
+        m_step_scale[i - 1] = scale;
+    }
+}
+
+void LinearizedFwdModel::JacobianErrors(ColumnVector &errors) const
+{
+    errors.ReSize(m_centre.Nrows());
+    ColumnVector ref;
+    for (int i = 1; i <= m_centre.Nrows(); i++)
+    {
+        // Half the step used for the Jacobian, so a Richardson Jacobian is not
+        // compared with itself
+        Derivative(i, FiniteDifferences::RICHARDSON, Step(i) / 2, ref);
+        double scale = ref.MaximumAbsoluteValue();
+        double diff = (m_jacobian.Column(i) - ref).MaximumAbsoluteValue();
+        errors(i) = (scale > 0) ? diff / scale : diff;
+    }
+}
+
+void LinearizedFwdModel::CheckFinite(const ColumnVector &about) const
+{
     if (0 * m_jacobian != 0 * m_jacobian)
     {
         LOG << "LinearizedFwdModel::jacobian:\n" << m_jacobian;
@@ -95,6 +95,44 @@ protected:
     NEWMAT::ColumnVector m_offset; // g(m) - The amount to effectively subtract from Y is g(m)-J*m
 };
 
+/**
+ * How a linearized model calculates the Jacobian by numerical differentiation
+ *
+ * This is only used when the model does not provide its own gradient
+ */
+struct FiniteDifferences
+{
+    /** Forward differences use one model evaluation per parameter, central two and
+     * Richardson extrapolation of central differences four */
+    enum Method
+    {
+        FORWARD,
+        CENTRAL,
+        RICHARDSON
+    };
+
+    FiniteDifferences()
+        : adaptive(false)
+    {
+    }
+
+    /**
+     * Read the fd-method and fd-adaptive options
+     *
+     * fd-method is forward, central or richardson, either a single method for all
+     * parameters or a comma separated list with one method for each parameter
+     *
+     * @param nparams Number of model parameters
+     */
+    void Initialize(FabberRunData &args, int nparams);
+
+    /** Method for each parameter. If empty, central differences are used */
+    std::vector<Method> methods;
+
+    /** If true, tune the step size for each parameter from an error estimate */
+    bool adaptive;
+};
+
 /**
  * Linearized wrapper interface to another nonlinear forward model
  *
@@ -145,6 +183,62 @@ public:
      */
     void ReCentre(const NEWMAT::ColumnVector &about);
 
+    /**
+     * Move the linearization centre using a rank-one update of the Jacobian
+     *
+     * @param about New centre in parameter space
+     *
+     * The underlying model is evaluated once at the new centre to give
+     * the new offset. The Jacobian is then corrected with a Broyden update so
+     * that it reproduces the change in the model output along the step from
+     * the old centre, rather than being recalculated in full. This is much
+     * cheaper than ReCentre when the Jacobian is obtained by numerical
+     * differentiation, but the Jacobian becomes less accurate with each
+     * update so ReCentre should be called periodically.
+     *
+     * If ReCentre has not been called yet this is the same as ReCentre
+     */
+    void BroydenUpdate(const NEWMAT::ColumnVector &about);
+
+    /**
+     * Set how the Jacobian is calculated by numerical differentiation
+     *
+     * With adaptive steps, the step for each parameter is tuned at the next
+     * call to ReCentre and then kept for later calls
+     */
+    void SetDifferencing(const FiniteDifferences &fd);
+
+    /**
+     * Estimate the relative error in each column of the current Jacobian
+     *
+     * The Jacobian is compared with a reference calculated about the current
+     * centre by Richardson extrapolation with half the current step. For
+     * fd-method=richardson this measures the change from halving the step.
+     * This costs four model evaluations per parameter so is intended for
+     * diagnostics only.
+     *
+     * @param errors Set to the maximum absolute difference from the reference
+     *               in each column, relative to the largest reference value
+     */
+    void JacobianErrors(NEWMAT::ColumnVector &errors) const;
+
 private:
     const FwdModel *m_model;
+
+    void CheckFinite(const NEWMAT::ColumnVector &about) const;
+
+    /** Step size for parameter i (from 1) at the current centre */
+    double Step(int i) const;
+
+    /** Numerical derivative of the model output with respect to parameter i */
+    void Derivative(int i, FiniteDifferences::Method method, double step,
+        NEWMAT::ColumnVector &deriv) const;
+
+    /** Choose the step size for parameter i to balance truncation and rounding error */
+    void TuneStep(int i, FiniteDifferences::Method method);
+
+    FiniteDifferences m_fd;
+
+    /** Multiplier of the default step for each parameter once steps have been tuned */
+    std::vector<double> m_step_scale;
 };
@@ -0,0 +1,651 @@
+/*  fwdmodel_surrogate.cc - Interpolated surrogate for an expensive forward model
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "fwdmodel_surrogate.h"
+
+#include "easylog.h"
+#include "rundata.h"
+#include "version.h"
+
+#include <newmatio.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <math.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace NEWMAT;
+
+static const string CACHE_MAGIC = "FABBER_SURROGATE_1";
+
+// Refuse to build a grid with more sample values than this (8 bytes each)
+static const double MAX_SAMPLES = 1e8;
+
+static OptionSpec OPTIONS[] = {
+    { "surrogate-model", OPT_STR, "Name of the forward model to approximate", OPT_REQ, "" },
+    { "surrogate-interp", OPT_STR, "Interpolation method: linear or cubic", OPT_NONREQ, "linear" },
+    { "surrogate-cache", OPT_FILE,
+        "File to cache grid samples in. Reused if it matches the current model and options",
+        OPT_NONREQ, "" },
+    { "surrogate-ntpts", OPT_INT,
+        "Number of timepoints to evaluate the model at. Default is from the main data",
+        OPT_NONREQ, "" },
+    { "surrogate-min", OPT_STR,
+        "Minimum of each parameter in model space, comma separated or as surrogate-min1, "
+        "surrogate-min2 etc. Default is from the prior",
+        OPT_NONREQ, "" },
+    { "surrogate-max", OPT_STR,
+        "Maximum of each parameter in model space, comma separated or as surrogate-max1, "
+        "surrogate-max2 etc. Default is from the prior",
+        OPT_NONREQ, "" },
+    { "surrogate-nsd", OPT_FLOAT,
+        "Number of prior standard deviations either side of the prior mean to sample when "
+        "range is not given",
+        OPT_NONREQ, "3" },
+    { "surrogate-npts", OPT_INT, "Initial number of grid points along each parameter axis",
+        OPT_NONREQ, "5" },
+    { "surrogate-maxpts", OPT_INT, "Maximum number of grid points along each parameter axis",
+        OPT_NONREQ, "33" },
+    { "surrogate-tol", OPT_FLOAT,
+        "Tolerance for adaptive refinement of the grid, relative to the maximum signal",
+        OPT_NONREQ, "0.001" },
+    { "" },
+};
+
+FwdModel *SurrogateFwdModel::NewInstance()
+{
+    return new SurrogateFwdModel();
+}
+
+void SurrogateFwdModel::GetOptions(vector<OptionSpec> &opts) const
+{
+    for (int i = 0; OPTIONS[i].name != ""; i++)
+    {
+        opts.push_back(OPTIONS[i]);
+    }
+}
+
+string SurrogateFwdModel::GetDescription() const
+{
+    return "Approximates another forward model by interpolating on a grid of precomputed samples";
+}
+
+string SurrogateFwdModel::ModelVersion() const
+{
+    return fabber_version();
+}
+
+void SurrogateFwdModel::Initialize(FabberRunData &args)
+{
+    FwdModel::Initialize(args);
+
+    m_model_name = args.GetString("surrogate-model");
+    if (m_model_name == "surrogate")
+    {
+        throw InvalidOptionValue("surrogate-model", m_model_name, "Cannot wrap another surrogate");
+    }
+    m_model.reset(FwdModel::NewFromName(m_model_name));
+    m_model->SetLogger(m_log);
+    m_model->Initialize(args);
+
+    string interp = args.GetStringDefault("surrogate-interp", "linear");
+    if (interp == "linear")
+        m_cubic = false;
+    else if (interp == "cubic")
+        m_cubic = true;
+    else
+        throw InvalidOptionValue("surrogate-interp", interp, "Must be linear or cubic");
+
+    int npts = args.GetIntDefault("surrogate-npts", 5, 2);
+    int max_pts = args.GetIntDefault("surrogate-maxpts", 33, npts);
+    double tol = args.GetDoubleDefault("surrogate-tol", 0.001, 0);
+    double nsd = args.GetDoubleDefault("surrogate-nsd", 3, 0);
+
+    // The wrapped model needs some data so it knows how many timepoints to produce
+    if (args.HaveKey("surrogate-ntpts"))
+    {
+        m_ntpts = args.GetInt("surrogate-ntpts", 1);
+    }
+    else
+    {
+        m_ntpts = args.GetMainVoxelData().Nrows();
+    }
+    ColumnVector voxdata(m_ntpts), voxcoords(3);
+    voxdata = 0;
+    voxcoords = 0;
+    m_model->PassData(voxdata, voxcoords);
+
+    // Parameter ranges in model space
+    vector<Parameter> params;
+    m_model->GetParameterDefaults(params);
+    const int nparams = params.size();
+    if (nparams == 0)
+    {
+        throw InvalidOptionValue("surrogate-model", m_model_name, "Model has no parameters");
+    }
+    ColumnVector pmin = args.GetColumnVector("surrogate-min");
+    ColumnVector pmax = args.GetColumnVector("surrogate-max");
+    if (pmin.Nrows() != 0 && pmin.Nrows() != nparams)
+    {
+        throw InvalidOptionValue("surrogate-min", stringify(pmin.Nrows()) + " values",
+            "Must give one value for each of the " + stringify(nparams) + " parameters");
+    }
+    if (pmax.Nrows() != 0 && pmax.Nrows() != nparams)
+    {
+        throw InvalidOptionValue("surrogate-max", stringify(pmax.Nrows()) + " values",
+            "Must give one value for each of the " + stringify(nparams) + " parameters");
+    }
+
+    m_nodes.clear();
+    m_nodes.resize(nparams);
+    m_centre.ReSize(nparams);
+    for (int p = 0; p < nparams; p++)
+    {
+        // Default range is taken in Fabber space, so e.g. log-transformed parameters
+        // are not sampled at negative values
+        DistParams fp = params[p].transform->ToFabber(params[p].prior);
+        double lo = params[p].transform->ToModel(fp.mean() - nsd * sqrt(fp.var()));
+        double hi = params[p].transform->ToModel(fp.mean() + nsd * sqrt(fp.var()));
+        if (lo > hi)
+            swap(lo, hi);
+        if (pmin.Nrows() > 0)
+            lo = pmin(p + 1);
+        if (pmax.Nrows() > 0)
+            hi = pmax(p + 1);
+        if (!(hi > lo))
+        {
+            throw InvalidOptionValue("surrogate-max", stringify(hi),
+                "Range for parameter " + params[p].name + " is empty");
+        }
+
+        for (int i = 0; i < npts; i++)
+        {
+            m_nodes[p].push_back(lo + (hi - lo) * double(i) / (npts - 1));
+        }
+        m_centre(p + 1) = 0.5 * (lo + hi);
+        LOG << "SurrogateFwdModel::Parameter " << params[p].name << " range " << lo << " - " << hi
+            << endl;
+    }
+
+    // The model may not produce the number of timepoints we asked for
+    ColumnVector centre_result;
+    EvaluateWrapped(m_centre, centre_result);
+    m_ntpts = centre_result.Nrows();
+
+    string signature = Signature(args, npts, max_pts, tol);
+    string cache_file = args.GetStringDefault("surrogate-cache", "");
+    if (cache_file != "" && LoadCache(cache_file, signature))
+    {
+        LOG << "SurrogateFwdModel::Loaded grid samples from " << cache_file << endl;
+        return;
+    }
+
+    for (int p = 0; p < nparams; p++)
+    {
+        RefineAxis(p, tol, max_pts);
+        LOG << "SurrogateFwdModel::Parameter " << params[p].name << " using "
+            << m_nodes[p].size() << " grid points" << endl;
+    }
+    SampleGrid();
+
+    if (cache_file != "")
+    {
+        SaveCache(cache_file, signature);
+    }
+}
+
+void SurrogateFwdModel::GetParameterDefaults(vector<Parameter> &params) const
+{
+    m_model->GetParameterDefaults(params);
+}
+
+void SurrogateFwdModel::NameParams(vector<string> &names) const
+{
+    vector<Parameter> params;
+    GetParameterDefaults(params);
+    for (size_t p = 0; p < params.size(); p++)
+    {
+        names.push_back(params[p].name);
+    }
+}
+
+void SurrogateFwdModel::InitVoxelPosterior(MVNDist &posterior) const
+{
+    // Voxelwise initialization is delegated to the wrapped model which needs
+    // the real voxel data for this
+    m_model->PassData(data, coords, suppdata);
+    m_model->InitVoxelPosterior(posterior);
+}
+
+void SurrogateFwdModel::EvaluateModel(
+    const ColumnVector &params, ColumnVector &result, const string &key) const
+{
+    if (key != "")
+    {
+        throw InvalidOptionValue("surrogate-model", m_model_name,
+            "Alternative model outputs are not supported by the surrogate model");
+    }
+    Interpolate(params, result, NULL);
+}
+
+bool SurrogateFwdModel::Gradient(const ColumnVector &params, Matrix &grad) const
+{
+    ColumnVector result;
+    Interpolate(params, result, &grad);
+    return true;
+}
+
+void SurrogateFwdModel::EvaluateWrapped(const ColumnVector &params, ColumnVector &result) const
+{
+    m_model->EvaluateModel(params, result);
+    if (0 * result != 0 * result)
+    {
+        LOG_ERR("SurrogateFwdModel::params:\n" << params.t());
+        throw FabberInternalError(
+            "SurrogateFwdModel: Non-finite values from wrapped model " + m_model_name);
+    }
+}
+
+void SurrogateFwdModel::GetAxisWeights(
+    const vector<double> &nodes, double x, AxisWeights &aw) const
+{
+    const int n = nodes.size();
+
+    // Cell containing x, clamped so that we extrapolate from the edge cells
+    int i = upper_bound(nodes.begin(), nodes.end(), x) - nodes.begin() - 1;
+    if (i < 0)
+        i = 0;
+    if (i > n - 2)
+        i = n - 2;
+    const double h = nodes[i + 1] - nodes[i];
+    const double t = (x - nodes[i]) / h;
+
+    if (!m_cubic || t < 0 || t > 1)
+    {
+        aw.n = 2;
+        aw.idx[0] = i;
+        aw.idx[1] = i + 1;
+        aw.w[0] = 1 - t;
+        aw.w[1] = t;
+        aw.dw[0] = -1 / h;
+        aw.dw[1] = 1 / h;
+        return;
+    }
+
+    // Cubic Hermite interpolation with finite difference slopes at the nodes. The
+    // result is linear in the node values, so we accumulate a weight for each
+    // of nodes i-1 .. i+2
+    const double t2 = t * t, t3 = t2 * t;
+    const double h00 = 2 * t3 - 3 * t2 + 1, dh00 = 6 * t2 - 6 * t;
+    const double h10 = t3 - 2 * t2 + t, dh10 = 3 * t2 - 4 * t + 1;
+    const double h01 = -2 * t3 + 3 * t2, dh01 = -6 * t2 + 6 * t;
+    const double h11 = t3 - t2, dh11 = 3 * t2 - 2 * t;
+
+    double w[4] = { 0, h00, h01, 0 };
+    double dw[4] = { 0, dh00, dh01, 0 };
+
+    // Slope at node i, scaled by h
+    if (i > 0)
+    {
+        double a = h / (nodes[i + 1] - nodes[i - 1]);
+        w[2] += h10 * a;
+        w[0] -= h10 * a;
+        dw[2] += dh10 * a;
+        dw[0] -= dh10 * a;
+    }
+    else
+    {
+        w[2] += h10;
+        w[1] -= h10;
+        dw[2] += dh10;
+        dw[1] -= dh10;
+    }
+
+    // Slope at node i+1, scaled by h
+    if (i + 2 < n)
+    {
+        double b = h / (nodes[i + 2] - nodes[i]);
+        w[3] += h11 * b;
+        w[1] -= h11 * b;
+        dw[3] += dh11 * b;
+        dw[1] -= dh11 * b;
+    }
+    else
+    {
+        w[2] += h11;
+        w[1] -= h11;
+        dw[2] += dh11;
+        dw[1] -= dh11;
+    }
+
+    aw.n = 4;
+    for (int k = 0; k < 4; k++)
+    {
+        // Nodes off the end of the grid always have zero weight
+        aw.idx[k] = min(max(i - 1 + k, 0), n - 1);
+        aw.w[k] = w[k];
+        aw.dw[k] = dw[k] / h;
+    }
+}
+
+void SurrogateFwdModel::Interpolate(
+    const ColumnVector &params, ColumnVector &result, Matrix *grad) const
+{
+    const int nparams = m_nodes.size();
+    assert(params.Nrows() == nparams);
+
+    vector<AxisWeights> aws(nparams);
+    vector<int> strides(nparams);
+    int stride = m_ntpts;
+    for (int k = 0; k < nparams; k++)
+    {
+        GetAxisWeights(m_nodes[k], params(k + 1), aws[k]);
+        strides[k] = stride;
+        stride *= m_nodes[k].size();
+    }
+
+    result.ReSize(m_ntpts);
+    result = 0;
+    Real *res = result.Store();
+    Real *gr = NULL;
+    if (grad)
+    {
+        grad->ReSize(m_ntpts, nparams);
+        *grad = 0;
+        gr = grad->Store();
+    }
+
+    // Iterate over all combinations of contributing nodes on each axis
+    vector<int> pos(nparams, 0);
+    while (true)
+    {
+        double w = 1;
+        int offset = 0;
+        for (int k = 0; k < nparams; k++)
+        {
+            w *= aws[k].w[pos[k]];
+            offset += aws[k].idx[pos[k]] * strides[k];
+        }
+        const double *sample = &m_samples[offset];
+
+        if (w != 0)
+        {
+            for (int t = 0; t < m_ntpts; t++)
+                res[t] += w * sample[t];
+        }
+
+        if (gr)
+        {
+            for (int k = 0; k < nparams; k++)
+            {
+                double gw = aws[k].dw[pos[k]];
+                for (int j = 0; j < nparams && gw != 0; j++)
+                {
+                    if (j != k)
+                        gw *= aws[j].w[pos[j]];
+                }
+                if (gw != 0)
+                {
+                    // NEWMAT stores row-major
+                    for (int t = 0; t < m_ntpts; t++)
+                        gr[t * nparams + k] += gw * sample[t];
+                }
+            }
+        }
+
+        int k = 0;
+        while (k < nparams && ++pos[k] == aws[k].n)
+        {
+            pos[k] = 0;
+            k++;
+        }
+        if (k == nparams)
+            break;
+    }
+}
+
+double SurrogateFwdModel::AxisError(const vector<double> &nodes, const vector<ColumnVector> &ys,
+    double x, const ColumnVector &y) const
+{
+    AxisWeights aw;
+    GetAxisWeights(nodes, x, aw);
+    ColumnVector interp(y.Nrows());
+    interp = 0;
+    for (int i = 0; i < aw.n; i++)
+    {
+        if (aw.w[i] != 0)
+            interp += aw.w[i] * ys[aw.idx[i]];
+    }
+    return (interp - y).MaximumAbsoluteValue();
+}
+
+void SurrogateFwdModel::RefineAxis(int axis, double tol, int max_pts)
+{
+    // Refinement is done on a 1D slice through the grid centre, bisecting any interval
+    // where the interpolant misses the model at the midpoint
+    vector<double> &nodes = m_nodes[axis];
+    ColumnVector p = m_centre;
+    vector<ColumnVector> ys(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        p(axis + 1) = nodes[i];
+        EvaluateWrapped(p, ys[i]);
+    }
+
+    while (int(nodes.size()) < max_pts)
+    {
+        double scale = 0;
+        for (size_t i = 0; i < ys.size(); i++)
+            scale = max(scale, ys[i].MaximumAbsoluteValue());
+        if (scale == 0)
+            scale = 1;
+
+        int budget = max_pts - nodes.size();
+        vector<double> new_nodes;
+        vector<ColumnVector> new_ys;
+        for (size_t i = 0; i < nodes.size() - 1; i++)
+        {
+            new_nodes.push_back(nodes[i]);
+            new_ys.push_back(ys[i]);
+            if (budget > 0)
+            {
+                double mid = 0.5 * (nodes[i] + nodes[i + 1]);
+                ColumnVector y;
+                p(axis + 1) = mid;
+                EvaluateWrapped(p, y);
+                if (AxisError(nodes, ys, mid, y) > tol * scale)
+                {
+                    new_nodes.push_back(mid);
+                    new_ys.push_back(y);
+                    budget--;
+                }
+            }
+        }
+        new_nodes.push_back(nodes.back());
+        new_ys.push_back(ys.back());
+
+        if (new_nodes.size() == nodes.size())
+            break;
+        nodes = new_nodes;
+        ys = new_ys;
+    }
+}
+
+void SurrogateFwdModel::SampleGrid()
+{
+    const int nparams = m_nodes.size();
+    double total = 1;
+    for (int k = 0; k < nparams; k++)
+        total *= m_nodes[k].size();
+    if (total * m_ntpts > MAX_SAMPLES)
+    {
+        throw FabberRunDataError("SurrogateFwdModel: Grid of " + stringify(total)
+            + " nodes is too large - reduce surrogate-maxpts or increase surrogate-tol");
+    }
+
+    int nnodes = int(total);
+    LOG << "SurrogateFwdModel::Sampling " << m_model_name << " at " << nnodes << " grid nodes"
+        << endl;
+    m_samples.resize(nnodes * m_ntpts);
+
+    ColumnVector p(nparams), result;
+    vector<int> pos(nparams, 0);
+    for (int n = 0; n < nnodes; n++)
+    {
+        for (int k = 0; k < nparams; k++)
+            p(k + 1) = m_nodes[k][pos[k]];
+        EvaluateWrapped(p, result);
+        if (result.Nrows() != m_ntpts)
+        {
+            throw FabberInternalError("SurrogateFwdModel: Wrapped model returned "
+                + stringify(result.Nrows()) + " timepoints, expected " + stringify(m_ntpts));
+        }
+        for (int t = 0; t < m_ntpts; t++)
+            m_samples[n * m_ntpts + t] = result(t + 1);
+
+        // Nodes are ordered with the first parameter varying fastest
+        for (int k = 0; k < nparams && ++pos[k] == int(m_nodes[k].size()); k++)
+            pos[k] = 0;
+    }
+}
+
+string SurrogateFwdModel::Signature(FabberRunData &args, int npts, int max_pts, double tol) const
+{
+    stringstream sig;
+    sig << setprecision(17);
+    sig << "model=" << m_model_name << ";version=" << m_model->ModelVersion()
+        << ";interp=" << (m_cubic ? "cubic" : "linear") << ";ntpts=" << m_ntpts
+        << ";npts=" << npts << ";maxpts=" << max_pts << ";tol=" << tol;
+    for (size_t p = 0; p < m_nodes.size(); p++)
+    {
+        sig << ";range" << p + 1 << "=" << m_nodes[p].front() << "," << m_nodes[p].back();
+    }
+
+    vector<OptionSpec> opts;
+    m_model->GetOptions(opts);
+    for (size_t i = 0; i < opts.size(); i++)
+    {
+        sig << ";" << opts[i].name << "=" << args.GetStringDefault(opts[i].name, "");
+    }
+    return sig.str();
+}
+
+bool SurrogateFwdModel::LoadCache(const string &filename, const string &signature)
+{
+    ifstream in(filename.c_str(), ios::in | ios::binary);
+    if (!in.good())
+        return false;
+
+    string magic, sig;
+    getline(in, magic);
+    getline(in, sig);
+    if (magic != CACHE_MAGIC || sig != signature)
+    {
+        LOG << "SurrogateFwdModel::Cache " << filename << " does not match current options" << endl;
+        return false;
+    }
+
+    int nparams, ntpts;
+    in.read(reinterpret_cast<char *>(&nparams), sizeof(nparams));
+    in.read(reinterpret_cast<char *>(&ntpts), sizeof(ntpts));
+    if (!in.good() || nparams != int(m_nodes.size()) || ntpts != m_ntpts)
+        return false;
+
+    vector<vector<double> > nodes(nparams);
+    double total = 1;
+    for (int p = 0; p < nparams; p++)
+    {
+        int n;
+        in.read(reinterpret_cast<char *>(&n), sizeof(n));
+        if (!in.good() || n < 2)
+            return false;
+        nodes[p].resize(n);
+        in.read(reinterpret_cast<char *>(&nodes[p][0]), n * sizeof(double));
+        total *= n;
+    }
+    if (!in.good() || total * ntpts > MAX_SAMPLES)
+        return false;
+
+    vector<double> samples(int(total) * ntpts);
+    in.read(reinterpret_cast<char *>(&samples[0]), samples.size() * sizeof(double));
+    if (!in.good())
+        return false;
+
+    m_nodes.swap(nodes);
+    m_samples.swap(samples);
+    if (!CheckCache())
+    {
+        // Options which the wrapped model does not declare (e.g. with older models)
+        // may have changed, so the samples are not valid
+        LOG << "SurrogateFwdModel::Cache " << filename << " does not match model output" << endl;
+        m_nodes.swap(nodes);
+        m_samples.clear();
+        return false;
+    }
+    return true;
+}
+
+bool SurrogateFwdModel::CheckCache() const
+{
+    // Spot check the first and last grid nodes against the wrapped model
+    const int nparams = m_nodes.size();
+    ColumnVector first(nparams), last(nparams), result;
+    for (int k = 0; k < nparams; k++)
+    {
+        first(k + 1) = m_nodes[k].front();
+        last(k + 1) = m_nodes[k].back();
+    }
+
+    const double *samples[2] = { &m_samples[0], &m_samples[m_samples.size() - m_ntpts] };
+    const ColumnVector *params[2] = { &first, &last };
+    for (int i = 0; i < 2; i++)
+    {
+        EvaluateWrapped(*params[i], result);
+        if (result.Nrows() != m_ntpts)
+            return false;
+        for (int t = 0; t < m_ntpts; t++)
+        {
+            double diff = fabs(result(t + 1) - samples[i][t]);
+            if (diff > 1e-9 * max(fabs(result(t + 1)), 1.0))
+                return false;
+        }
+    }
+    return true;
+}
+
+void SurrogateFwdModel::SaveCache(const string &filename, const string &signature) const
+{
+    ofstream out(filename.c_str(), ios::out | ios::binary);
+    if (!out.good())
+    {
+        WARN_ONCE("SurrogateFwdModel: Could not write cache file " + filename);
+        return;
+    }
+
+    out << CACHE_MAGIC << endl << signature << endl;
+    int nparams = m_nodes.size();
+    out.write(reinterpret_cast<const char *>(&nparams), sizeof(nparams));
+    out.write(reinterpret_cast<const char *>(&m_ntpts), sizeof(m_ntpts));
+    for (int p = 0; p < nparams; p++)
+    {
+        int n = m_nodes[p].size();
+        out.write(reinterpret_cast<const char *>(&n), sizeof(n));
+        out.write(reinterpret_cast<const char *>(&m_nodes[p][0]), n * sizeof(double));
+    }
+    out.write(reinterpret_cast<const char *>(&m_samples[0]), m_samples.size() * sizeof(double));
+    if (!out.good())
+    {
+        WARN_ONCE("SurrogateFwdModel: Error writing cache file " + filename);
+    }
+    else
+    {
+        LOG << "SurrogateFwdModel::Saved grid samples to " << filename << endl;
+    }
+}
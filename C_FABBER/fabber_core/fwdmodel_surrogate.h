@@ -0,0 +1,132 @@
+/*  fwdmodel_surrogate.h - Interpolated surrogate for an expensive forward model
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+#pragma once
+
+#include "dist_mvn.h"
+#include "fwdmodel.h"
+#include "rundata.h"
+
+#include <newmat.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Forward model which approximates another model by interpolating
+ * on a precomputed grid of samples
+ *
+ * At Initialize the wrapped model (surrogate-model) is evaluated on a
+ * tensor-product grid covering a range of each parameter in model space.
+ * The nodes along each axis are placed adaptively - starting from a
+ * uniform grid, intervals are bisected wherever the interpolant
+ * disagrees with the wrapped model by more than surrogate-tol. The
+ * samples can be cached to a file so subsequent runs with the same
+ * protocol do not need to resample.
+ *
+ * Evaluation is then by multilinear or cubic (Hermite) interpolation,
+ * and the gradient of the interpolant is available analytically, so
+ * the linearization does not need to re-evaluate the model for each
+ * Jacobian column.
+ *
+ * Outside the sampled range the interpolant is extrapolated linearly
+ * from the edge cell.
+ */
+class SurrogateFwdModel : public FwdModel
+{
+public:
+    static FwdModel *NewInstance();
+
+    SurrogateFwdModel()
+        : m_cubic(false)
+        , m_ntpts(0)
+    {
+    }
+
+    void GetOptions(std::vector<OptionSpec> &opts) const;
+    std::string GetDescription() const;
+    std::string ModelVersion() const;
+
+    void Initialize(FabberRunData &args);
+    void InitVoxelPosterior(MVNDist &posterior) const;
+    void EvaluateModel(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result,
+        const std::string &key = "") const;
+    bool Gradient(const NEWMAT::ColumnVector &params, NEWMAT::Matrix &grad) const;
+    void NameParams(std::vector<std::string> &names) const;
+
+    /**
+     * Evaluate the interpolant and optionally its gradient
+     *
+     * @param params Parameters in model space
+     * @param result Interpolated model prediction
+     * @param grad If not NULL, set to the gradient of the interpolant
+     *             (number of timepoints x number of parameters)
+     */
+    void Interpolate(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result,
+        NEWMAT::Matrix *grad) const;
+
+    /**
+     * @return Grid nodes along the axis of a parameter (0-based index)
+     */
+    const std::vector<double> &GetNodes(int param) const
+    {
+        return m_nodes.at(param);
+    }
+
+protected:
+    void GetParameterDefaults(std::vector<Parameter> &params) const;
+
+private:
+    /**
+     * Interpolation weights for one axis
+     *
+     * Up to 4 nodes contribute (2 for linear interpolation). The
+     * weights are for the value and the derivative with respect
+     * to the parameter value
+     */
+    struct AxisWeights
+    {
+        int n;
+        int idx[4];
+        double w[4];
+        double dw[4];
+    };
+
+    void GetAxisWeights(const std::vector<double> &nodes, double x, AxisWeights &aw) const;
+    void EvaluateWrapped(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result) const;
+    double AxisError(const std::vector<double> &nodes, const std::vector<NEWMAT::ColumnVector> &ys,
+        double x, const NEWMAT::ColumnVector &y) const;
+    void RefineAxis(int axis, double tol, int max_pts);
+    void SampleGrid();
+    std::string Signature(FabberRunData &args, int npts, int max_pts, double tol) const;
+    bool LoadCache(const std::string &filename, const std::string &signature);
+    bool CheckCache() const;
+    void SaveCache(const std::string &filename, const std::string &signature) const;
+
+    /** The model being approximated */
+    std::auto_ptr<FwdModel> m_model;
+
+    /** Name of the model being approximated */
+    std::string m_model_name;
+
+    /** Use cubic rather than multilinear interpolation */
+    bool m_cubic;
+
+    /** Number of timepoints produced by the wrapped model */
+    int m_ntpts;
+
+    /** Grid nodes for each parameter in model space, in increasing order */
+    std::vector<std::vector<double> > m_nodes;
+
+    /** Grid centre, used for adaptive refinement of each axis */
+    NEWMAT::ColumnVector m_centre;
+
+    /**
+     * Model samples at each grid node. Timepoints vary fastest, then
+     * the first parameter, then the second, etc.
+     */
+    std::vector<double> m_samples;
+};
@@ -0,0 +1,498 @@
+/*  inference_gridsearch.cc - Grid search inference technique
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "inference_gridsearch.h"
+
+#include "easylog.h"
+#include "fwdmodel.h"
+#include "fwdmodel_linear.h"
+#include "rundata.h"
+#include "threads.h"
+#include "version.h"
+
+#include <newmat.h>
+#include <newmatio.h>
+
+#include <algorithm>
+#include <math.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace NEWMAT;
+
+// Refuse to build a grid with more sample values than this (8 bytes each)
+static const double MAX_SAMPLES = 1e8;
+
+// Number of grid points or voxels handed to a thread at a time
+static const int CHUNK_SIZE = 64;
+
+static OptionSpec OPTIONS[] = {
+    { "grid-min", OPT_STR,
+        "Minimum of each parameter in model space, comma separated or as grid-min1, grid-min2 "
+        "etc. Default is from the prior",
+        OPT_NONREQ, "" },
+    { "grid-max", OPT_STR,
+        "Maximum of each parameter in model space, comma separated or as grid-max1, grid-max2 "
+        "etc. Default is from the prior",
+        OPT_NONREQ, "" },
+    { "grid-nsd", OPT_FLOAT,
+        "Number of prior standard deviations either side of the prior mean to search when "
+        "range is not given",
+        OPT_NONREQ, "2" },
+    { "grid-npts", OPT_STR,
+        "Number of grid points along each parameter axis. A single value, or one for each "
+        "parameter, comma separated or as grid-npts1, grid-npts2 etc",
+        OPT_NONREQ, "10" },
+    { "num-threads", OPT_INT, "Number of threads to use. 0 means one for each processor",
+        OPT_NONREQ, "1" },
+    { "" },
+};
+
+// Work item for evaluating the model at each grid point
+class GridSampleWork : public ParallelWork
+{
+public:
+    GridSampleWork(const vector<FwdModel *> &models, const vector<ColumnVector> &points,
+        vector<ColumnVector> &results)
+        : m_models(models)
+        , m_points(points)
+        , m_results(results)
+    {
+    }
+
+    virtual void Process(int point, int thread)
+    {
+        try
+        {
+            m_models[thread]->EvaluateFabber(m_points[point], m_results[point]);
+        }
+        catch (...)
+        {
+            // Model may not be defined at the edges of the grid - the point is
+            // marked as bad by leaving the result empty
+            m_results[point].ReSize(0);
+        }
+    }
+
+private:
+    const vector<FwdModel *> &m_models;
+    const vector<ColumnVector> &m_points;
+    vector<ColumnVector> &m_results;
+};
+
+// Work item for finding the best grid point and Laplace approximation for each voxel
+class GridVoxelWork : public ParallelWork
+{
+public:
+    GridVoxelWork(const GridSearchInferenceTechnique &grid, const vector<FwdModel *> &models,
+        const Matrix &data, const Matrix &coords, const Matrix &suppdata,
+        vector<MVNDist *> &results, vector<string> &errors, bool halt_bad_voxel)
+        : m_grid(grid)
+        , m_models(models)
+        , m_data(data)
+        , m_coords(coords)
+        , m_suppdata(suppdata)
+        , m_results(results)
+        , m_errors(errors)
+        , m_halt_bad_voxel(halt_bad_voxel)
+    {
+    }
+
+    virtual void Process(int voxel, int thread)
+    {
+        m_grid.FitVoxel(voxel + 1, *m_models[thread], m_data, m_coords, m_suppdata,
+            m_results[voxel], m_errors[voxel], m_halt_bad_voxel);
+    }
+
+private:
+    const GridSearchInferenceTechnique &m_grid;
+    const vector<FwdModel *> &m_models;
+    const Matrix &m_data;
+    const Matrix &m_coords;
+    const Matrix &m_suppdata;
+    vector<MVNDist *> &m_results;
+    vector<string> &m_errors;
+    bool m_halt_bad_voxel;
+};
+
+InferenceTechnique *GridSearchInferenceTechnique::NewInstance()
+{
+    return new GridSearchInferenceTechnique();
+}
+
+void GridSearchInferenceTechnique::GetOptions(vector<OptionSpec> &opts) const
+{
+    InferenceTechnique::GetOptions(opts);
+    for (int i = 0; OPTIONS[i].name != ""; i++)
+    {
+        opts.push_back(OPTIONS[i]);
+    }
+}
+
+string GridSearchInferenceTechnique::GetDescription() const
+{
+    return "Grid search inference technique. Finds the best fit from a precomputed grid of "
+           "model parameter values";
+}
+
+string GridSearchInferenceTechnique::GetVersion() const
+{
+    return fabber_version();
+}
+
+void GridSearchInferenceTechnique::Initialize(FwdModel *fwd_model, FabberRunData &rundata)
+{
+    InferenceTechnique::Initialize(fwd_model, rundata);
+
+    m_model_name = rundata.GetStringDefault("model", "");
+    m_nthreads = GetNumThreads(rundata);
+    double nsd = rundata.GetDoubleDefault("grid-nsd", 2, 0);
+
+    vector<Parameter> params;
+    m_model->GetParameters(rundata, params);
+    if (m_num_params == 0)
+    {
+        throw InvalidOptionValue("model", m_model_name, "Model has no parameters");
+    }
+
+    ColumnVector pmin = rundata.GetColumnVector("grid-min");
+    ColumnVector pmax = rundata.GetColumnVector("grid-max");
+    ColumnVector npts = rundata.GetColumnVector("grid-npts", 1);
+    if (pmin.Nrows() != 0 && pmin.Nrows() != m_num_params)
+    {
+        throw InvalidOptionValue("grid-min", stringify(pmin.Nrows()) + " values",
+            "Must give one value for each of the " + stringify(m_num_params) + " parameters");
+    }
+    if (pmax.Nrows() != 0 && pmax.Nrows() != m_num_params)
+    {
+        throw InvalidOptionValue("grid-max", stringify(pmax.Nrows()) + " values",
+            "Must give one value for each of the " + stringify(m_num_params) + " parameters");
+    }
+    if (npts.Nrows() > 1 && npts.Nrows() != m_num_params)
+    {
+        throw InvalidOptionValue("grid-npts", stringify(npts.Nrows()) + " values",
+            "Must give a single value or one for each of the " + stringify(m_num_params)
+                + " parameters");
+    }
+
+    m_axes.clear();
+    m_axes.resize(m_num_params);
+    m_prior_means.ReSize(m_num_params);
+    m_prior_precs.ReSize(m_num_params);
+    double total_points = 1;
+    for (int p = 0; p < m_num_params; p++)
+    {
+        // Default range is taken in Fabber space, so e.g. log-transformed parameters
+        // are not sampled at negative values. Note that GetParameters has already
+        // transformed the prior into Fabber space
+        DistParams fp = params[p].prior;
+        m_prior_means(p + 1) = fp.mean();
+        m_prior_precs(p + 1) = fp.prec();
+
+        double lo = params[p].transform->ToModel(fp.mean() - nsd * sqrt(fp.var()));
+        double hi = params[p].transform->ToModel(fp.mean() + nsd * sqrt(fp.var()));
+        if (lo > hi)
+            swap(lo, hi);
+        if (pmin.Nrows() > 0)
+            lo = pmin(p + 1);
+        if (pmax.Nrows() > 0)
+            hi = pmax(p + 1);
+
+        int n = 10;
+        if (npts.Nrows() == 1)
+            n = int(npts(1));
+        else if (npts.Nrows() > 1)
+            n = int(npts(p + 1));
+
+        if (n == 1)
+        {
+            m_axes[p].push_back(params[p].transform->ToFabber(0.5 * (lo + hi)));
+        }
+        else
+        {
+            if (!(hi > lo))
+            {
+                throw InvalidOptionValue("grid-max", stringify(hi),
+                    "Range for parameter " + params[p].name + " is empty");
+            }
+            // Points are evenly spaced in model space
+            for (int i = 0; i < n; i++)
+            {
+                m_axes[p].push_back(
+                    params[p].transform->ToFabber(lo + (hi - lo) * double(i) / (n - 1)));
+            }
+        }
+        total_points *= n;
+        LOG << "GridSearchInferenceTechnique::Parameter " << params[p].name << " range " << lo
+            << " - " << hi << " with " << n << " points" << endl;
+    }
+
+    if (total_points > MAX_SAMPLES)
+    {
+        throw InvalidOptionValue(
+            "grid-npts", stringify(total_points) + " grid points", "Grid is too large");
+    }
+    m_npoints = int(total_points);
+    LOG << "GridSearchInferenceTechnique::" << m_npoints << " grid points, using " << m_nthreads
+        << " threads" << endl;
+}
+
+void GridSearchInferenceTechnique::GridPoint(int point, ColumnVector &params) const
+{
+    // First parameter varies fastest
+    params.ReSize(m_num_params);
+    for (int p = 0; p < m_num_params; p++)
+    {
+        int n = m_axes[p].size();
+        params(p + 1) = m_axes[p][point % n];
+        point /= n;
+    }
+}
+
+void GridSearchInferenceTechnique::SampleGrid(const vector<FwdModel *> &models)
+{
+    vector<ColumnVector> points(m_npoints);
+    vector<ColumnVector> results(m_npoints);
+    for (int i = 0; i < m_npoints; i++)
+    {
+        GridPoint(i, points[i]);
+    }
+
+    GridSampleWork work(models, points, results);
+    ParallelFor(work, m_npoints, m_nthreads, CHUNK_SIZE);
+
+    m_ntpts = 0;
+    for (int i = 0; i < m_npoints; i++)
+    {
+        m_ntpts = max(m_ntpts, results[i].Nrows());
+    }
+    if (double(m_ntpts) * m_npoints > MAX_SAMPLES)
+    {
+        throw InvalidOptionValue("grid-npts", stringify(m_npoints) + " grid points",
+            "Grid is too large for " + stringify(m_ntpts) + " timepoints");
+    }
+
+    // Copy the signals into contiguous storage and precompute the parts of
+    // the cost which do not depend on the voxel data
+    m_signals.resize(m_npoints * m_ntpts);
+    m_signal_sq.resize(m_npoints);
+    m_prior_cost.resize(m_npoints);
+    int nbad = 0;
+    for (int i = 0; i < m_npoints; i++)
+    {
+        double sq = 0;
+        bool good = (results[i].Nrows() == m_ntpts);
+        for (int t = 0; good && t < m_ntpts; t++)
+        {
+            double val = results[i](t + 1);
+            m_signals[i * m_ntpts + t] = val;
+            sq += val * val;
+            good = !isnan(val) && !isinf(val);
+        }
+        m_signal_sq[i] = sq;
+
+        double prior_cost = 0;
+        for (int p = 1; p <= m_num_params; p++)
+        {
+            double d = points[i](p) - m_prior_means(p);
+            prior_cost += 0.5 * d * d * m_prior_precs(p);
+        }
+
+        // Points where the model could not be evaluated are never selected
+        if (good)
+        {
+            m_prior_cost[i] = prior_cost;
+        }
+        else
+        {
+            m_prior_cost[i] = HUGE_VAL;
+            nbad++;
+        }
+    }
+    if (nbad > 0)
+    {
+        LOG << "GridSearchInferenceTechnique::Model could not be evaluated at " << nbad
+            << " grid points - these will be ignored" << endl;
+    }
+}
+
+int GridSearchInferenceTechnique::BestPoint(const double *y, double &ssr) const
+{
+    // SSR = y.y - 2 y.s + s.s so only the dot product with the data needs
+    // to be computed for each point
+    double yy = 0;
+    for (int t = 0; t < m_ntpts; t++)
+    {
+        yy += y[t] * y[t];
+    }
+
+    // Avoid log(0) for a perfect fit
+    const double min_ssr = 1e-12 * max(yy, 1e-300);
+    int best = 0;
+    double best_cost = HUGE_VAL;
+    ssr = yy;
+    for (int i = 0; i < m_npoints; i++)
+    {
+        if (m_prior_cost[i] == HUGE_VAL)
+            continue;
+
+        const double *s = &m_signals[i * m_ntpts];
+        double ys = 0;
+        for (int t = 0; t < m_ntpts; t++)
+        {
+            ys += y[t] * s[t];
+        }
+        double point_ssr = max(yy - 2 * ys + m_signal_sq[i], min_ssr);
+        double cost = 0.5 * m_ntpts * log(point_ssr) + m_prior_cost[i];
+        if (cost < best_cost)
+        {
+            best_cost = cost;
+            best = i;
+            ssr = point_ssr;
+        }
+    }
+    return best;
+}
+
+void GridSearchInferenceTechnique::FitVoxel(int v, FwdModel &model, const Matrix &data,
+    const Matrix &coords, const Matrix &suppdata, MVNDist *&result, string &error,
+    bool halt_bad_voxel) const
+{
+    ColumnVector y = data.Column(v);
+    if (suppdata.Ncols() > 0)
+        model.PassData(y, coords.Column(v), suppdata.Column(v));
+    else
+        model.PassData(y, coords.Column(v));
+
+    double ssr;
+    int best = BestPoint(y.Store(), ssr);
+
+    MVNDist *mvn = new MVNDist(m_num_params);
+    GridPoint(best, mvn->means);
+    string laplace_error;
+    try
+    {
+        // Laplace approximation about the best point using the linearized model
+        LinearizedFwdModel lin(&model);
+        lin.ReCentre(mvn->means);
+        Matrix J = lin.Jacobian();
+        SymmetricMatrix prec;
+        prec << J.t() * J * (m_ntpts / ssr);
+        for (int p = 1; p <= m_num_params; p++)
+        {
+            prec(p, p) += m_prior_precs(p);
+        }
+        mvn->SetPrecisions(prec);
+        mvn->GetCovariance();
+    }
+    catch (Exception &e)
+    {
+        if (halt_bad_voxel)
+        {
+            delete mvn;
+            throw;
+        }
+        laplace_error = e.what();
+    }
+    catch (FabberInternalError &e)
+    {
+        // Non-finite model output or Jacobian, e.g. at the edge of the grid
+        if (halt_bad_voxel)
+        {
+            delete mvn;
+            throw;
+        }
+        laplace_error = e.what();
+    }
+
+    if (laplace_error != "")
+    {
+        // Keep the best grid point but with uninformative precision
+        error = laplace_error;
+        mvn->SetPrecisions(IdentityMatrix(m_num_params) * 1e-12);
+    }
+    result = mvn;
+}
+
+void GridSearchInferenceTechnique::DoCalculations(FabberRunData &rundata)
+{
+    const Matrix &data = rundata.GetMainVoxelData();
+    const Matrix &coords = rundata.GetVoxelCoords();
+    const Matrix &suppdata = rundata.GetVoxelSuppData();
+    int nvoxels = data.Ncols();
+    if (nvoxels == 0)
+        return;
+
+    // Each thread needs its own model instance as models are not required to be
+    // thread safe. These are created here as initialization may not be thread safe
+    vector<FwdModel *> models(1, m_model);
+    for (int t = 1; t < m_nthreads; t++)
+    {
+        FwdModel *model = FwdModel::NewFromName(m_model_name);
+        model->SetLogger(m_log);
+        model->Initialize(rundata);
+        models.push_back(model);
+    }
+
+    try
+    {
+        // pass in some (dummy) data/coords here just in case the model relies upon it
+        // use the first voxel values as our dummies
+        for (unsigned int t = 0; t < models.size(); t++)
+        {
+            if (suppdata.Ncols() > 0)
+                models[t]->PassData(data.Column(1), coords.Column(1), suppdata.Column(1));
+            else
+                models[t]->PassData(data.Column(1), coords.Column(1));
+        }
+
+        LOG << "GridSearchInferenceTechnique::Evaluating model at grid points" << endl;
+        SampleGrid(models);
+        if (m_ntpts != data.Nrows())
+        {
+            throw FabberInternalError("Model produced " + stringify(m_ntpts)
+                + " timepoints but the data has " + stringify(data.Nrows()));
+        }
+
+        LOG << "GridSearchInferenceTechnique::Searching grid for " << nvoxels << " voxels"
+            << endl;
+        resultMVNs.resize(nvoxels, NULL);
+        vector<string> errors(nvoxels);
+        GridVoxelWork work(
+            *this, models, data, coords, suppdata, resultMVNs, errors, m_halt_bad_voxel);
+        ParallelFor(work, nvoxels, m_nthreads, CHUNK_SIZE);
+
+        for (int v = 0; v < nvoxels; v++)
+        {
+            if (errors[v] != "")
+            {
+                LOG << "GridSearchInferenceTechnique::Numerical error for voxel " << v + 1
+                    << " at " << coords.Column(v + 1).t() << " : " << errors[v] << endl
+                    << "   Precision matrix set manually" << endl;
+            }
+        }
+    }
+    catch (...)
+    {
+        for (unsigned int t = 1; t < models.size(); t++)
+        {
+            delete models[t];
+        }
+        throw;
+    }
+
+    for (unsigned int t = 1; t < models.size(); t++)
+    {
+        delete models[t];
+    }
+}
+
+void GridSearchInferenceTechnique::ReleaseResults(vector<MVNDist *> &mvns)
+{
+    mvns = resultMVNs;
+    resultMVNs.clear();
+}
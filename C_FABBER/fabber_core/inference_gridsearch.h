@@ -0,0 +1,142 @@
+/*  inference_gridsearch.h - Grid search inference technique
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+#pragma once
+
+#include "inference.h"
+
+#include <newmat.h>
+
+#include <string>
+#include <vector>
+
+/**
+ * Inference technique which searches a regular grid of parameter values
+ *
+ * The model is evaluated once at every point on the grid and the resulting
+ * signals are shared between all voxels. For each voxel, the grid point
+ * with the highest posterior probability is selected. The noise is assumed
+ * white with unknown variance which is marginalised using a Jeffreys prior,
+ * so the cost at each point is
+ *
+ *   N/2 log(SSR) + 1/2 (p - m)' P (p - m)
+ *
+ * where SSR is the sum of squared residuals, N the number of timepoints and
+ * m, P the mean and precision of the (diagonal) parameter priors in Fabber
+ * space. The output is a Laplace approximation about the best grid point
+ * using the linearized model and the noise precision N/SSR.
+ *
+ * This is a robust way to find the right mode of a multi-modal posterior and
+ * is also used by Vb (with the init-gridsearch option) to generate initial
+ * posteriors.
+ *
+ * The grid signals are computed using the data from the first voxel to
+ * initialize the model, so models whose predictions depend on the voxel data
+ * are not suitable.
+ */
+class GridSearchInferenceTechnique : public InferenceTechnique
+{
+public:
+    static InferenceTechnique *NewInstance();
+
+    GridSearchInferenceTechnique()
+        : m_npoints(0)
+        , m_ntpts(0)
+        , m_nthreads(1)
+    {
+    }
+
+    virtual void GetOptions(std::vector<OptionSpec> &opts) const;
+    virtual std::string GetDescription() const;
+    virtual std::string GetVersion() const;
+
+    virtual void Initialize(FwdModel *fwd_model, FabberRunData &rundata);
+    virtual void DoCalculations(FabberRunData &rundata);
+
+    /**
+     * Transfer ownership of the per-voxel results to the caller
+     *
+     * Each MVN contains only the model parameters, in Fabber space
+     */
+    void ReleaseResults(std::vector<MVNDist *> &mvns);
+
+    /**
+     * Find the best grid point for a voxel and the Laplace approximation about it
+     *
+     * This is called from multiple threads during DoCalculations so does not modify
+     * any member data. Numerical errors in the Laplace approximation, including
+     * non-finite model output, are rethrown if halt_bad_voxel is set, otherwise the
+     * best grid point is returned with an uninformative precision and the error
+     * message is returned in error.
+     *
+     * @param v Voxel index, starting at 1
+     * @param model Model instance to use for this thread
+     * @param data Data for all voxels, one column per voxel
+     * @param coords Voxel coordinates, one column per voxel
+     * @param suppdata Supplementary data, one column per voxel, or empty if none
+     * @param result Will be set to a new MVN containing the result
+     * @param error Will be set to the error message if the Laplace approximation
+     *              failed, otherwise left unchanged
+     * @param halt_bad_voxel If true, rethrow errors in the Laplace approximation
+     */
+    void FitVoxel(int v, FwdModel &model, const NEWMAT::Matrix &data,
+        const NEWMAT::Matrix &coords, const NEWMAT::Matrix &suppdata, MVNDist *&result,
+        std::string &error, bool halt_bad_voxel) const;
+
+protected:
+    /**
+     * Get the parameter values at a grid point
+     *
+     * @param point Index of the grid point
+     * @param params Will be set to the parameter values in Fabber space
+     */
+    void GridPoint(int point, NEWMAT::ColumnVector &params) const;
+
+    /**
+     * Evaluate the model at every grid point
+     *
+     * @param models One model instance per thread
+     */
+    void SampleGrid(const std::vector<FwdModel *> &models);
+
+    /**
+     * Find the best grid point for a voxel
+     *
+     * @param y Voxel timeseries data
+     * @param ssr Will be set to the sum of squared residuals at the best point
+     * @return Index of the best grid point
+     */
+    int BestPoint(const double *y, double &ssr) const;
+
+    /** Values of each parameter along its axis of the grid, in Fabber space */
+    std::vector<std::vector<double> > m_axes;
+
+    /** Number of grid points */
+    int m_npoints;
+
+    /** Number of timepoints in the model output */
+    int m_ntpts;
+
+    /** Model signal at each grid point, timepoints varying fastest */
+    std::vector<double> m_signals;
+
+    /** Sum of squares of the model signal at each grid point */
+    std::vector<double> m_signal_sq;
+
+    /** Prior contribution to the cost at each grid point */
+    std::vector<double> m_prior_cost;
+
+    /** Prior means in Fabber space */
+    NEWMAT::ColumnVector m_prior_means;
+
+    /** Prior precisions in Fabber space */
+    NEWMAT::ColumnVector m_prior_precs;
+
+    /** Number of threads to use */
+    int m_nthreads;
+
+    /** Name of the forward model, used to create additional instances for threads */
+    std::string m_model_name;
+};
@@ -0,0 +1,576 @@
+/*  inference_mcmc.cc - Adaptive Metropolis MCMC inference technique
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "inference_mcmc.h"
+
+#include "easylog.h"
+#include "fwdmodel.h"
+#include "fwdmodel_linear.h"
+#include "priors.h"
+#include "run_context.h"
+#include "rundata.h"
+#include "threads.h"
+#include "version.h"
+
+#include <newmat.h>
+#include <newmatio.h>
+
+#include <algorithm>
+#include <math.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace NEWMAT;
+
+// Adaptation of the proposal starts after this many burn-in iterations and
+// is repeated at this interval
+static const int ADAPT_INTERVAL = 100;
+
+// Acceptance rate which the proposal scale is tuned towards
+static const double TARGET_ACCEPTANCE = 0.234;
+
+static OptionSpec OPTIONS[] = {
+    { "mcmc-burnin", OPT_INT,
+        "Number of burn-in iterations, during which the proposal distribution is adapted",
+        OPT_NONREQ, "1000" },
+    { "mcmc-samples", OPT_INT, "Number of iterations after burn-in", OPT_NONREQ, "2000" },
+    { "mcmc-thin", OPT_INT, "Keep one in this many samples when saving samples", OPT_NONREQ,
+        "1" },
+    { "mcmc-seed", OPT_INT, "Seed for the random number generator", OPT_NONREQ, "1" },
+    { "save-mcmc-samples", OPT_BOOL,
+        "Save the (thinned) samples of each parameter as samples_<param>", OPT_NONREQ, "" },
+    { "continue-from-mvn", OPT_MVN,
+        "Start chains from the posterior in this MVN, e.g. the output of a VB run. The "
+        "posterior covariance is used as the initial proposal covariance",
+        OPT_NONREQ, "" },
+    { "num-threads", OPT_INT, "Number of threads to use. 0 means one for each processor",
+        OPT_NONREQ, "1" },
+    { "" },
+};
+
+namespace
+{
+/**
+ * Random number generator (xorshift64*) with normal deviates by Box-Muller
+ *
+ * This is small enough that each voxel can have its own stream which is
+ * independent of the thread it runs on
+ */
+class Rng
+{
+public:
+    Rng(unsigned long seed, int stream)
+        : m_have_spare(false)
+        , m_spare(0)
+    {
+        // Mix the seed and stream number using splitmix64 so nearby seeds
+        // give unrelated streams
+        unsigned long long z = (unsigned long long)(seed) * 0x9E3779B97F4A7C15ULL
+            + (unsigned long long)(stream) * 0xBF58476D1CE4E5B9ULL + 0x94D049BB133111EBULL;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        m_state = z ^ (z >> 31);
+        if (m_state == 0)
+            m_state = 1;
+    }
+
+    /** @return Uniform deviate in (0, 1) */
+    double Uniform()
+    {
+        m_state ^= m_state >> 12;
+        m_state ^= m_state << 25;
+        m_state ^= m_state >> 27;
+        unsigned long long r = m_state * 2685821657736338717ULL;
+        return (double(r >> 11) + 0.5) / 9007199254740992.0;
+    }
+
+    /** @return Standard normal deviate */
+    double Normal()
+    {
+        if (m_have_spare)
+        {
+            m_have_spare = false;
+            return m_spare;
+        }
+        double r = sqrt(-2 * log(Uniform()));
+        double theta = 2 * M_PI * Uniform();
+        m_spare = r * sin(theta);
+        m_have_spare = true;
+        return r * cos(theta);
+    }
+
+private:
+    unsigned long long m_state;
+    bool m_have_spare;
+    double m_spare;
+};
+
+/**
+ * Log posterior (up to a constant) in Fabber space, or -HUGE_VAL if the
+ * model cannot be evaluated
+ */
+double LogPosterior(const FwdModel &model, const ColumnVector &y, const ColumnVector &params,
+    const ColumnVector &prior_means, const SymmetricMatrix &prior_prec, double &ssr)
+{
+    ColumnVector pred;
+    try
+    {
+        model.EvaluateFabber(params, pred);
+    }
+    catch (...)
+    {
+        return -HUGE_VAL;
+    }
+    if (pred.Nrows() != y.Nrows())
+        return -HUGE_VAL;
+
+    ssr = 0;
+    for (int t = 1; t <= y.Nrows(); t++)
+    {
+        double d = y(t) - pred(t);
+        ssr += d * d;
+    }
+    if (isnan(ssr) || isinf(ssr))
+        return -HUGE_VAL;
+
+    // Avoid log(0) for a perfect fit
+    ssr = max(ssr, 1e-300);
+    ColumnVector dp = params - prior_means;
+    double prior_term = (dp.t() * prior_prec * dp).AsScalar();
+    return -0.5 * y.Nrows() * log(ssr) - 0.5 * prior_term;
+}
+
+/**
+ * Cholesky factor of a proposal covariance, adding jitter to the diagonal
+ * if it is not numerically positive definite
+ */
+bool ProposalFactor(const SymmetricMatrix &cov, LowerTriangularMatrix &factor)
+{
+    SymmetricMatrix c = cov;
+    double jitter = 0;
+    for (int i = 1; i <= c.Nrows(); i++)
+    {
+        jitter = max(jitter, 1e-10 * fabs(c(i, i)));
+    }
+    for (int attempt = 0; attempt < 5; attempt++)
+    {
+        try
+        {
+            factor = Cholesky(c);
+            return true;
+        }
+        catch (Exception &)
+        {
+            for (int i = 1; i <= c.Nrows(); i++)
+            {
+                c(i, i) += jitter;
+            }
+            jitter *= 100;
+        }
+    }
+    return false;
+}
+
+// Work item for running the chain for each voxel
+class McmcVoxelWork : public ParallelWork
+{
+public:
+    McmcVoxelWork(McmcInferenceTechnique &mcmc, const vector<FwdModel *> &models,
+        const Matrix &data, const Matrix &coords, const Matrix &suppdata,
+        const vector<MVNDist> &starts, const vector<MVNDist> &priors, bool laplace,
+        vector<MVNDist *> &results, vector<double> &acceptance, vector<string> &errors,
+        bool halt_bad_voxel)
+        : m_mcmc(mcmc)
+        , m_models(models)
+        , m_data(data)
+        , m_coords(coords)
+        , m_suppdata(suppdata)
+        , m_starts(starts)
+        , m_priors(priors)
+        , m_laplace(laplace)
+        , m_results(results)
+        , m_acceptance(acceptance)
+        , m_errors(errors)
+        , m_halt_bad_voxel(halt_bad_voxel)
+    {
+    }
+
+    virtual void Process(int voxel, int thread)
+    {
+        int v = voxel + 1;
+        FwdModel &model = *m_models[thread];
+        ColumnVector y = m_data.Column(v);
+        if (m_suppdata.Ncols() > 0)
+            model.PassData(y, m_coords.Column(v), m_suppdata.Column(v));
+        else
+            model.PassData(y, m_coords.Column(v));
+
+        try
+        {
+            m_mcmc.RunChain(v, model, y, m_starts[voxel], m_priors[voxel], m_laplace,
+                m_results[voxel], m_acceptance[voxel]);
+        }
+        catch (FabberInternalError &e)
+        {
+            if (m_halt_bad_voxel)
+                throw;
+            m_errors[voxel] = e.what();
+        }
+        catch (Exception &e)
+        {
+            if (m_halt_bad_voxel)
+                throw;
+            m_errors[voxel] = e.what();
+        }
+    }
+
+private:
+    McmcInferenceTechnique &m_mcmc;
+    const vector<FwdModel *> &m_models;
+    const Matrix &m_data;
+    const Matrix &m_coords;
+    const Matrix &m_suppdata;
+    const vector<MVNDist> &m_starts;
+    const vector<MVNDist> &m_priors;
+    bool m_laplace;
+    vector<MVNDist *> &m_results;
+    vector<double> &m_acceptance;
+    vector<string> &m_errors;
+    bool m_halt_bad_voxel;
+};
+}
+
+InferenceTechnique *McmcInferenceTechnique::NewInstance()
+{
+    return new McmcInferenceTechnique();
+}
+
+void McmcInferenceTechnique::GetOptions(vector<OptionSpec> &opts) const
+{
+    InferenceTechnique::GetOptions(opts);
+    for (int i = 0; OPTIONS[i].name != ""; i++)
+    {
+        opts.push_back(OPTIONS[i]);
+    }
+}
+
+string McmcInferenceTechnique::GetDescription() const
+{
+    return "Adaptive Metropolis MCMC inference technique";
+}
+
+string McmcInferenceTechnique::GetVersion() const
+{
+    return fabber_version();
+}
+
+void McmcInferenceTechnique::Initialize(FwdModel *fwd_model, FabberRunData &rundata)
+{
+    InferenceTechnique::Initialize(fwd_model, rundata);
+
+    m_model_name = rundata.GetStringDefault("model", "");
+    m_nthreads = GetNumThreads(rundata);
+    m_burnin = rundata.GetIntDefault("mcmc-burnin", 1000, 0);
+    m_samples = rundata.GetIntDefault("mcmc-samples", 2000, 1);
+    m_thin = rundata.GetIntDefault("mcmc-thin", 1, 1);
+    m_seed = rundata.GetIntDefault("mcmc-seed", 1, 0);
+    m_continueFromFile = rundata.GetStringDefault("continue-from-mvn", "");
+
+    m_model->GetParameters(rundata, m_params);
+    for (unsigned int p = 0; p < m_params.size(); p++)
+    {
+        char type = m_params[p].prior_type;
+        if ((type == PRIOR_SPATIAL_M) || (type == PRIOR_SPATIAL_m) || (type == PRIOR_SPATIAL_P)
+            || (type == PRIOR_SPATIAL_p))
+        {
+            throw InvalidOptionValue("param-spatial-priors", stringify(type),
+                "Spatial priors are not supported by the mcmc method");
+        }
+    }
+
+    LOG << "McmcInferenceTechnique::" << m_burnin << " burn-in iterations, " << m_samples
+        << " samples, using " << m_nthreads << " threads" << endl;
+}
+
+void McmcInferenceTechnique::RunChain(int v, FwdModel &model, const ColumnVector &y,
+    const MVNDist &start, const MVNDist &prior, bool laplace, MVNDist *&result,
+    double &acceptance)
+{
+    const int nparams = m_num_params;
+    const ColumnVector prior_means = prior.means;
+    const SymmetricMatrix prior_prec = prior.GetPrecisions();
+    Rng rng(m_seed, v);
+
+    ColumnVector x = start.means;
+    double ssr;
+    double lp = LogPosterior(model, y, x, prior_means, prior_prec, ssr);
+    if (lp == -HUGE_VAL)
+    {
+        throw FabberInternalError("Model could not be evaluated at the initial point");
+    }
+
+    // Initial proposal covariance
+    SymmetricMatrix cov = start.GetCovariance();
+    if (laplace)
+    {
+        try
+        {
+            LinearizedFwdModel lin(&model);
+            lin.ReCentre(x);
+            Matrix J = lin.Jacobian();
+            SymmetricMatrix prec;
+            prec << J.t() * J * (y.Nrows() / ssr) + prior_prec;
+            cov = prec.i();
+        }
+        catch (Exception &)
+        {
+            // Stay with the initial posterior covariance
+        }
+        catch (FabberInternalError &)
+        {
+            // Non-finite model output or Jacobian at the start point - as above
+        }
+    }
+
+    // Optimal scaling for a Gaussian target (Gelman et al 1996)
+    const double base_scale = 2.38 * 2.38 / nparams;
+    double log_scale = 0;
+    LowerTriangularMatrix factor;
+    if (!ProposalFactor(cov * base_scale, factor))
+    {
+        throw FabberInternalError("Initial proposal covariance is not positive definite");
+    }
+
+    // Running mean and sum of squared deviations (Welford) of the burn-in
+    // chain for adaptation and of the retained chain for the result
+    ColumnVector mean(nparams), delta(nparams), z(nparams), xp;
+    SymmetricMatrix m2(nparams);
+    mean = 0;
+    m2 = 0;
+    int n = 0;
+    int accepted = 0, adapt_accepted = 0, nadapt = 0;
+    int row = 1;
+
+    for (int it = 0; it < m_burnin + m_samples; it++)
+    {
+        if (it == m_burnin)
+        {
+            // Start collecting statistics for the result
+            mean = 0;
+            m2 = 0;
+            n = 0;
+        }
+
+        for (int p = 1; p <= nparams; p++)
+        {
+            z(p) = rng.Normal();
+        }
+        xp = x + factor * z;
+        double ssrp;
+        double lpp = LogPosterior(model, y, xp, prior_means, prior_prec, ssrp);
+        if ((lpp != -HUGE_VAL) && (log(rng.Uniform()) < lpp - lp))
+        {
+            x = xp;
+            lp = lpp;
+            if (it < m_burnin)
+                adapt_accepted++;
+            else
+                accepted++;
+        }
+
+        n++;
+        delta = x - mean;
+        mean += delta / n;
+        for (int i = 1; i <= nparams; i++)
+        {
+            for (int j = 1; j <= i; j++)
+            {
+                m2(i, j) += delta(i) * delta(j) * (n - 1) / n;
+            }
+        }
+
+        if ((it < m_burnin) && ((it + 1) % ADAPT_INTERVAL == 0))
+        {
+            // Robbins-Monro update of the overall scale towards the target acceptance
+            // rate, and proposal shape from the chain so far once it has enough samples
+            nadapt++;
+            double rate = double(adapt_accepted) / ADAPT_INTERVAL;
+            log_scale += (rate - TARGET_ACCEPTANCE) / sqrt(double(nadapt));
+            adapt_accepted = 0;
+            if (n > 2 * nparams)
+            {
+                cov = m2 / (n - 1);
+            }
+            LowerTriangularMatrix new_factor;
+            if (ProposalFactor(cov * (base_scale * exp(log_scale)), new_factor))
+            {
+                factor = new_factor;
+            }
+        }
+        else if ((it >= m_burnin) && !m_sample_output.empty()
+            && ((it - m_burnin) % m_thin == 0))
+        {
+            for (int p = 0; p < nparams; p++)
+            {
+                m_sample_output[p](row, v) = m_params[p].transform->ToModel(x(p + 1));
+            }
+            row++;
+        }
+    }
+
+    result = new MVNDist(nparams);
+    result->means = mean;
+    if (n > 1)
+        result->SetCovariance(m2 / (n - 1));
+    else
+        result->SetCovariance(cov);
+    acceptance = double(accepted) / m_samples;
+}
+
+void McmcInferenceTechnique::DoCalculations(FabberRunData &rundata)
+{
+    const Matrix &data = rundata.GetMainVoxelData();
+    const Matrix &coords = rundata.GetVoxelCoords();
+    const Matrix &suppdata = rundata.GetVoxelSuppData();
+    int nvoxels = data.Ncols();
+    if (nvoxels == 0)
+        return;
+
+    if (rundata.GetBool("save-mcmc-samples"))
+    {
+        int nkept = (m_samples + m_thin - 1) / m_thin;
+        m_sample_output.resize(m_num_params, Matrix(nkept, nvoxels));
+    }
+
+    // Starting points. If continuing from an MVN, this contains the noise
+    // parameters as well which we do not need
+    vector<MVNDist> starts(nvoxels, MVNDist(m_num_params, m_log));
+    if (m_continueFromFile != "")
+    {
+        LOG << "McmcInferenceTechnique::Starting chains from " << m_continueFromFile << endl;
+        InitMVNFromFile(m_continueFromFile, rundata, "");
+        if ((int)resultMVNs.size() != nvoxels || resultMVNs[0]->GetSize() < m_num_params)
+        {
+            throw InvalidOptionValue("continue-from-mvn", m_continueFromFile,
+                "MVN does not match the number of voxels and model parameters");
+        }
+        for (int v = 0; v < nvoxels; v++)
+        {
+            starts[v] = resultMVNs[v]->GetSubmatrix(1, m_num_params, false);
+            delete resultMVNs[v];
+        }
+        resultMVNs.clear();
+    }
+
+    // Initial posteriors and priors are set up serially as the model and prior
+    // objects are not required to be thread safe. The initial posterior is also
+    // needed by ARD priors
+    RunContext ctx(nvoxels);
+    ctx.fwd_post.resize(nvoxels, MVNDist(m_num_params, m_log));
+    for (int v = 1; v <= nvoxels; v++)
+    {
+        if (suppdata.Ncols() > 0)
+            m_model->PassData(data.Column(v), coords.Column(v), suppdata.Column(v));
+        else
+            m_model->PassData(data.Column(v), coords.Column(v));
+        if (m_continueFromFile == "")
+        {
+            m_model->GetInitialPosterior(ctx.fwd_post[v - 1]);
+            starts[v - 1] = ctx.fwd_post[v - 1];
+        }
+        else
+        {
+            ctx.fwd_post[v - 1] = starts[v - 1];
+        }
+    }
+
+    vector<Prior *> priors = PriorFactory(rundata).CreatePriors(m_params);
+    vector<MVNDist> voxel_priors(nvoxels, MVNDist(m_num_params, m_log));
+    for (int v = 1; v <= nvoxels; v++)
+    {
+        ctx.v = v;
+        for (int k = 0; k < m_num_params; k++)
+        {
+            priors[k]->ApplyToMVN(&voxel_priors[v - 1], ctx);
+        }
+    }
+    for (int k = 0; k < m_num_params; k++)
+    {
+        delete priors[k];
+    }
+
+    // Each thread needs its own model instance as models are not required to be
+    // thread safe. These are created here as initialization may not be thread safe
+    vector<FwdModel *> models(1, m_model);
+    for (int t = 1; t < min(m_nthreads, nvoxels); t++)
+    {
+        FwdModel *model = FwdModel::NewFromName(m_model_name);
+        model->SetLogger(m_log);
+        model->Initialize(rundata);
+        models.push_back(model);
+    }
+
+    resultMVNs.resize(nvoxels, NULL);
+    vector<double> acceptance(nvoxels, 0);
+    vector<string> errors(nvoxels);
+    try
+    {
+        McmcVoxelWork work(*this, models, data, coords, suppdata, starts, voxel_priors,
+            m_continueFromFile == "", resultMVNs, acceptance, errors, m_halt_bad_voxel);
+        ParallelFor(work, nvoxels, models.size());
+    }
+    catch (...)
+    {
+        for (unsigned int t = 1; t < models.size(); t++)
+        {
+            delete models[t];
+        }
+        throw;
+    }
+    for (unsigned int t = 1; t < models.size(); t++)
+    {
+        delete models[t];
+    }
+
+    double mean_acceptance = 0;
+    int ngood = 0;
+    for (int v = 0; v < nvoxels; v++)
+    {
+        if (errors[v] != "")
+        {
+            LOG << "McmcInferenceTechnique::Error for voxel " << v + 1 << " at "
+                << coords.Column(v + 1).t() << " : " << errors[v] << endl
+                << "   Outputting initial posterior" << endl;
+            resultMVNs[v] = new MVNDist(starts[v]);
+        }
+        else
+        {
+            mean_acceptance += acceptance[v];
+            ngood++;
+        }
+    }
+    if (ngood > 0)
+    {
+        LOG << "McmcInferenceTechnique::Mean acceptance rate after burn-in: "
+            << mean_acceptance / ngood << endl;
+    }
+}
+
+void McmcInferenceTechnique::SaveResults(FabberRunData &rundata) const
+{
+    InferenceTechnique::SaveResults(rundata);
+
+    if (!m_sample_output.empty())
+    {
+        LOG << "McmcInferenceTechnique::Writing samples..." << endl;
+        for (int p = 0; p < m_num_params; p++)
+        {
+            Matrix samples = m_sample_output[p];
+            rundata.SaveVoxelData("samples_" + m_params[p].name, samples);
+        }
+    }
+}
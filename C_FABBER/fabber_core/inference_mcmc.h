@@ -0,0 +1,107 @@
+/*  inference_mcmc.h - Adaptive Metropolis MCMC inference technique
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+#pragma once
+
+#include "inference.h"
+
+#include <newmat.h>
+
+#include <string>
+#include <vector>
+
+/**
+ * Inference technique using adaptive Metropolis sampling
+ *
+ * An independent chain is run for each voxel. The target distribution is
+ * the posterior of the model parameters in Fabber space, using the priors
+ * set up by the Prior objects (spatial priors are not supported). The noise
+ * is assumed white with unknown variance which is marginalised using a
+ * Jeffreys prior, so the log likelihood is -N/2 log(SSR).
+ *
+ * Proposals are multivariate normal. The proposal covariance starts from
+ * the Laplace approximation at the initial point (or the supplied posterior
+ * covariance when continuing from an MVN, e.g. the output of a VB run) and
+ * during burn-in is adapted to the sample covariance of the chain, with an
+ * overall scale tuned towards the optimal acceptance rate (Haario et al 2001,
+ * Roberts & Rosenthal 2009). The proposal is fixed after burn-in so the
+ * retained samples come from a valid Markov chain.
+ *
+ * Voxels are distributed between threads. Each voxel has its own random
+ * number stream derived from the seed and the voxel index, so results do
+ * not depend on the number of threads.
+ */
+class McmcInferenceTechnique : public InferenceTechnique
+{
+public:
+    static InferenceTechnique *NewInstance();
+
+    McmcInferenceTechnique()
+        : m_burnin(0)
+        , m_samples(0)
+        , m_thin(1)
+        , m_seed(0)
+        , m_nthreads(1)
+    {
+    }
+
+    virtual void GetOptions(std::vector<OptionSpec> &opts) const;
+    virtual std::string GetDescription() const;
+    virtual std::string GetVersion() const;
+
+    virtual void Initialize(FwdModel *fwd_model, FabberRunData &rundata);
+    virtual void DoCalculations(FabberRunData &rundata);
+    virtual void SaveResults(FabberRunData &rundata) const;
+
+    /**
+     * Run the chain for a single voxel
+     *
+     * This is called from multiple threads during DoCalculations so does not
+     * modify any shared member data except the voxel's own column of the
+     * sample matrices.
+     *
+     * @param v Voxel index, starting at 1
+     * @param model Model instance to use for this thread
+     * @param start Starting point and initial proposal covariance
+     * @param prior Prior for this voxel
+     * @param laplace If true, the initial proposal covariance is the Laplace approximation
+     *                at the starting point rather than the covariance of start
+     * @param result Will be set to a new MVN containing the sample mean and covariance
+     * @param acceptance Will be set to the acceptance rate after burn-in
+     */
+    void RunChain(int v, FwdModel &model, const NEWMAT::ColumnVector &y, const MVNDist &start,
+        const MVNDist &prior, bool laplace, MVNDist *&result, double &acceptance);
+
+protected:
+    /** Number of burn-in iterations during which the proposal is adapted */
+    int m_burnin;
+
+    /** Number of iterations after burn-in */
+    int m_samples;
+
+    /** Keep one sample in this many for the sample output */
+    int m_thin;
+
+    /** Seed for the random number generator */
+    unsigned long m_seed;
+
+    /** Number of threads to use */
+    int m_nthreads;
+
+    /** Model parameters, used to transform samples to model space */
+    std::vector<Parameter> m_params;
+
+    /** Name of the forward model, used to create additional instances for threads */
+    std::string m_model_name;
+
+    /** If not empty, initialize the chains from this MVN */
+    std::string m_continueFromFile;
+
+    /**
+     * Thinned samples in model space, one matrix per parameter with one row per
+     * retained sample and one column per voxel. Empty if samples are not being saved
+     */
+    std::vector<NEWMAT::Matrix> m_sample_output;
+};
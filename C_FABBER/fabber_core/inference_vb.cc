@@ -10,17 +10,21 @@
 
 #include "convergence.h"
 #include "easylog.h"
+#include "inference_gridsearch.h"
 #include "priors.h"
 #include "run_context.h"
+#include "threads.h"
 #include "tools.h"
 #include "version.h"
 
 #include <miscmaths/miscmaths.h>
 #include <newmatio.h>
 
+#include <algorithm>
+#include <fstream>
+#include <map>
 #include <math.h>
-
-using MISCMATHS::sign;
+#include <stdio.h>
 
 // ------------------------------------------------------------------------------------------------
 // --------         Input Option Text           ---------------------------------------------------
@@ -37,6 +41,25 @@ static OptionSpec OPTIONS[] = {
     { "max-trials", OPT_STR, "When using the trial mode convergence detector, the maximum number "
                              "of trials after an initial reduction in F",
         OPT_NONREQ, "10" },
+    { "min-pchange", OPT_FLOAT, "When using the pchange convergence detector, stop when no "
+                                "posterior mean changes by more than this many posterior "
+                                "standard deviations",
+        OPT_NONREQ, "0.01" },
+    { "jacobian-refresh", OPT_INT, "Recalculate the Jacobian in full every N iterations, "
+                                   "using a rank-one (Broyden) update in between. The Jacobian "
+                                   "is also recalculated if F decreases. Voxelwise VB only",
+        OPT_NONREQ, "1" },
+    { "fd-method", OPT_STR, "Numerical differentiation method for models without a gradient: "
+                            "forward, central or richardson. May be a comma separated list "
+                            "with one method for each parameter",
+        OPT_NONREQ, "central" },
+    { "fd-adaptive", OPT_BOOL, "Tune the numerical differentiation step for each parameter "
+                               "from an error estimate",
+        OPT_NONREQ, "" },
+    { "jacobian-check", OPT_BOOL, "Compare the Jacobian with a Richardson estimate using half "
+                                  "the step in each voxel and report the worst relative errors. "
+                                  "Voxelwise VB only",
+        OPT_NONREQ, "" },
     { "print-free-energy", OPT_BOOL, "Output the free energy", OPT_NONREQ, "" },
     { "mcsteps", OPT_INT, "Number of motion correction steps", OPT_NONREQ, "0" },
     { "continue-from-mvn", OPT_MVN, "Continue previous run from output MVN files", OPT_NONREQ, "" },
@@ -68,6 +91,47 @@ static OptionSpec OPTIONS[] = {
     { "update-spatial-prior-on-first-iteration", OPT_BOOL, "", OPT_NONREQ, "" },
     { "locked-linear-from-mvn", OPT_MVN, "MVN file containing fixed centres for linearization",
         OPT_NONREQ, "" },
+    { "coarse-init", OPT_INT, "Initialize posteriors by first fitting data averaged over blocks "
+                              "of this many voxels (must be a power of 2, e.g. 2 or 4). Fitting "
+                              "is repeated with the block size halved each time until it is 2",
+        OPT_NONREQ, "0" },
+    { "init-gridsearch", OPT_BOOL, "Initialize posteriors using the best fit from a grid search. "
+                                   "The grid-* options of the gridsearch method apply",
+        OPT_NONREQ, "" },
+    { "multistart", OPT_INT, "Number of starting points to fit in each voxel. The solution with "
+                             "the highest free energy is kept",
+        OPT_NONREQ, "1" },
+    { "multistart-init", OPT_MATRIX, "Starting points for multistart fitting, one row per start "
+                                     "and one column per model parameter. The initial posterior is "
+                                     "always the first start",
+        OPT_NONREQ, "" },
+    { "multistart-nsd", OPT_FLOAT, "Starting points not given in multistart-init are spread over "
+                                   "this many prior standard deviations either side of the mean",
+        OPT_NONREQ, "1" },
+    { "multistart-margin", OPT_FLOAT, "Abandon a starting point when its free energy is this far "
+                                      "below the best start and not increasing fast enough to "
+                                      "catch up",
+        OPT_NONREQ, "10" },
+    { "warm-start", OPT_STR, "Visit voxels in a spatially coherent order and initialize each "
+                             "from the posterior of an already fitted neighbour. Order may be "
+                             "raster (alternating direction raster scan) or hilbert (3D Hilbert "
+                             "curve)",
+        OPT_NONREQ, "" },
+    { "spatial-order", OPT_STR, "Reorder voxels along a space filling curve during spatial VB so "
+                                "neighbouring voxels are close in memory. Order may be morton "
+                                "(Z-order curve) or hilbert (3D Hilbert curve)",
+        OPT_NONREQ, "" },
+    { "checkpoint", OPT_FILE, "During spatial VB, periodically save the state of the run to this "
+                              "file so it can be resumed using resume-from",
+        OPT_NONREQ, "" },
+    { "checkpoint-interval", OPT_INT, "Number of spatial iterations between checkpoints",
+        OPT_NONREQ, "1" },
+    { "resume-from", OPT_FILE, "Resume a spatial VB run from a checkpoint file. The data, mask, "
+                               "model and prior options must be the same as the original run",
+        OPT_NONREQ, "" },
+    { "num-threads", OPT_INT, "Number of threads to use for multistart fitting. 0 means one for "
+                              "each processor",
+        OPT_NONREQ, "1" },
     { "" },
 };
 
@@ -140,6 +204,134 @@ void Vb::Initialize(FwdModel *fwd_model, FabberRunData &rundata)
     // Locked linearizations, if requested
     m_locked_linear = rundata.GetStringDefault("locked-linear-from-mvn", "") != "";
 
+    // Numerical differentiation of the model
+    m_fd.Initialize(rundata, m_num_params);
+    m_jacobian_check = rundata.GetBool("jacobian-check");
+
+    // Coarse-to-fine initialization, if requested
+    m_coarse_init = rundata.GetIntDefault("coarse-init", 0, 0);
+    if (m_coarse_init > 1)
+    {
+        if ((m_coarse_init & (m_coarse_init - 1)) != 0)
+        {
+            throw InvalidOptionValue(
+                "coarse-init", stringify(m_coarse_init), "Must be a power of 2");
+        }
+        if (m_continueFromFile != "")
+        {
+            throw InvalidOptionValue("coarse-init", stringify(m_coarse_init),
+                "Cannot be used with continue-from-mvn");
+        }
+        if (m_locked_linear)
+        {
+            throw InvalidOptionValue("coarse-init", stringify(m_coarse_init),
+                "Cannot be used with locked-linear-from-mvn");
+        }
+    }
+
+    // Grid search initialization, if requested
+    m_gridsearch_init = rundata.GetBool("init-gridsearch");
+    if (m_gridsearch_init)
+    {
+        if (m_continueFromFile != "")
+        {
+            throw InvalidOptionValue(
+                "init-gridsearch", "", "Cannot be used with continue-from-mvn");
+        }
+        if (m_coarse_init > 1)
+        {
+            throw InvalidOptionValue("init-gridsearch", "", "Cannot be used with coarse-init");
+        }
+    }
+
+    // Multiple starting points, if requested
+    m_multistart = rundata.GetIntDefault("multistart", 1, 1);
+    m_nthreads = GetNumThreads(rundata);
+    if (m_multistart > 1)
+    {
+        if (rundata.GetString("method") != "vb")
+        {
+            throw InvalidOptionValue("multistart", stringify(m_multistart),
+                "Can only be used with the vb method");
+        }
+        if (m_locked_linear)
+        {
+            throw InvalidOptionValue("multistart", stringify(m_multistart),
+                "Cannot be used with locked-linear-from-mvn");
+        }
+        m_multistart_margin = rundata.GetDoubleDefault("multistart-margin", 10, 0);
+        SetupMultiStartPoints(rundata);
+        LOG << "Vb::Fitting from " << m_multistart << " starting points in each voxel using "
+            << m_nthreads << " threads" << endl;
+    }
+
+    // Warm starts from neighbouring voxels, if requested
+    m_warm_start = rundata.GetStringDefault("warm-start", "");
+    if (m_warm_start != "")
+    {
+        if ((m_warm_start != "raster") && (m_warm_start != "hilbert"))
+        {
+            throw InvalidOptionValue("warm-start", m_warm_start, "Must be raster or hilbert");
+        }
+        if (rundata.GetString("method") != "vb")
+        {
+            throw InvalidOptionValue(
+                "warm-start", m_warm_start, "Can only be used with the vb method");
+        }
+        if ((m_continueFromFile != "") || (m_coarse_init > 1) || m_gridsearch_init
+            || (m_multistart > 1))
+        {
+            throw InvalidOptionValue("warm-start", m_warm_start,
+                "Cannot be used with continue-from-mvn, coarse-init, init-gridsearch or "
+                "multistart");
+        }
+    }
+
+    // Reordering of voxels for spatial VB, if requested
+    m_spatial_order = rundata.GetStringDefault("spatial-order", "");
+    if (m_spatial_order != "")
+    {
+        if ((m_spatial_order != "morton") && (m_spatial_order != "hilbert"))
+        {
+            throw InvalidOptionValue("spatial-order", m_spatial_order, "Must be morton or hilbert");
+        }
+        if (rundata.GetString("method") == "vb")
+        {
+            throw InvalidOptionValue(
+                "spatial-order", m_spatial_order, "Can only be used with the spatialvb method");
+        }
+        if ((m_continueFromFile != "") || m_locked_linear || (m_coarse_init > 1)
+            || m_gridsearch_init)
+        {
+            throw InvalidOptionValue("spatial-order", m_spatial_order,
+                "Cannot be used with continue-from-mvn, locked-linear-from-mvn, coarse-init or "
+                "init-gridsearch");
+        }
+    }
+
+    // Checkpointing of spatial VB runs, if requested
+    m_checkpoint = rundata.GetStringDefault("checkpoint", "");
+    m_checkpoint_interval = rundata.GetIntDefault("checkpoint-interval", 1, 1);
+    m_resume_from = rundata.GetStringDefault("resume-from", "");
+    if ((m_checkpoint != "") && (rundata.GetString("method") == "vb"))
+    {
+        throw InvalidOptionValue(
+            "checkpoint", m_checkpoint, "Can only be used with the spatialvb method");
+    }
+    if (m_resume_from != "")
+    {
+        if (rundata.GetString("method") == "vb")
+        {
+            throw InvalidOptionValue(
+                "resume-from", m_resume_from, "Can only be used with the spatialvb method");
+        }
+        if ((m_continueFromFile != "") || (m_coarse_init > 1) || m_gridsearch_init)
+        {
+            throw InvalidOptionValue("resume-from", m_resume_from,
+                "Cannot be used with continue-from-mvn, coarse-init or init-gridsearch");
+        }
+    }
+
 } // Vb::Initialize
 
 
@@ -170,7 +362,9 @@ void Vb::SetupPerVoxelDists(FabberRunData &rundata)
     m_ctx->fwd_post.resize(m_nvoxels);
 
     // Re-centred in voxel loop below
-    m_lin_model.resize(m_nvoxels, LinearizedFwdModel(m_model));
+    LinearizedFwdModel lin(m_model);
+    lin.SetDifferencing(m_fd);
+    m_lin_model.resize(m_nvoxels, lin);
 
     // Initialized in voxel loop below
     m_conv.resize(m_nvoxels, NULL);
@@ -185,6 +379,9 @@ void Vb::SetupPerVoxelDists(FabberRunData &rundata)
     // Initialized during calculation
     resultFs.resize(m_nvoxels, 9999); // 9999 is a garbage default value
 
+    // No voxels have failed yet
+    m_bad_voxels.assign(m_nvoxels, false);
+
     // Whether to fix the linearization centres (default: false)
     vector<MVNDist *> lockedLinearDists;
     Matrix lockedLinearCentres;
@@ -227,6 +424,15 @@ void Vb::SetupPerVoxelDists(FabberRunData &rundata)
             // may want the voxel data in order to do this
             PassModelData(v);
             m_model->GetInitialPosterior(m_ctx->fwd_post[v - 1]);
+            if (resultMVNs[v - 1])
+            {
+                // Seeded from a coarse fit or grid search. The model's InitVoxelPosterior
+                // has already been applied by GetInitialPosterior, and only its means are
+                // replaced as the seed variances are not comparable with the full VB fit
+                m_ctx->fwd_post[v - 1].means = resultMVNs[v - 1]->means.Rows(1, m_num_params);
+                delete resultMVNs[v - 1];
+                resultMVNs[v - 1] = NULL;
+            }
             // Set initial noise posterior
             m_ctx->noise_post[v - 1] = initialNoisePosterior->Clone();
         }
@@ -282,35 +488,22 @@ void Vb::IgnoreVoxel(int v)
 {
     LOG << "Vb::IgnoreVoxel This voxel will be ignored in further updates" << endl;
 
-    m_ignore_voxels.push_back(v);
+    m_bad_voxels[v - 1] = true;
 
     // Remove voxel from lists of neighbours of other voxels.
     // We identify affected voxels by looking in the neighbour
     // lists for the bad voxel, because any voxel which has
     // the bad voxel as a neighbour will be a neighbour of the
-    // bad voxel
-    vector<int> nn = m_ctx->neighbours[v - 1];
-    for (vector<int>::iterator i = nn.begin(); i != nn.end(); ++i)
-    {
-        // Reference to list of neighbours of some other voxel which
-        // has the bad voxel as a neighbour
-        vector<int> &n2 = m_ctx->neighbours[*i - 1];
-
-        n2.erase(std::remove(n2.begin(), n2.end(), v), n2.end());
-    }
-
-    // Same for next-nearest-neighbours
-    nn = m_ctx->neighbours2[v - 1];
-    for (vector<int>::iterator i = nn.begin(); i != nn.end(); ++i)
-    {
-        // Reference to list of neighbours of some other voxel which
-        // has the bad voxel as a neighbour
-        vector<int> &n2 = m_ctx->neighbours2[*i - 1];
-
-        n2.erase(std::remove(n2.begin(), n2.end(), v), n2.end());
-    }
+    // bad voxel. Same for next-nearest-neighbours
+    m_ctx->neighbours.RemoveVoxel(v);
+    m_ctx->neighbours2.RemoveVoxel(v);
 } // Vb::IgnoreVoxel
 
+int Vb::NumBadVoxels() const
+{
+    return count(m_bad_voxels.begin(), m_bad_voxels.end(), true);
+} // Vb::NumBadVoxels
+
 // ------------------------------------------------------------------------------------------------
 // --------         Calculate Free Energy       ---------------------------------------------------
 // ------------------------------------------------------------------------------------------------
@@ -374,6 +567,13 @@ void Vb::DoCalculations(FabberRunData &rundata)
     assert(resultMVNs.empty());
     assert(resultFs.empty());
 
+    if (m_coarse_init > 1)
+        InitMVNFromCoarseFit(rundata);
+    else if (m_gridsearch_init)
+        InitMVNFromGridSearch(rundata);
+    else if (m_spatial_order != "")
+        SortVoxels(rundata);
+
     SetupPerVoxelDists(rundata);
 
     if (rundata.GetBool("output-only"))
@@ -383,7 +583,10 @@ void Vb::DoCalculations(FabberRunData &rundata)
     }
     else if (rundata.GetString("method") == "vb")
     {
-        DoCalculationsVoxelwise(rundata);
+        if (m_multistart > 1)
+            DoCalculationsMultiStart(rundata);
+        else
+            DoCalculationsVoxelwise(rundata);
     }
     else
     {
@@ -396,6 +599,9 @@ void Vb::DoCalculations(FabberRunData &rundata)
         resultFs.clear();
     }
 
+    if (!m_voxel_order.empty())
+        UnsortVoxels(rundata);
+
     // Delete stuff (avoid memory leaks)
     for (int v = 1; v <= m_nvoxels; v++)
     {
@@ -405,6 +611,301 @@ void Vb::DoCalculations(FabberRunData &rundata)
 } // Vb::DoCalculations
 
 
+// ------------------------------------------------------------------------------------------------
+// --------         Voxel Reordering                ------------------------------------------------
+// ------------------------------------------------------------------------------------------------
+namespace
+{
+// Return values stored in the sorted voxel order to the original order
+template <class T>
+void UnsortValues(vector<T> &values, const vector<int> &order)
+{
+    if (values.empty())
+        return;
+
+    vector<T> sorted(values);
+    for (unsigned int i = 0; i < order.size(); i++)
+    {
+        values[order[i] - 1] = sorted[i];
+    }
+}
+}
+
+void Vb::SortVoxels(FabberRunData &rundata)
+{
+    // Image priors are stored in the original voxel order
+    vector<Parameter> params;
+    m_model->GetParameters(rundata, params);
+    vector<Prior *> priors = PriorFactory(rundata).CreatePriors(params);
+    for (unsigned int k = 0; k < priors.size(); k++)
+    {
+        bool image_prior = dynamic_cast<ImagePrior *>(priors[k]) != NULL;
+        delete priors[k];
+        if (image_prior)
+        {
+            throw InvalidOptionValue(
+                "spatial-order", m_spatial_order, "Cannot be used with image priors");
+        }
+    }
+
+    LOG << "Vb::Reordering voxels using " << m_spatial_order << " order" << endl;
+    SpatialOrder(*m_coords, m_spatial_order, m_voxel_order);
+
+    m_sorted_data.ReSize(m_origdata->Nrows(), m_nvoxels);
+    m_sorted_coords.ReSize(m_coords->Nrows(), m_nvoxels);
+    m_sorted_suppdata.ReSize(m_suppdata->Nrows(), m_suppdata->Ncols());
+    for (int i = 1; i <= m_nvoxels; i++)
+    {
+        int v = m_voxel_order[i - 1];
+        m_sorted_data.Column(i) = m_origdata->Column(v);
+        m_sorted_coords.Column(i) = m_coords->Column(v);
+        if (m_suppdata->Ncols() > 0)
+            m_sorted_suppdata.Column(i) = m_suppdata->Column(v);
+    }
+    m_origdata = &m_sorted_data;
+    m_coords = &m_sorted_coords;
+    m_suppdata = &m_sorted_suppdata;
+} // Vb::SortVoxels
+
+void Vb::UnsortVoxels(FabberRunData &rundata)
+{
+    UnsortValues(resultMVNs, m_voxel_order);
+    UnsortValues(resultFs, m_voxel_order);
+    UnsortValues(m_bad_voxels, m_voxel_order);
+
+    m_origdata = &rundata.GetMainVoxelData();
+    m_coords = &rundata.GetVoxelCoords();
+    m_suppdata = &rundata.GetVoxelSuppData();
+    m_sorted_data.CleanUp();
+    m_sorted_coords.CleanUp();
+    m_sorted_suppdata.CleanUp();
+    m_voxel_order.clear();
+} // Vb::UnsortVoxels
+
+
+// ------------------------------------------------------------------------------------------------
+// --------         Coarse-to-fine Initialization   -----------------------------------------------
+// ------------------------------------------------------------------------------------------------
+void Vb::InitMVNFromCoarseFit(FabberRunData &rundata)
+{
+    // Full resolution data which we will temporarily replace with block averages
+    const Matrix *origdata = m_origdata;
+    const Matrix *coords = m_coords;
+    const Matrix *suppdata = m_suppdata;
+    const int nvoxels = m_nvoxels;
+    RunContext *ctx = m_ctx;
+
+    // Image priors are defined per voxel so cannot be applied to block averaged data
+    vector<Parameter> params;
+    m_model->GetParameters(rundata, params);
+    vector<Prior *> priors = PriorFactory(rundata).CreatePriors(params);
+    for (unsigned int k = 0; k < priors.size(); k++)
+    {
+        bool image_prior = dynamic_cast<ImagePrior *>(priors[k]) != NULL;
+        delete priors[k];
+        if (image_prior)
+        {
+            throw InvalidOptionValue("coarse-init", stringify(m_coarse_init),
+                "Cannot be used with image priors");
+        }
+    }
+
+    // For 2D data, blocks are only formed within slices
+    int block_dims = (m_spatial_dims == 2) ? 2 : 3;
+
+    // Size of the voxel grid, used to give each block a unique key. We assume
+    // co-ordinates could be zero but not negative
+    long extent[3];
+    for (int d = 1; d <= 3; d++)
+    {
+        extent[d - 1] = long(coords->Row(d).Maximum()) + 1;
+    }
+
+    // Posteriors from the previous (coarser) level, and the block
+    // each full resolution voxel belonged to at that level
+    vector<MVNDist *> seeds;
+    vector<int> prev_block;
+
+    for (int block_size = m_coarse_init; block_size > 1; block_size /= 2)
+    {
+        // Assign each voxel to a block, numbered in order of first appearance
+        vector<int> block(nvoxels);
+        map<long, int> block_ids;
+        for (int v = 1; v <= nvoxels; v++)
+        {
+            long key = 0;
+            for (int d = 3; d >= 1; d--)
+            {
+                int c = int((*coords)(d, v));
+                if (d <= block_dims)
+                    c /= block_size;
+                key = key * extent[d - 1] + c;
+            }
+            map<long, int>::iterator it = block_ids.find(key);
+            if (it == block_ids.end())
+            {
+                int id = block_ids.size();
+                block_ids[key] = id;
+                block[v - 1] = id;
+            }
+            else
+            {
+                block[v - 1] = it->second;
+            }
+        }
+        int nblocks = block_ids.size();
+
+        // Average data, coords and supplementary data over the voxels in each block
+        Matrix block_data(origdata->Nrows(), nblocks);
+        Matrix block_coords(coords->Nrows(), nblocks);
+        Matrix block_supp(suppdata->Nrows(), suppdata->Ncols() > 0 ? nblocks : 0);
+        ColumnVector count(nblocks);
+        block_data = 0;
+        block_coords = 0;
+        block_supp = 0;
+        count = 0;
+        for (int v = 1; v <= nvoxels; v++)
+        {
+            int b = block[v - 1] + 1;
+            block_data.Column(b) += origdata->Column(v);
+            block_coords.Column(b) += coords->Column(v);
+            if (suppdata->Ncols() > 0)
+                block_supp.Column(b) += suppdata->Column(v);
+            count(b) += 1;
+        }
+        for (int b = 1; b <= nblocks; b++)
+        {
+            block_data.Column(b) /= count(b);
+            block_coords.Column(b) /= count(b);
+            if (suppdata->Ncols() > 0)
+                block_supp.Column(b) /= count(b);
+        }
+
+        LOG << "Vb::Coarse initialization with block size " << block_size << ": " << nblocks
+            << " blocks" << endl;
+
+        // Initial posteriors for each block from the previous level. SetupPerVoxelDists
+        // takes ownership of these
+        resultMVNs.assign(nblocks, NULL);
+        for (int v = 0; v < nvoxels; v++)
+        {
+            int b = block[v];
+            if (!seeds.empty() && !resultMVNs[b] && seeds[prev_block[v]])
+                resultMVNs[b] = new MVNDist(*seeds[prev_block[v]]);
+        }
+        for (unsigned int b = 0; b < seeds.size(); b++)
+        {
+            delete seeds[b];
+        }
+
+        // Run a voxelwise fit on the block data
+        m_origdata = &block_data;
+        m_coords = &block_coords;
+        m_suppdata = &block_supp;
+        m_nvoxels = nblocks;
+        m_ctx = new RunContext(nblocks);
+        m_lin_model.clear();
+        m_conv.clear();
+        resultFs.clear();
+        SetupPerVoxelDists(rundata);
+        DoCalculationsVoxelwise(rundata);
+
+        // Keep the posteriors from blocks which were fitted successfully
+        seeds = resultMVNs;
+        for (int b = 0; b < nblocks; b++)
+        {
+            if (m_bad_voxels[b])
+            {
+                delete seeds[b];
+                seeds[b] = NULL;
+            }
+        }
+        prev_block = block;
+
+        for (int b = 0; b < nblocks; b++)
+        {
+            delete m_ctx->noise_post[b];
+            delete m_ctx->noise_prior[b];
+            delete m_conv[b];
+        }
+        delete m_ctx;
+    }
+
+    // Restore the full resolution data and set up the initial posteriors for each voxel
+    m_origdata = origdata;
+    m_coords = coords;
+    m_suppdata = suppdata;
+    m_nvoxels = nvoxels;
+    m_ctx = ctx;
+    m_lin_model.clear();
+    m_conv.clear();
+    resultFs.clear();
+
+    resultMVNs.assign(nvoxels, NULL);
+    for (int v = 0; v < nvoxels; v++)
+    {
+        if (seeds[prev_block[v]])
+            resultMVNs[v] = new MVNDist(*seeds[prev_block[v]]);
+    }
+    for (unsigned int b = 0; b < seeds.size(); b++)
+    {
+        delete seeds[b];
+    }
+} // Vb::InitMVNFromCoarseFit
+
+
+// ------------------------------------------------------------------------------------------------
+// --------         Grid Search Initialization      -----------------------------------------------
+// ------------------------------------------------------------------------------------------------
+void Vb::InitMVNFromGridSearch(FabberRunData &rundata)
+{
+    LOG << "Vb::Initializing posteriors from grid search" << endl;
+    GridSearchInferenceTechnique grid;
+    grid.Initialize(m_model, rundata);
+    grid.DoCalculations(rundata);
+    grid.ReleaseResults(resultMVNs);
+} // Vb::InitMVNFromGridSearch
+
+
+// ------------------------------------------------------------------------------------------------
+// --------         Voxel Order                    ------------------------------------------------
+// ------------------------------------------------------------------------------------------------
+namespace
+{
+// Fitting state of each voxel for warm starts
+const char VOXEL_UNFITTED = 0;
+const char VOXEL_FITTED = 1;
+const char VOXEL_FAILED = 2;
+
+// Linearization update. The Jacobian is recalculated in full if the convergence
+// detector calls for it, otherwise it is updated from the change in the model output
+void Relinearize(
+    LinearizedFwdModel &lin, const ColumnVector &centre, ConvergenceDetector &conv, double F)
+{
+    if (conv.NeedFullJacobian(F))
+        lin.ReCentre(centre);
+    else
+        lin.BroydenUpdate(centre);
+}
+}
+
+void Vb::GetVoxelOrder(vector<int> &order) const
+{
+    if (m_warm_start == "")
+    {
+        order.resize(m_nvoxels);
+        for (int v = 1; v <= m_nvoxels; v++)
+        {
+            order[v - 1] = v;
+        }
+    }
+    else
+    {
+        SpatialOrder(*m_coords, m_warm_start, order);
+    }
+} // Vb::GetVoxelOrder
+
+
 // ------------------------------------------------------------------------------------------------
 // --------         Voxelwise Calculations         ------------------------------------------------
 // ------------------------------------------------------------------------------------------------
@@ -414,14 +915,69 @@ void Vb::DoCalculationsVoxelwise(FabberRunData &rundata)
     m_model->GetParameters(rundata, params);
     vector<Prior *> priors = PriorFactory(rundata).CreatePriors(params);
 
+    // Total iterations over all voxels, and iterations saved by stopping early
+    // because the parameters stopped changing, for reporting
+    long total_its = 0, saved_its = 0;
+
+    // For warm starts, voxels are visited in a spatially coherent order and each is
+    // seeded from a neighbour which has already been fitted successfully
+    vector<int> order;
+    GetVoxelOrder(order);
+    vector<char> fitted;
+    int prev_v = 0, nseeded = 0;
+    if (m_warm_start != "")
+    {
+        CalcNeighbours(*m_coords);
+        fitted.resize(m_nvoxels, VOXEL_UNFITTED);
+    }
+
+    // Running total of the free energy of fitted voxels, for progress reporting
+    double total_F = 0;
+    int nfitted = 0;
+
+    // Worst relative Jacobian error for each parameter, and the voxel it occurred in
+    vector<double> jac_error(m_num_params, 0);
+    vector<int> jac_error_voxel(m_num_params, 0);
+
     // Loop over voxels
-    for (int v = 1; v <= m_nvoxels; v++)
+    for (int i = 1; i <= m_nvoxels; i++)
     {
+        int v = order[i - 1];
+        if (rundata.Cancelled())
+        {
+            // Voxels not yet fitted keep their initial posterior so the results
+            // so far can still be saved, but are marked as bad
+            LOG << "Vb::Cancelled after " << i - 1 << " of " << m_nvoxels << " voxels" << endl;
+            for (int j = i; j <= m_nvoxels; j++)
+            {
+                v = order[j - 1];
+                m_bad_voxels[v - 1] = true;
+                StoreVoxelResult(v, resultFs[v - 1]);
+            }
+            break;
+        }
         PassModelData(v);
 
         m_ctx->v = v;
         m_ctx->it = 0;
 
+        if (!fitted.empty())
+        {
+            // Prefer the previous voxel if it is a neighbour as it is usually the closest
+            int seed = 0;
+            for (const int *n = m_ctx->neighbours.Begin(v); n != m_ctx->neighbours.End(v); ++n)
+            {
+                if ((fitted[*n - 1] == VOXEL_FITTED) && ((seed == 0) || (*n == prev_v)))
+                    seed = *n;
+            }
+            if (seed > 0)
+            {
+                m_ctx->fwd_post[v - 1].means = m_ctx->fwd_post[seed - 1].means;
+                *m_ctx->noise_post[v - 1] = *m_ctx->noise_post[seed - 1];
+                nseeded++;
+            }
+        }
+
         // Save our model parameters in case we need to revert later.
         // Note need to save prior in case ARD is being used
         NoiseParams *const noisePosteriorSave = m_ctx->noise_post[v - 1]->Clone();
@@ -429,14 +985,29 @@ void Vb::DoCalculationsVoxelwise(FabberRunData &rundata)
         MVNDist fwdPriorSave(m_ctx->fwd_prior[v - 1]);
 
         // Give an indication of the progress through the voxels;
-        rundata.Progress(v, m_nvoxels);
+        rundata.Progress(i, m_nvoxels);
         double F = 1234.5678;
+        bool failed = false;
 
         try
         {
             m_lin_model[v - 1].ReCentre(m_ctx->fwd_post[v - 1].means);
             m_conv[v - 1]->Reset();
 
+            if (m_jacobian_check)
+            {
+                ColumnVector errors;
+                m_lin_model[v - 1].JacobianErrors(errors);
+                for (int k = 0; k < m_num_params; k++)
+                {
+                    if (errors(k + 1) > jac_error[k])
+                    {
+                        jac_error[k] = errors(k + 1);
+                        jac_error_voxel[k] = v;
+                    }
+                }
+            }
+
             // START the VB updates and run through the relevant iterations (according to the
             // convergence testing)
             do
@@ -465,28 +1036,34 @@ void Vb::DoCalculationsVoxelwise(FabberRunData &rundata)
                     Fprior += priors[k]->ApplyToMVN(&m_ctx->fwd_prior[v - 1], *m_ctx);
                 }
 
-                F = CalculateF(v, "before", Fprior);
+                // The intermediate free energies are only for diagnostic output, apart
+                // from F after the noise update which may be needed to decide whether
+                // to recalculate the Jacobian
+                if (m_printF)
+                    CalculateF(v, "before", Fprior);
 
                 m_noise->UpdateTheta(*m_ctx->noise_post[v - 1], m_ctx->fwd_post[v - 1],
                     m_ctx->fwd_prior[v - 1], m_lin_model[v - 1], m_origdata->Column(v), NULL,
                     m_conv[v - 1]->LMalpha());
 
-                F = CalculateF(v, "theta", Fprior);
+                if (m_printF)
+                    CalculateF(v, "theta", Fprior);
 
                 m_noise->UpdateNoise(*m_ctx->noise_post[v - 1], *m_ctx->noise_prior[v - 1],
                     m_ctx->fwd_post[v - 1], m_lin_model[v - 1], m_origdata->Column(v));
 
-                F = CalculateF(v, "phi", Fprior);
+                if (m_printF || m_conv[v - 1]->NeedJacobianF())
+                    F = CalculateF(v, "phi", Fprior);
 
                 // Linearization update
                 // Update the linear model before doing Free energy calculation
                 // (and ready for next round of theta and phi updates)
-                m_lin_model[v - 1].ReCentre(m_ctx->fwd_post[v - 1].means);
+                Relinearize(m_lin_model[v - 1], m_ctx->fwd_post[v - 1].means, *m_conv[v - 1], F);
 
                 F = CalculateF(v, "lin", Fprior);
 
                 ++m_ctx->it;
-            } while (!m_conv[v - 1]->Test(F));
+            } while (!m_conv[v - 1]->Test(F, m_ctx->fwd_post[v - 1]));
 
             // Revert to old values at last stage if required
             if (m_conv[v - 1]->NeedRevert())
@@ -504,6 +1081,8 @@ void Vb::DoCalculationsVoxelwise(FabberRunData &rundata)
 
             if (m_halt_bad_voxel)
                 throw;
+            m_bad_voxels[v - 1] = true;
+            failed = true;
         }
         catch (NEWMAT::Exception &e)
         {
@@ -512,33 +1091,555 @@ void Vb::DoCalculationsVoxelwise(FabberRunData &rundata)
 
             if (m_halt_bad_voxel)
                 throw;
+            m_bad_voxels[v - 1] = true;
+            failed = true;
+        }
+        total_its += m_ctx->it;
+        if (!failed)
+            saved_its += m_conv[v - 1]->IterationsSaved();
+        if (!failed && m_needF)
+        {
+            total_F += F;
+            nfitted++;
         }
+        rundata.Iteration(m_ctx->it, nfitted > 0 ? total_F / nfitted : 0);
 
-        // now write the results to resultMVNs
-        try
+        StoreVoxelResult(v, F);
+        if (!fitted.empty())
+            fitted[v - 1] = failed ? VOXEL_FAILED : VOXEL_FITTED;
+        prev_v = v;
+    }
+
+    if (m_nvoxels > 0)
+    {
+        LOG << "Vb::Mean iterations per voxel: " << double(total_its) / m_nvoxels
+            << ", bad voxels: " << NumBadVoxels() << endl;
+        if (!fitted.empty())
+        {
+            LOG << "Vb::Warm started " << nseeded << " voxels from a neighbour" << endl;
+        }
+        if (saved_its > 0)
         {
-            resultMVNs.at(v - 1)
-                = new MVNDist(m_ctx->fwd_post[v - 1], m_ctx->noise_post[v - 1]->OutputAsMVN());
-            if (m_needF)
-                resultFs.at(v - 1) = F;
+            LOG << "Vb::Iterations saved by stopping when parameters stopped changing: "
+                << saved_its << endl;
         }
-        catch (...)
+        if (m_jacobian_check)
         {
-            // Even that can fail, due to results being singular
-            LOG << "Vb::Can't give any sensible answer for this voxel; outputting zero +- "
-                   "identity\n";
-            MVNDist *tmp = new MVNDist(m_log);
-            tmp->SetSize(m_ctx->fwd_post[v - 1].means.Nrows()
-                + m_ctx->noise_post[v - 1]->OutputAsMVN().means.Nrows());
-            tmp->SetCovariance(IdentityMatrix(tmp->means.Nrows()));
-            resultMVNs.at(v - 1) = tmp;
-            if (m_needF)
-                resultFs.at(v - 1) = F;
+            LOG << "Vb::Worst relative Jacobian errors at the initial linearization:" << endl;
+            for (int k = 0; k < m_num_params; k++)
+            {
+                LOG << "Vb::  " << params[k].name << ": " << jac_error[k];
+                if (jac_error_voxel[k] > 0)
+                    LOG << " (voxel " << jac_error_voxel[k] << ")";
+                LOG << endl;
+            }
         }
     }
 } // Vb::DoCalculationsVoxelwise
 
 
+// ------------------------------------------------------------------------------------------------
+// --------         Store Voxel Result          ---------------------------------------------------
+// ------------------------------------------------------------------------------------------------
+void Vb::StoreVoxelResult(int v, double F)
+{
+    try
+    {
+        resultMVNs.at(v - 1)
+            = new MVNDist(m_ctx->fwd_post[v - 1], m_ctx->noise_post[v - 1]->OutputAsMVN());
+        if (m_needF)
+            resultFs.at(v - 1) = F;
+    }
+    catch (...)
+    {
+        // Even that can fail, due to results being singular
+        LOG << "Vb::Can't give any sensible answer for this voxel; outputting zero +- "
+               "identity\n";
+        MVNDist *tmp = new MVNDist(m_log);
+        tmp->SetSize(m_ctx->fwd_post[v - 1].means.Nrows()
+            + m_ctx->noise_post[v - 1]->OutputAsMVN().means.Nrows());
+        tmp->SetCovariance(IdentityMatrix(tmp->means.Nrows()));
+        resultMVNs.at(v - 1) = tmp;
+        if (m_needF)
+            resultFs.at(v - 1) = F;
+    }
+} // Vb::StoreVoxelResult
+
+
+// ------------------------------------------------------------------------------------------------
+// --------         Multistart Calculations     ---------------------------------------------------
+// ------------------------------------------------------------------------------------------------
+namespace
+{
+// Starts are not abandoned until they have done this many iterations
+const int MULTISTART_MIN_ITS = 2;
+
+// A start is abandoned if, at its most recent rate of increase, its free
+// energy would still be below the best start after this many iterations
+const int MULTISTART_LOOKAHEAD = 10;
+
+// Radical inverse of k in the given base, i.e. the k-th element of the
+// Halton sequence, used to spread starting points evenly
+double RadicalInverse(int k, int base)
+{
+    double inv = 1.0 / base;
+    double f = inv;
+    double r = 0;
+    while (k > 0)
+    {
+        r += f * (k % base);
+        k /= base;
+        f *= inv;
+    }
+    return r;
+}
+
+// State of the fit from a single starting point
+struct StartFit
+{
+    StartFit(const FwdModel *model, const FiniteDifferences &fd)
+        : lin(model)
+        , noise_post(NULL)
+        , noise_prior(NULL)
+        , noise_save(NULL)
+        , conv(NULL)
+        , its(0)
+        , F(-HUGE_VAL)
+        , prevF(-HUGE_VAL)
+        , saveF(-HUGE_VAL)
+        , active(true)
+        , failed(false)
+    {
+        lin.SetDifferencing(fd);
+    }
+
+    MVNDist post, prior, post_save, prior_save;
+    LinearizedFwdModel lin;
+    NoiseParams *noise_post, *noise_prior, *noise_save;
+    ConvergenceDetector *conv;
+    int its;
+    double F, prevF, saveF;
+    bool active, failed;
+    std::string error;
+};
+
+void DeleteStartFits(vector<StartFit> &fits)
+{
+    for (unsigned int s = 0; s < fits.size(); s++)
+    {
+        delete fits[s].noise_post;
+        delete fits[s].noise_prior;
+        delete fits[s].noise_save;
+    }
+}
+
+void RevertStartFit(StartFit &fit)
+{
+    *fit.noise_post = *fit.noise_save;
+    fit.post = fit.post_save;
+    fit.prior = fit.prior_save;
+    fit.F = fit.saveF;
+    fit.lin.ReCentre(fit.post.means);
+}
+
+// One VB iteration for a single start, as in Vb::DoCalculationsVoxelwise.
+// Returns true if the fit has converged
+bool IterateStartFit(StartFit &fit, int v, const ColumnVector &y, RunContext &ctx,
+    NoiseModel &noise, const vector<Prior *> &priors)
+{
+    if (fit.conv->NeedRevert())
+        RevertStartFit(fit);
+
+    if (fit.conv->NeedSave())
+    {
+        *fit.noise_save = *fit.noise_post;
+        fit.post_save = fit.post;
+        fit.prior_save = fit.prior;
+        fit.saveF = fit.F;
+    }
+
+    // ARD priors depend on the current posterior
+    ctx.v = v;
+    ctx.it = fit.its;
+    ctx.fwd_post[v - 1] = fit.post;
+    double Fprior = 0;
+    for (unsigned int k = 0; k < priors.size(); k++)
+    {
+        Fprior += priors[k]->ApplyToMVN(&fit.prior, ctx);
+    }
+
+    noise.UpdateTheta(*fit.noise_post, fit.post, fit.prior, fit.lin, y, NULL, fit.conv->LMalpha());
+    noise.UpdateNoise(*fit.noise_post, *fit.noise_prior, fit.post, fit.lin, y);
+    Relinearize(fit.lin, fit.post.means, *fit.conv, fit.F);
+
+    fit.prevF = fit.F;
+    fit.F = noise.CalcFreeEnergy(*fit.noise_post, *fit.noise_prior, fit.post, fit.prior, fit.lin, y)
+        + Fprior;
+    ++fit.its;
+
+    if (!fit.conv->Test(fit.F, fit.post))
+        return false;
+
+    if (fit.conv->NeedRevert())
+        RevertStartFit(fit);
+    return true;
+}
+
+// Fits voxels with multiple starting points. Progress is reported and cancellation
+// checked under a lock as voxels are fitted on several threads. Voxels which have
+// not been started when the run is cancelled are skipped
+class MultiStartWork : public ParallelWork
+{
+public:
+    MultiStartWork(Vb &vb, FabberRunData &rundata, vector<Vb::MultiStartThread> &threads,
+        const vector<Prior *> &priors, const vector<double> &Fs, vector<int> &its,
+        vector<int> &abandoned, vector<string> &errors, vector<bool> &skipped)
+        : m_vb(vb)
+        , m_rundata(rundata)
+        , m_threads(threads)
+        , m_priors(priors)
+        , m_Fs(Fs)
+        , m_its(its)
+        , m_abandoned(abandoned)
+        , m_errors(errors)
+        , m_skipped(skipped)
+        , m_ndone(0)
+        , m_nfitted(0)
+        , m_total_F(0)
+    {
+    }
+
+    virtual void Process(int voxel, int thread)
+    {
+        {
+            ScopedLock lock(m_mutex);
+            if (m_rundata.Cancelled())
+            {
+                m_skipped[voxel] = true;
+                return;
+            }
+        }
+
+        m_vb.FitVoxelMultiStart(voxel + 1, m_threads[thread], m_priors, m_its[voxel],
+            m_abandoned[voxel], m_errors[voxel]);
+
+        ScopedLock lock(m_mutex);
+        m_ndone++;
+        if (m_errors[voxel] == "")
+        {
+            m_total_F += m_Fs[voxel];
+            m_nfitted++;
+        }
+        m_rundata.Progress(m_ndone, int(m_its.size()));
+        m_rundata.Iteration(m_its[voxel], m_nfitted > 0 ? m_total_F / m_nfitted : 0);
+    }
+
+private:
+    Vb &m_vb;
+    FabberRunData &m_rundata;
+    vector<Vb::MultiStartThread> &m_threads;
+    const vector<Prior *> &m_priors;
+    const vector<double> &m_Fs;
+    vector<int> &m_its;
+    vector<int> &m_abandoned;
+    vector<string> &m_errors;
+    vector<bool> &m_skipped;
+    Mutex m_mutex;
+    int m_ndone;
+    int m_nfitted;
+    double m_total_F;
+};
+
+void DeleteMultiStartThreads(vector<Vb::MultiStartThread> &threads)
+{
+    // The first thread uses the inference method's own model and noise model
+    for (unsigned int t = 0; t < threads.size(); t++)
+    {
+        if (t > 0)
+        {
+            delete threads[t].model;
+            delete threads[t].noise;
+        }
+        for (unsigned int s = 0; s < threads[t].conv.size(); s++)
+        {
+            delete threads[t].conv[s];
+        }
+        delete threads[t].ctx;
+    }
+}
+}
+
+void Vb::SetupMultiStartPoints(FabberRunData &rundata)
+{
+    vector<Parameter> params;
+    m_model->GetParameters(rundata, params);
+    m_multistart_points.ReSize(m_multistart - 1, m_num_params);
+
+    // Starting points given explicitly, in model space
+    int nsupplied = 0;
+    string filename = rundata.GetStringDefault("multistart-init", "");
+    if (filename != "")
+    {
+        Matrix points = fabber::read_matrix_file(filename);
+        if (points.Ncols() != m_num_params)
+        {
+            throw InvalidOptionValue("multistart-init", filename,
+                "Must have one column for each model parameter (" + stringify(m_num_params)
+                    + ")");
+        }
+        nsupplied = min(points.Nrows(), m_multistart - 1);
+        for (int s = 1; s <= nsupplied; s++)
+        {
+            for (int p = 1; p <= m_num_params; p++)
+            {
+                m_multistart_points(s, p) = params[p - 1].transform->ToFabber(points(s, p));
+            }
+        }
+    }
+
+    // Remaining points are spread over the priors in Fabber space using a
+    // Halton sequence with a different prime base for each parameter
+    double nsd = rundata.GetDoubleDefault("multistart-nsd", 1, 0);
+    vector<int> bases;
+    for (int n = 2; (int)bases.size() < m_num_params; n++)
+    {
+        bool prime = true;
+        for (unsigned int i = 0; i < bases.size() && prime; i++)
+        {
+            prime = (n % bases[i]) != 0;
+        }
+        if (prime)
+            bases.push_back(n);
+    }
+    for (int s = nsupplied + 1; s <= m_multistart - 1; s++)
+    {
+        for (int p = 1; p <= m_num_params; p++)
+        {
+            double u = RadicalInverse(s - nsupplied, bases[p - 1]);
+            const DistParams &prior = params[p - 1].prior;
+            m_multistart_points(s, p) = prior.mean() + nsd * sqrt(prior.var()) * (2 * u - 1);
+        }
+    }
+} // Vb::SetupMultiStartPoints
+
+void Vb::FitVoxelMultiStart(int v, MultiStartThread &thread, const vector<Prior *> &priors,
+    int &its, int &abandoned, string &error)
+{
+    ColumnVector y = m_origdata->Column(v);
+    if (m_suppdata->Ncols() > 0)
+        thread.model->PassData(y, m_coords->Column(v), m_suppdata->Column(v));
+    else
+        thread.model->PassData(y, m_coords->Column(v));
+
+    // Each start begins with the initial posterior, with means replaced by the starting point
+    vector<StartFit> fits(m_multistart, StartFit(thread.model, m_fd));
+    for (int s = 0; s < m_multistart; s++)
+    {
+        StartFit &fit = fits[s];
+        fit.post = m_ctx->fwd_post[v - 1];
+        if (s > 0)
+            fit.post.means = m_multistart_points.Row(s).t();
+        fit.prior = m_ctx->fwd_prior[v - 1];
+        fit.post_save = fit.post;
+        fit.prior_save = fit.prior;
+        fit.noise_post = m_ctx->noise_post[v - 1]->Clone();
+        fit.noise_prior = m_ctx->noise_prior[v - 1]->Clone();
+        fit.noise_save = fit.noise_post->Clone();
+        fit.conv = thread.conv[s];
+        fit.conv->Reset();
+    }
+
+    // Update each active start by one iteration in turn, so starts which are
+    // clearly dominated can be dropped before they have used many iterations
+    abandoned = 0;
+    int nactive = m_multistart;
+    while (nactive > 0)
+    {
+        for (int s = 0; s < m_multistart; s++)
+        {
+            StartFit &fit = fits[s];
+            if (!fit.active)
+                continue;
+            try
+            {
+                if (fit.its == 0)
+                    fit.lin.ReCentre(fit.post.means);
+                if (IterateStartFit(fit, v, y, *thread.ctx, *thread.noise, priors))
+                {
+                    fit.active = false;
+                    nactive--;
+                }
+            }
+            catch (FabberInternalError &e)
+            {
+                fit.error = e.what();
+            }
+            catch (NEWMAT::Exception &e)
+            {
+                fit.error = e.what();
+            }
+            if (fit.error != "")
+            {
+                fit.active = false;
+                fit.failed = true;
+                nactive--;
+            }
+        }
+
+        double bestF = -HUGE_VAL;
+        for (int s = 0; s < m_multistart; s++)
+        {
+            if (!fits[s].failed && (fits[s].its > 0))
+                bestF = max(bestF, fits[s].F);
+        }
+        for (int s = 0; s < m_multistart; s++)
+        {
+            StartFit &fit = fits[s];
+            if (!fit.active || (fit.its < MULTISTART_MIN_ITS))
+                continue;
+            double gap = bestF - fit.F;
+            if ((gap > m_multistart_margin) && ((fit.F - fit.prevF) * MULTISTART_LOOKAHEAD < gap))
+            {
+                fit.active = false;
+                nactive--;
+                abandoned++;
+            }
+        }
+    }
+
+    // Keep the start with the highest free energy. Abandoned starts are included,
+    // although by construction they will not normally win. Ties go to the earliest start
+    int best = -1;
+    its = 0;
+    for (int s = 0; s < m_multistart; s++)
+    {
+        its += fits[s].its;
+        if (!fits[s].failed && ((best < 0) || (fits[s].F > fits[best].F)))
+            best = s;
+    }
+
+    if (best < 0)
+    {
+        error = fits[0].error;
+        DeleteStartFits(fits);
+        if (m_halt_bad_voxel)
+            throw FabberInternalError(error);
+        return;
+    }
+
+    m_ctx->fwd_post[v - 1] = fits[best].post;
+    m_ctx->fwd_prior[v - 1] = fits[best].prior;
+    *m_ctx->noise_post[v - 1] = *fits[best].noise_post;
+    resultFs[v - 1] = fits[best].F;
+    m_multistart_best[v - 1] = best + 1;
+    DeleteStartFits(fits);
+} // Vb::FitVoxelMultiStart
+
+void Vb::DoCalculationsMultiStart(FabberRunData &rundata)
+{
+    vector<Parameter> params;
+    m_model->GetParameters(rundata, params);
+    vector<Prior *> priors = PriorFactory(rundata).CreatePriors(params);
+
+    // The free energy is needed to choose between starts
+    m_needF = true;
+    m_multistart_best.assign(m_nvoxels, 0);
+
+    // Per-thread objects are created here as initialization may not be thread safe
+    string conv_name = rundata.GetStringDefault("convergence", "maxits");
+    vector<MultiStartThread> threads(max(1, min(m_nthreads, m_nvoxels)));
+    for (unsigned int t = 0; t < threads.size(); t++)
+    {
+        MultiStartThread &thread = threads[t];
+        if (t == 0)
+        {
+            thread.model = m_model;
+            thread.noise = m_noise.get();
+        }
+        else
+        {
+            thread.model = FwdModel::NewFromName(rundata.GetString("model"));
+            thread.model->SetLogger(m_log);
+            thread.model->Initialize(rundata);
+            thread.noise = NoiseModel::NewFromName(rundata.GetString("noise"));
+            thread.noise->SetLogger(m_log);
+            thread.noise->Initialize(rundata);
+        }
+        for (int s = 0; s < m_multistart; s++)
+        {
+            thread.conv.push_back(ConvergenceDetector::NewFromName(conv_name));
+            thread.conv[s]->Initialize(rundata);
+        }
+        thread.ctx = new RunContext(m_nvoxels);
+        thread.ctx->fwd_post.resize(m_nvoxels);
+    }
+
+    vector<int> its(m_nvoxels, 0), abandoned(m_nvoxels, 0);
+    vector<string> errors(m_nvoxels);
+    vector<bool> skipped(m_nvoxels, false);
+    try
+    {
+        MultiStartWork work(
+            *this, rundata, threads, priors, resultFs, its, abandoned, errors, skipped);
+        ParallelFor(work, m_nvoxels, threads.size());
+    }
+    catch (...)
+    {
+        DeleteMultiStartThreads(threads);
+        for (unsigned int k = 0; k < priors.size(); k++)
+        {
+            delete priors[k];
+        }
+        throw;
+    }
+    DeleteMultiStartThreads(threads);
+    for (unsigned int k = 0; k < priors.size(); k++)
+    {
+        delete priors[k];
+    }
+
+    // Voxels skipped after the run was cancelled keep their initial posterior so the
+    // results so far can still be saved, but are marked as bad
+    int nskipped = int(count(skipped.begin(), skipped.end(), true));
+    if (nskipped > 0)
+    {
+        LOG << "Vb::Cancelled after " << m_nvoxels - nskipped << " of " << m_nvoxels
+            << " voxels" << endl;
+    }
+
+    long total_its = 0;
+    int total_abandoned = 0;
+    vector<int> wins(m_multistart + 1, 0);
+    for (int v = 1; v <= m_nvoxels; v++)
+    {
+        if (skipped[v - 1])
+            m_bad_voxels[v - 1] = true;
+        else if (errors[v - 1] != "")
+        {
+            LOG << "Vb::All starting points failed for voxel " << v << " at "
+                << m_coords->Column(v).t() << " : " << errors[v - 1] << endl;
+            m_bad_voxels[v - 1] = true;
+        }
+        total_its += its[v - 1];
+        total_abandoned += abandoned[v - 1];
+        wins[m_multistart_best[v - 1]]++;
+        StoreVoxelResult(v, resultFs[v - 1]);
+    }
+
+    if (m_nvoxels > 0)
+    {
+        LOG << "Vb::Mean iterations per voxel (all starts): " << double(total_its) / m_nvoxels
+            << ", abandoned starts: " << total_abandoned
+            << ", bad voxels: " << NumBadVoxels() << endl;
+        for (int s = 1; s <= m_multistart; s++)
+        {
+            LOG << "Vb::Start " << s << " gave the best solution in " << wins[s] << " voxels"
+                << endl;
+        }
+    }
+} // Vb::DoCalculationsMultiStart
+
+
 // ------------------------------------------------------------------------------------------------
 // --------         Spatial Calculations               --------------------------------------------
 // ------------------------------------------------------------------------------------------------
@@ -568,7 +1669,14 @@ void Vb::DoCalculationsSpatial(FabberRunData &rundata)
     double Fglobal = 1234.5678;
     int maxits = convertTo<int>(rundata.GetStringDefault("max-iterations", "10"));
 
+    if (m_resume_from != "")
+    {
+        LoadCheckpoint(rundata);
+        conv.SetIterations(m_ctx->it);
+    }
+
     // MAIN ITERATION LOOP
+    bool converged = false;
     do
     {
         LOG << endl << "*** Spatial iteration *** " << (m_ctx->it + 1) << endl;
@@ -600,18 +1708,19 @@ void Vb::DoCalculationsSpatial(FabberRunData &rundata)
                     DebugVoxel(v, "Priors set");
 
                 // Ignore voxels where numerical issues have occurred
-                if (std::find(m_ignore_voxels.begin(), m_ignore_voxels.end(), v)
-                    != m_ignore_voxels.end())
+                if (m_bad_voxels[v - 1])
                     continue;
 
-                CalculateF(v, "before", Fprior);
+                if (m_printF)
+                    CalculateF(v, "before", Fprior);
 
                 m_noise->UpdateTheta(*m_ctx->noise_post[v - 1], m_ctx->fwd_post[v - 1],
                     m_ctx->fwd_prior[v - 1], m_lin_model[v - 1], m_origdata->Column(v), NULL, 0);
                 if (m_debug)
                     DebugVoxel(v, "Theta updated");
 
-                CalculateF(v, "theta", Fprior);
+                if (m_printF)
+                    CalculateF(v, "theta", Fprior);
             }
             catch (FabberInternalError &e)
             {
@@ -645,7 +1754,8 @@ void Vb::DoCalculationsSpatial(FabberRunData &rundata)
             if (m_debug)
                 DebugVoxel(v, "Noise updated");
 
-            CalculateF(v, "noise", Fprior);
+            if (m_printF)
+                CalculateF(v, "noise", Fprior);
 
             if (!m_locked_linear)
                 m_lin_model[v - 1].ReCentre(m_ctx->fwd_post[v - 1].means);
@@ -656,7 +1766,16 @@ void Vb::DoCalculationsSpatial(FabberRunData &rundata)
         }
 
         ++m_ctx->it;
-    } while (!conv.Test(Fglobal));
+        rundata.Iteration(m_ctx->it, (m_needF && m_nvoxels > 0) ? Fglobal / m_nvoxels : 0);
+        converged = conv.Test(Fglobal);
+        if (!converged && (m_checkpoint != "") && (m_ctx->it % m_checkpoint_interval == 0))
+            SaveCheckpoint(rundata);
+        if (!converged && rundata.Cancelled())
+        {
+            LOG << "Vb::Cancelled after " << m_ctx->it << " spatial iterations" << endl;
+            break;
+        }
+    } while (!converged);
 
     // Interesting addition: calculate "coefficient resels" from Penny et al. 2005
     for (int k = 1; k <= m_num_params; k++)
@@ -681,207 +1800,193 @@ void Vb::DoCalculationsSpatial(FabberRunData &rundata)
 
 
 // ------------------------------------------------------------------------------------------------
-// --------         Check Stuff                 ---------------------------------------------------
+// --------         Checkpoints                 ---------------------------------------------------
 // ------------------------------------------------------------------------------------------------
-void Vb::CheckCoordMatrixCorrectlyOrdered(const Matrix &coords)
+namespace
 {
-    // Only 3D
-    assert(coords.Nrows() == 3);
+// First line of a checkpoint file, identifying the format version
+const string CHECKPOINT_MAGIC = "FABBER_VB_CHECKPOINT_1";
 
-    // Voxels are stored one per column, each column is the x/y/z coords
-    const int m_nvoxels = coords.Ncols();
-
-    // Go through each voxel one at a time apart from last
-    for (int v = 1; v <= m_nvoxels - 1; v++)
+// MVNs are stored as the means and the lower triangle of the precision matrix.
+// Precisions are what the VB updates and priors set, so they are restored exactly
+void WriteMVN(ostream &out, const MVNDist &mvn)
+{
+    const SymmetricMatrix &prec = mvn.GetPrecisions();
+    vector<double> values;
+    for (int i = 1; i <= mvn.GetSize(); i++)
     {
-        // Find difference between current coords and next
-        ColumnVector diff = coords.Column(v + 1) - coords.Column(v);
-
-        // Check order
-        // +1 = +x, +10 = +y, +100 = +z, -100 = -z+x, etc.
-        int d = sign(diff(1)) + 10 * sign(diff(2)) + 100 * sign(diff(3));
-        if (d <= 0)
+        values.push_back(mvn.means(i));
+        for (int j = 1; j <= i; j++)
         {
-            LOG << "Vb::Found mis-ordered voxels " << v << " and " << v + 1 << ": d=" << d << endl;
-            throw FabberInternalError(
-                "Coordinate matrix must be in correct order to use adjacency-based priors.");
+            values.push_back(prec(i, j));
         }
     }
-} // Vb::CheckCoordMatrixCorrectlyOrdered
+    out.write(reinterpret_cast<const char *>(&values[0]), values.size() * sizeof(double));
+}
 
-// ------------------------------------------------------------------------------------------------
-// --------         Binary Search               ---------------------------------------------------
-// ------------------------------------------------------------------------------------------------
-// Binary search for data(index) == num
-// Assumes data is sorted ascending!!
-// Either returns an index such that data(index) == num
-//   or -1 if num is not present in data.
-static inline int binarySearch(const ColumnVector &data, int num)
+// The MVN must already have the correct size
+bool ReadMVN(istream &in, MVNDist &mvn)
 {
-    int first = 1, last = data.Nrows();
-
-    while (first <= last)
+    const int n = mvn.GetSize();
+    vector<double> values(n + n * (n + 1) / 2);
+    in.read(reinterpret_cast<char *>(&values[0]), values.size() * sizeof(double));
+    if (!in.good())
+        return false;
+
+    SymmetricMatrix prec(n);
+    int idx = 0;
+    for (int i = 1; i <= n; i++)
     {
-        int test = (first + last) / 2;
-
-        if (data(test) < num)
-        {
-            first = test + 1;
-        }
-        else if (data(test) > num)
+        mvn.means(i) = values[idx++];
+        for (int j = 1; j <= i; j++)
         {
-            last = test - 1;
-        }
-        else if (data(test) == num)
-        {
-            return test;
-        }
-        else
-        {
-            assert(false); // logic error!  data wasn't sorted?
+            prec(i, j) = values[idx++];
         }
     }
-    return -1;
+    mvn.SetPrecisions(prec);
+    return true;
+}
 }
 
-
-// ------------------------------------------------------------------------------------------------
-// --------         Calculate Neighbours          -------------------------------------------------
-// ------------------------------------------------------------------------------------------------
-void Vb::CalcNeighbours(const Matrix &coords)
+string Vb::CheckpointSignature(FabberRunData &rundata) const
+{
+    stringstream sig;
+    sig << "model=" << rundata.GetString("model") << ";noise=" << rundata.GetString("noise")
+        << ";nparams=" << m_num_params << ";nnoise=" << m_noise_params
+        << ";nvoxels=" << m_nvoxels << ";ntpts=" << m_origdata->Nrows()
+        << ";param-spatial-priors=" << rundata.GetStringDefault("param-spatial-priors", "")
+        << ";spatial-dims=" << m_spatial_dims << ";spatial-order=" << m_spatial_order;
+    return sig.str();
+} // Vb::CheckpointSignature
+
+void Vb::SaveCheckpoint(FabberRunData &rundata) const
 {
-    const int nVoxels = coords.Ncols();
-    if (nVoxels == 0)
+    // Write to a temporary file first so an interruption while writing
+    // does not destroy the previous checkpoint
+    string tmp_filename = m_checkpoint + ".tmp";
+    ofstream out(tmp_filename.c_str(), ios::out | ios::binary);
+    if (!out.good())
+    {
+        WARN_ONCE("Vb: Could not write checkpoint file " + tmp_filename);
         return;
+    }
 
-    // Voxels must be ordered by increasing z, y and x values respectively
-    // otherwise binary search for voxel by offset will not work
-    CheckCoordMatrixCorrectlyOrdered(coords);
-
-    // Create a column vector with one entry per voxel.
-    ColumnVector offsets(nVoxels);
-
-    // Populate offsets with the offset into the
-    // matrix of each voxel. We assume that co-ordinates
-    // could be zero but not negative
-    int xsize = coords.Row(1).Maximum() + 1;
-    int ysize = coords.Row(2).Maximum() + 1;
-    for (int v = 1; v <= nVoxels; v++)
-    {
-        int x = coords(1, v);
-        int y = coords(2, v);
-        int z = coords(3, v);
-        int offset = z * xsize * ysize + y * xsize + x;
-        offsets(v) = offset;
-    }
-
-    // Delta is a list of offsets to find nearest
-    // neighbours in x y and z direction (not diagonally)
-    // Of course applying these offsets naively would not
-    // always work, e.g. offset of -1 in the x direction
-    // will not be a nearest neighbour for the first voxel
-    // so need to check for this in subsequent code
-    vector<int> delta;
-    delta.push_back(1);              // next row
-    delta.push_back(-1);             // prev row
-    delta.push_back(xsize);          // next column
-    delta.push_back(-xsize);         // prev column
-    delta.push_back(xsize * ysize);  // next slice
-    delta.push_back(-xsize * ysize); // prev slice
-
-    // Don't look for neighbours in all dimensions.
-    // For example if spatialDims=2, max_delta=3 so we
-    // only look for neighbours in rows and columns
-    //
-    // However note we still need the full list of 3D deltas for later
-    int max_delta = m_spatial_dims * 2 - 1;
-
-    // Neighbours is a vector of vectors, so each voxel
-    // will have an entry which is a vector of its neighbours
-    m_ctx->neighbours.resize(nVoxels);
+    out << CHECKPOINT_MAGIC << endl << CheckpointSignature(rundata) << endl;
+    out.write(reinterpret_cast<const char *>(&m_ctx->it), sizeof(m_ctx->it));
+    for (int v = 1; v <= m_nvoxels; v++)
+    {
+        double coords[3] = { (*m_coords)(1, v), (*m_coords)(2, v), (*m_coords)(3, v) };
+        char bad = m_bad_voxels[v - 1] ? 1 : 0;
+        out.write(reinterpret_cast<const char *>(coords), sizeof(coords));
+        out.write(&bad, sizeof(bad));
+        WriteMVN(out, m_ctx->fwd_post[v - 1]);
+        WriteMVN(out, m_ctx->fwd_prior[v - 1]);
+        WriteMVN(out, m_ctx->noise_post[v - 1]->OutputAsMVN());
+    }
+    out.close();
 
-    // Go through each voxel. Note that offsets is indexed from 1 not 0
-    // however the offsets themselves (potentially) start at 0.
-    for (int vid = 1; vid <= nVoxels; vid++)
+    if (out.fail())
     {
-        // Get the voxel offset into the matrix
-        int pos = int(offsets(vid));
+        WARN_ONCE("Vb: Error writing checkpoint file " + tmp_filename);
+        return;
+    }
 
-        // Now search for neighbours
-        for (int n = 0; n <= max_delta; n++)
-        {
-            // is there a voxel at this neighbour position?
-            // indexed from 1; id == -1 if not found.
-            int id = binarySearch(offsets, pos + delta[n]);
+#ifdef _WIN32
+    // rename does not replace an existing file on Windows
+    remove(m_checkpoint.c_str());
+#endif
+    if (rename(tmp_filename.c_str(), m_checkpoint.c_str()) != 0)
+    {
+        WARN_ONCE("Vb: Could not replace checkpoint file " + m_checkpoint);
+        return;
+    }
+    LOG << "Vb::Saved checkpoint after iteration " << m_ctx->it << " to " << m_checkpoint << endl;
+} // Vb::SaveCheckpoint
 
-            // No such voxel: continue
-            if (id < 0)
-                continue;
+void Vb::LoadCheckpoint(FabberRunData &rundata)
+{
+    ifstream in(m_resume_from.c_str(), ios::in | ios::binary);
+    if (!in.good())
+        throw InvalidOptionValue("resume-from", m_resume_from, "Could not open file");
+
+    string magic, sig;
+    getline(in, magic);
+    getline(in, sig);
+    if (magic != CHECKPOINT_MAGIC)
+        throw InvalidOptionValue("resume-from", m_resume_from, "Not a VB checkpoint file");
+    if (sig != CheckpointSignature(rundata))
+    {
+        LOG << "Vb::Checkpoint was saved with: " << sig << endl;
+        throw InvalidOptionValue(
+            "resume-from", m_resume_from, "Checkpoint does not match the data or options");
+    }
 
-            // Check for wrap-around
+    int it;
+    in.read(reinterpret_cast<char *>(&it), sizeof(it));
+    if (!in.good() || (it < 0))
+        throw InvalidOptionValue("resume-from", m_resume_from, "Checkpoint file is corrupt");
 
-            // Don't check for wrap around on final co-ord
-            // PREVIOUSLY		if (delta.size() >= n + 2)
-            // Changed (fixed)? because if spatialDims != 3 we still need
-            // to check for wrap around in y-coordinate FIXME check
-            if (n < 4)
+    for (int v = 1; v <= m_nvoxels; v++)
+    {
+        double coords[3];
+        char bad;
+        in.read(reinterpret_cast<char *>(coords), sizeof(coords));
+        in.read(&bad, sizeof(bad));
+        if (!in.good())
+            break;
+        for (int d = 0; d < 3; d++)
+        {
+            if (coords[d] != (*m_coords)(d + 1, v))
             {
-                bool ignore = false;
-                if (delta[n] > 0)
-                {
-                    int test = delta[n + 2];
-                    if (test > 0)
-                        ignore = (pos % test) >= test - delta[n];
-                }
-                else
-                {
-                    int test = -delta[n + 2];
-                    if (test > 0)
-                        ignore = (pos % test) < -delta[n];
-                }
-                if (ignore)
-                {
-                    continue;
-                }
+                throw InvalidOptionValue("resume-from", m_resume_from,
+                    "Voxel " + stringify(v) + " has different co-ordinates in checkpoint");
             }
-
-            // If we get this far, add it to the list
-            m_ctx->neighbours.at(vid - 1).push_back(id);
         }
-    }
 
-    // Similar algorithm but looking for Neighbours-of-neighbours, excluding self,
-    // but including duplicates if there are two routes to get there
-    // (diagonally connected)
-    m_ctx->neighbours2.resize(nVoxels);
+        MVNDist noise = m_ctx->noise_post[v - 1]->OutputAsMVN();
+        if (!ReadMVN(in, m_ctx->fwd_post[v - 1]) || !ReadMVN(in, m_ctx->fwd_prior[v - 1])
+            || !ReadMVN(in, noise))
+            break;
+        m_ctx->noise_post[v - 1]->InputFromMVN(noise);
+        m_noise->Precalculate(
+            *m_ctx->noise_post[v - 1], *m_ctx->noise_prior[v - 1], m_origdata->Column(v));
 
-    for (int vid = 1; vid <= nVoxels; vid++)
-    {
-        // Go through the list of neighbours for each voxel.
-        for (unsigned n1 = 0; n1 < m_ctx->neighbours.at(vid - 1).size(); n1++)
+        // Linearization centres follow the posterior unless they are fixed
+        if (!m_locked_linear)
         {
-            // n1id is the voxel index (not the offset) of the neighbour
-            int n1id = m_ctx->neighbours[vid - 1].at(n1);
-            int checkNofN = 0;
-            // Go through each of it's neighbours. Add each, apart from original voxel
-            for (unsigned n2 = 0; n2 < m_ctx->neighbours.at(n1id - 1).size(); n2++)
-            {
-                int n2id = m_ctx->neighbours[n1id - 1].at(n2);
-                if (n2id != vid)
-                {
-                    m_ctx->neighbours2[vid - 1].push_back(n2id);
-                }
-                else
-                    checkNofN++;
-            }
+            PassModelData(v);
+            m_lin_model[v - 1].ReCentre(m_ctx->fwd_post[v - 1].means);
+        }
 
-            if (checkNofN != 1)
-            {
-                throw FabberInternalError("Each of this voxel's neighbours must have "
-                                          "this voxel as a neighbour");
-            }
+        if (bad && !m_bad_voxels[v - 1])
+        {
+            m_bad_voxels[v - 1] = true;
+            m_ctx->neighbours.RemoveVoxel(v);
+            m_ctx->neighbours2.RemoveVoxel(v);
         }
     }
+    if (!in.good())
+        throw InvalidOptionValue("resume-from", m_resume_from, "Checkpoint file is truncated");
+
+    m_ctx->it = it;
+    LOG << "Vb::Resuming from " << m_resume_from << " after iteration " << it << " with "
+        << NumBadVoxels() << " bad voxels" << endl;
+} // Vb::LoadCheckpoint
+
+
+// ------------------------------------------------------------------------------------------------
+// --------         Calculate Neighbours          -------------------------------------------------
+// ------------------------------------------------------------------------------------------------
+void Vb::CalcNeighbours(const Matrix &coords)
+{
+    // Don't look for neighbours in all dimensions.
+    // For example if spatialDims=2 we only look for
+    // neighbours in rows and columns
+    m_ctx->neighbours.BuildNearest(coords, m_spatial_dims);
+
+    // Neighbours-of-neighbours, excluding self, but including duplicates
+    // if there are two routes to get there (diagonally connected)
+    m_ctx->neighbours2.BuildSecondNearest(m_ctx->neighbours);
 } // Vb::CalcNeighbours
 
 
@@ -937,5 +2042,31 @@ void Vb::SaveResults(FabberRunData &rundata) const
     {
         LOG << "Vb::Free energy wasn't recorded, so no freeEnergy data saved" << endl;
     }
+
+    // Save the mask of voxels where numerical errors occurred
+    if (rundata.GetBool("save-bad-voxels"))
+    {
+        LOG << "Vb::Writing bad voxels" << endl;
+        Matrix bad(1, nVoxels);
+        bad = 0;
+        for (int vox = 1; vox <= (int)m_bad_voxels.size(); vox++)
+        {
+            if (m_bad_voxels[vox - 1])
+                bad(1, vox) = 1;
+        }
+        rundata.SaveVoxelData("bad_voxels", bad);
+    }
+
+    // Save which starting point was used in each voxel
+    if (!m_multistart_best.empty())
+    {
+        LOG << "Vb::Writing best starting point" << endl;
+        Matrix best(1, nVoxels);
+        for (int vox = 1; vox <= nVoxels; vox++)
+        {
+            best(1, vox) = m_multistart_best.at(vox - 1);
+        }
+        rundata.SaveVoxelData("multistart_best", best);
+    }
     LOG << "Vb::Done writing results." << endl;
 } // Vb::SaveResults
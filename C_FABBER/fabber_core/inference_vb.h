@@ -13,6 +13,8 @@
 #include <string>
 #include <vector>
 
+class Prior;
+
 class Vb : public InferenceTechnique
 {
 public:
@@ -29,6 +31,13 @@ public:
         , m_num_mcsteps(0)
         , m_spatial_dims(-1)
         , m_locked_linear(false)
+        , m_jacobian_check(false)
+        , m_coarse_init(0)
+        , m_gridsearch_init(false)
+        , m_multistart(1)
+        , m_multistart_margin(0)
+        , m_nthreads(1)
+        , m_checkpoint_interval(1)
     {
     }
 
@@ -41,6 +50,43 @@ public:
 
     virtual void SaveResults(FabberRunData &rundata) const;
 
+    /**
+     * Objects used by a single thread during multistart fitting. Forward models,
+     * noise models and convergence detectors are not required to be thread safe
+     * so each thread has its own
+     */
+    struct MultiStartThread
+    {
+        FwdModel *model;
+        NoiseModel *noise;
+
+        /** Convergence detector for each starting point */
+        std::vector<ConvergenceDetector *> conv;
+
+        /** Used to give ARD priors the posterior of the start being updated */
+        RunContext *ctx;
+    };
+
+    /**
+     * Fit a voxel from each starting point and keep the solution with the highest
+     * free energy
+     *
+     * Starts are updated one iteration at a time in turn so a start can be abandoned
+     * once its free energy is well below the best start and is not increasing fast
+     * enough to catch up. The result is stored in the run context, resultFs and
+     * m_multistart_best.
+     *
+     * This is called from multiple threads so does not modify any shared data
+     * other than the results for voxel v.
+     *
+     * @param its Will be set to the total number of iterations over all starts
+     * @param abandoned Will be set to the number of starts which were abandoned
+     * @param error Will be set to an error message if every start failed. If
+     *              halt_bad_voxel is set an exception is thrown instead
+     */
+    void FitVoxelMultiStart(int v, MultiStartThread &thread, const std::vector<Prior *> &priors,
+        int &its, int &abandoned, std::string &error);
+
 protected:
     /**
      * Initialize noise prior or posterior distribution from a file stored in the
@@ -69,6 +115,55 @@ protected:
      */
     virtual void DoCalculationsSpatial(FabberRunData &data);
 
+    /**
+     * Do calculations loop in voxelwise mode using multiple starting
+     * points for each voxel
+     */
+    virtual void DoCalculationsMultiStart(FabberRunData &data);
+
+    /**
+     * Set up the starting points used for multistart fitting other than
+     * the initial posterior. These are taken from the multistart-init
+     * matrix if given and then spread over the parameter priors
+     */
+    void SetupMultiStartPoints(FabberRunData &rundata);
+
+    /**
+     * Get the order in which to fit voxels in voxelwise mode
+     *
+     * This is the order of the data unless warm starts are being used,
+     * in which case it is a raster scan or Hilbert curve so that each
+     * voxel usually has a neighbour which has already been fitted
+     *
+     * @param order Will be set to voxel indices, starting at 1
+     */
+    void GetVoxelOrder(std::vector<int> &order) const;
+
+    /**
+     * Reorder the voxel data, co-ordinates and supplementary data along a
+     * space filling curve for spatial VB
+     *
+     * Neighbouring voxels are then usually close together in the per-voxel
+     * storage, which improves memory locality when the spatial priors look
+     * up the posteriors of each voxel's neighbours. The reordered matrices
+     * replace m_origdata etc. until UnsortVoxels is called. Models see the
+     * data for each voxel through PassData as usual, but image priors are
+     * not supported as they are stored in the original order
+     */
+    void SortVoxels(FabberRunData &rundata);
+
+    /**
+     * Return the results to the original voxel order after SortVoxels
+     * and restore the original voxel data
+     */
+    void UnsortVoxels(FabberRunData &rundata);
+
+    /**
+     * Store the final posterior for a voxel in resultMVNs, and the free
+     * energy in resultFs if required
+     */
+    void StoreVoxelResult(int v, double F);
+
     /**
      * Calculate free energy if required, and display if required
      */
@@ -91,18 +186,58 @@ protected:
     void SetupPerVoxelDists(FabberRunData &allData);
 
     /**
-    * Check voxels are listed in order
-    *
-    * Order must be increasing in z value, or if same
-    * increasing in y value, and if y and z are same
-    * increasing in x value.
-    *
-    * This is basically column-major (Fortran) ordering - used as default by NEWIMAGE.
-    */
-    void CheckCoordMatrixCorrectlyOrdered(const NEWMAT::Matrix &voxelCoords);
+     * Generate initial posteriors by fitting block-averaged data
+     *
+     * The data is averaged over blocks of m_coarse_init voxels along
+     * each spatial dimension (only voxels in the mask are included) and
+     * fitted voxelwise. The block size is then halved and the process
+     * repeated, using the previous fit to initialize each block, until
+     * the block size is 2. resultMVNs is then set up with the block
+     * posteriors for each full-resolution voxel, in the same way as
+     * it would be by InitMVNFromFile, so they can be used to initialize
+     * the full resolution fit.
+     *
+     * Blocks where the fit failed are left as NULL so the model's
+     * default initial posterior is used for their voxels
+     */
+    void InitMVNFromCoarseFit(FabberRunData &rundata);
+
+    /**
+     * Generate initial posteriors using the gridsearch inference method
+     *
+     * resultMVNs is set up with the grid search result for each voxel
+     */
+    void InitMVNFromGridSearch(FabberRunData &rundata);
+
+    /**
+     * Description of the data and options which a checkpoint must match
+     * to be resumed
+     */
+    std::string CheckpointSignature(FabberRunData &rundata) const;
+
+    /**
+     * Save the state of a spatial VB run to the checkpoint file
+     *
+     * This includes the iteration count, voxelwise model priors and posteriors,
+     * noise posteriors and bad voxels. The file is binary in the native byte
+     * order. If it cannot be written a warning is given and the run continues
+     */
+    void SaveCheckpoint(FabberRunData &rundata) const;
+
+    /**
+     * Restore the state of a spatial VB run from the resume-from file
+     *
+     * This must be called after the per-voxel distributions and neighbours
+     * have been set up. The spatial precisions of the priors are not stored
+     * as they are recalculated from the restored posteriors at the start of
+     * each iteration
+     */
+    void LoadCheckpoint(FabberRunData &rundata);
 
     /**
      * Calculate first and second nearest neighbours of each voxel
+     *
+     * Voxels may be listed in any order
     */
     void CalcNeighbours(const NEWMAT::Matrix &voxelCoords);
 
@@ -115,6 +250,11 @@ protected:
      */
     void IgnoreVoxel(int v);
 
+    /**
+     * @return Number of voxels where numerical errors have occurred
+     */
+    int NumBadVoxels() const;
+
     /** Number of voxels in data */
     int m_nvoxels;
 
@@ -167,8 +307,11 @@ protected:
     /** Convergence detector for each voxel */
     std::vector<ConvergenceDetector *> m_conv;
 
-    /** Voxels to ignore, indexed from 1 as per NEWMAT */
-    std::vector<int> m_ignore_voxels;
+    /**
+     * Voxels where numerical errors have occurred, one flag per voxel.
+     * These are ignored in further updates
+     */
+    std::vector<bool> m_bad_voxels;
 
     /**
      * Number of spatial dimensions
@@ -187,4 +330,70 @@ protected:
      * centres are generally loaded from an MVN file
      */
     bool m_locked_linear;
+
+    /** How the linearized models calculate the Jacobian by numerical differentiation */
+    FiniteDifferences m_fd;
+
+    /** If true, report the worst relative errors in the Jacobian for each parameter */
+    bool m_jacobian_check;
+
+    /**
+     * Block size for coarse-to-fine initialization. 0 or 1 means
+     * no coarse fitting, otherwise must be a power of 2
+     */
+    int m_coarse_init;
+
+    /** If true, initialize posteriors using a grid search */
+    bool m_gridsearch_init;
+
+    /** Number of starting points for each voxel */
+    int m_multistart;
+
+    /**
+     * A start is abandoned when its free energy is more than this
+     * below the best start and it is not improving fast enough to catch up
+     */
+    double m_multistart_margin;
+
+    /**
+     * Starting points other than the initial posterior, in Fabber space.
+     * One row per start and one column per model parameter
+     */
+    NEWMAT::Matrix m_multistart_points;
+
+    /** Index of the start which gave the best solution in each voxel, from 1 */
+    std::vector<int> m_multistart_best;
+
+    /** Number of threads to use for multistart fitting */
+    int m_nthreads;
+
+    /**
+     * Order to visit voxels in for warm starts from neighbouring voxels
+     * (raster or hilbert), or empty for no warm starts
+     */
+    std::string m_warm_start;
+
+    /**
+     * Space filling curve to reorder voxels along for spatial VB (morton
+     * or hilbert), or empty to keep the order of the data
+     */
+    std::string m_spatial_order;
+
+    /**
+     * Original index of each voxel in the sorted order, starting at 1.
+     * Empty when the voxels are not reordered
+     */
+    std::vector<int> m_voxel_order;
+
+    /** Voxel data, co-ordinates and supplementary data in the sorted order */
+    NEWMAT::Matrix m_sorted_data, m_sorted_coords, m_sorted_suppdata;
+
+    /** File to save spatial VB checkpoints to, or empty for no checkpoints */
+    std::string m_checkpoint;
+
+    /** Number of spatial iterations between checkpoints */
+    int m_checkpoint_interval;
+
+    /** If not empty, resume spatial VB from this checkpoint file */
+    std::string m_resume_from;
 };
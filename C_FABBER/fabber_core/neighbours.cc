@@ -0,0 +1,296 @@
+/*  neighbours.cc - Voxel neighbour graphs and spatially coherent voxel orderings
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "neighbours.h"
+
+#include "rundata.h"
+#include "tools.h"
+
+#include <newmat.h>
+
+#include <algorithm>
+#include <math.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+using NEWMAT::Matrix;
+
+namespace
+{
+// Grid offsets of nearest neighbours, in the order they are listed
+const int DIRECTIONS[6][3] = {
+    { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 },
+};
+
+// Dense index of the voxels in the bounding box of the co-ordinates. Each grid
+// position holds the index of the voxel at that position starting at 1, or 0 if
+// there is no voxel there
+class GridIndex
+{
+public:
+    explicit GridIndex(const Matrix &coords)
+        : m_coords(coords)
+    {
+        for (int d = 0; d < 3; d++)
+        {
+            m_min[d] = int(floor(coords.Row(d + 1).Minimum()));
+            m_size[d] = int(coords.Row(d + 1).Maximum()) - m_min[d] + 1;
+        }
+        m_index.resize(size_t(m_size[0]) * m_size[1] * m_size[2], 0);
+
+        for (int v = 1; v <= coords.Ncols(); v++)
+        {
+            int &entry = m_index[Offset(v)];
+            if (entry != 0)
+            {
+                throw FabberInternalError("Voxels " + stringify(entry) + " and " + stringify(v)
+                    + " have the same co-ordinates");
+            }
+            entry = v;
+        }
+    }
+
+    // Index of the neighbour of voxel v in the given direction, or 0 if there is none
+    int Neighbour(int v, int dir) const
+    {
+        int pos[3];
+        for (int d = 0; d < 3; d++)
+        {
+            pos[d] = int(m_coords(d + 1, v)) - m_min[d] + DIRECTIONS[dir][d];
+            if ((pos[d] < 0) || (pos[d] >= m_size[d]))
+                return 0;
+        }
+        return m_index[(size_t(pos[2]) * m_size[1] + pos[1]) * m_size[0] + pos[0]];
+    }
+
+private:
+    size_t Offset(int v) const
+    {
+        size_t x = int(m_coords(1, v)) - m_min[0];
+        size_t y = int(m_coords(2, v)) - m_min[1];
+        size_t z = int(m_coords(3, v)) - m_min[2];
+        return (z * m_size[1] + y) * m_size[0] + x;
+    }
+
+    const Matrix &m_coords;
+    int m_min[3];
+    int m_size[3];
+    vector<int> m_index;
+};
+
+// Position along a 3D Hilbert curve of side 2^bits (Skilling, 'Programming
+// the Hilbert curve', AIP Conf Proc 707, 2004)
+unsigned long long HilbertIndex(unsigned int x, unsigned int y, unsigned int z, int bits)
+{
+    unsigned int X[3] = { x, y, z };
+    unsigned int M = 1u << (bits - 1);
+
+    // Inverse undo excess work
+    for (unsigned int Q = M; Q > 1; Q >>= 1)
+    {
+        unsigned int P = Q - 1;
+        for (int i = 0; i < 3; i++)
+        {
+            if (X[i] & Q)
+            {
+                X[0] ^= P;
+            }
+            else
+            {
+                unsigned int t = (X[0] ^ X[i]) & P;
+                X[0] ^= t;
+                X[i] ^= t;
+            }
+        }
+    }
+
+    // Gray encode
+    for (int i = 1; i < 3; i++)
+    {
+        X[i] ^= X[i - 1];
+    }
+    unsigned int t = 0;
+    for (unsigned int Q = M; Q > 1; Q >>= 1)
+    {
+        if (X[2] & Q)
+            t ^= Q - 1;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        X[i] ^= t;
+    }
+
+    // Interleave the bits of the transposed index
+    unsigned long long index = 0;
+    for (int b = bits - 1; b >= 0; b--)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            index = (index << 1) | ((X[i] >> b) & 1);
+        }
+    }
+    return index;
+}
+
+// Position along a Morton (Z-order) curve, formed by interleaving the bits
+// of the co-ordinates
+unsigned long long MortonIndex(unsigned int x, unsigned int y, unsigned int z, int bits)
+{
+    unsigned long long index = 0;
+    for (int b = bits - 1; b >= 0; b--)
+    {
+        index = (index << 3) | (((z >> b) & 1) << 2) | (((y >> b) & 1) << 1) | ((x >> b) & 1);
+    }
+    return index;
+}
+}
+
+void NeighbourGraph::BuildNearest(const Matrix &coords, int n_dims)
+{
+    const int nvoxels = coords.Ncols();
+    m_start.assign(nvoxels, 0);
+    m_count.assign(nvoxels, 0);
+    m_ids.clear();
+    if (nvoxels == 0)
+        return;
+
+    GridIndex grid(coords);
+
+    // Count the neighbours first so each voxel's list can be placed directly
+    // into the shared array
+    int total = 0;
+    for (int v = 1; v <= nvoxels; v++)
+    {
+        m_start[v - 1] = total;
+        for (int dir = 0; dir < n_dims * 2; dir++)
+        {
+            if (grid.Neighbour(v, dir) > 0)
+                m_count[v - 1]++;
+        }
+        total += m_count[v - 1];
+    }
+
+    m_ids.resize(total);
+    for (int v = 1; v <= nvoxels; v++)
+    {
+        if (m_count[v - 1] == 0)
+            continue;
+        int *ids = &m_ids[0] + m_start[v - 1];
+        for (int dir = 0; dir < n_dims * 2; dir++)
+        {
+            int id = grid.Neighbour(v, dir);
+            if (id > 0)
+                *ids++ = id;
+        }
+    }
+}
+
+void NeighbourGraph::BuildSecondNearest(const NeighbourGraph &nearest)
+{
+    const int nvoxels = nearest.NumVoxels();
+    m_start.assign(nvoxels, 0);
+    m_count.assign(nvoxels, 0);
+    m_ids.clear();
+
+    int total = 0;
+    for (int v = 1; v <= nvoxels; v++)
+    {
+        m_start[v - 1] = total;
+        for (const int *n1 = nearest.Begin(v); n1 != nearest.End(v); ++n1)
+        {
+            // Each of this voxel's neighbours must list it exactly once
+            int n = int(count(nearest.Begin(*n1), nearest.End(*n1), v));
+            if (n != 1)
+            {
+                throw FabberInternalError("Each of this voxel's neighbours must have "
+                                          "this voxel as a neighbour");
+            }
+            m_count[v - 1] += nearest.Count(*n1) - 1;
+        }
+        total += m_count[v - 1];
+    }
+
+    m_ids.resize(total);
+    for (int v = 1; v <= nvoxels; v++)
+    {
+        if (m_count[v - 1] == 0)
+            continue;
+        int *ids = &m_ids[0] + m_start[v - 1];
+        for (const int *n1 = nearest.Begin(v); n1 != nearest.End(v); ++n1)
+        {
+            ids = remove_copy(nearest.Begin(*n1), nearest.End(*n1), ids, v);
+        }
+    }
+}
+
+void NeighbourGraph::RemoveVoxel(int v)
+{
+    for (const int *n = Begin(v); n != End(v); ++n)
+    {
+        int *ids = &m_ids[0] + m_start[*n - 1];
+        m_count[*n - 1] = int(remove(ids, ids + m_count[*n - 1], v) - ids);
+    }
+}
+
+void SpatialOrder(const Matrix &coords, const string &type, vector<int> &order)
+{
+    if ((type != "raster") && (type != "hilbert") && (type != "morton"))
+    {
+        throw FabberInternalError("Unknown voxel order: " + type);
+    }
+
+    const int nvoxels = coords.Ncols();
+    order.resize(nvoxels);
+    if (nvoxels == 0)
+        return;
+
+    // We assume that co-ordinates could be zero but not negative
+    int size[3];
+    for (int d = 1; d <= 3; d++)
+    {
+        size[d - 1] = int(coords.Row(d).Maximum()) + 1;
+    }
+    int bits = 1;
+    while ((1 << bits) < max(size[0], max(size[1], size[2])))
+    {
+        bits++;
+    }
+
+    vector<pair<unsigned long long, int> > keys(nvoxels);
+    for (int v = 1; v <= nvoxels; v++)
+    {
+        unsigned int x = (unsigned int)(coords(1, v));
+        unsigned int y = (unsigned int)(coords(2, v));
+        unsigned int z = (unsigned int)(coords(3, v));
+        unsigned long long key;
+        if (type == "hilbert")
+        {
+            key = HilbertIndex(x, y, z, bits);
+        }
+        else if (type == "morton")
+        {
+            key = MortonIndex(x, y, z, bits);
+        }
+        else
+        {
+            // Raster scan which reverses direction on alternate rows and slices
+            // so consecutive voxels are always adjacent
+            if (z % 2)
+                y = size[1] - 1 - y;
+            unsigned long long row = (unsigned long long)z * size[1] + y;
+            if (row % 2)
+                x = size[0] - 1 - x;
+            key = row * size[0] + x;
+        }
+        keys[v - 1] = make_pair(key, v);
+    }
+    sort(keys.begin(), keys.end());
+    for (int v = 0; v < nvoxels; v++)
+    {
+        order[v] = keys[v].second;
+    }
+}
@@ -0,0 +1,103 @@
+/*  neighbours.h - Voxel neighbour graphs and spatially coherent voxel orderings
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+#pragma once
+
+#include <newmat.h>
+
+#include <string>
+#include <vector>
+
+/**
+ * Lists of neighbours for each voxel, stored in compressed sparse row form
+ *
+ * The neighbours of all voxels are stored in a single array, with the
+ * neighbours of each voxel contiguous, so iterating over the neighbours of
+ * successive voxels walks through memory in order. Voxel indices start at 1
+ * as for data matrices.
+ */
+class NeighbourGraph
+{
+public:
+    NeighbourGraph()
+    {
+    }
+
+    /**
+     * Build the nearest neighbour graph from voxel co-ordinates
+     *
+     * Neighbours are found by looking up the adjacent grid positions in a
+     * dense index of the bounding box of the voxels, so the voxels may be
+     * in any order. For each voxel the neighbours are listed in the order
+     * +x, -x, +y, -y, +z, -z.
+     *
+     * @param coords Voxel grid co-ordinates, 3 rows and one column per voxel
+     * @param n_dims If 2, get neighbours in 2D slices only. Also works for 1
+     *               although this is unusual!
+     */
+    void BuildNearest(const NEWMAT::Matrix &coords, int n_dims = 3);
+
+    /**
+     * Build the second nearest neighbour graph from a nearest neighbour graph
+     *
+     * The list for each voxel will exclude itself, but include duplicates
+     * if there are two routes to get there (diagonally connected)
+     */
+    void BuildSecondNearest(const NeighbourGraph &nearest);
+
+    /** @return Number of voxels in the graph */
+    int NumVoxels() const
+    {
+        return int(m_count.size());
+    }
+
+    /** @return Number of neighbours of voxel v, starting at 1 */
+    int Count(int v) const
+    {
+        return m_count[v - 1];
+    }
+
+    /** @return Pointer to the first neighbour index of voxel v, starting at 1 */
+    const int *Begin(int v) const
+    {
+        return m_ids.empty() ? NULL : &m_ids[0] + m_start[v - 1];
+    }
+
+    /** @return Pointer to one past the last neighbour index of voxel v, starting at 1 */
+    const int *End(int v) const
+    {
+        return Begin(v) + m_count[v - 1];
+    }
+
+    /**
+     * Remove voxel v from the neighbour lists of other voxels
+     *
+     * The graph must be symmetric, i.e. any voxel which has v as a
+     * neighbour must be a neighbour of v. The list for v itself is
+     * not changed.
+     */
+    void RemoveVoxel(int v);
+
+private:
+    /** Offset of the first neighbour of each voxel in m_ids */
+    std::vector<int> m_start;
+
+    /** Number of neighbours of each voxel. May shrink when voxels are removed */
+    std::vector<int> m_count;
+
+    /** Neighbour indices, starting at 1 */
+    std::vector<int> m_ids;
+};
+
+/**
+ * Get a spatially coherent order in which to visit voxels
+ *
+ * @param coords Voxel grid co-ordinates, 3 rows and one column per voxel.
+ *               Co-ordinates may be zero but not negative
+ * @param type raster (raster scan which reverses direction on alternate rows
+ *             and slices), hilbert (3D Hilbert curve) or morton (Z-order curve)
+ * @param order Will be set to voxel indices, starting at 1
+ */
+void SpatialOrder(const NEWMAT::Matrix &coords, const std::string &type, std::vector<int> &order);
@@ -17,207 +17,160 @@
 
 #include <stdexcept>
 
-#define AR1_BANDWIDTH 3
-
 using MISCMATHS::digamma;
 
-// Good enough for AR(1) with covariance terms
-// Reason: regular AR(1) matrix R has stuff only in -2.
-// R'*R are oppositely oriented so +/- 2 is still good enough.
-// Covariance terms are at +/-1, so maximum possible offset from
-// the main diagonal is +/-3.
-
-NoiseModel *Ar1cNoiseModel::NewInstance()
+namespace
 {
-    return new Ar1cNoiseModel();
-}
-Ar1cMatrixCache::Ar1cMatrixCache(int numPhis)
-    : nPhis(numPhis)
+// k_p * k_q + J_p * cov * J_q' for data points p and q, starting at 0
+inline double PairTerm(const Real *k, const Real *j, const Real *jc, int nparams, int p, int q)
 {
+    const Real *jp = j + p * nparams;
+    const Real *jcq = jc + q * nparams;
+    double sum = k[p] * k[q];
+    for (int i = 0; i < nparams; i++)
+    {
+        sum += jp[i] * jcq[i];
+    }
+    return sum;
 }
-
-Ar1cMatrixCache::Ar1cMatrixCache(const Ar1cMatrixCache &from)
-    : alphaMarginals(from.alphaMarginals)
-    , alphaMatrices(from.alphaMatrices)
-    , nPhis(from.nPhis)
-{
 }
 
-// recalculated whenever alpha changes
-unsigned Ar1cMatrixCache::FlattenIndex(unsigned n, unsigned a12pow, unsigned a34pow) const
+NoiseModel *Ar1cNoiseModel::NewInstance()
 {
-    assert((n == 1 || n == 2) && (a12pow <= 2 && a34pow <= 2));
-    return n - 1 + 2 * (a12pow + 3 * (a34pow));
+    return new Ar1cNoiseModel();
 }
 
-void Ar1cMatrixCache::Update(const Ar1cParams &dist, int nTimes)
+Ar1cPrecision::Ar1cPrecision(int numPhis)
+    : nPhis(numPhis)
+    , cross(false)
 {
-    //  LOG << "In Ar1cMatrixCache::Update..." << endl;
-    // Let's see if alphaMatrices have been defined yet
-    if (alphaMatrices.size() == 0)
-    {
-        assert(alphaMarginals.size() == 0); // Marginals always calculated afterwards
-        alphaMatrices.resize(FlattenIndex(nPhis, 0, 2) + 1);
-
-        // This is horrible, I know, but it's late and I'm tired.
-        for (int n = 1; n <= nPhis; n++)
-        {
-            for (int a12pow = 0; a12pow <= 2; a12pow++)
-            {
-                for (int a34pow = 0; a34pow <= 2 - a12pow; a34pow++)
-                {
-                    if (dist.alpha.means.Nrows() < 3 && a34pow > 0)
-                        break; // don't calculate unnecessary terms
-
-                    unsigned index = FlattenIndex(n, a12pow, a34pow);
-                    assert(index < alphaMatrices.size());
-                    SymmetricBandMatrix &mat = alphaMatrices[index];
-
-                    mat.ReSize(nTimes * nPhis, AR1_BANDWIDTH);
-                    mat = 0;
-
-                    // Take advantage of the fact that all the alphaMatrices have the same
-                    //  form: a single diagonal line (sometimes reflected to keep the matrix
-                    //  symmetric) with length = nTimes-1.
-
-                    int row, col;
-                    double value;
-                    switch (a12pow * 10 + a34pow)
-                    {
-                    // These are for the matlab style, where the data sets from the
-                    // two echo times are concatenated rather than interleaved:
-                    // case 00: row = col = 2; break;
-                    // case 10: row = 1; col = 2; break;
-                    // case 20: row = col = 1; break;
-                    // case 01: row = nTimes+2; col = 2; break;
-                    // case 11: row = nTimes+2; col = 1; break;
-                    // case 02: row = col = nTimes+2; break;
-                    // default: assert(false);
-
-                    // For the interleaved TE1/TE2 style.
-                    // 0<i<=nTimes: -> 2*i-1
-                    // nTimes<i<=2*nTimes: -> 2*(i-nTimes)
-                    // so 1->1, 2->3, nTimes+2->4
-                    case 00:
-                        row = col = 1 + nPhis;
-                        break;
-                    case 10:
-                        row = 1;
-                        col = 1 + nPhis;
-                        break;
-                    case 20:
-                        row = col = 1;
-                        break;
-                    case 01:
-                        row = 4;
-                        col = 3;
-                        break;
-                    case 11:
-                        row = 4;
-                        col = 1;
-                        break;
-                    case 02:
-                        row = col = 4;
-                        break;
-                    default:
-                        throw FabberInternalError("Ar1cMatrixCache::Update Invalid row/col");
-                    }
-
-                    if (a12pow + a34pow == 1)
-                        value = -1;
-                    else
-                        value = 1;
-
-                    // These assignments are for the phi1-related matrix; quadrants are
-                    // swapped for phi2:
-                    //      if (n==2)
-                    //	{
-                    //	  row = (row + nTimes) % (2*nTimes);
-                    //	  col = (col + nTimes) % (2*nTimes);
-                    //	}
-                    if (n == 2)
-                    {
-                        row = row - 1 + 2 * (row % 2); // 2n->2n-1, 2n-1->2n
-                        col = col - 1 + 2 * (col % 2);
-                    }
-
-                    // for (int count = 0; count < nTimes-1; count++, row++, col++)
-                    for (int count = 0; count < nTimes - 1; count++, row += nPhis, col += nPhis)
-                    {
-                        // LOG << "row="<<row<<",col="<<col<<endl;
-                        mat(row, col) = value;
-                        assert(row <= mat.Nrows() && col <= mat.Ncols());
-                    }
-                }
-            }
-        }
-    }
-
-    // So now we know alphaMatrices are defined.
-    assert(alphaMatrices[0].Nrows() == nTimes * nPhis);
-
-    // Always update the alphaMatrices
-    if (alphaMarginals.size() == 0)
+    assert(nPhis == 1 || nPhis == 2);
+    for (int n = 0; n < 2; n++)
     {
-        alphaMarginals.resize(2);
-        alphaMarginals[0].ReSize(nTimes * nPhis, AR1_BANDWIDTH);
-        alphaMarginals[1].ReSize(nTimes * nPhis, AR1_BANDWIDTH);
+        Ea[n] = Ea2[n] = Eb[n] = Eab[n] = Eb2[n] = 0;
     }
-    assert(alphaMarginals[0].Nrows() == nTimes * nPhis);
-    assert(alphaMarginals[1].Nrows() == nTimes * nPhis);
+}
 
-    const unsigned nAlphas = dist.alpha.means.Nrows();
+void Ar1cPrecision::Update(const MVNDist &alpha)
+{
+    const int nAlphas = alpha.means.Nrows();
+    const ColumnVector &m = alpha.means;
+    const SymmetricMatrix &cov = alpha.GetCovariance();
+    cross = (nAlphas >= 3);
 
     for (int n = 1; n <= nPhis; n++)
     {
-        Matrix covarPlus = dist.alpha.GetCovariance() + dist.alpha.means * dist.alpha.means.t();
-        assert(covarPlus == covarPlus.t()); // must by symmetric
-
-        //      LOG << "CovarPlus is\n" << covarPlus;
-
-        if (nAlphas >= 3)
+        Ea[n - 1] = m(n);
+        Ea2[n - 1] = cov(n, n) + m(n) * m(n);
+        if (cross)
         {
             const int T = (nAlphas == 4) ? 2 + n : 3;
-
-            alphaMarginals.at(n - 1) = GetMatrix(n, 0, 0) + GetMatrix(n, 1, 0) * dist.alpha.means(n)
-                + GetMatrix(n, 2, 0) * covarPlus(n, n) + GetMatrix(n, 0, 1) * dist.alpha.means(T)
-                + GetMatrix(n, 1, 1) * covarPlus(n, T) + GetMatrix(n, 0, 2) * covarPlus(T, T);
+            Eb[n - 1] = m(T);
+            Eab[n - 1] = cov(n, T) + m(n) * m(T);
+            Eb2[n - 1] = cov(T, T) + m(T) * m(T);
         }
         else
         {
-            assert(nAlphas == 2);
+            Eb[n - 1] = Eab[n - 1] = Eb2[n - 1] = 0;
+        }
+    }
+}
 
-            alphaMarginals.at(n - 1) = GetMatrix(n, 0, 0) + GetMatrix(n, 1, 0) * dist.alpha.means(n)
-                + GetMatrix(n, 2, 0) * covarPlus(n, n);
+void Ar1cPrecision::ResidualSums(
+    int n, const ColumnVector &k, const Matrix &J, const Matrix &Jcov, Ar1cSums &sums) const
+{
+    const int nparams = J.Ncols();
+    const int nTimes = J.Nrows() / nPhis;
+    assert(J.Nrows() == nTimes * nPhis);
+    const Real *kk = k.Store();
+    const Real *j = J.Store();
+    const Real *jc = Jcov.Store();
+
+    // Data is interleaved, so the point for echo e (from 0) at time t (from 0)
+    // is t * nPhis + e
+    const int echo = n - 1;
+    const int other = 1 - echo;
+
+    sums.xx = sums.xy = sums.yy = sums.xz = sums.yz = sums.zz = 0;
+    for (int t = 0; t < nTimes; t++)
+    {
+        const int x = t * nPhis + echo;
+
+        // x_t for t > 1 is also y_(t+1) for t < nTimes
+        double diag = PairTerm(kk, j, jc, nparams, x, x);
+        if (t > 0)
+            sums.xx += diag;
+        if (t < nTimes - 1)
+            sums.yy += diag;
+        if (t == 0)
+            continue;
+
+        const int y = x - nPhis;
+        sums.xy += PairTerm(kk, j, jc, nparams, x, y);
+        if (cross)
+        {
+            const int z = t * nPhis + other;
+            sums.xz += PairTerm(kk, j, jc, nparams, x, z);
+            sums.yz += PairTerm(kk, j, jc, nparams, y, z);
+            sums.zz += PairTerm(kk, j, jc, nparams, z, z);
         }
     }
 }
 
-const SymmetricBandMatrix &Ar1cMatrixCache::GetMatrix(
-    unsigned n, unsigned a12pow, unsigned a34pow) const
+double Ar1cPrecision::QuadraticForm(int n, const Ar1cSums &sums) const
 {
-    //  LOG << "Called: GetMatrix(" << n << "," << a12pow << "," << a34pow << ")" << endl;
-    assert(alphaMatrices.size() > FlattenIndex(n, a12pow, a34pow));
-    return alphaMatrices[FlattenIndex(n, a12pow, a34pow)]; //[n-1][a12pow][a3pow];
+    // Expectation of sum of (x_t - a * y_t - b * z_t)^2
+    const int i = n - 1;
+    return sums.xx - 2 * Ea[i] * sums.xy + Ea2[i] * sums.yy - 2 * Eb[i] * sums.xz
+        + 2 * Eab[i] * sums.yz + Eb2[i] * sums.zz;
 }
 
-const SymmetricBandMatrix &Ar1cMatrixCache::GetMarginal(unsigned n) const
+void Ar1cPrecision::Multiply(int n, double w, const Matrix &v, Matrix &out) const
 {
-    //  LOG << "In GetMarginal("<<n<<") const" << endl;
-    //  LOG << alphaMarginals.size() << ":" << alphaMarginals[n-1].Nrows()<<endl;
-    if (alphaMarginals.size() < n)
-        throw FabberInternalError(("GetMarginal(" + stringify(n) + "): not enough elements (only"
-                                      + stringify(alphaMarginals.size()) + ") in alphaMarginals!\n")
-                                      .c_str());
-    //  LOG << "Size of alphaMarginals[n-1] is " << alphaMarginals[n-1].Nrows() << " by " <<
-    //  alphaMarginals[n-1].Ncols() << endl;
-    return alphaMarginals[n - 1];
+    const int ncols = v.Ncols();
+    const int nTimes = v.Nrows() / nPhis;
+    assert(v.Nrows() == nTimes * nPhis);
+    assert(out.Nrows() == v.Nrows() && out.Ncols() == ncols);
+    const Real *vv = v.Store();
+    Real *o = out.Store();
+
+    const int i = n - 1;
+    const double a = w * Ea[i], a2 = w * Ea2[i];
+    const double b = w * Eb[i], ab = w * Eab[i], b2 = w * Eb2[i];
+    const int other = 1 - i;
+
+    for (int t = 1; t < nTimes; t++)
+    {
+        const Real *vx = vv + (t * nPhis + i) * ncols;
+        const Real *vy = vx - nPhis * ncols;
+        Real *ox = o + (t * nPhis + i) * ncols;
+        Real *oy = ox - nPhis * ncols;
+        if (cross)
+        {
+            const Real *vz = vv + (t * nPhis + other) * ncols;
+            Real *oz = o + (t * nPhis + other) * ncols;
+            for (int c = 0; c < ncols; c++)
+            {
+                ox[c] += w * vx[c] - a * vy[c] - b * vz[c];
+                oy[c] += -a * vx[c] + a2 * vy[c] + ab * vz[c];
+                oz[c] += -b * vx[c] + ab * vy[c] + b2 * vz[c];
+            }
+        }
+        else
+        {
+            for (int c = 0; c < ncols; c++)
+            {
+                ox[c] += w * vx[c] - a * vy[c];
+                oy[c] += -a * vx[c] + a2 * vy[c];
+            }
+        }
+    }
 }
 
 Ar1cParams::Ar1cParams(int nAlpha, int nPhi)
     : alpha(nAlpha)
     , phis(nPhi)
-    , alphaMat(nPhi)
+    , precision(nPhi)
 {
     return;
 }
@@ -225,7 +178,7 @@ Ar1cParams::Ar1cParams(int nAlpha, int nPhi)
 Ar1cParams::Ar1cParams(const Ar1cParams &from)
     : alpha(from.alpha)
     , phis(from.phis)
-    , alphaMat(from.alphaMat)
+    , precision(from.precision)
 {
     return;
 }
@@ -235,7 +188,7 @@ const Ar1cParams &Ar1cParams::operator=(const NoiseParams &in)
     const Ar1cParams &from = dynamic_cast<const Ar1cParams &>(in);
     alpha = from.alpha;
     phis = from.phis;
-    alphaMat = from.alphaMat;
+    precision = from.precision;
     return *this;
 }
 
@@ -374,49 +327,14 @@ void Ar1cNoiseModel::UpdateNoise(NoiseParams &noise, const NoiseParams &noisePri
     UpdatePhi(noise, noisePrior, theta, linear, data);
 }
 
-// Helper class for UpdateAlpha (could be used elsewhere)
-// Evaluates (k' * ?? * k) + Trace(inv(L) * J' * ?? * J) for
-// a symmetric band ??.
-class OperatorKLJ
+void Ar1cNoiseModel::ResidualSums(const Ar1cParams &noise, const MVNDist &theta,
+    const LinearFwdModel &linear, const ColumnVector &data, Ar1cSums *sums) const
 {
-public:
-    OperatorKLJ(const ColumnVector &k2, const SymmetricMatrix &L2, const Matrix &J2)
-        : k(k2)
-        , L(L2)
-        , J(J2)
-    {
-        return;
-    }
-    //    : k(k2), JLiJt(J2.Ncols(), AR1_BANDWIDTH)
-    //            JLiJt << (J2*L2.i()*J2.t());
-    //            // the above doesn't work... should be some sort of lossy store, but
-    //            // it crashes with an "Undefined bandwidth" error... not sure why.
-    //            // Could always calculate it as a SymmetricMatrix then manually
-    //            // (i.e. in a loop) copy the near-diagonal bit to a
-    //            // a SymmetricBandMatrix -- so much hassle!)
-    //        }
-
-    double operator()(const SymmetricBandMatrix &input) const;
-
-private:
-    const ColumnVector &k;
-    const SymmetricMatrix &L;
-    const Matrix &J;
-    //  SymmetricBandMatrix JLiJt;
-};
-
-double OperatorKLJ::operator()(const SymmetricBandMatrix &input) const
-{
-    //  assert(input.BandWidth().Lower() <= AR1_BANDWIDTH);
-    //  return (k.t() * input * k).AsScalar()
-    //      + (input * JLiJt).Trace();
-    return (k.t() * input * k).AsScalar() + (L.i() * J.t() * input * J).Trace();
-    // Could precalculate J * L.i() * J.t(), but that's a big matrix
-    // to store so I'm not sure if it'd actually be better.
-    // Now, since trace(A*B) = sum(sum(A.*B')), we only need to keep the elements
-    // on the band... if we know the bandwidth in advance (and can be bothered!)
-    // Turns out to be quite tricky in NEWMAT.  There's no obvious way to convert
-    // a SymmetricMatrix into a SymmetricBandMatrix (i.e. it's lossy)
+    const Matrix &J = linear.Jacobian();
+    const ColumnVector k = data - linear.Offset() + J * (linear.Centre() - theta.means);
+    const Matrix Jcov = J * theta.GetCovariance();
+    for (int i = 1; i <= nPhis; i++)
+        noise.precision.ResidualSums(i, k, J, Jcov, sums[i - 1]);
 }
 
 void Ar1cNoiseModel::UpdateAlpha(NoiseParams &noise, const NoiseParams &noisePrior,
@@ -424,21 +342,19 @@ void Ar1cNoiseModel::UpdateAlpha(NoiseParams &noise, const NoiseParams &noisePri
 {
     Ar1cParams &posterior = dynamic_cast<Ar1cParams &>(noise);
     const Ar1cParams &prior = dynamic_cast<const Ar1cParams &>(noisePrior);
-    Ar1cMatrixCache &alphaMat = posterior.alphaMat;
 
     const int nNoiseModels = posterior.phis.size();
-    // unused: const int nTimes = data.Nrows() / nPhis;
     const unsigned nAlphas = prior.alpha.means.Nrows();
     assert(nNoiseModels == nPhis); // the only size currently supported
 
-    const Matrix &J = linear.Jacobian();
-    const ColumnVector k = data - linear.Offset() + J * (linear.Centre() - theta.means);
-
     ColumnVector si_ci(nNoiseModels);
     for (int i = 1; i <= nNoiseModels; i++)
         si_ci(i) = posterior.phis[i - 1].b * posterior.phis[i - 1].c;
 
-    const OperatorKLJ OpKLJ(k, theta.GetPrecisions(), J);
+    // The terms involving each power of the AR coefficients. Terms in a^2 come
+    // from the yy sums, ab from yz, b^2 from zz, a from xy and b from xz
+    Ar1cSums sums[2];
+    ResidualSums(posterior, theta, linear, data, sums);
 
     SymmetricMatrix alphaPrecisions = prior.alpha.GetPrecisions();
 
@@ -446,17 +362,17 @@ void Ar1cNoiseModel::UpdateAlpha(NoiseParams &noise, const NoiseParams &noisePri
 
     {
         for (int i = 1; i <= nNoiseModels; i++)
-            alphaPrecisions(i, i) += si_ci(i) * OpKLJ(alphaMat.GetMatrix(i, 2, 0));
+            alphaPrecisions(i, i) += si_ci(i) * sums[i - 1].yy;
 
         if (T > 2)
         {
             // we have at least one cross-term
             alphaPrecisions(3, 1) += // SymmetricMatrix, so this also sets (1,3)
-                0.5 * si_ci(1) * OpKLJ(alphaMat.GetMatrix(1, 1, 1));
+                si_ci(1) * sums[0].yz;
             alphaPrecisions(T, 2) += // also sets (2,3)
-                0.5 * si_ci(2) * OpKLJ(alphaMat.GetMatrix(2, 1, 1));
-            alphaPrecisions(3, 3) += si_ci(1) * OpKLJ(alphaMat.GetMatrix(1, 0, 2));
-            alphaPrecisions(T, T) += si_ci(2) * OpKLJ(alphaMat.GetMatrix(2, 0, 2));
+                si_ci(2) * sums[1].yz;
+            alphaPrecisions(3, 3) += si_ci(1) * sums[0].zz;
+            alphaPrecisions(T, T) += si_ci(2) * sums[1].zz;
         }
         posterior.alpha.SetPrecisions(alphaPrecisions);
 
@@ -477,12 +393,12 @@ void Ar1cNoiseModel::UpdateAlpha(NoiseParams &noise, const NoiseParams &noisePri
         ColumnVector tmp(T);
         tmp = prior.alpha.GetPrecisions() * prior.alpha.means;
         for (int i = 1; i <= nNoiseModels; i++)
-            tmp(i) += -0.5 * si_ci(i) * OpKLJ(alphaMat.GetMatrix(i, 1, 0));
+            tmp(i) += si_ci(i) * sums[i - 1].xy;
 
         if (T > 2)
         {
-            tmp(3) += -0.5 * si_ci(1) * OpKLJ(alphaMat.GetMatrix(1, 0, 1));
-            tmp(T) += -0.5 * si_ci(2) * OpKLJ(alphaMat.GetMatrix(2, 0, 1));
+            tmp(3) += si_ci(1) * sums[0].xz;
+            tmp(T) += si_ci(2) * sums[1].xz;
         }
         posterior.alpha.means = posterior.alpha.GetCovariance() * tmp;
     }
@@ -496,10 +412,8 @@ void Ar1cNoiseModel::UpdateAlpha(NoiseParams &noise, const NoiseParams &noisePri
         // throw overflow_exception("Alpha > 1 detected");
     }
 
-    {
-        // Update the alpha marginals (used by phi and theta updates)
-        alphaMat.Update(posterior, data.Nrows() / nPhis);
-    }
+    // Update the expected AR coefficients (used by phi and theta updates)
+    posterior.precision.Update(posterior.alpha);
 }
 
 void Ar1cNoiseModel::UpdatePhi(NoiseParams &noise, const NoiseParams &noisePrior,
@@ -507,22 +421,16 @@ void Ar1cNoiseModel::UpdatePhi(NoiseParams &noise, const NoiseParams &noisePrior
 {
     Ar1cParams &posterior = dynamic_cast<Ar1cParams &>(noise);
     const Ar1cParams &prior = dynamic_cast<const Ar1cParams &>(noisePrior);
-    Ar1cMatrixCache &alphaMat = posterior.alphaMat;
 
-    const Matrix &J = linear.Jacobian();
-    ColumnVector k = data - linear.Offset() + J * (linear.Centre() - theta.means);
     int nTimes = data.Nrows() / nPhis; // Number of data points FOR EACH ECHO
 
+    Ar1cSums sums[2];
+    ResidualSums(posterior, theta, linear, data, sums);
+
     for (int i = 1; i <= nPhis; i++)
     {
-        {
-            const SymmetricBandMatrix &Qi = alphaMat.GetMarginal(i);
-
-            double tmp
-                = (k.t() * Qi * k).AsScalar() + (theta.GetCovariance() * J.t() * Qi * J).Trace();
-
-            posterior.phis[i - 1].b = 1 / (tmp * 0.5 + 1 / prior.phis[i - 1].b);
-        }
+        double tmp = posterior.precision.QuadraticForm(i, sums[i - 1]);
+        posterior.phis[i - 1].b = 1 / (tmp * 0.5 + 1 / prior.phis[i - 1].b);
 
         assert(posterior.phis[i - 1].b > 0);
 
@@ -535,7 +443,6 @@ void Ar1cNoiseModel::UpdateTheta(const NoiseParams &noise, MVNDist &theta,
     MVNDist *thetaWithoutPrior, float LMalpha) const
 {
     const Ar1cParams &posterior = dynamic_cast<const Ar1cParams &>(noise);
-    const Ar1cMatrixCache &alphaMat = posterior.alphaMat;
 
     // Translated from vb_ar1c_update_theta in the NPINTS project in FMRIB's CVS.
 
@@ -547,28 +454,24 @@ void Ar1cNoiseModel::UpdateTheta(const NoiseParams &noise, MVNDist &theta,
     for (int i = 1; i <= nPhis; i++)
         si_ci(i) = posterior.phis.at(i - 1).b * posterior.phis.at(i - 1).c;
 
-    SymmetricBandMatrix X;
+    // X = sum of si_ci * Q_i is applied to J and to the data without being formed
+    const ColumnVector r = data - gml + J * ml;
+    Matrix XJ(J.Nrows(), J.Ncols());
+    XJ = 0;
+    ColumnVector Xr(r.Nrows());
+    Xr = 0;
+    for (int i = 1; i <= nPhis; i++)
     {
-        if (nPhis == 2)
-            X = si_ci(1) * alphaMat.GetMarginal(1) + si_ci(2) * alphaMat.GetMarginal(2);
-        else
-            X = si_ci(1) * alphaMat.GetMarginal(1);
+        posterior.precision.Multiply(i, si_ci(i), J, XJ);
+        posterior.precision.Multiply(i, si_ci(i), r, Xr);
     }
 
-    //    SymmetricMatrix Ltmp = J.t() * X * J;
     SymmetricMatrix Ltmp;
-    {
-        Matrix Ltmp_tmp = J.t() * X * J;
-        // LOG<<"Max error: "<<(Ltmp_tmp.t() - Ltmp_tmp).MaximumAbsoluteValue()
-        //    <<", compared to "<<Ltmp_tmp.MaximumAbsoluteValue()<<endl;
-        // assert(Ltmp_tmp.t() == Ltmp_tmp);
-        Ltmp << Ltmp_tmp;
-        // assert(Ltmp == Ltmp_tmp);
-    }
+    Ltmp << J.t() * XJ;
 
     ColumnVector mTmp;
     {
-        mTmp = J.t() * X * (data - gml + J * ml);
+        mTmp = J.t() * Xr;
 
         theta.SetPrecisions(thetaPrior.GetPrecisions() + Ltmp);
         theta.means
@@ -598,12 +501,12 @@ void Ar1cNoiseModel::UpdateTheta(const NoiseParams &noise, MVNDist &theta,
         thetaWithoutPrior->means = thetaWithoutPrior->GetCovariance() * mTmp;
     }
 
-    {
-        LogAndSign chk = theta.GetPrecisions().LogDeterminant();
-        if (chk.Sign() <= 0)
-            LOG << "Note: In UpdateTheta, theta precisions aren't positive-definite: " << chk.Sign()
-                << ", " << chk.LogValue() << endl;
-    }
+    // The log determinant is cached in theta for the free energy calculation
+    int sign;
+    double logdet = theta.GetLogDetPrecisions(&sign);
+    if (sign <= 0)
+        LOG << "Note: In UpdateTheta, theta precisions aren't positive-definite: " << sign << ", "
+            << logdet << endl;
 }
 
 ostream &operator<<(ostream &s, vector<double> n)
@@ -619,25 +522,17 @@ double Ar1cNoiseModel::CalcFreeEnergy(const NoiseParams &noise, const NoiseParam
 {
     const Ar1cParams &posterior = dynamic_cast<const Ar1cParams &>(noise);
     const Ar1cParams &prior = dynamic_cast<const Ar1cParams &>(noisePrior);
-    const Ar1cMatrixCache &alphaMat = posterior.alphaMat;
 
-    const Matrix &J = linear.Jacobian();
-    ColumnVector k = data - linear.Offset() + J * (linear.Centre() - theta.means);
-    const SymmetricMatrix &Linv = theta.GetCovariance();
-
-    const GammaDist &phi1 = posterior.phis.at(1 - 1);
-    SymmetricMatrix Qsum;
-    if (nPhis == 2)
-    {
-        const GammaDist &phi2 = posterior.phis.at(2 - 1);
-
-        Qsum = alphaMat.GetMarginal(1) * (phi1.b * phi1.c)
-            + alphaMat.GetMarginal(2) * (phi2.b * phi2.c);
-    }
-    else
+    // k' * Qsum * k + Trace(J' * Qsum * J * Linv) where Qsum = sum of si_ci * Q_i
+    Ar1cSums sums[2];
+    ResidualSums(posterior, theta, linear, data, sums);
+    double Qsum_terms = 0;
+    for (int i = 1; i <= nPhis; i++)
     {
-        Qsum = alphaMat.GetMarginal(1) * (phi1.b * phi1.c);
+        const GammaDist &phi = posterior.phis.at(i - 1);
+        Qsum_terms += phi.b * phi.c * posterior.precision.QuadraticForm(i, sums[i - 1]);
     }
+    const SymmetricMatrix &Linv = theta.GetCovariance();
 
     int nTimes = data.Nrows() / nPhis; // Number of data points FOR EACH ECHO
     int nTheta = theta.means.Nrows();
@@ -647,11 +542,11 @@ double Ar1cNoiseModel::CalcFreeEnergy(const NoiseParams &noise, const NoiseParam
     // in vb_ar1c_freeenergy.m, as of 12-Apr-2007.
 
     double expectedLogAlphaDist = // Now match
-        +0.5 * posterior.alpha.GetPrecisions().LogDeterminant().LogValue()
+        +0.5 * posterior.alpha.GetLogDetPrecisions()
         - 0.5 * nAlphas * (log(2 * M_PI) + 1);
 
     double expectedLogThetaDist = // Now match
-        +0.5 * theta.GetPrecisions().LogDeterminant().LogValue()
+        +0.5 * theta.GetLogDetPrecisions()
         - 0.5 * nTheta * (log(2 * M_PI) + 1);
 
     double expectedLogPhiDist = 0;
@@ -677,10 +572,9 @@ double Ar1cNoiseModel::CalcFreeEnergy(const NoiseParams &noise, const NoiseParam
 
     expectedLogPosteriorParts[1] = -log(2 * M_PI) * (nTimes - 1 + 0.5 * nAlphas + 0.5 * nTheta);
 
-    expectedLogPosteriorParts[2]
-        = -0.5 * (k.t() * Qsum * k).AsScalar() - 0.5 * (J.t() * Qsum * J * Linv).Trace();
+    expectedLogPosteriorParts[2] = -0.5 * Qsum_terms;
 
-    expectedLogPosteriorParts[3] = +0.5 * thetaPrior.GetPrecisions().LogDeterminant().LogValue();
+    expectedLogPosteriorParts[3] = +0.5 * thetaPrior.GetLogDetPrecisions();
 
     expectedLogPosteriorParts[4] = -0.5
         * ((theta.means - thetaPrior.means).t() * thetaPrior.GetPrecisions()
@@ -689,7 +583,7 @@ double Ar1cNoiseModel::CalcFreeEnergy(const NoiseParams &noise, const NoiseParam
 
     expectedLogPosteriorParts[5] = -0.5 * (Linv * thetaPrior.GetPrecisions()).Trace();
 
-    expectedLogPosteriorParts[6] = +0.5 * prior.alpha.GetPrecisions().LogDeterminant().LogValue();
+    expectedLogPosteriorParts[6] = +0.5 * prior.alpha.GetLogDetPrecisions();
 
     expectedLogPosteriorParts[7] = -0.5
         * ((posterior.alpha.means - prior.alpha.means).t() * prior.alpha.GetPrecisions()
@@ -732,14 +626,12 @@ void Ar1cNoiseModel::Precalculate(
 {
     Ar1cParams &posterior = dynamic_cast<Ar1cParams &>(noise);
     const Ar1cParams &prior = dynamic_cast<const Ar1cParams &>(noisePrior);
-    Ar1cMatrixCache &alphaMat = posterior.alphaMat;
 
     int nTimes = sampleData.Nrows() / nPhis;
 
-    // Pre-calculate the alpha matrices and alpha marginals
-    // after this, the matrices should never change (marginals are updated)
-    // by UpdateAlpha's call to alphaMat.Update().
-    alphaMat.Update(posterior, nTimes);
+    // Initialize the expected AR coefficients. After this they are
+    // updated by UpdateAlpha
+    posterior.precision.Update(posterior.alpha);
 
     // Prevents the massive (artificial) drop in F on the first phi update:
     // (needed so that F results match MATLAB exactly)
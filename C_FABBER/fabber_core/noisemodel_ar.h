@@ -15,30 +15,66 @@
 #include <string>
 #include <vector>
 
-class Ar1cParams;
+/**
+ * Sums used to evaluate quadratic forms with the AR(1) precision of one echo
+ *
+ * The residual for echo n at time t is x_t - a * y_t - b * z_t, where x_t is
+ * the data point for echo n at time t, y_t the data point for echo n at time t-1
+ * and z_t the data point for the other echo at time t (only used with cross terms).
+ * Each member is the sum over t = 2..nTimes of k_p * k_q + J_p * cov * J_q' for the
+ * pair of data points p, q given by its name.
+ */
+struct Ar1cSums
+{
+    double xx, xy, yy, xz, yz, zz;
+};
 
-// Helper class -- caches some of the AR matrices
-class Ar1cMatrixCache
+/**
+ * Expected AR(1) noise precision matrix for each echo
+ *
+ * The precision matrices are banded with a bandwidth of at most 3, and are fully
+ * determined by the posterior moments of the AR coefficients. Only these moments are
+ * stored - quadratic forms and products with the precision matrices are evaluated
+ * directly in O(nTimes) without forming any matrices.
+ */
+class Ar1cPrecision
 {
 public:
-    explicit Ar1cMatrixCache(int numPhis);
-    Ar1cMatrixCache(const Ar1cMatrixCache &from);
-    const NEWMAT::SymmetricBandMatrix &GetMatrix(unsigned n, unsigned a12pow, unsigned a3pow) const;
-    const NEWMAT::SymmetricBandMatrix &GetMarginal(unsigned n) const;
-    void Update(const Ar1cParams &dist, int nTimes);
+    explicit Ar1cPrecision(int numPhis);
+
+    /** Recalculate the expected AR coefficients from the alpha posterior */
+    void Update(const MVNDist &alpha);
+
+    /**
+     * Calculate the sums needed for quadratic forms with the precision of echo n
+     *
+     * @param n Echo, starting at 1
+     * @param k Residuals at the linearization point
+     * @param J Jacobian of the linearized model
+     * @param Jcov J * cov where cov is the parameter covariance
+     */
+    void ResidualSums(int n, const NEWMAT::ColumnVector &k, const NEWMAT::Matrix &J,
+        const NEWMAT::Matrix &Jcov, Ar1cSums &sums) const;
+
+    /** @return k' * Q_n * k + Trace(cov * J' * Q_n * J) given the sums for echo n */
+    double QuadraticForm(int n, const Ar1cSums &sums) const;
+
+    /**
+     * out += w * Q_n * v where Q_n is the precision of echo n
+     *
+     * @param v Matrix with one row per data point
+     * @param out Matrix the same size as v
+     */
+    void Multiply(int n, double w, const NEWMAT::Matrix &v, NEWMAT::Matrix &out) const;
 
 private:
-    std::vector<NEWMAT::SymmetricBandMatrix> alphaMarginals;
-    // recalculated whenever alpha changes
-    unsigned FlattenIndex(unsigned n, unsigned a12pow, unsigned a34pow) const;
+    int nPhis;
 
-    // should only be calculated once
-    // Note that if more than one model is being inferred upon at a time,
-    // this will be unnecessarily duplicated in every one of them --
-    // might speed things up considerably by sharing.
-    std::vector<NEWMAT::SymmetricBandMatrix> alphaMatrices;
+    /** True if the residuals include the cross term b * z_t */
+    bool cross;
 
-    int nPhis;
+    // Expectations of a, a^2, b, ab and b^2 for each echo
+    double Ea[2], Ea2[2], Eb[2], Eab[2], Eb2[2];
 };
 
 // Parameter-storage class -- it's really just an enhanced structure
@@ -57,11 +93,10 @@ public:
 
 private:
     friend class Ar1cNoiseModel; // Needs to use this class like it's a structure
-    friend class Ar1cMatrixCache;
     MVNDist alpha;
     std::vector<GammaDist> phis;
 
-    Ar1cMatrixCache alphaMat;
+    Ar1cPrecision precision;
 };
 
 class Ar1cNoiseModel : public NoiseModel
@@ -75,7 +110,7 @@ public:
 
     virtual void HardcodedInitialDists(NoiseParams &prior, NoiseParams &posterior) const;
 
-    /** Used to pre-evaluate the alpha matrices in the cache */
+    /** Used to initialize the expected AR coefficients */
     virtual void Precalculate(NoiseParams &noise, const NoiseParams &noisePrior,
         const NEWMAT::ColumnVector &sampleData) const;
 
@@ -100,4 +135,9 @@ protected:
 
     virtual void UpdatePhi(NoiseParams &noise, const NoiseParams &noisePrior, const MVNDist &theta,
         const LinearFwdModel &model, const NEWMAT::ColumnVector &data) const;
+
+private:
+    /** Calculate the residual sums for each echo at the current theta */
+    void ResidualSums(const Ar1cParams &noise, const MVNDist &theta, const LinearFwdModel &model,
+        const NEWMAT::ColumnVector &data, Ar1cSums *sums) const;
 };
@@ -16,13 +16,75 @@
 #include <miscmaths/miscmaths.h>
 #include <newmat.h>
 
+#include <algorithm>
 #include <ostream>
 #include <string>
+#include <vector>
 
 using MISCMATHS::digamma;
 using namespace NEWMAT;
 using namespace std;
 
+namespace
+{
+// For each phi, the sum over the data points it applies to of the squared residual k
+// plus the trace term J_t * cov * J_t' (i.e. (cov * J.t() * Qi * J).Trace() without forming
+// the product). Done in one pass over the data points whatever the number of phis
+void ResidualSums(const vector<int> &phi_index, const ColumnVector &k, const Matrix &J,
+    const SymmetricMatrix &cov, vector<double> &sums)
+{
+    const int ntimes = J.Nrows();
+    const int nparams = J.Ncols();
+    Matrix Jcov = J * cov;
+    const Real *j = J.Store();
+    const Real *jc = Jcov.Store();
+    const Real *kk = k.Store();
+
+    fill(sums.begin(), sums.end(), 0.0);
+    for (int t = 0; t < ntimes; t++)
+    {
+        double var = 0;
+        for (int p = 0; p < nparams; p++)
+        {
+            var += j[t * nparams + p] * jc[t * nparams + p];
+        }
+        sums[phi_index[t]] += kk[t] * kk[t] + var;
+    }
+}
+
+// Calculate J' * W * J and J' * W * r for diagonal weights W in one pass over
+// the data points. Only the lower triangle of J' * W * J is accumulated
+void WeightedNormalEquations(const Matrix &J, const vector<double> &w, const ColumnVector &r,
+    SymmetricMatrix &JtWJ, ColumnVector &JtWr)
+{
+    const int ntimes = J.Nrows();
+    const int nparams = J.Ncols();
+    JtWJ.ReSize(nparams);
+    JtWJ = 0;
+    JtWr.ReSize(nparams);
+    JtWr = 0;
+
+    // SymmetricMatrix stores the lower triangle row by row
+    Real *a = JtWJ.Store();
+    Real *b = JtWr.Store();
+    const Real *rr = r.Store();
+    for (int t = 0; t < ntimes; t++)
+    {
+        const Real *jt = J.Store() + t * nparams;
+        for (int p = 0; p < nparams; p++)
+        {
+            double wj = w[t] * jt[p];
+            b[p] += wj * rr[t];
+            Real *row = a + p * (p + 1) / 2;
+            for (int q = 0; q <= p; q++)
+            {
+                row[q] += wj * jt[q];
+            }
+        }
+    }
+}
+}
+
 NoiseModel *WhiteNoiseModel::NewInstance()
 {
     return new WhiteNoiseModel();
@@ -103,7 +165,7 @@ void WhiteNoiseModel::Initialize(FabberRunData &args)
     // set up the pattern correctly as that requires the data length
     // (number of timeseries samples) to be known and is done
     // at calculation time.
-    MakeQis(phiPattern.length());
+    MakePhiIndex(phiPattern.length());
 
     // Allow phi to be locked externally
     lockedNoiseStdev = convertTo<double>(args.GetStringDefault("locked-noise-stdev", "-1"));
@@ -117,18 +179,18 @@ void WhiteNoiseModel::Initialize(FabberRunData &args)
 
 int WhiteNoiseModel::NumParams()
 {
-    return Qis.size();
+    return m_phi_count.size();
 }
 WhiteParams *WhiteNoiseModel::NewParams() const
 {
-    return new WhiteParams(Qis.size());
+    return new WhiteParams(m_phi_count.size());
 }
 void WhiteNoiseModel::HardcodedInitialDists(NoiseParams &priorIn, NoiseParams &posteriorIn) const
 {
     WhiteParams &prior = dynamic_cast<WhiteParams &>(priorIn);
     WhiteParams &posterior = dynamic_cast<WhiteParams &>(posteriorIn);
 
-    int nPhis = Qis.size();
+    int nPhis = m_phi_count.size();
     assert(nPhis > 0);
     //    prior.resize(nPhis);
     //    posterior.resize(nPhis);
@@ -162,10 +224,10 @@ void WhiteNoiseModel::HardcodedInitialDists(NoiseParams &priorIn, NoiseParams &p
     }
 }
 
-void WhiteNoiseModel::MakeQis(int dataLen) const
+void WhiteNoiseModel::MakePhiIndex(int dataLen) const
 {
-    if (!Qis.empty() && Qis[0].Nrows() == dataLen)
-        return; // Qis are already up-to-date
+    if ((int)m_phi_index.size() == dataLen)
+        return; // Index is already up-to-date
 
     // Read the pattern string into a vector pat
     const int patternLen = phiPattern.length();
@@ -193,40 +255,25 @@ void WhiteNoiseModel::MakeQis(int dataLen) const
             nPhis = n;
     }
 
-    // Extend pat to the the full data length by repeating
-    // FIXME ever heard of modular arithmetic :-)
-    // To be fair this is pretty harmless unless you have huge timeseries
-    while ((int)pat.size() < dataLen)
-        pat.push_back(pat.at(pat.size() - patternLen));
-
-    LOG << "WhiteNoiseMode::Pattern of phis used is " << pat << endl;
-
-    // Regenerate Qis. This is a vector of
-    // diagonal matrices, one for each parameter (Phi).
-    // Each matrix is the same size as the length of the data.
-    Qis.clear();
-    DiagonalMatrix zeroes(dataLen);
-    zeroes = 0.0;
-    Qis.resize(nPhis, zeroes); // initialize all to zero
-
-    // For each sample in the timeseries, find the
-    // appropriate parameter (phi) from the pattern
-    // and set the diagonal element in the Qi matrix
-    // to 1. So each Qi matrix has elements to define
-    // what samples it applies to
-    for (int d = 1; d <= dataLen; d++)
+    LOG << "WhiteNoiseModel::Pattern of phis used is " << pat << " repeated over " << dataLen
+        << " samples" << endl;
+
+    // For each sample in the timeseries, find the appropriate
+    // parameter (phi) from the pattern, repeated along the data
+    m_phi_index.resize(dataLen);
+    m_phi_count.assign(nPhis, 0);
+    for (int d = 0; d < dataLen; d++)
     {
-        //    Qis[pat[d-1]-1](d,d) = 1;
-        Qis.at(pat.at(d - 1) - 1)(d, d) = 1;
+        int phi = pat[d % patternLen] - 1;
+        m_phi_index[d] = phi;
+        m_phi_count[phi]++;
     }
 
     // Sanity checking - make sure every phi defined
     // in the pattern is used for at least one
-    // sample in the timeseries. Should be guaranteed
-    // by derivation above and previous check that pattern is
-    // not longer than the data.
-    for (int i = 1; i <= nPhis; i++)
-        if (Qis[i - 1].Trace() < 1.0) // this phi is never used
+    // sample in the timeseries.
+    for (int i = 0; i < nPhis; i++)
+        if (m_phi_count[i] == 0) // this phi is never used
             throw FabberInternalError("At least one Phi was unused! This is probably a bad thing.");
 }
 
@@ -239,30 +286,26 @@ void WhiteNoiseModel::UpdateNoise(NoiseParams &noise, const NoiseParams &noisePr
     const Matrix &J = linear.Jacobian();
     ColumnVector k = data - linear.Offset() + J * (linear.Centre() - theta.means);
 
-    // Check there are the same number of Qis in this model and in the
+    // Check there are the same number of phis in this model and in the
     // prior and posterior parameter sets.
-    MakeQis(data.Nrows());
-    const int nPhis = Qis.size();
+    MakePhiIndex(data.Nrows());
+    const int nPhis = m_phi_count.size();
     assert(nPhis == posterior.nPhis);
     assert(nPhis == prior.nPhis);
 
+    // This is calculating the 2nd and 3rd terms of RHS of Eq (22) in Chappel et al 2009
+    // for every phi
+    vector<double> sums(nPhis);
+    ResidualSums(m_phi_index, k, J, theta.GetCovariance(), sums);
+
     // Update each phi distribution in turn
     for (int i = 1; i <= nPhis; i++)
     {
-        // Each Phi matrix is a diagonal matrix of same size size as the
-        // number of time samples in the data
-        const DiagonalMatrix &Qi = Qis[i - 1];
-
-        // This is calculating the 2nd and 3rd terms of RHS of Eq (22) in Chappel et al 2009
-        double tmp = (k.t() * Qi * k).AsScalar() + (theta.GetCovariance() * J.t() * Qi * J).Trace();
-
         // This is Eq (22) in Chappel et al 2009
-        posterior.phis[i - 1].b = 1 / (tmp * 0.5 + 1 / prior.phis[i - 1].b);
+        posterior.phis[i - 1].b = 1 / (sums[i - 1] * 0.5 + 1 / prior.phis[i - 1].b);
 
         // Number of data sample points which use this parameter.
-        // Should be an integer
-        double nTimes = Qi.Trace();
-        assert(nTimes == int(nTimes));
+        int nTimes = m_phi_count[i - 1];
 
         // This is Eq (21) in Chappel et al 2009
         posterior.phis[i - 1].c = (nTimes - 1) * 0.5 + prior.phis[i - 1].c;
@@ -287,41 +330,42 @@ void WhiteNoiseModel::UpdateTheta(const NoiseParams &noiseIn, MVNDist &theta,
     const ColumnVector &gml = linear.Offset();
     const Matrix &J = linear.Jacobian();
 
-    // Make sure Qis are up-to-date
-    MakeQis(data.Nrows());
-    assert(Qis.size() == (unsigned)noise.nPhis);
+    // Make sure phi index is up-to-date
+    MakePhiIndex(data.Nrows());
+    assert(m_phi_count.size() == (unsigned)noise.nPhis);
 
-    // Marginalize over phi distributions
-    // Qis are diagonal matrices with 1 only where that phi applies.
-    // Adding up all the Qis will give you the identity matrix.
-    DiagonalMatrix X(data.Nrows());
-    X = 0;
-    for (unsigned i = 1; i <= Qis.size(); i++)
-        X += Qis[i - 1] * noise.phis[i - 1].CalcMean();
+    // Marginalize over phi distributions. X is the diagonal matrix
+    // containing the mean of the phi which applies to each sample
+    vector<double> phiMeans(noise.nPhis);
+    for (int i = 0; i < noise.nPhis; i++)
+        phiMeans[i] = noise.phis[i].CalcMean();
+    vector<double> X(data.Nrows());
+    for (int t = 0; t < data.Nrows(); t++)
+        X[t] = phiMeans[m_phi_index[t]];
 
     // Update Lambda (model precisions)
     //
-    // This is Eq (19) in Chappel et al (2009)
-    //
-    // use << instead of = because this is considered a lossy assignment
-    // (since NEWMAT isn't smart enough to know J'*X*J is always symmetric)
-
+    // This is Eq (19) in Chappel et al (2009). J'*X*(data - gml) is
+    // needed below and is calculated at the same time
     SymmetricMatrix Ltmp;
-    Ltmp << J.t() * X * J;
+    ColumnVector JtXr;
+    WeightedNormalEquations(J, X, data - gml, Ltmp, JtXr);
     theta.SetPrecisions(thetaPrior.GetPrecisions() + Ltmp);
 
-    // Error checking
-    LogAndSign chk = theta.GetPrecisions().LogDeterminant();
-    if (chk.Sign() <= 0)
+    // Error checking. The log determinant is cached in theta so the free energy
+    // calculation which follows does not need to repeat it
+    int sign;
+    double logdet = theta.GetLogDetPrecisions(&sign);
+    if (sign <= 0)
     {
         LOG << "WhiteNoiseModel:: In UpdateTheta, theta precisions aren't positive-definite: "
-            << chk.Sign() << ", " << chk.LogValue() << endl;
+            << sign << ", " << logdet << endl;
     }
 
     // Update m (model means)
     //
     // This is the first term of RHS of Eq (20) in Chappel et al (2009)
-    ColumnVector mTmp = J.t() * X * (data - gml + J * ml);
+    ColumnVector mTmp = JtXr + Ltmp * ml;
     if (LMalpha <= 0.0)
     {
         // Normal update (NB the LM update reduces to this when alpha=0 strictly)
@@ -341,7 +385,7 @@ void WhiteNoiseModel::UpdateTheta(const NoiseParams &noiseIn, MVNDist &theta,
         precdiag << prec;
 
         // a different (but equivalent) form for the LM update
-        Delta = J.t() * X * (data - gml) + thetaPrior.GetPrecisions() * thetaPrior.means
+        Delta = JtXr + thetaPrior.GetPrecisions() * thetaPrior.means
             - thetaPrior.GetPrecisions() * ml;
         try
         {
@@ -369,7 +413,8 @@ double WhiteNoiseModel::CalcFreeEnergy(const NoiseParams &noiseIn, const NoisePa
     const MVNDist &theta, const MVNDist &thetaPrior, const LinearFwdModel &linear,
     const ColumnVector &data) const
 {
-    const int nPhis = Qis.size();
+    MakePhiIndex(data.Nrows());
+    const int nPhis = m_phi_count.size();
     const WhiteParams &noise = dynamic_cast<const WhiteParams &>(noiseIn);
     const WhiteParams &noisePrior = dynamic_cast<const WhiteParams &>(noisePriorIn);
 
@@ -388,7 +433,7 @@ double WhiteNoiseModel::CalcFreeEnergy(const NoiseParams &noiseIn, const NoisePa
 
     // calcualte individual aprts of the free energy
     double expectedLogThetaDist = // bits arising from the factorised posterior for theta
-        +0.5 * theta.GetPrecisions().LogDeterminant().LogValue()
+        +0.5 * theta.GetLogDetPrecisions()
         - 0.5 * nTheta * (log(2 * M_PI) + 1);
 
     double expectedLogPhiDist = 0; // bits arising fromt he factorised posterior for phi
@@ -406,7 +451,7 @@ double WhiteNoiseModel::CalcFreeEnergy(const NoiseParams &noiseIn, const NoisePa
         expectedLogPhiDist += -gammaln(ci) - ci * log(si) - ci + (ci - 1) * (digamma(ci) + log(si));
 
         expectedLogPosteriorParts[0] += (digamma(ci) + log(si))
-            * ((Qis[i].Trace()) * 0.5 + ciPrior - 1); // nTimes using phi_{i+1} = Qis[i].Trace()
+            * (m_phi_count[i] * 0.5 + ciPrior - 1); // nTimes using phi_{i+1}
 
         expectedLogPosteriorParts[9]
             += -gammaln(ciPrior) - ciPrior * log(siPrior) - si * ci / siPrior;
@@ -414,10 +459,15 @@ double WhiteNoiseModel::CalcFreeEnergy(const NoiseParams &noiseIn, const NoisePa
 
     expectedLogPosteriorParts[1] = 0; //*NB not required
 
-    expectedLogPosteriorParts[2]
-        = -0.5 * (k.t() * k).AsScalar() - 0.5 * (J.t() * J * Linv).Trace(); //*NB remove Qsum
+    // k'*k + (J'*J*Linv).Trace() is the total over all phis of the sums used
+    // in UpdateNoise
+    vector<double> sums(nPhis);
+    ResidualSums(m_phi_index, k, J, Linv, sums);
+    expectedLogPosteriorParts[2] = 0; //*NB remove Qsum
+    for (int i = 0; i < nPhis; i++)
+        expectedLogPosteriorParts[2] -= 0.5 * sums[i];
 
-    expectedLogPosteriorParts[3] = +0.5 * thetaPrior.GetPrecisions().LogDeterminant().LogValue()
+    expectedLogPosteriorParts[3] = +0.5 * thetaPrior.GetLogDetPrecisions()
         - 0.5 * nTimes * log(2 * M_PI) - 0.5 * nTheta * log(2 * M_PI);
 
     expectedLogPosteriorParts[4] = -0.5
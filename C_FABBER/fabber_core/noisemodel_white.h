@@ -84,12 +84,15 @@ protected:
     double phiprior;
 
     /**
-     * Diagonal matrices, indicating which data points use each phi
+     * Index of the phi (starting at 0) which applies to each data point
      *
-     * Mutable because it's initialized lazily by MakeQis
+     * Mutable because it's initialized lazily by MakePhiIndex
      */
-    mutable std::vector<NEWMAT::DiagonalMatrix> Qis;
+    mutable std::vector<int> m_phi_index;
 
-    /** Create Qis vector */
-    void MakeQis(int dataLen) const;
+    /** Number of data points which use each phi */
+    mutable std::vector<int> m_phi_count;
+
+    /** Create phi index for data of the given length */
+    void MakePhiIndex(int dataLen) const;
 };
@@ -180,11 +180,103 @@ double ARDPrior::ApplyToMVN(MVNDist *prior, const RunContext &ctx)
     return -1.5 * (log(b) + digamma(0.5)) - 0.5 - gammaln(0.5) - 0.5 * log(b);
 }
 
-SpatialPrior::SpatialPrior(const Parameter &p, FabberRunData &rundata)
+SpatialPriorSums::SpatialPriorSums(int spatial_dims)
+    : m_spatial_dims(spatial_dims)
+    , m_ctx(NULL)
+    , m_it(-1)
+{
+}
+
+void SpatialPriorSums::AddParameter(unsigned int idx, char type_code)
+{
+    m_idx.push_back(idx);
+    m_type_code.push_back(type_code);
+    m_tmp1.push_back(0);
+    m_tmp2.push_back(0);
+    m_ctx = NULL;
+}
+
+void SpatialPriorSums::GetSums(const RunContext &ctx, unsigned int idx, double &tmp1, double &tmp2)
+{
+    if ((m_ctx != &ctx) || (m_it != ctx.it))
+    {
+        Calculate(ctx);
+        m_ctx = &ctx;
+        m_it = ctx.it;
+    }
+
+    for (unsigned int p = 0; p < m_idx.size(); p++)
+    {
+        if (m_idx[p] == idx)
+        {
+            tmp1 = m_tmp1[p];
+            tmp2 = m_tmp2[p];
+            return;
+        }
+    }
+    throw FabberInternalError("SpatialPriorSums: No sums for parameter " + stringify(idx));
+}
+
+void SpatialPriorSums::Calculate(const RunContext &ctx)
+{
+    // The following calculates Tr[Sigmak*S'*S]
+    const unsigned int nparams = m_idx.size();
+    m_tmp1.assign(nparams, 0);
+    m_tmp2.assign(nparams, 0);
+    vector<double> wk(nparams), Swk(nparams);
+    for (int v = 1; v <= ctx.nvoxels; v++)
+    {
+        const MVNDist &post = ctx.fwd_post[v - 1];
+        const SymmetricMatrix &cov = post.GetCovariance();
+        int nn = ctx.neighbours.Count(v);
+        for (unsigned int p = 0; p < nparams; p++)
+        {
+            double sigmak = cov(m_idx[p] + 1, m_idx[p] + 1);
+            char type_code = m_type_code[p];
+            if (type_code == PRIOR_SPATIAL_m) // useMRF)
+                m_tmp1[p] += sigmak * m_spatial_dims * 2;
+            else if (type_code == PRIOR_SPATIAL_M) // useMRF2)
+                m_tmp1[p] += sigmak * (nn + 1e-8);
+            else if (type_code == PRIOR_SPATIAL_p)
+                m_tmp1[p] += sigmak * (4 * m_spatial_dims * m_spatial_dims + nn);
+            else // P
+                m_tmp1[p] += sigmak * (nn * nn + nn);
+
+            wk[p] = post.means(m_idx[p] + 1);
+            Swk[p] = 0.0;
+        }
+
+        // Visit each neighbour once for all parameters
+        for (const int *v2It = ctx.neighbours.Begin(v); v2It != ctx.neighbours.End(v); ++v2It)
+        {
+            const ColumnVector &means = ctx.fwd_post[*v2It - 1].means;
+            for (unsigned int p = 0; p < nparams; p++)
+            {
+                Swk[p] += wk[p] - means(m_idx[p] + 1);
+            }
+        }
+
+        for (unsigned int p = 0; p < nparams; p++)
+        {
+            char type_code = m_type_code[p];
+            if (type_code == PRIOR_SPATIAL_p || type_code == PRIOR_SPATIAL_m)
+                Swk[p] += wk[p] * (m_spatial_dims * 2 - nn);
+
+            if (type_code == PRIOR_SPATIAL_m || type_code == PRIOR_SPATIAL_M)
+                m_tmp2[p] += Swk[p] * wk[p];
+            else
+                m_tmp2[p] += Swk[p] * Swk[p];
+        }
+    }
+}
+
+SpatialPrior::SpatialPrior(
+    const Parameter &p, FabberRunData &rundata, boost::shared_ptr<SpatialPriorSums> sums)
     : DefaultPrior(p)
     , m_akmean(1e-8)
     , m_spatial_dims(3)
     , m_spatial_speed(-1)
+    , m_sums(sums)
 {
     m_log = rundata.GetLogger();
     m_spatial_dims = rundata.GetIntDefault("spatial-dims", 3);
@@ -206,41 +298,17 @@ SpatialPrior::SpatialPrior(const Parameter &p, FabberRunData &rundata)
 
     // FIXME still needed?
     m_update_first_iter = rundata.GetBool("update-spatial-prior-on-first-iteration");
+
+    if (!m_sums)
+        m_sums.reset(new SpatialPriorSums(m_spatial_dims));
+    m_sums->AddParameter(m_idx, m_type_code);
 }
 
 double SpatialPrior::CalculateAkmean(const RunContext &ctx)
 {
-    // The following calculates Tr[Sigmak*S'*S]
-    double tmp1 = 0.0;
-    double tmp2 = 0.0;
-    for (int v = 1; v <= ctx.nvoxels; v++)
-    {
-        double sigmak = ctx.fwd_post.at(v - 1).GetCovariance()(m_idx + 1, m_idx + 1);
-        int nn = ctx.neighbours.at(v - 1).size();
-        if (m_type_code == PRIOR_SPATIAL_m) // useMRF)
-            tmp1 += sigmak * m_spatial_dims * 2;
-        else if (m_type_code == PRIOR_SPATIAL_M) // useMRF2)
-            tmp1 += sigmak * (nn + 1e-8);
-        else if (m_type_code == PRIOR_SPATIAL_p)
-            tmp1 += sigmak * (4 * m_spatial_dims * m_spatial_dims + nn);
-        else // P
-            tmp1 += sigmak * (nn * nn + nn);
-
-        double wk = ctx.fwd_post.at(v - 1).means(m_idx + 1);
-        double Swk = 0.0;
-        for (vector<int>::const_iterator v2It = ctx.neighbours[v - 1].begin();
-             v2It != ctx.neighbours.at(v - 1).end(); ++v2It)
-        {
-            Swk += wk - ctx.fwd_post.at(*v2It - 1).means(m_idx + 1);
-        }
-        if (m_type_code == PRIOR_SPATIAL_p || m_type_code == PRIOR_SPATIAL_m)
-            Swk += wk * (m_spatial_dims * 2 - ctx.neighbours.at(v - 1).size());
-
-        if (m_type_code == PRIOR_SPATIAL_m || m_type_code == PRIOR_SPATIAL_M)
-            tmp2 += Swk * wk;
-        else
-            tmp2 += Swk * Swk;
-    }
+    // Tr[Sigmak*S'*S] and smoothness term, shared with other spatial priors
+    double tmp1, tmp2;
+    m_sums->GetSums(ctx, m_idx, tmp1, tmp2);
 
     LOG << "SpatialPrior::UpdateAkmean " << m_idx << ": tmp1=" << tmp1 << ", tmp2=" << tmp2 << endl;
 
@@ -287,8 +355,8 @@ double SpatialPrior::ApplyToMVN(MVNDist *prior, const RunContext &ctx)
 
     double weight8 = 0; // weighted +8
     double contrib8 = 0.0;
-    for (vector<int>::const_iterator nidIt = ctx.neighbours[ctx.v - 1].begin();
-         nidIt != ctx.neighbours[ctx.v - 1].end(); ++nidIt)
+    for (const int *nidIt = ctx.neighbours.Begin(ctx.v); nidIt != ctx.neighbours.End(ctx.v);
+         ++nidIt)
     {
         int nid = *nidIt;
         const MVNDist &neighbourPost = ctx.fwd_post[nid - 1];
@@ -298,8 +366,8 @@ double SpatialPrior::ApplyToMVN(MVNDist *prior, const RunContext &ctx)
 
     double weight12 = 0; // weighted -1, may be duplicated
     double contrib12 = 0.0;
-    for (vector<int>::const_iterator nidIt = ctx.neighbours2[ctx.v - 1].begin();
-         nidIt != ctx.neighbours2[ctx.v - 1].end(); ++nidIt)
+    for (const int *nidIt = ctx.neighbours2.Begin(ctx.v); nidIt != ctx.neighbours2.End(ctx.v);
+         ++nidIt)
     {
         int nid = *nidIt;
         const MVNDist &neighbourPost = ctx.fwd_post[nid - 1];
@@ -307,7 +375,7 @@ double SpatialPrior::ApplyToMVN(MVNDist *prior, const RunContext &ctx)
         weight12 += -1;
     }
 
-    int nn = ctx.neighbours[ctx.v - 1].size();
+    int nn = ctx.neighbours.Count(ctx.v);
 
     if (m_type_code == PRIOR_SPATIAL_p)
     {
@@ -384,6 +452,9 @@ double SpatialPrior::ApplyToMVN(MVNDist *prior, const RunContext &ctx)
 
 std::vector<Prior *> PriorFactory::CreatePriors(const std::vector<Parameter> &params)
 {
+    // Spatial priors created together calculate their sums in a single pass
+    m_spatial_sums.reset();
+
     vector<Prior *> priors;
     for (size_t i = 0; i < params.size(); i++)
     {
@@ -414,7 +485,12 @@ Prior *PriorFactory::CreatePrior(Parameter p)
     case PRIOR_SPATIAL_m:
     case PRIOR_SPATIAL_P:
     case PRIOR_SPATIAL_p:
-        return new SpatialPrior(p, m_rundata);
+        if (!m_spatial_sums)
+        {
+            m_spatial_sums.reset(
+                new SpatialPriorSums(m_rundata.GetIntDefault("spatial-dims", 3)));
+        }
+        return new SpatialPrior(p, m_rundata, m_spatial_sums);
     case PRIOR_ARD:
         return new ARDPrior(p, m_rundata);
     default:
@@ -13,6 +13,8 @@
 
 #include <newmat.h>
 
+#include <boost/shared_ptr.hpp>
+
 #include <ostream>
 #include <string>
 #include <vector>
@@ -110,6 +112,49 @@ public:
     virtual double ApplyToMVN(MVNDist *prior, const RunContext &ctx);
 };
 
+/**
+ * Sums over voxels used to update the spatial precision of spatial priors
+ *
+ * For each parameter with a spatial prior this holds Tr[Sigmak*S'*S] and
+ * the smoothness term for the current posterior. The sums for all parameters
+ * are calculated in a single pass over the voxels and their neighbours, and
+ * only once per iteration however many spatial priors use them.
+ */
+class SpatialPriorSums
+{
+public:
+    SpatialPriorSums(int spatial_dims);
+
+    /**
+     * Add a parameter to calculate the sums for
+     *
+     * @param idx Parameter index, starting at 0
+     * @param type_code Spatial prior type
+     */
+    void AddParameter(unsigned int idx, char type_code);
+
+    /**
+     * Get the sums for a parameter, recalculating them for all parameters
+     * if this is the first request in the current iteration
+     */
+    void GetSums(const RunContext &ctx, unsigned int idx, double &tmp1, double &tmp2);
+
+private:
+    void Calculate(const RunContext &ctx);
+
+    int m_spatial_dims;
+
+    /** Parameter index and prior type for each set of sums */
+    std::vector<unsigned int> m_idx;
+    std::vector<char> m_type_code;
+
+    /** Run context and iteration the sums were last calculated for */
+    const RunContext *m_ctx;
+    int m_it;
+
+    std::vector<double> m_tmp1, m_tmp2;
+};
+
 /**
  * Prior which uses spatial information to inform the prior
  *
@@ -119,7 +164,12 @@ public:
 class SpatialPrior : public DefaultPrior
 {
 public:
-    SpatialPrior(const Parameter &param, FabberRunData &rundata);
+    /**
+     * @param sums Sums shared with the other spatial priors in the run. If not
+     *             given the prior calculates its own
+     */
+    SpatialPrior(const Parameter &param, FabberRunData &rundata,
+        boost::shared_ptr<SpatialPriorSums> sums = boost::shared_ptr<SpatialPriorSums>());
 
     virtual void DumpInfo(std::ostream &out) const;
     virtual double ApplyToMVN(MVNDist *prior, const RunContext &ctx);
@@ -130,6 +180,7 @@ protected:
     int m_spatial_dims;
     double m_spatial_speed;
     bool m_update_first_iter;
+    boost::shared_ptr<SpatialPriorSums> m_sums;
 };
 
 /**
@@ -146,6 +197,9 @@ public:
 private:
     FabberRunData &m_rundata;
 
+    /** Sums shared by the spatial priors created by CreatePriors */
+    boost::shared_ptr<SpatialPriorSums> m_spatial_sums;
+
     /** Create a prior for a parameter */
     Prior *CreatePrior(Parameter p);
 };
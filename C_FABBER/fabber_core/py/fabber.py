@@ -871,6 +871,39 @@ class FabberLib(Fabber):
 
         return ret
 
+    def model_evaluate_batch(self, rundata, params, nt, indata=None, coords=None, nthreads=0):
+        """
+        Evaluate the model for many parameter sets in one call
+
+        :param params: Dictionary of parameter name to sequence of values, one for each sample
+        :param nt: Number of timepoints to evaluate for each sample
+        :param indata: Optional array of voxel data, shape [nsamples, nt]
+        :param coords: Optional array of voxel co-ordinates, shape [nsamples, 3]
+        :param nthreads: Number of threads to use, 0 for one per processor
+        :return: Array of shape [nsamples, nt]. Samples where the model failed contain NaN
+        """
+        self._init_clib()
+        for key, value in rundata.items():
+            self._trycall(self.clib.fabber_set_opt, self.handle, str(key), str(value), self.errbuf)
+
+        self._trycall(self.clib.fabber_get_model_params, self.handle, len(self.outbuf), self.outbuf, self.errbuf)
+        model_params = self.outbuf.value.splitlines()
+        for p in model_params:
+            if p not in params:
+                raise FabberException("Model parameter %s not specified" % p)
+        plist = np.ascontiguousarray(np.column_stack([np.atleast_1d(params[p]) for p in model_params]), dtype=np.float32)
+        nsamples = plist.shape[0]
+
+        ret = np.zeros([nsamples, nt], dtype=np.float32)
+        if indata is not None:
+            indata = np.ascontiguousarray(indata, dtype=np.float32).reshape([nsamples, nt])
+        if coords is not None:
+            coords = np.ascontiguousarray(coords, dtype=np.float32).reshape([nsamples, 3])
+        self._trycall(self.clib.fabber_model_evaluate_batch, self.handle, nsamples, len(model_params), plist.ravel(),
+                      nt, None if indata is None else indata.ctypes.data, None if coords is None else coords.ctypes.data,
+                      ret.ravel(), nthreads, self.errbuf)
+        return ret
+
     def run(self, rundata, progress_cb=None):
         """
         Run fabber on the provided rundata options
@@ -945,13 +978,24 @@ class FabberLib(Fabber):
 
         retdata, log = {}, ""
         self._trycall(self.clib.fabber_set_extent, self.handle, s[0], s[1], s[2], mask, self.errbuf)
+
+        # Input arrays are passed by reference, so they must be kept until the run is finished
+        inputs = []
         for key, item in data.items():
             if len(item.shape) == 3:
                 size = 1
             else:
                 size = item.shape[3]
-            item = np.ascontiguousarray(item.flatten(order='F'), dtype=np.float32)
-            self._trycall(self.clib.fabber_set_data, self.handle, key, size, item, self.errbuf)
+            item = np.asarray(item, dtype=np.float32)
+            inputs.append(item)
+            self._trycall(self.clib.fabber_set_data_ref, self.handle, key, size, item.ctypes.data, self._strides(item), self.errbuf)
+
+        # Outputs with one value per voxel are written straight into the returned arrays
+        for key in output_items:
+            if key.startswith("mean_") or key.startswith("std_") or key.startswith("zstat_") or key == "freeEnergy":
+                arr = np.zeros(s[:3], dtype=np.float32)
+                retdata[key] = arr
+                self._trycall(self.clib.fabber_set_output_buffer, self.handle, key, 1, arr.ctypes.data, self._strides(arr), self.errbuf)
 
         progress_cb_func = self.progress_cb_type(0)
         if progress_cb is not None:
@@ -960,7 +1004,10 @@ class FabberLib(Fabber):
         self._trycall(self.clib.fabber_dorun, self.handle, len(self.outbuf), self.outbuf, self.errbuf, progress_cb_func)
         log = self.outbuf.value
         for key in output_items:
+            # Fails for output buffers which the run never wrote to
             size = self._trycall(self.clib.fabber_get_data_size, self.handle, key, self.errbuf)
+            if key in retdata:
+                continue
 
             arr = np.ascontiguousarray(np.empty(nv * size, dtype=np.float32))
             self._trycall(self.clib.fabber_get_data, self.handle, key, arr, self.errbuf)
@@ -1001,6 +1048,8 @@ class FabberLib(Fabber):
             self.clib.fabber_set_extent.argtypes = [c_void_p, c_uint, c_uint, c_uint, c_int_arr, c_char_p]
             self.clib.fabber_set_opt.argtypes = [c_void_p, c_char_p, c_char_p, c_char_p]
             self.clib.fabber_set_data.argtypes = [c_void_p, c_char_p, c_uint, c_float_arr, c_char_p]
+            self.clib.fabber_set_data_ref.argtypes = [c_void_p, c_char_p, c_uint, c_void_p, POINTER(c_long), c_char_p]
+            self.clib.fabber_set_output_buffer.argtypes = [c_void_p, c_char_p, c_uint, c_void_p, POINTER(c_long), c_char_p]
             self.clib.fabber_get_data_size.argtypes = [c_void_p, c_char_p, c_char_p]
             self.clib.fabber_get_data.argtypes = [c_void_p, c_char_p, c_float_arr, c_char_p]
             self.clib.fabber_dorun.argtypes = [c_void_p, c_uint, c_char_p, c_char_p, self.progress_cb_type]
@@ -1013,6 +1062,7 @@ class FabberLib(Fabber):
             self.clib.fabber_get_model_params.argtypes = [c_void_p, c_uint, c_char_p, c_char_p]
             self.clib.fabber_get_model_outputs.argtypes = [c_void_p, c_uint, c_char_p, c_char_p]
             self.clib.fabber_model_evaluate.argtypes = [c_void_p, c_uint, c_float_arr, c_uint, c_float_arr, c_float_arr, c_char_p]
+            self.clib.fabber_model_evaluate_batch.argtypes = [c_void_p, c_uint, c_uint, c_float_arr, c_uint, c_void_p, c_void_p, c_float_arr, c_int, c_char_p]
         except Exception, e:
             raise FabberException("Error initializing Fabber library: %s" % str(e))
 
@@ -1023,6 +1073,13 @@ class FabberLib(Fabber):
         for lib in self.model_libs:
             self._trycall(self.clib.fabber_load_models, self.handle, lib, self.errbuf)
 
+    def _strides(self, arr):
+        """ Strides of a 3D or 4D float array in elements, as used by the C API """
+        strides = [st // arr.itemsize for st in arr.strides]
+        if len(strides) == 3:
+            strides.append(0)
+        return (c_long * 4)(*strides)
+
     def _trycall(self, call, *args):
         ret = call(*args)
         if ret < 0:
@@ -9,6 +9,7 @@
 
 #include "dist_mvn.h"
 #include "fwdmodel_linear.h"
+#include "neighbours.h"
 #include "noisemodel.h"
 
 #include <vector>
@@ -42,6 +43,6 @@ struct RunContext
     std::vector<MVNDist> fwd_post;
     std::vector<NoiseParams *> noise_prior;
     std::vector<NoiseParams *> noise_post;
-    std::vector<std::vector<int> > neighbours;
-    std::vector<std::vector<int> > neighbours2;
+    NeighbourGraph neighbours;
+    NeighbourGraph neighbours2;
 };
\ No newline at end of file
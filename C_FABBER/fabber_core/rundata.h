@@ -9,6 +9,7 @@
 #pragma once
 
 #include "easylog.h"
+#include "neighbours.h"
 
 #include <newmat.h>
 
@@ -106,6 +107,27 @@ public:
     virtual void Progress(int voxel, int nVoxels)
     {
     }
+
+    /**
+     * Report the state of the fit
+     *
+     * @param iteration Number of iterations done, for the voxel just fitted
+     *                  (voxelwise methods) or for the whole volume (spatial VB)
+     * @param mean_F Mean free energy of the voxels fitted so far, or 0 if the
+     *               free energy is not being calculated
+     */
+    virtual void Iteration(int iteration, double mean_F)
+    {
+    }
+
+    /**
+     * @return true if the run should stop early. Inference methods which support
+     *         this stop between voxels or iterations and save the results so far
+     */
+    virtual bool Cancelled()
+    {
+        return false;
+    }
 };
 
 /**
@@ -215,6 +237,13 @@ public:
      */
     void ParseParamFile(const std::string &file);
 
+    /**
+     * Parse options in .fab file format from a stream
+     *
+     * @see ParseParamFile
+     */
+    void ParseParams(std::istream &is);
+
     /**
      * Set string option.
      *
@@ -356,6 +385,27 @@ public:
     std::vector<double> GetDoubleList(
         const std::string &prefix, double min = -DBL_MAX, double max = DBL_MAX);
 
+    /**
+     * Get a numeric vector option, e.g. a list of echo times
+     *
+     * The vector may be given in any of the following ways:
+     *
+     *  - As a list of indexed options, e.g. tau1=0.01, tau2=0.02, etc
+     *  - As a single option containing comma-separated values, e.g. tau=0.01,0.02,0.03
+     *  - As a single option naming a VEST or ASCII matrix file containing the values
+     *
+     * A single option which is just a number returns a vector of length 1. The
+     * returned vector is sized once, so this is O(N) in the number of values.
+     *
+     * @param prefix Option name, or prefix before the index number
+     * @param min Minimum allowed value
+     * @param max maximum allowed value
+     * @return Vector of values, which will be empty if the option is not specified
+     * @throw if option specified, but contains an invalid number or file
+     */
+    NEWMAT::ColumnVector GetColumnVector(
+        const std::string &prefix, double min = -DBL_MAX, double max = DBL_MAX);
+
     /**
      * Get the output directory for this run.
      *
@@ -445,7 +495,7 @@ public:
      * @return The number of data values, e.g. 1 for a simple image, or for a time
      *         series the number of time slices, etc.
      */
-    int GetVoxelDataSize(const std::string &key);
+    virtual int GetVoxelDataSize(const std::string &key);
 
     /**
      * Get the main voxel data
@@ -538,7 +588,7 @@ public:
      *
      * The list will contain voxel indices for matrices, i.e. starting at 1 not 0
      */
-    std::vector<std::vector<int> > &GetNeighbours(int n_dims = 3);
+    const NeighbourGraph &GetNeighbours(int n_dims = 3);
 
     /**
       * Get list of second nearest neighbours for each voxel
@@ -551,7 +601,7 @@ public:
       *
       * The list will contain voxel indices for matrices, i.e. starting at 1 not 0
       */
-    std::vector<std::vector<int> > &GetSecondNeighbours(int n_dims = 3);
+    const NeighbourGraph &GetSecondNeighbours(int n_dims = 3);
 
     /**
      * Report progress
@@ -569,6 +619,28 @@ public:
             m_progress->Progress(voxel, nVoxels);
     }
 
+    /**
+     * Report the iteration reached and the current free energy
+     *
+     * @see ProgressCheck::Iteration
+     */
+    void Iteration(int iteration, double mean_F)
+    {
+        if (m_progress)
+            m_progress->Iteration(iteration, mean_F);
+    }
+
+    /**
+     * Check whether the user has asked for the run to stop
+     *
+     * InferenceMethods which can stop early should check this between voxels
+     * or iterations and, if it returns true, finish with the results so far.
+     */
+    bool Cancelled() const
+    {
+        return m_progress && m_progress->Cancelled();
+    }
+
     /**
      * Send list of all parameters to the logfile
      */
@@ -629,10 +701,10 @@ protected:
     std::map<std::string, std::string> m_params;
 
     /** Nearest neighbour lists, calculated lazily in GetNeighbours() */
-    std::vector<std::vector<int> > m_neighbours;
+    NeighbourGraph m_neighbours;
 
     /** Second nearest neighbour lists, calculated lazily in GetSecondNeighbours() */
-    std::vector<std::vector<int> > m_neighbours2;
+    NeighbourGraph m_neighbours2;
 
     std::string m_outdir;
 
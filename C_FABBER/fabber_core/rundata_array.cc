@@ -14,6 +14,7 @@
 
 #include "newmat.h"
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -32,11 +33,11 @@ void FabberRunDataArray::SetExtent(int nx, int ny, int nz, const int *mask)
     int nv = nx * ny * nz;
     if (mask)
     {
-        m_mask.insert(m_mask.end(), mask, mask + nv);
+        m_mask.assign(mask, mask + nv);
     }
     else
     {
-        m_mask.resize(nv, 1);
+        m_mask.assign(nv, 1);
     }
 
     int *maskPtr = &m_mask[0];
@@ -65,69 +66,196 @@ void FabberRunDataArray::SetExtent(int nx, int ny, int nz, const int *mask)
     SetVoxelCoords(coords);
 }
 
-void FabberRunDataArray::GetVoxelDataArray(string key, float *data)
+FabberRunDataArray::ArrayRef FabberRunDataArray::MakeRef(int data_size, const long *strides)
 {
-    assert(data);
-    Matrix mdata = FabberRunData::GetVoxelData(key);
-    int nt = mdata.Nrows();
-    float *dataPtr = data;
+    if (m_extent.size() != 3)
+    {
+        throw FabberRunDataError("Extent must be set before voxel data");
+    }
 
-    for (int t = 0; t < nt; t++)
+    ArrayRef ref;
+    ref.data_size = data_size;
+    ref.in = NULL;
+    ref.out = NULL;
+    ref.written = false;
+    if (strides)
     {
-        int v = 0;
-        const int *maskPtr = &m_mask[0];
-        for (int z = 0; z < m_extent[2]; z++)
+        for (int d = 0; d < 4; d++)
         {
-            for (int y = 0; y < m_extent[1]; y++)
-            {
-                for (int x = 0; x < m_extent[0]; x++)
-                {
-                    bool masked = (*maskPtr == 0);
-                    if (!masked)
-                        *dataPtr = mdata(t + 1, v + 1);
-                    else
-                        *dataPtr = 0;
-                    ++dataPtr;
-                    ++maskPtr;
-                    if (!masked)
-                        ++v;
-                }
-            }
+            ref.strides[d] = strides[d];
         }
     }
+    else
+    {
+        ref.strides[0] = 1;
+        ref.strides[1] = m_extent[0];
+        ref.strides[2] = long(m_extent[0]) * m_extent[1];
+        ref.strides[3] = long(m_extent[0]) * m_extent[1] * m_extent[2];
+    }
+    return ref;
 }
 
-void FabberRunDataArray::SetVoxelDataArray(string key, int data_size, const float *data)
+void FabberRunDataArray::ReadArray(const ArrayRef &ref, Matrix &data)
 {
-    assert(data);
-    const float *dataPtr = data;
-    int num_voxels = m_extent[0] * m_extent[1] * m_extent[2];
-    Matrix matrixData(data_size, num_voxels);
+    const Matrix &coords = GetVoxelCoords();
+    int nv = coords.Ncols();
+    data.ReSize(ref.data_size, nv);
+    if ((nv == 0) || (ref.data_size == 0))
+        return;
 
-    int v = 0;
-    for (int t = 0; t < data_size; t++)
+    // Each voxel's series is read in one go from the array. The matrix is
+    // stored by rows, so successive values for a voxel are nv apart
+    double *store = data.Store();
+    for (int v = 0; v < nv; v++)
+    {
+        const float *in = ref.in + long(coords(1, v + 1)) * ref.strides[0]
+            + long(coords(2, v + 1)) * ref.strides[1] + long(coords(3, v + 1)) * ref.strides[2];
+        double *out = store + v;
+        for (int t = 0; t < ref.data_size; t++)
+        {
+            *out = *in;
+            in += ref.strides[3];
+            out += nv;
+        }
+    }
+}
+
+void FabberRunDataArray::WriteArray(const Matrix &data, const ArrayRef &ref)
+{
+    // Voxels outside the mask are zero
+    for (int t = 0; t < ref.data_size; t++)
     {
-        v = 0;
-        const int *maskPtr = &m_mask[0];
         for (int z = 0; z < m_extent[2]; z++)
         {
             for (int y = 0; y < m_extent[1]; y++)
             {
+                float *out = ref.out + t * ref.strides[3] + z * ref.strides[2] + y * ref.strides[1];
                 for (int x = 0; x < m_extent[0]; x++)
                 {
-                    bool masked = (*maskPtr == 0);
-                    if (!masked)
-                    {
-                        matrixData(t + 1, v + 1) = *dataPtr;
-                    }
-                    ++dataPtr;
-                    ++maskPtr;
-                    if (!masked)
-                        ++v;
+                    *out = 0;
+                    out += ref.strides[0];
                 }
             }
         }
     }
-    matrixData = matrixData.Columns(1, v);
-    FabberRunData::SetVoxelData(key, matrixData);
+
+    const Matrix &coords = GetVoxelCoords();
+    int nv = coords.Ncols();
+    if ((nv == 0) || (ref.data_size == 0))
+        return;
+
+    const double *store = data.Store();
+    for (int v = 0; v < nv; v++)
+    {
+        float *out = ref.out + long(coords(1, v + 1)) * ref.strides[0]
+            + long(coords(2, v + 1)) * ref.strides[1] + long(coords(3, v + 1)) * ref.strides[2];
+        const double *in = store + v;
+        for (int t = 0; t < ref.data_size; t++)
+        {
+            *out = *in;
+            out += ref.strides[3];
+            in += nv;
+        }
+    }
+}
+
+void FabberRunDataArray::GetVoxelDataArray(string key, float *data, const long *strides)
+{
+    assert(data);
+    const Matrix &mdata = FabberRunData::GetVoxelData(key);
+    ArrayRef ref = MakeRef(mdata.Nrows(), strides);
+    ref.out = data;
+    WriteArray(mdata, ref);
+}
+
+void FabberRunDataArray::SetVoxelDataArray(
+    string key, int data_size, const float *data, const long *strides)
+{
+    assert(data);
+    ArrayRef ref = MakeRef(data_size, strides);
+    ref.in = data;
+    m_input_refs.erase(key);
+    ReadArray(ref, m_voxel_data[key]);
+}
+
+void FabberRunDataArray::SetVoxelDataRef(
+    string key, int data_size, const float *data, const long *strides)
+{
+    assert(data);
+    ArrayRef ref = MakeRef(data_size, strides);
+    ref.in = data;
+    m_input_refs[key] = ref;
+    m_voxel_data.erase(key);
+}
+
+void FabberRunDataArray::SetOutputArray(
+    string key, int data_size, float *data, const long *strides)
+{
+    assert(data);
+    ArrayRef ref = MakeRef(data_size, strides);
+    ref.out = data;
+    m_output_refs[key] = ref;
+}
+
+const Matrix &FabberRunDataArray::LoadVoxelData(const string &key)
+{
+    map<string, ArrayRef>::iterator ref = m_input_refs.find(key);
+    if ((ref != m_input_refs.end()) && (m_voxel_data.count(key) == 0))
+    {
+        ReadArray(ref->second, m_voxel_data[key]);
+    }
+    return FabberRunData::LoadVoxelData(key);
+}
+
+void FabberRunDataArray::SaveVoxelData(
+    const string &filename, Matrix &data, VoxelDataType data_type)
+{
+    map<string, ArrayRef>::iterator ref = m_output_refs.find(filename);
+    if (ref == m_output_refs.end())
+    {
+        FabberRunData::SaveVoxelData(filename, data, data_type);
+        return;
+    }
+
+    LOG << "FabberRunDataArray::Saving to output array: " << filename << endl;
+    if (data.Nrows() != ref->second.data_size)
+    {
+        throw InvalidOptionValue("Output array " + filename, stringify(ref->second.data_size),
+            "Output has " + stringify(data.Nrows()) + " values per voxel");
+    }
+    if (data.Ncols() != GetVoxelCoords().Ncols())
+    {
+        throw FabberInternalError("Output " + filename + " has incorrect number of voxels");
+    }
+    WriteArray(data, ref->second);
+    ref->second.written = true;
+}
+
+int FabberRunDataArray::GetVoxelDataSize(const string &key)
+{
+    map<string, ArrayRef>::iterator ref = m_output_refs.find(key);
+    if (ref == m_output_refs.end())
+    {
+        return FabberRunData::GetVoxelDataSize(key);
+    }
+    else if (!ref->second.written)
+    {
+        throw DataNotFound(key, "Output array has not been written");
+    }
+    return ref->second.data_size;
+}
+
+void FabberRunDataArray::ClearVoxelData(string key)
+{
+    FabberRunData::ClearVoxelData(key);
+    if (key != "")
+    {
+        m_input_refs.erase(key);
+        m_output_refs.erase(key);
+    }
+    else
+    {
+        m_input_refs.clear();
+        m_output_refs.clear();
+    }
 }
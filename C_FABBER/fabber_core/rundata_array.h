@@ -11,12 +11,21 @@
 
 #include "rundata.h"
 
+#include <newmat.h>
+
+#include <map>
 #include <string>
 #include <vector>
 
 /**
  * Extends FabberRunData to allow setting and returning
  * data as plain C float arrays
+ *
+ * Arrays are 4D with one value for each grid position, i.e. masked out
+ * voxels are included. Array positions are given by strides, which are the
+ * number of floats between successive elements in the x, y, z and 4th
+ * dimensions. If strides are not given, column-major order is used, i.e.
+ * x varies fastest.
  */
 class FabberRunDataArray : public FabberRunData
 {
@@ -27,9 +36,60 @@ public:
     }
 
     void SetExtent(int nx, int ny, int nz, const int *mask);
-    void GetVoxelDataArray(std::string key, float *data);
-    void SetVoxelDataArray(std::string key, int data_size, const float *data);
+    void GetVoxelDataArray(std::string key, float *data, const long *strides = NULL);
+    void SetVoxelDataArray(
+        std::string key, int data_size, const float *data, const long *strides = NULL);
+
+    /**
+     * Use a caller owned array for voxel data without copying it
+     *
+     * The array is read once, directly into the masked voxel data, when the
+     * data is first needed. It must remain valid until then.
+     */
+    void SetVoxelDataRef(
+        std::string key, int data_size, const float *data, const long *strides = NULL);
+
+    /**
+     * Write voxel data saved with this key directly into a caller owned array
+     *
+     * The data is not kept, so cannot be retrieved with GetVoxelData. Masked
+     * out voxels are set to zero. The array must remain valid until the data
+     * is saved, i.e. the end of the run.
+     */
+    void SetOutputArray(std::string key, int data_size, float *data, const long *strides = NULL);
+
+    /**
+     * For an output array, the data size is only returned once data has been
+     * saved to it since SetOutputArray was called, otherwise DataNotFound is
+     * thrown as for any other missing data
+     */
+    int GetVoxelDataSize(const std::string &key);
+
+    const NEWMAT::Matrix &LoadVoxelData(const std::string &key);
+    virtual void SaveVoxelData(
+        const std::string &filename, NEWMAT::Matrix &data, VoxelDataType data_type = VDT_SCALAR);
+
+    /** Also stops using any caller owned arrays set for the key */
+    virtual void ClearVoxelData(std::string key = "");
 
 private:
+    /** Caller owned array */
+    struct ArrayRef
+    {
+        int data_size;
+        const float *in;
+        float *out;
+        long strides[4];
+
+        /** For an output array, whether data has been saved to it */
+        bool written;
+    };
+
+    ArrayRef MakeRef(int data_size, const long *strides);
+    void ReadArray(const ArrayRef &ref, NEWMAT::Matrix &data);
+    void WriteArray(const NEWMAT::Matrix &data, const ArrayRef &ref);
+
     std::vector<int> m_mask;
-};
\ No newline at end of file
+    std::map<std::string, ArrayRef> m_input_refs;
+    std::map<std::string, ArrayRef> m_output_refs;
+};
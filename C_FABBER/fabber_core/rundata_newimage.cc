@@ -16,8 +16,11 @@
 #include <newimage/newimageio.h>
 #include <newmat.h>
 
+#include <algorithm>
+#include <map>
 #include <ostream>
 #include <string>
+#include <sys/stat.h>
 #include <vector>
 
 using namespace std;
@@ -45,13 +48,120 @@ static void DumpVolumeInfo(const volume<float> &info, ostream &out)
         << ", " << info.intent_param(2) << ", " << info.intent_param(3) << endl;
 }
 
+static boost::shared_ptr<const volume4D<float> > ReadImageFile(const string &filename)
+{
+    if (!fsl_imageexists(filename))
+    {
+        throw DataNotFound(filename, "File is invalid or does not exist");
+    }
+
+    boost::shared_ptr<volume4D<float> > vol(new volume4D<float>());
+    try
+    {
+        read_volume4D(*vol, filename);
+    }
+    catch (...)
+    {
+        throw DataNotFound(filename, "Error loading file");
+    }
+    return vol;
+}
+
+/**
+ * Get the modification time and size of an image file
+ *
+ * The filename may omit the extension as for NEWIMAGE
+ *
+ * @return false if no file was found
+ */
+static bool ImageFileStat(const string &filename, time_t &mtime, off_t &size)
+{
+    const char *EXTENSIONS[] = { "", ".nii.gz", ".nii", ".hdr.gz", ".hdr", NULL };
+    for (int i = 0; EXTENSIONS[i]; i++)
+    {
+        struct stat info;
+        if ((stat((filename + EXTENSIONS[i]).c_str(), &info) == 0) && S_ISREG(info.st_mode))
+        {
+            mtime = info.st_mtime;
+            size = info.st_size;
+            return true;
+        }
+    }
+    return false;
+}
+
+ImageCache::ImageCache(int max_images)
+    : m_max_images(max(max_images, 1))
+    , m_uses(0)
+{
+}
+
+boost::shared_ptr<const volume4D<float> > ImageCache::Load(const string &filename)
+{
+    // The lock is held while loading so that an image needed by several runs
+    // at once is only read once
+    ScopedLock lock(m_mutex);
+
+    time_t mtime = 0;
+    off_t size = 0;
+    if (!ImageFileStat(filename, mtime, size))
+    {
+        m_entries.erase(filename);
+        throw DataNotFound(filename, "File is invalid or does not exist");
+    }
+
+    map<string, Entry>::iterator iter = m_entries.find(filename);
+    if ((iter == m_entries.end()) || (iter->second.mtime != mtime) || (iter->second.size != size))
+    {
+        boost::shared_ptr<const volume4D<float> > vol = ReadImageFile(filename);
+        Entry &entry = m_entries[filename];
+        entry.vol = vol;
+        entry.mtime = mtime;
+        entry.size = size;
+        entry.last_used = ++m_uses;
+
+        while (int(m_entries.size()) > m_max_images)
+        {
+            map<string, Entry>::iterator oldest = m_entries.begin();
+            for (map<string, Entry>::iterator e = m_entries.begin(); e != m_entries.end(); ++e)
+            {
+                if (e->second.last_used < oldest->second.last_used)
+                    oldest = e;
+            }
+            m_entries.erase(oldest);
+        }
+        return vol;
+    }
+    iter->second.last_used = ++m_uses;
+    return iter->second.vol;
+}
+
+void ImageCache::Clear()
+{
+    ScopedLock lock(m_mutex);
+    m_entries.clear();
+}
+
 FabberRunDataNewimage::FabberRunDataNewimage(bool compat_options)
     : FabberRunData(compat_options)
     , m_mask(1, 1, 1)
     , m_have_mask(false)
+    , m_cache(NULL)
 {
 }
 
+boost::shared_ptr<const volume4D<float> > FabberRunDataNewimage::ReadImage(const string &filename)
+{
+    if (m_cache)
+    {
+        return m_cache->Load(filename);
+    }
+    else
+    {
+        return ReadImageFile(filename);
+    }
+}
+
 void FabberRunDataNewimage::SetExtentFromData()
 {
     string mask_fname = GetStringDefault("mask", "");
@@ -60,11 +170,7 @@ void FabberRunDataNewimage::SetExtentFromData()
     if (m_have_mask)
     {
         LOG << "FabberRunDataNewimage::Loading mask data from '" + mask_fname << "'" << endl;
-        if (!fsl_imageexists(mask_fname))
-        {
-            throw DataNotFound(mask_fname, "File is invalid or does not exist");
-        }
-        read_volume(m_mask, mask_fname);
+        m_mask = (*ReadImage(mask_fname))[0];
         m_mask.binarise(1e-16, m_mask.max() + 1, exclusive);
         DumpVolumeInfo(m_mask, LOG);
         SetCoordsFromExtent(m_mask.xsize(), m_mask.ysize(), m_mask.zsize());
@@ -75,13 +181,8 @@ void FabberRunDataNewimage::SetExtentFromData()
         // have a mask, and that the reference volume is initialized
         LOG << "FabberRunDataNewimage::No mask, using data for extent" << endl;
         string data_fname = GetStringDefault("data", GetStringDefault("data1", ""));
-        if (!fsl_imageexists(data_fname))
-        {
-            throw DataNotFound(data_fname, "File is invalid or does not exist");
-        }
-        volume<float> main_vol;
-        read_volume(main_vol, data_fname);
-        SetCoordsFromExtent(main_vol.xsize(), main_vol.ysize(), main_vol.zsize());
+        boost::shared_ptr<const volume4D<float> > main_vol = ReadImage(data_fname);
+        SetCoordsFromExtent(main_vol->xsize(), main_vol->ysize(), main_vol->zsize());
     }
 }
 
@@ -91,28 +192,15 @@ const Matrix &FabberRunDataNewimage::LoadVoxelData(const std::string &filename)
     {
         LOG << "FabberRunDataNewimage::Loading data from '" + filename << "'" << endl;
         // Load the data file using Newimage library
-        // FIXME should check for presence of file before trying to load.
-        if (!fsl_imageexists(filename))
-        {
-            throw DataNotFound(filename, "File is invalid or does not exist");
-        }
-
-        volume4D<float> vol;
-        try
-        {
-            read_volume4D(vol, filename);
-            if (!m_have_mask)
-            {
-                // We need a mask volume so that when we save we can make sure
-                // the image properties are set consistently with the source data
-                m_mask = vol[0];
-                m_mask = 1;
-                m_have_mask = true;
-            }
-        }
-        catch (...)
+        boost::shared_ptr<const volume4D<float> > vol_ptr = ReadImage(filename);
+        const volume4D<float> &vol = *vol_ptr;
+        if (!m_have_mask)
         {
-            throw DataNotFound(filename, "Error loading file");
+            // We need a mask volume so that when we save we can make sure
+            // the image properties are set consistently with the source data
+            m_mask = vol[0];
+            m_mask = 1;
+            m_have_mask = true;
         }
         DumpVolumeInfo(vol, LOG);
 
@@ -16,11 +16,59 @@
 
 #ifndef NO_NEWIMAGE
 #include "rundata.h"
+#include "threads.h"
 
 #include "newimage/newimage.h"
 #include "newmat.h"
 
+#include <boost/shared_ptr.hpp>
+
+#include <map>
 #include <string>
+#include <sys/types.h>
+#include <time.h>
+
+/**
+ * Cache of image files which can be shared between runs
+ *
+ * Images are keyed by filename and reloaded if the modification time or
+ * size of the file has changed since it was cached. The cache may be used
+ * from multiple threads. Cached images are never modified, so a run which
+ * is using an image is not affected if it is replaced in the cache.
+ */
+class ImageCache
+{
+public:
+    /**
+     * @param max_images Maximum number of images to keep. When this is exceeded
+     *                   the least recently used image is dropped
+     */
+    explicit ImageCache(int max_images = 32);
+
+    /**
+     * Get an image, loading it if it is not cached or the file has changed
+     *
+     * @param filename Image file name, as accepted by NEWIMAGE (the extension may be omitted)
+     */
+    boost::shared_ptr<const NEWIMAGE::volume4D<float> > Load(const std::string &filename);
+
+    /** Drop all cached images */
+    void Clear();
+
+private:
+    struct Entry
+    {
+        time_t mtime;
+        off_t size;
+        long last_used;
+        boost::shared_ptr<const NEWIMAGE::volume4D<float> > vol;
+    };
+
+    int m_max_images;
+    long m_uses;
+    std::map<std::string, Entry> m_entries;
+    Mutex m_mutex;
+};
 
 /**
  * Run data which uses NEWIMAGE to load NIFTII files
@@ -30,6 +78,17 @@ class FabberRunDataNewimage : public FabberRunData
 public:
     FabberRunDataNewimage(bool compat_options = true);
 
+    /**
+     * Load images through a shared cache rather than reading them from file
+     *
+     * @param cache Cache to use, or NULL to always read from file. The cache
+     *              is not owned and must outlive this object
+     */
+    void SetImageCache(ImageCache *cache)
+    {
+        m_cache = cache;
+    }
+
     void SetExtentFromData();
     const NEWMAT::Matrix &LoadVoxelData(const std::string &filename);
     virtual void SaveVoxelData(
@@ -37,8 +96,10 @@ public:
 
 private:
     void SetCoordsFromExtent(int nx, int ny, int nz);
+    boost::shared_ptr<const NEWIMAGE::volume4D<float> > ReadImage(const std::string &filename);
     NEWIMAGE::volume<float> m_mask;
     bool m_have_mask;
+    ImageCache *m_cache;
 };
 
 #endif /* NO_NEWIMAGE */
@@ -8,6 +8,8 @@
 #include "setup.h"
 
 #include "inference.h"
+#include "inference_gridsearch.h"
+#include "inference_mcmc.h"
 #include "inference_vb.h"
 #ifndef NO_NLLS
 #include "inference_nlls.h"
@@ -20,6 +22,7 @@
 #include "fwdmodel.h"
 #include "fwdmodel_linear.h"
 #include "fwdmodel_poly.h"
+#include "fwdmodel_surrogate.h"
 
 #include "convergence.h"
 
@@ -28,6 +31,8 @@ void FabberSetup::SetupDefaultInferenceTechniques()
     InferenceTechniqueFactory *factory = InferenceTechniqueFactory::GetInstance();
     factory->Add("vb", &Vb::NewInstance);
     factory->Add("spatialvb", &Vb::NewInstance);
+    factory->Add("gridsearch", &GridSearchInferenceTechnique::NewInstance);
+    factory->Add("mcmc", &McmcInferenceTechnique::NewInstance);
 #ifndef NO_NLLS
     factory->Add("nlls", &NLLSInferenceTechnique::NewInstance);
 #endif
@@ -45,6 +50,7 @@ void FabberSetup::SetupDefaultFwdModels()
     FwdModelFactory *factory = FwdModelFactory::GetInstance();
     factory->Add("linear", &LinearFwdModel::NewInstance);
     factory->Add("poly", &PolynomialFwdModel::NewInstance);
+    factory->Add("surrogate", &SurrogateFwdModel::NewInstance);
 }
 
 void FabberSetup::SetupDefaultConvergenceDetectors()
@@ -54,6 +60,7 @@ void FabberSetup::SetupDefaultConvergenceDetectors()
     factory->Add("pointzeroone", &FchangeConvergenceDetector::NewInstance);
     factory->Add("freduce", &FreduceConvergenceDetector::NewInstance);
     factory->Add("trialmode", &TrialModeConvergenceDetector::NewInstance);
+    factory->Add("pchange", &PchangeConvergenceDetector::NewInstance);
     factory->Add("lm", &LMConvergenceDetector::NewInstance);
 }
 
@@ -70,4 +77,5 @@ void FabberSetup::Destroy()
     FwdModelFactory::Destroy();
     NoiseModelFactory::Destroy();
     InferenceTechniqueFactory::Destroy();
+    ConvergenceDetectorFactory::Destroy();
 }
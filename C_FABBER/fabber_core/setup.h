@@ -17,6 +17,9 @@ class FabberSetup
 public:
     /**
      * Invoke each Setup function in turn.
+     *
+     * This is safe to call repeatedly and from multiple threads, as names
+     * which are already registered are not changed.
      */
     static void SetupDefaults();
     /**
@@ -44,6 +47,10 @@ public:
     static void SetupDefaultConvergenceDetectors();
     /**
      * Destroy all singleton factory instances.
+     *
+     * The factories are shared by every run in the process, so this must only
+     * be called when no runs are in progress (e.g. at exit or between tests).
+     * Models from dynamic libraries must be loaded again afterwards.
      */
     static void Destroy();
 };
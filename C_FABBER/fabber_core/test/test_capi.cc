@@ -0,0 +1,338 @@
+//
+// Tests of asynchronous runs and model evaluation through the C API
+
+#include "gtest/gtest.h"
+
+#include "fabber_capi.h"
+#include "fwdmodel_poly.h"
+#include "rundata.h"
+#include "setup.h"
+
+#include <math.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+const int NTIMES = 10;
+const int LOG_SIZE = 100000;
+
+// Enough voxels that a run cannot finish before the next API call
+const int NVOXELS_LONG = 5000;
+
+class CapiTest : public ::testing::TestWithParam<int>
+{
+protected:
+    CapiTest()
+        : fab(NULL)
+    {
+        FabberSetup::SetupDefaults();
+    }
+
+    virtual ~CapiTest()
+    {
+        fabber_destroy(fab);
+        FabberSetup::Destroy();
+    }
+
+    // Set up a linear (degree 1) polynomial model with a different intercept in
+    // each voxel and a small amount of deterministic 'noise'. The parameter is the
+    // number of starting points for VB
+    void SetUpRun(int nvoxels)
+    {
+        err[0] = '\0';
+        fab = fabber_new(err);
+        ASSERT_TRUE(fab != NULL) << err;
+        std::vector<int> mask(nvoxels, 1);
+        ASSERT_EQ(0, fabber_set_extent(fab, nvoxels, 1, 1, &mask[0], err)) << err;
+
+        std::vector<float> data(NTIMES * nvoxels);
+        for (int t = 0; t < NTIMES; t++)
+        {
+            for (int v = 0; v < nvoxels; v++)
+            {
+                data[t * nvoxels + v] = C0(v) + 0.5f * t + 0.01f * float(sin(double(t * v)));
+            }
+        }
+        ASSERT_EQ(0, fabber_set_data(fab, "data", NTIMES, &data[0], err)) << err;
+        ASSERT_EQ(0, fabber_set_opt(fab, "method", "vb", err)) << err;
+        ASSERT_EQ(0, fabber_set_opt(fab, "noise", "white", err)) << err;
+        ASSERT_EQ(0, fabber_set_opt(fab, "model", "poly", err)) << err;
+        ASSERT_EQ(0, fabber_set_opt(fab, "degree", "1", err)) << err;
+        ASSERT_EQ(0, fabber_set_opt(fab, "multistart", stringify(GetParam()).c_str(), err))
+            << err;
+        ASSERT_EQ(0, fabber_set_opt(fab, "save-model-fit", "", err)) << err;
+    }
+
+    // Run synchronously, discarding the log
+    int Run()
+    {
+        std::vector<char> log(LOG_SIZE);
+        return fabber_dorun(fab, LOG_SIZE, &log[0], err, NULL);
+    }
+
+    // Poll until the run finishes and return the result of the final poll
+    int Wait(int &voxel, int &nvoxels)
+    {
+        int ret;
+        while ((ret = fabber_poll(fab, &voxel, &nvoxels, NULL, NULL, 0, NULL, err))
+            == FABBER_RUN_RUNNING)
+        {
+            usleep(1000);
+        }
+        return ret;
+    }
+
+    static float C0(int v)
+    {
+        return float(v % 7) - 3;
+    }
+
+    void *fab;
+    char err[FABBER_ERR_MAXC + 1];
+};
+
+// Test an asynchronous run reports progress for every voxel and gives
+// the same result as a synchronous run
+TEST_P(CapiTest, Async)
+{
+    const int NVOXELS = 20;
+    SetUpRun(NVOXELS);
+
+    ASSERT_EQ(0, Run()) << err;
+    std::vector<float> sync_fit(NTIMES * NVOXELS);
+    ASSERT_EQ(0, fabber_get_data(fab, "modelfit", &sync_fit[0], err)) << err;
+
+    ASSERT_EQ(0, fabber_dorun_async(fab, err)) << err;
+    int voxel = -1, nvoxels = -1;
+    ASSERT_EQ(0, Wait(voxel, nvoxels)) << err;
+    ASSERT_EQ(NVOXELS, voxel);
+    ASSERT_EQ(NVOXELS, nvoxels);
+
+    std::vector<float> fit(NTIMES * NVOXELS);
+    ASSERT_EQ(0, fabber_get_data(fab, "modelfit", &fit[0], err)) << err;
+    for (int i = 0; i < NTIMES * NVOXELS; i++)
+    {
+        ASSERT_EQ(sync_fit[i], fit[i]);
+    }
+}
+
+// Test a cancelled run stops before fitting every voxel but still
+// saves output for all of them
+TEST_P(CapiTest, Cancel)
+{
+    SetUpRun(NVOXELS_LONG);
+    ASSERT_EQ(0, fabber_set_opt(fab, "max-iterations", "50", err)) << err;
+
+    ASSERT_EQ(0, fabber_dorun_async(fab, err)) << err;
+    ASSERT_EQ(0, fabber_cancel(fab, err)) << err;
+    int voxel = -1, nvoxels = -1;
+    ASSERT_EQ(FABBER_RUN_CANCELLED, Wait(voxel, nvoxels)) << err;
+    ASSERT_LT(voxel, NVOXELS_LONG);
+
+    ASSERT_EQ(NTIMES, fabber_get_data_size(fab, "modelfit", err)) << err;
+}
+
+// Test calls which use the run data fail while a run is in progress, and
+// succeed again once it has finished
+TEST_P(CapiTest, CallsWhileRunning)
+{
+    SetUpRun(NVOXELS_LONG);
+    ASSERT_EQ(0, fabber_set_opt(fab, "max-iterations", "50", err)) << err;
+
+    ASSERT_EQ(0, fabber_dorun_async(fab, err)) << err;
+    ASSERT_LT(fabber_set_opt(fab, "max-iterations", "1", err), 0);
+    ASSERT_LT(fabber_get_data_size(fab, "data", err), 0);
+    ASSERT_LT(fabber_dorun_async(fab, err), 0);
+    ASSERT_LT(Run(), 0);
+
+    ASSERT_EQ(0, fabber_cancel(fab, err)) << err;
+    int voxel = -1, nvoxels = -1;
+    ASSERT_EQ(FABBER_RUN_CANCELLED, Wait(voxel, nvoxels)) << err;
+    ASSERT_EQ(0, fabber_set_opt(fab, "max-iterations", "1", err)) << err;
+    ASSERT_EQ(NTIMES, fabber_get_data_size(fab, "data", err)) << err;
+}
+
+// Test a context can be destroyed while a run is in progress and that
+// a new context can then be used
+TEST_P(CapiTest, DestroyWhileRunning)
+{
+    SetUpRun(NVOXELS_LONG);
+    ASSERT_EQ(0, fabber_set_opt(fab, "max-iterations", "50", err)) << err;
+
+    ASSERT_EQ(0, fabber_dorun_async(fab, err)) << err;
+    fabber_destroy(fab);
+    fab = NULL;
+
+    SetUpRun(1);
+    ASSERT_EQ(0, Run()) << err;
+}
+
+// Test polling and cancelling are errors when no asynchronous run has been started
+TEST_P(CapiTest, NoRun)
+{
+    SetUpRun(1);
+    ASSERT_LT(fabber_poll(fab, NULL, NULL, NULL, NULL, 0, NULL, err), 0);
+    ASSERT_LT(fabber_cancel(fab, err), 0);
+}
+
+// Voxelwise VB and VB with multiple starting points
+INSTANTIATE_TEST_CASE_P(CapiTests, CapiTest, ::testing::Values(1, 3));
+
+// Polynomial model which adds the voxel data and the sum of the voxel
+// co-ordinates to its output, so batch evaluation can be checked to pass
+// the right data to each sample. Not defined for an intercept above 1000
+class DataPolyModel : public PolynomialFwdModel
+{
+public:
+    static FwdModel *NewInstance()
+    {
+        return new DataPolyModel();
+    }
+
+    void EvaluateModel(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result,
+        const std::string &key = "") const
+    {
+        if (params(1) > 1000)
+            throw FabberInternalError("DataPolyModel: intercept out of range");
+        PolynomialFwdModel::EvaluateModel(params, result, key);
+        result += data + coords(1) + coords(2) + coords(3);
+    }
+};
+
+const int NSAMPLES = 37;
+
+class CapiEvaluateTest : public ::testing::Test
+{
+protected:
+    CapiEvaluateTest()
+        : fab(NULL)
+    {
+        FabberSetup::SetupDefaults();
+        FwdModelFactory::GetInstance()->Add("datapoly", &DataPolyModel::NewInstance);
+    }
+
+    virtual ~CapiEvaluateTest()
+    {
+        fabber_destroy(fab);
+        FabberSetup::Destroy();
+    }
+
+    // Linear (degree 1) model with a different intercept and slope, voxel
+    // data and co-ordinates for each sample
+    virtual void SetUp()
+    {
+        err[0] = '\0';
+        fab = fabber_new(err);
+        ASSERT_TRUE(fab != NULL) << err;
+        ASSERT_EQ(0, fabber_set_opt(fab, "model", "datapoly", err)) << err;
+        ASSERT_EQ(0, fabber_set_opt(fab, "degree", "1", err)) << err;
+
+        params.resize(NSAMPLES * 2);
+        indata.resize(NSAMPLES * NTIMES);
+        coords.resize(NSAMPLES * 3);
+        for (int s = 0; s < NSAMPLES; s++)
+        {
+            params[s * 2] = float(s % 5) - 2;
+            params[s * 2 + 1] = 0.25f * float(s % 3);
+            for (int t = 0; t < NTIMES; t++)
+            {
+                indata[s * NTIMES + t] = float(sin(double(s + t)));
+            }
+            for (int i = 0; i < 3; i++)
+            {
+                coords[s * 3 + i] = float(s + i);
+            }
+        }
+    }
+
+    // Evaluate one sample on its own with fabber_model_evaluate, which
+    // always uses co-ordinates (1, 1, 1)
+    void EvaluateSingle(int s, bool with_data, std::vector<float> &output)
+    {
+        output.resize(NTIMES);
+        ASSERT_EQ(0, fabber_model_evaluate(fab, 2, &params[s * 2], NTIMES,
+                         with_data ? &indata[s * NTIMES] : NULL, &output[0], err))
+            << err;
+    }
+
+    void *fab;
+    char err[FABBER_ERR_MAXC + 1];
+    std::vector<float> params, indata, coords;
+};
+
+// Test batch evaluation gives the same output as evaluating each sample
+// separately, for different numbers of threads and with and without
+// voxel data and co-ordinates
+TEST_F(CapiEvaluateTest, BatchMatchesSingle)
+{
+    int n_threads[] = { 0, 1, 2, 4 };
+    for (int with_data = 0; with_data < 2; with_data++)
+    {
+        for (int with_coords = 0; with_coords < 2; with_coords++)
+        {
+            for (int n = 0; n < 4; n++)
+            {
+                std::vector<float> output(NSAMPLES * NTIMES, -1);
+                ASSERT_EQ(0, fabber_model_evaluate_batch(fab, NSAMPLES, 2, &params[0], NTIMES,
+                                 with_data ? &indata[0] : NULL, with_coords ? &coords[0] : NULL,
+                                 &output[0], n_threads[n], err))
+                    << err;
+
+                std::vector<float> single;
+                for (int s = 0; s < NSAMPLES; s++)
+                {
+                    EvaluateSingle(s, with_data, single);
+                    float offset = 0;
+                    if (with_coords)
+                    {
+                        offset = coords[s * 3] + coords[s * 3 + 1] + coords[s * 3 + 2] - 3;
+                    }
+                    for (int t = 0; t < NTIMES; t++)
+                    {
+                        ASSERT_FLOAT_EQ(single[t] + offset, output[s * NTIMES + t])
+                            << "threads=" << n_threads[n] << " sample=" << s << " t=" << t;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Test batch evaluation fails if the number of parameters does not match the model
+TEST_F(CapiEvaluateTest, BatchParamCount)
+{
+    std::vector<float> output(NSAMPLES * NTIMES);
+    ASSERT_LT(fabber_model_evaluate_batch(
+                  fab, NSAMPLES / 2, 3, &params[0], NTIMES, NULL, NULL, &output[0], 1, err),
+        0);
+    ASSERT_NE(std::string(""), std::string(err));
+}
+
+// Test a sample where the model throws gives NaN output without affecting
+// the other samples
+TEST_F(CapiEvaluateTest, BatchModelError)
+{
+    const int BAD_SAMPLE = 5;
+    params[BAD_SAMPLE * 2] = 2000;
+    std::vector<float> output(NSAMPLES * NTIMES);
+    ASSERT_EQ(0, fabber_model_evaluate_batch(fab, NSAMPLES, 2, &params[0], NTIMES, &indata[0],
+                     NULL, &output[0], 2, err))
+        << err;
+
+    std::vector<float> single;
+    for (int s = 0; s < NSAMPLES; s++)
+    {
+        if (s != BAD_SAMPLE)
+            EvaluateSingle(s, true, single);
+        for (int t = 0; t < NTIMES; t++)
+        {
+            if (s == BAD_SAMPLE)
+                ASSERT_TRUE(isnan(output[s * NTIMES + t]));
+            else
+                ASSERT_FLOAT_EQ(single[t], output[s * NTIMES + t]);
+        }
+    }
+}
+}
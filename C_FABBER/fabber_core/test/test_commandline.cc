@@ -305,6 +305,42 @@ TEST_F(ClTestTest, Overwrite)
     ASSERT_TRUE(contains(out, "test_data_small.nii.gz"));
 }
 
+// Test a batch of runs which share the same data, with options from a .fab file
+// and the command line
+TEST_F(ClTestTest, Batch)
+{
+    ofstream fab("testfabber_batch.fab");
+    fab << "model=poly" << endl
+        << "method=vb" << endl
+        << "noise=white" << endl
+        << "mask=" << FABBER_SRC_DIR << "/test/test_mask_small.nii.gz" << endl
+        << "data=" << FABBER_SRC_DIR << "/test/test_data.nii.gz" << endl;
+    fab.close();
+
+    ofstream runs("testfabber_batch.list");
+    runs << "# Two variants of the same run" << endl
+         << "-f testfabber_batch.fab --output=out.tmp --degree=2" << endl
+         << endl
+         << "-f testfabber_batch.fab --output=out2.tmp --degree=1" << endl;
+    runs.close();
+
+    ASSERT_EQ(0, runFabber("--batch=testfabber_batch.list --max-cores=2"));
+    remove("testfabber_batch.fab");
+    remove("testfabber_batch.list");
+
+    string out = getLogfile("out.tmp");
+    ASSERT_TRUE(contains(out, "degree=2"));
+    ASSERT_TRUE(contains(out, "test_mask_small.nii.gz"));
+    out = getLogfile("out2.tmp");
+    ASSERT_TRUE(contains(out, "degree=1"));
+    ASSERT_TRUE(contains(out, "test_data.nii.gz"));
+    int ret = system("rm -rf out2.tmp"); //Not portable!
+    if (ret != 0) cerr << "WARNING: Failed to remove temp directory out2.tmp" << endl;
+
+    compareNifti("out.tmp/mean_c0.nii.gz", string(FABBER_SRC_DIR) + "/test/outdata_poly/mean_c0.nii.gz");
+    compareNifti("out.tmp/mean_c2.nii.gz", string(FABBER_SRC_DIR) + "/test/outdata_poly/mean_c2.nii.gz");
+}
+
 TEST_F(ClTestTest, ListModels)
 {
     string args = "--listmodels";
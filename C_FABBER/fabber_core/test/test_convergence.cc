@@ -304,4 +304,97 @@ TEST_F(ConvergenceTest, TestTrialModeConvergenceDetectorReduce)
     }
     ASSERT_EQ(true, c->Test(F - 2 * MAXTRIALS * FCHANGE));
 }
+
+// Test the policy for full recalculations of the Jacobian
+TEST_F(ConvergenceTest, TestFullJacobian)
+{
+    int MAXITERS = 37;
+    double FCHANGE = 0.0001;
+    double F = 12.1;
+
+    rundata.Set("max-iterations", MAXITERS);
+    rundata.Set("min-fchange", FCHANGE);
+    ConvergenceDetector *c = ConvergenceDetector::NewFromName("fchange");
+    c->Initialize(rundata);
+
+    // By default always recalculate
+    ASSERT_EQ(true, c->NeedFullJacobian(F));
+    ASSERT_EQ(true, c->NeedFullJacobian(F + 1));
+
+    // Every third linearization, or when F reduces
+    rundata.Set("jacobian-refresh", "3");
+    c->Initialize(rundata);
+    ASSERT_EQ(false, c->NeedFullJacobian(F));
+    ASSERT_EQ(false, c->NeedFullJacobian(F + 1));
+    ASSERT_EQ(true, c->NeedFullJacobian(F + 2));
+    ASSERT_EQ(false, c->NeedFullJacobian(F + 3));
+    ASSERT_EQ(true, c->NeedFullJacobian(F + 2.5));
+    ASSERT_EQ(false, c->NeedFullJacobian(F + 3));
+
+    // Reset starts counting again
+    c->Reset();
+    ASSERT_EQ(false, c->NeedFullJacobian(F));
+    ASSERT_EQ(false, c->NeedFullJacobian(F + 1));
+    ASSERT_EQ(true, c->NeedFullJacobian(F + 2));
+
+    rundata.Set("jacobian-refresh", "0");
+    ASSERT_THROW(c->Initialize(rundata), InvalidOptionValue);
+    delete c;
+}
+
+// Test convergence when the parameters stop changing
+TEST_F(ConvergenceTest, TestPchangeConvergenceDetector)
+{
+    int MAXITERS = 37;
+    double FCHANGE = 0.0001;
+    double F = 12.1;
+
+    rundata.Set("max-iterations", MAXITERS);
+    rundata.Set("min-fchange", FCHANGE);
+    rundata.Set("min-pchange", "0.1");
+    ConvergenceDetector *c = ConvergenceDetector::NewFromName("pchange");
+    c->Initialize(rundata);
+    ASSERT_EQ(true, c->UseF());
+
+    // Posterior standard deviation of 2
+    MVNDist post(1);
+    post.means = 1;
+    NEWMAT::SymmetricMatrix cov(1);
+    cov = 4;
+    post.SetCovariance(cov);
+
+    // First test has nothing to compare against
+    ASSERT_EQ(false, c->Test(F, post));
+
+    // Mean changes by 0.5 std, F increasing
+    post.means = 2;
+    ASSERT_EQ(false, c->Test(F + 1, post));
+
+    // Mean changes by 0.05 std
+    post.means = 2.1;
+    ASSERT_EQ(true, c->Test(F + 2, post));
+    ASSERT_EQ("Parameter change less than minimum", c->GetReason());
+    ASSERT_EQ(false, c->NeedRevert());
+    ASSERT_GT(c->IterationsSaved(), 0);
+
+    // If F has just reduced, converges but reverts to the best parameters
+    c->Reset();
+    ASSERT_EQ(0, c->IterationsSaved());
+    ASSERT_EQ(false, c->Test(F, post));
+    post.means = 3;
+    ASSERT_EQ(false, c->Test(F + 1, post));
+    post.means = 3.05;
+    ASSERT_EQ(true, c->Test(F + 0.5, post));
+    ASSERT_EQ(true, c->NeedRevert());
+
+    // Without the posterior behaves as trial mode
+    c->Reset();
+    ASSERT_EQ(false, c->Test(F));
+    ASSERT_EQ(false, c->Test(F + 1));
+    ASSERT_EQ(true, c->Test(F + 1));
+
+    rundata.Set("min-pchange", "0");
+    ASSERT_THROW(c->Initialize(rundata), InvalidOptionValue);
+    delete c;
+}
 }
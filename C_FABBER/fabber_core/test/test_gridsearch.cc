@@ -0,0 +1,192 @@
+//
+// Tests of the grid search inference method
+
+#include "gtest/gtest.h"
+
+#include "easylog.h"
+#include "fwdmodel_poly.h"
+#include "inference.h"
+#include "rundata.h"
+#include "setup.h"
+
+#include <newmat.h>
+
+#include <limits>
+#include <math.h>
+#include <string>
+
+namespace
+{
+// Polynomial model which is only defined when the intercept is a whole number,
+// as it is at every point of the test grid, so the Laplace approximation about
+// the best grid point fails
+class OnGridPolyModel : public PolynomialFwdModel
+{
+public:
+    static FwdModel *NewInstance()
+    {
+        return new OnGridPolyModel();
+    }
+
+    void EvaluateModel(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result,
+        const std::string &key = "") const
+    {
+        PolynomialFwdModel::EvaluateModel(params, result, key);
+        if (params(1) != floor(params(1)))
+            result = std::numeric_limits<double>::quiet_NaN();
+    }
+};
+
+class GridSearchTest : public ::testing::Test
+{
+protected:
+    GridSearchTest()
+    {
+        FabberSetup::SetupDefaults();
+        FwdModelFactory::GetInstance()->Add("ongridpoly", &OnGridPolyModel::NewInstance);
+    }
+
+    virtual ~GridSearchTest()
+    {
+        FabberSetup::Destroy();
+    }
+
+    // Set up a linear (degree 1) polynomial model with a different
+    // intercept and slope in each voxel, all of which lie on the grid
+    virtual void SetUp()
+    {
+        rundata.SetLogger(&log);
+        data.ReSize(NTIMES, NVOXELS);
+        coords.ReSize(3, NVOXELS);
+        for (int v = 1; v <= NVOXELS; v++)
+        {
+            coords(1, v) = v - 1;
+            coords(2, v) = 0;
+            coords(3, v) = 0;
+            for (int t = 1; t <= NTIMES; t++)
+            {
+                data(t, v) = C0(v) + C1(v) * t;
+            }
+        }
+        rundata.SetVoxelCoords(coords);
+        rundata.SetVoxelData("data", data);
+        rundata.Set("noise", "white");
+        rundata.Set("model", "poly");
+        rundata.Set("degree", "1");
+        rundata.Set("grid-min", "-5,-2");
+        rundata.Set("grid-max", "5,2");
+        rundata.Set("grid-npts", "11,9");
+    }
+
+    static double C0(int v)
+    {
+        return (v % 11) - 5;
+    }
+
+    static double C1(int v)
+    {
+        return 0.5 * (v % 9) - 2;
+    }
+
+    static const int NTIMES = 10;
+    static const int NVOXELS = 50;
+    EasyLog log;
+    FabberRunData rundata;
+    NEWMAT::Matrix data, coords;
+};
+
+// Tests that the grid point matching the data is found in each voxel
+TEST_F(GridSearchTest, ExactGridPoint)
+{
+    rundata.Set("method", "gridsearch");
+    rundata.Run();
+
+    NEWMAT::Matrix mean0 = rundata.GetVoxelData("mean_c0");
+    NEWMAT::Matrix mean1 = rundata.GetVoxelData("mean_c1");
+    ASSERT_EQ(NVOXELS, mean0.Ncols());
+    for (int v = 1; v <= NVOXELS; v++)
+    {
+        ASSERT_NEAR(C0(v), mean0(1, v), 1e-8);
+        ASSERT_NEAR(C1(v), mean1(1, v), 1e-8);
+    }
+}
+
+// Tests that using multiple threads gives identical results
+TEST_F(GridSearchTest, Threads)
+{
+    data(1, 1) += 0.3;
+    data(NTIMES, 2) -= 0.7;
+    rundata.SetVoxelData("data", data);
+    rundata.Set("method", "gridsearch");
+    rundata.Run();
+    NEWMAT::Matrix mean0 = rundata.GetVoxelData("mean_c0");
+    NEWMAT::Matrix std0 = rundata.GetVoxelData("std_c0");
+
+    rundata.Set("num-threads", "4");
+    rundata.Run();
+    NEWMAT::Matrix mean0_threads = rundata.GetVoxelData("mean_c0");
+    NEWMAT::Matrix std0_threads = rundata.GetVoxelData("std_c0");
+    for (int v = 1; v <= NVOXELS; v++)
+    {
+        ASSERT_EQ(mean0(1, v), mean0_threads(1, v));
+        ASSERT_EQ(std0(1, v), std0_threads(1, v));
+    }
+}
+
+// Tests using the grid search to initialize VB
+TEST_F(GridSearchTest, VbInit)
+{
+    // Move the data off the grid so VB has something to do
+    data += 0.05;
+    rundata.SetVoxelData("data", data);
+    rundata.Set("method", "vb");
+    rundata.SetBool("init-gridsearch");
+    rundata.Set("max-iterations", "10");
+    rundata.Run();
+
+    NEWMAT::Matrix mean0 = rundata.GetVoxelData("mean_c0");
+    NEWMAT::Matrix mean1 = rundata.GetVoxelData("mean_c1");
+    for (int v = 1; v <= NVOXELS; v++)
+    {
+        ASSERT_NEAR(C0(v) + 0.05, mean0(1, v), 1e-3);
+        ASSERT_NEAR(C1(v), mean1(1, v), 1e-3);
+    }
+}
+
+// Tests that a voxel whose Laplace approximation gives non-finite values keeps the
+// best grid point with an uninformative precision when bad voxels are allowed
+TEST_F(GridSearchTest, NonFiniteLaplace)
+{
+    rundata.Set("method", "gridsearch");
+    rundata.Set("model", "ongridpoly");
+    rundata.SetBool("allow-bad-voxels");
+    rundata.Run();
+
+    NEWMAT::Matrix mean0 = rundata.GetVoxelData("mean_c0");
+    NEWMAT::Matrix mean1 = rundata.GetVoxelData("mean_c1");
+    NEWMAT::Matrix std0 = rundata.GetVoxelData("std_c0");
+    ASSERT_EQ(NVOXELS, mean0.Ncols());
+    for (int v = 1; v <= NVOXELS; v++)
+    {
+        ASSERT_NEAR(C0(v), mean0(1, v), 1e-8);
+        ASSERT_NEAR(C1(v), mean1(1, v), 1e-8);
+        ASSERT_GT(std0(1, v), 1e5);
+    }
+}
+
+// Tests that non-finite values in the Laplace approximation stop the run by default
+TEST_F(GridSearchTest, NonFiniteLaplaceHalt)
+{
+    rundata.Set("method", "gridsearch");
+    rundata.Set("model", "ongridpoly");
+    ASSERT_THROW(rundata.Run(), FabberInternalError);
+}
+
+// Tests that the number of grid points must match the number of parameters
+TEST_F(GridSearchTest, BadNumPoints)
+{
+    rundata.Set("method", "gridsearch");
+    rundata.Set("grid-npts", "3,4,5");
+    ASSERT_THROW(rundata.Run(), InvalidOptionValue);
+}
+}
@@ -0,0 +1,200 @@
+//
+// Tests of the MCMC inference method
+
+#include "gtest/gtest.h"
+
+#include "easylog.h"
+#include "fwdmodel_poly.h"
+#include "inference.h"
+#include "rundata.h"
+#include "setup.h"
+
+#include <newmat.h>
+
+#include <limits>
+#include <math.h>
+#include <string>
+
+namespace
+{
+// Polynomial model which is not defined for intercepts very close to, but not
+// exactly, zero. The chains start from zero, so the Jacobian for the initial
+// proposal covariance is not finite but the chains themselves are unaffected
+class StartNanPolyModel : public PolynomialFwdModel
+{
+public:
+    static FwdModel *NewInstance()
+    {
+        return new StartNanPolyModel();
+    }
+
+    void EvaluateModel(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result,
+        const std::string &key = "") const
+    {
+        PolynomialFwdModel::EvaluateModel(params, result, key);
+        if ((params(1) != 0) && (fabs(params(1)) < 1e-6))
+            result = std::numeric_limits<double>::quiet_NaN();
+    }
+};
+
+class McmcTest : public ::testing::Test
+{
+protected:
+    McmcTest()
+    {
+        FabberSetup::SetupDefaults();
+        FwdModelFactory::GetInstance()->Add("startnanpoly", &StartNanPolyModel::NewInstance);
+    }
+
+    virtual ~McmcTest()
+    {
+        FabberSetup::Destroy();
+    }
+
+    // Set up a linear (degree 1) polynomial model with a different
+    // intercept and slope in each voxel and a small amount of
+    // deterministic 'noise'
+    virtual void SetUp()
+    {
+        rundata.SetLogger(&log);
+        data.ReSize(NTIMES, NVOXELS);
+        coords.ReSize(3, NVOXELS);
+        for (int v = 1; v <= NVOXELS; v++)
+        {
+            coords(1, v) = v - 1;
+            coords(2, v) = 0;
+            coords(3, v) = 0;
+            for (int t = 1; t <= NTIMES; t++)
+            {
+                data(t, v) = C0(v) + C1(v) * t + 0.1 * sin(double(t * v));
+            }
+        }
+        rundata.SetVoxelCoords(coords);
+        rundata.SetVoxelData("data", data);
+        rundata.Set("noise", "white");
+        rundata.Set("model", "poly");
+        rundata.Set("degree", "1");
+        rundata.Set("method", "mcmc");
+        rundata.Set("mcmc-burnin", "500");
+        rundata.Set("mcmc-samples", "1000");
+    }
+
+    static double C0(int v)
+    {
+        return (v % 7) - 3;
+    }
+
+    static double C1(int v)
+    {
+        return 0.5 * (v % 5) - 1;
+    }
+
+    static const int NTIMES = 20;
+    static const int NVOXELS = 20;
+    EasyLog log;
+    FabberRunData rundata;
+    NEWMAT::Matrix data, coords;
+};
+
+// Tests that the posterior mean is close to the true parameters
+TEST_F(McmcTest, PosteriorMean)
+{
+    rundata.Run();
+
+    NEWMAT::Matrix mean0 = rundata.GetVoxelData("mean_c0");
+    NEWMAT::Matrix mean1 = rundata.GetVoxelData("mean_c1");
+    NEWMAT::Matrix std0 = rundata.GetVoxelData("std_c0");
+    ASSERT_EQ(NVOXELS, mean0.Ncols());
+    for (int v = 1; v <= NVOXELS; v++)
+    {
+        ASSERT_NEAR(C0(v), mean0(1, v), 0.2);
+        ASSERT_NEAR(C1(v), mean1(1, v), 0.02);
+        ASSERT_GT(std0(1, v), 0);
+        ASSERT_LT(std0(1, v), 0.2);
+    }
+}
+
+// Tests that using multiple threads gives identical results
+TEST_F(McmcTest, Threads)
+{
+    rundata.Run();
+    NEWMAT::Matrix mean0 = rundata.GetVoxelData("mean_c0");
+    NEWMAT::Matrix std0 = rundata.GetVoxelData("std_c0");
+
+    rundata.Set("num-threads", "4");
+    rundata.Run();
+    NEWMAT::Matrix mean0_threads = rundata.GetVoxelData("mean_c0");
+    NEWMAT::Matrix std0_threads = rundata.GetVoxelData("std_c0");
+    for (int v = 1; v <= NVOXELS; v++)
+    {
+        ASSERT_EQ(mean0(1, v), mean0_threads(1, v));
+        ASSERT_EQ(std0(1, v), std0_threads(1, v));
+    }
+}
+
+// Tests starting the chains from a VB posterior
+TEST_F(McmcTest, VbInit)
+{
+    rundata.Set("method", "vb");
+    rundata.SetBool("save-mvn");
+    rundata.Run();
+    NEWMAT::Matrix mvns = rundata.GetVoxelData("finalMVN");
+    NEWMAT::Matrix vb_mean0 = rundata.GetVoxelData("mean_c0");
+    NEWMAT::Matrix vb_mean1 = rundata.GetVoxelData("mean_c1");
+
+    rundata.Set("method", "mcmc");
+    rundata.SetBool("save-mvn", false);
+    rundata.Set("mcmc-burnin", "200");
+    rundata.SetVoxelData("mvns", mvns);
+    rundata.Set("continue-from-mvn", "mvns");
+    rundata.Run();
+
+    NEWMAT::Matrix mean0 = rundata.GetVoxelData("mean_c0");
+    NEWMAT::Matrix mean1 = rundata.GetVoxelData("mean_c1");
+    for (int v = 1; v <= NVOXELS; v++)
+    {
+        ASSERT_NEAR(vb_mean0(1, v), mean0(1, v), 0.05);
+        ASSERT_NEAR(vb_mean1(1, v), mean1(1, v), 0.005);
+    }
+}
+
+// Tests that thinned samples are saved
+TEST_F(McmcTest, SaveSamples)
+{
+    rundata.Set("mcmc-samples", "100");
+    rundata.Set("mcmc-thin", "10");
+    rundata.SetBool("save-mcmc-samples");
+    rundata.Run();
+
+    NEWMAT::Matrix samples0 = rundata.GetVoxelData("samples_c0");
+    ASSERT_EQ(10, samples0.Nrows());
+    ASSERT_EQ(NVOXELS, samples0.Ncols());
+    for (int v = 1; v <= NVOXELS; v++)
+    {
+        ASSERT_NEAR(C0(v), samples0(1, v), 1);
+    }
+}
+
+// Tests that the chains run from the initial posterior covariance when the
+// Laplace approximation at the start point gives non-finite values, rather
+// than the voxels failing (which would stop the run, as bad voxels are not allowed)
+TEST_F(McmcTest, NonFiniteLaplace)
+{
+    rundata.Set("model", "startnanpoly");
+    ASSERT_NO_THROW(rundata.Run());
+
+    NEWMAT::Matrix mean0 = rundata.GetVoxelData("mean_c0");
+    ASSERT_EQ(NVOXELS, mean0.Ncols());
+    for (int v = 1; v <= NVOXELS; v++)
+    {
+        ASSERT_TRUE(mean0(1, v) == mean0(1, v));
+    }
+}
+
+// Tests that an invalid thinning interval is rejected
+TEST_F(McmcTest, BadThin)
+{
+    rundata.Set("mcmc-thin", "0");
+    ASSERT_THROW(rundata.Run(), InvalidOptionValue);
+}
+}
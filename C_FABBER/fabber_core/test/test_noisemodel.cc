@@ -0,0 +1,159 @@
+// Tests for noise models
+
+#include "gtest/gtest.h"
+
+#include "dist_mvn.h"
+#include "noisemodel_ar.h"
+
+#include <newmat.h>
+
+#include <math.h>
+
+using NEWMAT::ColumnVector;
+using NEWMAT::Matrix;
+using NEWMAT::SymmetricMatrix;
+
+namespace
+{
+const int NTIMES = 7;
+const int NPARAMS = 3;
+
+// Deterministic values in [-1, 1] which are not obviously structured
+double Val(int i, int j, int seed)
+{
+    return sin(1.3 * i + 2.7 * j + 0.9 * seed);
+}
+
+// AR coefficient posterior with nAlphas coefficients and a positive definite covariance
+MVNDist Alpha(int nAlphas)
+{
+    MVNDist alpha(nAlphas);
+    Matrix a(nAlphas, nAlphas);
+    for (int i = 1; i <= nAlphas; i++)
+    {
+        alpha.means(i) = 0.5 * Val(i, 0, 1);
+        for (int j = 1; j <= nAlphas; j++)
+        {
+            a(i, j) = 0.3 * Val(i, j, 2);
+        }
+    }
+    SymmetricMatrix cov;
+    cov << a * a.t() + 0.01 * NEWMAT::IdentityMatrix(nAlphas);
+    alpha.SetCovariance(cov);
+    return alpha;
+}
+
+// Precision of the residuals for echo n, built explicitly as the expectation of
+// sum over t > 1 of r_t r_t', where r_t = x_t - a y_t - b z_t picks out the
+// current point x, the previous point of the same echo y and the current point of
+// the other echo z. Data is interleaved with nPhis echoes
+Matrix ExplicitQ(const MVNDist &alpha, int nPhis, int n)
+{
+    const int nAlphas = alpha.means.Nrows();
+    const ColumnVector &m = alpha.means;
+    const SymmetricMatrix &cov = alpha.GetCovariance();
+    const bool cross = (nAlphas >= 3);
+    const int T = (nAlphas == 4) ? 2 + n : 3;
+
+    // Expectations of products of (1, -a, -b)
+    Matrix E(3, 3);
+    E = 0;
+    E(1, 1) = 1;
+    E(1, 2) = E(2, 1) = -m(n);
+    E(2, 2) = cov(n, n) + m(n) * m(n);
+    if (cross)
+    {
+        E(1, 3) = E(3, 1) = -m(T);
+        E(2, 3) = E(3, 2) = cov(n, T) + m(n) * m(T);
+        E(3, 3) = cov(T, T) + m(T) * m(T);
+    }
+
+    const int N = NTIMES * nPhis;
+    Matrix Q(N, N);
+    Q = 0;
+    for (int t = 1; t < NTIMES; t++)
+    {
+        int idx[3];
+        idx[0] = t * nPhis + n;
+        idx[1] = idx[0] - nPhis;
+        idx[2] = t * nPhis + (3 - n);
+        for (int i = 0; i < 3; i++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                if (E(i + 1, j + 1) != 0)
+                    Q(idx[i], idx[j]) += E(i + 1, j + 1);
+            }
+        }
+    }
+    return Q;
+}
+
+void CheckPrecision(int nPhis, int nAlphas)
+{
+    const int N = NTIMES * nPhis;
+    MVNDist alpha = Alpha(nAlphas);
+    Ar1cPrecision precision(nPhis);
+    precision.Update(alpha);
+
+    ColumnVector k(N);
+    Matrix J(N, NPARAMS), v(N, 2), a(NPARAMS, NPARAMS);
+    for (int i = 1; i <= N; i++)
+    {
+        k(i) = Val(i, 0, 3);
+        v(i, 1) = Val(i, 1, 4);
+        v(i, 2) = Val(i, 2, 4);
+        for (int j = 1; j <= NPARAMS; j++)
+        {
+            J(i, j) = Val(i, j, 5);
+        }
+    }
+    for (int i = 1; i <= NPARAMS; i++)
+    {
+        for (int j = 1; j <= NPARAMS; j++)
+        {
+            a(i, j) = Val(i, j, 6);
+        }
+    }
+    SymmetricMatrix cov;
+    cov << a * a.t() + 0.1 * NEWMAT::IdentityMatrix(NPARAMS);
+    Matrix Jcov = J * cov;
+
+    for (int n = 1; n <= nPhis; n++)
+    {
+        Matrix Q = ExplicitQ(alpha, nPhis, n);
+
+        Ar1cSums sums;
+        precision.ResidualSums(n, k, J, Jcov, sums);
+        double expected = (k.t() * Q * k).AsScalar() + (cov * J.t() * Q * J).Trace();
+        ASSERT_NEAR(expected, precision.QuadraticForm(n, sums), 1e-10 * (1 + fabs(expected)));
+
+        Matrix start(N, 2);
+        start = 1;
+        Matrix out = start;
+        precision.Multiply(n, 2.5, v, out);
+        Matrix expected_out = start + 2.5 * Q * v;
+        for (int i = 1; i <= N; i++)
+        {
+            ASSERT_NEAR(expected_out(i, 1), out(i, 1), 1e-10);
+            ASSERT_NEAR(expected_out(i, 2), out(i, 2), 1e-10);
+        }
+    }
+}
+
+// Test the AR(1) precision terms against explicitly constructed
+// precision matrices for a single echo
+TEST(Ar1cPrecisionTest, OneEcho)
+{
+    CheckPrecision(1, 1);
+}
+
+// Test the AR(1) precision terms for two interleaved echoes, with no cross
+// term, a cross term shared between echoes and separate cross terms
+TEST(Ar1cPrecisionTest, TwoEchoes)
+{
+    CheckPrecision(2, 2);
+    CheckPrecision(2, 3);
+    CheckPrecision(2, 4);
+}
+}
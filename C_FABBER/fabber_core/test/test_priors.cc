@@ -246,3 +246,63 @@ TEST_F(ImagePriorTest, ApplyToMVN)
     }
 }
 
+
+class SpatialPriorTest : public ::testing::Test
+{
+};
+
+// Spatial priors sharing sums give the same result as priors calculating their own
+TEST_F(SpatialPriorTest, SharedSums)
+{
+    const char TYPES[] = { PRIOR_SPATIAL_M, PRIOR_SPATIAL_m, PRIOR_SPATIAL_P, PRIOR_SPATIAL_p };
+    const int NUM_PARAMS = 4;
+
+    NEWMAT::Matrix coords(3, NUM_VOXELS);
+    coords = 0;
+    RunContext ctx(NUM_VOXELS);
+    ctx.fwd_post.resize(NUM_VOXELS, MVNDist(NUM_PARAMS));
+    for (int v=1; v<=NUM_VOXELS; v++) {
+        coords(1, v) = v % 5;
+        coords(2, v) = v / 5;
+        NEWMAT::SymmetricMatrix cov(NUM_PARAMS);
+        cov = 0;
+        for (int k=1; k<=NUM_PARAMS; k++) {
+            ctx.fwd_post[v-1].means(k) = (v * k) % 7 - 2.5;
+            cov(k, k) = 0.1 * ((v + k) % 3 + 1);
+        }
+        ctx.fwd_post[v-1].SetCovariance(cov);
+    }
+    ctx.neighbours.BuildNearest(coords);
+    ctx.neighbours2.BuildSecondNearest(ctx.neighbours);
+
+    FabberRunData rundata;
+    boost::shared_ptr<SpatialPriorSums> sums(new SpatialPriorSums(3));
+    vector<SpatialPrior *> shared, separate;
+    for (int k=0; k<NUM_PARAMS; k++) {
+        Parameter p(k, PARAM_NAME, DistParams(PRIOR_MEAN, PRIOR_VAR), DistParams(POST_MEAN, POST_VAR), 
+                    TYPES[k]);
+        shared.push_back(new SpatialPrior(p, rundata, sums));
+        separate.push_back(new SpatialPrior(p, rundata));
+    }
+
+    ctx.it = 1;
+    for (int v=1; v<=NUM_VOXELS; v++) {
+        ctx.v = v;
+        MVNDist mvn_shared(NUM_PARAMS), mvn_separate(NUM_PARAMS);
+        mvn_shared.SetCovariance(NEWMAT::IdentityMatrix(NUM_PARAMS));
+        mvn_separate.SetCovariance(NEWMAT::IdentityMatrix(NUM_PARAMS));
+        for (int k=0; k<NUM_PARAMS; k++) {
+            shared[k]->ApplyToMVN(&mvn_shared, ctx);
+            separate[k]->ApplyToMVN(&mvn_separate, ctx);
+        }
+        for (int k=1; k<=NUM_PARAMS; k++) {
+            ASSERT_EQ(mvn_separate.means(k), mvn_shared.means(k));
+            ASSERT_EQ(mvn_separate.GetPrecisions()(k, k), mvn_shared.GetPrecisions()(k, k));
+        }
+    }
+
+    for (int k=0; k<NUM_PARAMS; k++) {
+        delete shared[k];
+        delete separate[k];
+    }
+}
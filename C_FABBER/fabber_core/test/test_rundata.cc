@@ -5,9 +5,16 @@
 
 #include "easylog.h"
 #include "rundata.h"
+#include "rundata_array.h"
 #include "setup.h"
+#include "threads.h"
 
 #include <fstream>
+#include <math.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 namespace
 {
@@ -303,6 +310,87 @@ TEST_F(RunDataTest, DoubleList)
     ASSERT_EQ(8.5, list[1]);
 }
 
+// Tests vector option given as an indexed list
+TEST_F(RunDataTest, ColumnVectorIndexed)
+{
+    FabberRunData rundata;
+    rundata.Set("wibble1", "7.5");
+    rundata.Set("wibble2", "8.5");
+    rundata.Set("wibble3", "9.5");
+
+    NEWMAT::ColumnVector vec = rundata.GetColumnVector("wibble");
+    ASSERT_EQ(3, vec.Nrows());
+    ASSERT_EQ(7.5, vec(1));
+    ASSERT_EQ(8.5, vec(2));
+    ASSERT_EQ(9.5, vec(3));
+}
+
+// Tests vector option given as a comma separated list
+TEST_F(RunDataTest, ColumnVectorCommaSeparated)
+{
+    FabberRunData rundata;
+    rundata.Set("wibble", "7.5, 8.5,9.5");
+
+    NEWMAT::ColumnVector vec = rundata.GetColumnVector("wibble");
+    ASSERT_EQ(3, vec.Nrows());
+    ASSERT_EQ(7.5, vec(1));
+    ASSERT_EQ(8.5, vec(2));
+    ASSERT_EQ(9.5, vec(3));
+}
+
+// Tests vector option given as a single value
+TEST_F(RunDataTest, ColumnVectorSingle)
+{
+    FabberRunData rundata;
+    rundata.Set("wibble", "7.5");
+
+    NEWMAT::ColumnVector vec = rundata.GetColumnVector("wibble");
+    ASSERT_EQ(1, vec.Nrows());
+    ASSERT_EQ(7.5, vec(1));
+}
+
+// Tests vector option which is not specified
+TEST_F(RunDataTest, ColumnVectorMissing)
+{
+    FabberRunData rundata;
+
+    NEWMAT::ColumnVector vec = rundata.GetColumnVector("wibble");
+    ASSERT_EQ(0, vec.Nrows());
+}
+
+// Tests vector option given as a matrix file
+TEST_F(RunDataTest, ColumnVectorFile)
+{
+    string filename = "temp_vector.mat";
+    ofstream os(filename.c_str());
+    os << "7.5 8.5" << endl;
+    os << "9.5 10.5" << endl;
+    os.close();
+
+    FabberRunData rundata;
+    rundata.Set("wibble", filename);
+
+    NEWMAT::ColumnVector vec = rundata.GetColumnVector("wibble");
+    remove(filename.c_str());
+    ASSERT_EQ(4, vec.Nrows());
+    ASSERT_EQ(7.5, vec(1));
+    ASSERT_EQ(8.5, vec(2));
+    ASSERT_EQ(9.5, vec(3));
+    ASSERT_EQ(10.5, vec(4));
+}
+
+// Tests bad values in vector options
+TEST_F(RunDataTest, ColumnVectorConvertFail)
+{
+    FabberRunData rundata;
+    rundata.Set("wibble", "7.5,ABC");
+    ASSERT_THROW(rundata.GetColumnVector("wibble"), InvalidOptionValue);
+    rundata.Set("wibble", "no_such_file.mat");
+    ASSERT_THROW(rundata.GetColumnVector("wibble"), InvalidOptionValue);
+    rundata.Set("wibble", "7.5,8.5");
+    ASSERT_THROW(rundata.GetColumnVector("wibble", 8), InvalidOptionValue);
+}
+
 // Tests bad int option
 TEST_F(RunDataTest, IntConvertFail)
 {
@@ -512,4 +600,231 @@ TEST_F(RunDataTest, ClearVoxelData)
     ASSERT_THROW(rundata.GetVoxelData("data2"), DataNotFound);
     ASSERT_THROW(rundata.GetVoxelData("data3"), DataNotFound);
 }
+
+// Tests borrowing input arrays and writing output arrays with strides, using
+// C order (last dimension varies fastest) as numpy does by default
+TEST_F(RunDataTest, ArrayRefStrided)
+{
+    const int NX = 3, NY = 2, NZ = 2, NT = 2;
+    int mask[NX * NY * NZ];
+    for (int i = 0; i < NX * NY * NZ; i++)
+    {
+        mask[i] = (i % 4 == 1) ? 0 : 1;
+    }
+    long strides[4] = { NY * NZ * NT, NZ * NT, NT, 1 };
+    std::vector<float> in(NX * NY * NZ * NT), out(NX * NY * NZ * NT, -1);
+
+    FabberRunDataArray rundata;
+    rundata.SetExtent(NX, NY, NZ, mask);
+    rundata.SetVoxelDataRef("data", NT, &in[0], strides);
+    rundata.SetOutputArray("out", NT, &out[0], strides);
+
+    // The array should not be read until the data is needed
+    for (int i = 0; i < NX * NY * NZ * NT; i++)
+    {
+        in[i] = float(i);
+    }
+    NEWMAT::Matrix data = rundata.GetVoxelData("data");
+    const NEWMAT::Matrix &coords = rundata.GetVoxelCoords();
+    ASSERT_EQ(NT, data.Nrows());
+    ASSERT_EQ(coords.Ncols(), data.Ncols());
+    for (int v = 1; v <= data.Ncols(); v++)
+    {
+        int x = int(coords(1, v)), y = int(coords(2, v)), z = int(coords(3, v));
+        ASSERT_EQ(0, mask[x + NX * (y + NY * z)] == 0);
+        for (int t = 0; t < NT; t++)
+        {
+            ASSERT_EQ(in[x * strides[0] + y * strides[1] + z * strides[2] + t], data(t + 1, v));
+        }
+    }
+
+    // Output goes straight to the array, with zeros outside the mask
+    rundata.SaveVoxelData("out", data);
+    ASSERT_THROW(rundata.GetVoxelData("out"), DataNotFound);
+    for (int x = 0; x < NX; x++)
+    {
+        for (int y = 0; y < NY; y++)
+        {
+            for (int z = 0; z < NZ; z++)
+            {
+                for (int t = 0; t < NT; t++)
+                {
+                    int idx = x * strides[0] + y * strides[1] + z * strides[2] + t;
+                    if (mask[x + NX * (y + NY * z)])
+                        ASSERT_EQ(in[idx], out[idx]);
+                    else
+                        ASSERT_EQ(0, out[idx]);
+                }
+            }
+        }
+    }
+
+    // Output with the wrong number of values per voxel
+    NEWMAT::Matrix wrong(NT + 1, data.Ncols());
+    wrong = 0;
+    ASSERT_THROW(rundata.SaveVoxelData("out", wrong), InvalidOptionValue);
+}
+
+// Tests that unwritten output arrays are reported as missing and that
+// clearing voxel data stops using borrowed arrays
+TEST_F(RunDataTest, ArrayRefClear)
+{
+    const int NX = 2, NY = 2, NZ = 1, NT = 3;
+    int mask[NX * NY * NZ] = { 1, 1, 1, 1 };
+    std::vector<float> in(NX * NY * NZ * NT, 1), out(NX * NY * NZ, -1);
+
+    FabberRunDataArray rundata;
+    rundata.SetExtent(NX, NY, NZ, mask);
+    rundata.SetVoxelDataRef("data", NT, &in[0]);
+    rundata.SetOutputArray("out", 1, &out[0]);
+    ASSERT_EQ(NT, rundata.GetVoxelDataSize("data"));
+    ASSERT_THROW(rundata.GetVoxelDataSize("out"), DataNotFound);
+
+    NEWMAT::Matrix data(1, NX * NY * NZ);
+    data = 2;
+    rundata.SaveVoxelData("out", data);
+    ASSERT_EQ(1, rundata.GetVoxelDataSize("out"));
+    ASSERT_EQ(2, out[0]);
+
+    rundata.ClearVoxelData("data");
+    ASSERT_THROW(rundata.GetVoxelData("data"), DataNotFound);
+    ASSERT_EQ(1, rundata.GetVoxelDataSize("out"));
+
+    // Once cleared, output is kept in the run data rather than the array
+    rundata.ClearVoxelData();
+    rundata.SetExtent(NX, NY, NZ, mask);
+    data = 3;
+    rundata.SaveVoxelData("out", data);
+    ASSERT_EQ(2, out[0]);
+    ASSERT_EQ(3, rundata.GetVoxelData("out")(1, 1));
+}
+
+// Fits a linear function in its own run data, so several can be run
+// at the same time on different threads
+class ContextThread : public Thread
+{
+public:
+    static const int NVOXELS = 10;
+    static const int NTIMES = 10;
+
+    explicit ContextThread(int id)
+        : id(id)
+    {
+    }
+
+    void Run()
+    {
+        NEWMAT::Matrix data(NTIMES, NVOXELS), coords(3, NVOXELS);
+        for (int v = 1; v <= NVOXELS; v++)
+        {
+            coords(1, v) = v - 1;
+            coords(2, v) = 0;
+            coords(3, v) = 0;
+            for (int t = 1; t <= NTIMES; t++)
+            {
+                data(t, v) = Intercept(v) + 0.5 * t + 0.01 * sin(double(t * v));
+            }
+        }
+
+        FabberRunData rundata;
+        rundata.SetLogger(&log);
+        rundata.SetVoxelCoords(coords);
+        rundata.SetVoxelData("data", data);
+        rundata.Set("noise", "white");
+        rundata.Set("model", "poly");
+        rundata.Set("degree", "1");
+        rundata.Set("method", "vb");
+        rundata.Run();
+        mean = rundata.GetVoxelData("mean_c0");
+    }
+
+    double Intercept(int v) const
+    {
+        return id + 0.1 * v;
+    }
+
+    int id;
+    EasyLog log;
+    NEWMAT::Matrix mean;
+};
+
+// Tests that independent runs can be done concurrently in one process and give
+// the same results as running them one at a time
+TEST_F(RunDataTest, ParallelContexts)
+{
+    const int NCONTEXTS = 8;
+    ContextThread serial(NCONTEXTS - 1);
+    serial.Run();
+
+    std::auto_ptr<ContextThread> threads[NCONTEXTS];
+    for (int i = 0; i < NCONTEXTS; i++)
+    {
+        threads[i].reset(new ContextThread(i));
+    }
+    for (int i = 0; i < NCONTEXTS; i++)
+    {
+        threads[i]->Start();
+    }
+    for (int i = 0; i < NCONTEXTS; i++)
+    {
+        threads[i]->Join();
+    }
+
+    for (int i = 0; i < NCONTEXTS; i++)
+    {
+        ASSERT_EQ("", threads[i]->GetError());
+        ASSERT_EQ(int(ContextThread::NVOXELS), threads[i]->mean.Ncols());
+        for (int v = 1; v <= ContextThread::NVOXELS; v++)
+        {
+            ASSERT_NEAR(threads[i]->Intercept(v), threads[i]->mean(1, v), 0.05);
+        }
+    }
+    for (int v = 1; v <= ContextThread::NVOXELS; v++)
+    {
+        ASSERT_EQ(serial.mean(1, v), threads[NCONTEXTS - 1]->mean(1, v));
+    }
+}
+
+// Work which throws an exception of a given type for one item
+template <class E> class ThrowingWork : public ParallelWork
+{
+public:
+    explicit ThrowingWork(const E &e)
+        : e(e)
+    {
+    }
+
+    void Process(int item, int thread)
+    {
+        if (item == 50)
+            throw e;
+    }
+
+    E e;
+};
+
+// Tests that ParallelFor rethrows an exception from a worker thread with
+// its original type
+TEST_F(RunDataTest, ParallelForErrorType)
+{
+    ThrowingWork<DataNotFound> not_found(DataNotFound("data"));
+    ASSERT_THROW(ParallelFor(not_found, 100, 4), DataNotFound);
+
+    ThrowingWork<InvalidOptionValue> invalid(InvalidOptionValue("opt", "val"));
+    ASSERT_THROW(ParallelFor(invalid, 100, 4), InvalidOptionValue);
+
+    ThrowingWork<NEWMAT::Exception> newmat(NEWMAT::Exception("newmat"));
+    ASSERT_THROW(ParallelFor(newmat, 100, 4), NEWMAT::Exception);
+
+    ThrowingWork<std::logic_error> other(std::logic_error("other"));
+    try
+    {
+        ParallelFor(other, 100, 4);
+        FAIL() << "Expected an exception";
+    }
+    catch (const FabberInternalError &e)
+    {
+        ASSERT_NE(std::string::npos, std::string(e.what()).find("other"));
+    }
+}
 }
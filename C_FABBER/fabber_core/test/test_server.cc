@@ -0,0 +1,240 @@
+#ifndef NO_NEWIMAGE
+#ifndef _WIN32
+//
+// Tests of the job server and its image cache
+
+#include "gtest/gtest.h"
+
+#include "easylog.h"
+#include "fabber_server.h"
+#include "rundata.h"
+#include "rundata_newimage.h"
+#include "setup.h"
+#include "threads.h"
+
+#include "newimage/newimageall.h"
+
+#include <boost/shared_ptr.hpp>
+
+#include <fstream>
+#include <math.h>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+using namespace std;
+
+namespace
+{
+const int NX = 5;
+const int NTIMES = 10;
+
+// Save a line of NX voxels with a timeseries in each which is approximately
+// linear with intercept c0 + x and gradient 1
+void SaveImage(const string &filename, int nx, float c0)
+{
+    NEWIMAGE::volume4D<float> vol(nx, 1, 1, NTIMES);
+    for (int x = 0; x < nx; x++)
+    {
+        for (int t = 0; t < NTIMES; t++)
+        {
+            vol(x, 0, 0, t) = c0 + x + t + 0.01f * float(sin(double(x + 3 * t)));
+        }
+    }
+    NEWIMAGE::save_volume4D(vol, filename);
+}
+
+bool FileExists(const string &filename)
+{
+    struct stat st;
+    return stat(filename.c_str(), &st) == 0;
+}
+
+typedef boost::shared_ptr<const NEWIMAGE::volume4D<float> > ImagePtr;
+
+class ImageCacheTest : public ::testing::Test
+{
+protected:
+    virtual void TearDown()
+    {
+        remove("testfabber_cache1.nii.gz");
+        remove("testfabber_cache2.nii.gz");
+        remove("testfabber_cache3.nii.gz");
+    }
+};
+
+// Test a cached image is returned until the size or modification time of
+// the file changes
+TEST_F(ImageCacheTest, Reload)
+{
+    ImageCache cache;
+    SaveImage("testfabber_cache1.nii.gz", NX, 1);
+    ImagePtr vol = cache.Load("testfabber_cache1.nii.gz");
+    ASSERT_EQ(NX, vol->xsize());
+    ASSERT_EQ(vol.get(), cache.Load("testfabber_cache1.nii.gz").get());
+
+    SaveImage("testfabber_cache1.nii.gz", NX + 1, 1);
+    ImagePtr resized = cache.Load("testfabber_cache1.nii.gz");
+    ASSERT_NE(vol.get(), resized.get());
+    ASSERT_EQ(NX + 1, resized->xsize());
+    ASSERT_EQ(resized.get(), cache.Load("testfabber_cache1.nii.gz").get());
+
+    struct stat st;
+    ASSERT_EQ(0, stat("testfabber_cache1.nii.gz", &st));
+    struct utimbuf times;
+    times.actime = st.st_atime;
+    times.modtime = st.st_mtime + 10;
+    ASSERT_EQ(0, utime("testfabber_cache1.nii.gz", &times));
+    ImagePtr touched = cache.Load("testfabber_cache1.nii.gz");
+    ASSERT_NE(resized.get(), touched.get());
+    ASSERT_EQ(NX + 1, touched->xsize());
+}
+
+// Test the least recently used image is dropped when the cache is full
+TEST_F(ImageCacheTest, Evict)
+{
+    ImageCache cache(2);
+    SaveImage("testfabber_cache1.nii.gz", NX, 1);
+    SaveImage("testfabber_cache2.nii.gz", NX, 2);
+    SaveImage("testfabber_cache3.nii.gz", NX, 3);
+
+    ImagePtr vol1 = cache.Load("testfabber_cache1.nii.gz");
+    ImagePtr vol2 = cache.Load("testfabber_cache2.nii.gz");
+
+    // Image 1 is now used more recently than image 2, so image 2 is dropped
+    ASSERT_EQ(vol1.get(), cache.Load("testfabber_cache1.nii.gz").get());
+    ImagePtr vol3 = cache.Load("testfabber_cache3.nii.gz");
+    ASSERT_EQ(vol1.get(), cache.Load("testfabber_cache1.nii.gz").get());
+    ASSERT_EQ(vol3.get(), cache.Load("testfabber_cache3.nii.gz").get());
+    ASSERT_NE(vol2.get(), cache.Load("testfabber_cache2.nii.gz").get());
+}
+
+// Test a missing file is an error
+TEST_F(ImageCacheTest, Missing)
+{
+    ImageCache cache;
+    ASSERT_THROW(cache.Load("testfabber_cache_missing.nii.gz"), DataNotFound);
+}
+
+// Runs a server until it is stopped
+class ServeThread : public Thread
+{
+public:
+    explicit ServeThread(FabberServer &server)
+        : m_server(server)
+    {
+    }
+
+protected:
+    void Run()
+    {
+        m_server.Serve();
+    }
+
+private:
+    FabberServer &m_server;
+};
+
+const string SPOOL = "testfabber_spool.tmp";
+const string DATA = "testfabber_server_data.nii.gz";
+
+class ServerTest : public ::testing::Test
+{
+protected:
+    ServerTest()
+    {
+        FabberSetup::SetupDefaults();
+    }
+
+    virtual ~ServerTest()
+    {
+        FabberSetup::Destroy();
+    }
+
+    virtual void TearDown()
+    {
+        remove(DATA.c_str());
+        string cmd = "rm -rf " + SPOOL + " testfabber_out.tmp testfabber_out2.tmp";
+        int ret = system(cmd.c_str()); // Not portable!
+        if (ret != 0)
+            cerr << "WARNING: failed to remove temp directories" << endl;
+    }
+
+    // Write a job to the spool directory
+    void SaveJob(const string &name, const string &data, const string &output)
+    {
+        ofstream job((SPOOL + "/" + name).c_str());
+        job << "# Linear fit" << endl
+            << "model=poly" << endl
+            << "degree=1" << endl
+            << "method=vb" << endl
+            << "noise=white" << endl
+            << "data=" << data << endl
+            << "output=" << output << endl;
+    }
+};
+
+// Test jobs placed in the spool directory are run, with the job files renamed
+// to show the outcome and the error saved for a failed job
+TEST_F(ServerTest, Spool)
+{
+    ASSERT_EQ(0, mkdir(SPOOL.c_str(), 0755));
+    SaveImage(DATA, NX, 2);
+    SaveJob("good.fab", DATA, "testfabber_out.tmp");
+    SaveJob("bad.fab", "testfabber_server_missing.nii.gz", "testfabber_out2.tmp");
+
+    EasyLog log;
+    stringstream logstr;
+    log.StartLog(logstr);
+    FabberRunData options;
+    options.Set("spool", SPOOL);
+    options.Set("max-cores", "2");
+    FabberServer server(options);
+    server.SetLogger(&log);
+
+    ServeThread thread(server);
+    thread.Start();
+    const string good = SPOOL + "/good.fab", bad = SPOOL + "/bad.fab";
+    for (int i = 0; (i < 600) && !(FileExists(good + ".done") && FileExists(bad + ".failed"));
+         i++)
+    {
+        usleep(100000);
+    }
+    FabberServer::Stop();
+    thread.Join();
+    log.StopLog();
+    ASSERT_EQ("", thread.GetError());
+
+    ASSERT_TRUE(FileExists(good + ".done")) << logstr.str();
+    ASSERT_FALSE(FileExists(good));
+    ASSERT_FALSE(FileExists(good + ".running"));
+    ASSERT_FALSE(FileExists(good + ".error"));
+
+    ASSERT_TRUE(FileExists(bad + ".failed")) << logstr.str();
+    ASSERT_FALSE(FileExists(bad));
+    ASSERT_FALSE(FileExists(bad + ".running"));
+    ifstream error((bad + ".error").c_str());
+    string msg;
+    getline(error, msg);
+    ASSERT_NE("", msg);
+
+    // Poly model evaluates at t=1..NTIMES so the fitted intercept is one less
+    NEWIMAGE::volume<float> mean_c0, mean_c1;
+    NEWIMAGE::read_volume(mean_c0, "testfabber_out.tmp/mean_c0.nii.gz");
+    NEWIMAGE::read_volume(mean_c1, "testfabber_out.tmp/mean_c1.nii.gz");
+    ASSERT_EQ(NX, mean_c0.xsize());
+    for (int x = 0; x < NX; x++)
+    {
+        ASSERT_NEAR(1 + x, mean_c0(x, 0, 0), 0.1);
+        ASSERT_NEAR(1, mean_c1(x, 0, 0), 0.01);
+    }
+    ASSERT_FALSE(FileExists("testfabber_out2.tmp/mean_c0.nii.gz"));
+}
+}
+
+#endif /* _WIN32 */
+#endif /* NO_NEWIMAGE */
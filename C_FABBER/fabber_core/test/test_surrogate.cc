@@ -0,0 +1,148 @@
+//
+// Tests of the surrogate (interpolated) forward model
+
+#include "gtest/gtest.h"
+
+#include "easylog.h"
+#include "fwdmodel.h"
+#include "rundata.h"
+#include "setup.h"
+
+#include <newmat.h>
+
+#include <memory>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace
+{
+class SurrogateTest : public ::testing::TestWithParam<std::string>
+{
+protected:
+    SurrogateTest()
+    {
+        FabberSetup::SetupDefaults();
+    }
+
+    virtual ~SurrogateTest()
+    {
+        FabberSetup::Destroy();
+    }
+
+    virtual void SetUp()
+    {
+        rundata.SetLogger(&log);
+        rundata.Set("model", "surrogate");
+        rundata.Set("surrogate-model", "poly");
+        rundata.Set("surrogate-interp", GetParam());
+        rundata.Set("surrogate-ntpts", NTIMES);
+        rundata.Set("surrogate-min", "-2,-1,-0.5");
+        rundata.Set("surrogate-max", "2,1,0.5");
+        rundata.Set("degree", 2);
+    }
+
+    // Evaluate the polynomial model directly for comparison
+    void PolyEvaluate(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result)
+    {
+        std::auto_ptr<FwdModel> poly(FwdModel::NewFromName("poly"));
+        poly->Initialize(rundata);
+        NEWMAT::ColumnVector voxdata(NTIMES), coords(3);
+        voxdata = 0;
+        coords = 0;
+        poly->PassData(voxdata, coords);
+        poly->EvaluateModel(params, result);
+    }
+
+    static const int NTIMES = 7;
+    EasyLog log;
+    FabberRunData rundata;
+};
+
+// Tests that a model which is linear in its parameters is reproduced
+// exactly by the interpolant, including outside the sampled range
+TEST_P(SurrogateTest, LinearModelExact)
+{
+    std::auto_ptr<FwdModel> model(FwdModel::NewFromName("surrogate"));
+    model->Initialize(rundata);
+    std::vector<Parameter> params;
+    model->GetParameters(rundata, params);
+    ASSERT_EQ(3, params.size());
+
+    double testvals[][3] = { { 0.3, -0.7, 0.1 }, { -1.9, 0.99, -0.45 }, { 2.5, -1.5, 0.7 } };
+    for (int i = 0; i < 3; i++)
+    {
+        NEWMAT::ColumnVector p(3), result, expected;
+        p << testvals[i][0] << testvals[i][1] << testvals[i][2];
+        model->EvaluateModel(p, result);
+        PolyEvaluate(p, expected);
+        ASSERT_EQ(NTIMES, result.Nrows());
+        for (int t = 1; t <= NTIMES; t++)
+        {
+            ASSERT_NEAR(expected(t), result(t), 1e-8 * std::max(1.0, fabs(expected(t))));
+        }
+    }
+}
+
+// Tests the analytic gradient of the interpolant
+TEST_P(SurrogateTest, Gradient)
+{
+    std::auto_ptr<FwdModel> model(FwdModel::NewFromName("surrogate"));
+    model->Initialize(rundata);
+
+    NEWMAT::ColumnVector p(3);
+    p << 0.3 << -0.7 << 0.1;
+    NEWMAT::Matrix grad;
+    ASSERT_TRUE(model->Gradient(p, grad));
+    ASSERT_EQ(NTIMES, grad.Nrows());
+    ASSERT_EQ(3, grad.Ncols());
+
+    // Polynomial model: d/dc_n = t^n
+    for (int t = 1; t <= NTIMES; t++)
+    {
+        ASSERT_NEAR(1, grad(t, 1), 1e-8);
+        ASSERT_NEAR(t, grad(t, 2), 1e-8);
+        ASSERT_NEAR(t * t, grad(t, 3), 1e-8);
+    }
+}
+
+// Tests that grid samples are written to and reused from the cache file
+TEST_P(SurrogateTest, Cache)
+{
+    std::string filename = "surrogate_test.cache";
+    remove(filename.c_str());
+    rundata.Set("surrogate-cache", filename);
+
+    NEWMAT::ColumnVector p(3), result1, result2;
+    p << 0.3 << -0.7 << 0.1;
+
+    std::auto_ptr<FwdModel> model1(FwdModel::NewFromName("surrogate"));
+    model1->Initialize(rundata);
+    model1->EvaluateModel(p, result1);
+
+    FILE *f = fopen(filename.c_str(), "rb");
+    ASSERT_TRUE(f != NULL);
+    fclose(f);
+
+    std::auto_ptr<FwdModel> model2(FwdModel::NewFromName("surrogate"));
+    model2->Initialize(rundata);
+    model2->EvaluateModel(p, result2);
+    remove(filename.c_str());
+
+    ASSERT_EQ(result1.Nrows(), result2.Nrows());
+    for (int t = 1; t <= result1.Nrows(); t++)
+    {
+        ASSERT_EQ(result1(t), result2(t));
+    }
+}
+
+// Tests that the wrapped model must be specified
+TEST_P(SurrogateTest, NoModel)
+{
+    rundata.Unset("surrogate-model");
+    std::auto_ptr<FwdModel> model(FwdModel::NewFromName("surrogate"));
+    ASSERT_THROW(model->Initialize(rundata), FabberError);
+}
+
+INSTANTIATE_TEST_CASE_P(SurrogateTests, SurrogateTest, ::testing::Values("linear", "cubic"));
+}
@@ -15,6 +15,13 @@
 #include "rundata_newimage.h"
 #include "setup.h"
 
+#include <iostream>
+#include <limits>
+#include <math.h>
+#include <sstream>
+#include <stdlib.h>
+#include <time.h>
+
 namespace
 {
 
@@ -301,6 +308,446 @@ TEST_P(VbTest, ImagePriorsFile)
 }
 #endif
 
+// Test coarse-to-fine initialization gives the same result as a normal run
+// when the data varies between voxels
+TEST_P(VbTest, CoarseInit)
+{
+    int NTIMES = 10;
+    int VSIZE = 5;
+    float VAL = 7.32;
+    int DEGREE = 2;
+
+    // Create coordinates and data matrices
+    // Data fitted to a quadratic function whose coefficients vary
+    // across the volume, so the block averages differ from the voxels
+    NEWMAT::Matrix voxelCoords, data;
+    data.ReSize(NTIMES, VSIZE * VSIZE * VSIZE);
+    voxelCoords.ReSize(3, VSIZE * VSIZE * VSIZE);
+    int v = 1;
+    for (int z = 0; z < VSIZE; z++)
+    {
+        for (int y = 0; y < VSIZE; y++)
+        {
+            for (int x = 0; x < VSIZE; x++)
+            {
+                voxelCoords(1, v) = x;
+                voxelCoords(2, v) = y;
+                voxelCoords(3, v) = z;
+                for (int n = 0; n < NTIMES; n++)
+                {
+                    data(n + 1, v) = VAL * (x + 1) + (1.5 * VAL) * (z + 1) * (n + 1) * (n + 1);
+                }
+                v++;
+            }
+        }
+    }
+
+    rundata->SetVoxelCoords(voxelCoords);
+    rundata->SetVoxelData("data", data);
+    rundata->Set("noise", "white");
+    rundata->Set("model", "poly");
+    rundata->Set("degree", stringify(DEGREE));
+    rundata->Set("max-iterations", "20");
+    rundata->Set("coarse-init", "4");
+    Run();
+
+    NEWMAT::Matrix mean0 = rundata->GetVoxelData("mean_c0");
+    NEWMAT::Matrix mean2 = rundata->GetVoxelData("mean_c2");
+    ASSERT_EQ(mean0.Nrows(), 1);
+    ASSERT_EQ(mean0.Ncols(), VSIZE * VSIZE * VSIZE);
+    ASSERT_EQ(mean2.Ncols(), VSIZE * VSIZE * VSIZE);
+    for (int i = 0; i < VSIZE * VSIZE * VSIZE; i++)
+    {
+        int x = int(voxelCoords(1, i + 1));
+        int z = int(voxelCoords(3, i + 1));
+        ASSERT_NEAR(VAL * (x + 1), mean0(1, i + 1), VAL * 0.01);
+        ASSERT_NEAR(VAL * 1.5 * (z + 1), mean2(1, i + 1), VAL * 0.01);
+    }
+}
+
+// Test coarse-to-fine initialization requires a power of 2 block size
+TEST_P(VbTest, CoarseInitBadBlockSize)
+{
+    NEWMAT::Matrix voxelCoords(3, 1), data(10, 1);
+    voxelCoords = 0;
+    data = 1;
+    rundata->SetVoxelCoords(voxelCoords);
+    rundata->SetVoxelData("data", data);
+    rundata->Set("noise", "white");
+    rundata->Set("model", "poly");
+    rundata->Set("degree", "0");
+    rundata->Set("coarse-init", "3");
+    ASSERT_THROW(Run(), InvalidOptionValue);
+}
+
+// Test fitting from multiple starting points
+TEST_P(VbTest, MultiStart)
+{
+    int NTIMES = 10;
+    int VSIZE = 3;
+    float VAL = 7.32;
+
+    // Linear data whose slope varies across the volume
+    NEWMAT::Matrix voxelCoords, data;
+    data.ReSize(NTIMES, VSIZE * VSIZE * VSIZE);
+    voxelCoords.ReSize(3, VSIZE * VSIZE * VSIZE);
+    int v = 1;
+    for (int z = 0; z < VSIZE; z++)
+    {
+        for (int y = 0; y < VSIZE; y++)
+        {
+            for (int x = 0; x < VSIZE; x++)
+            {
+                voxelCoords(1, v) = x;
+                voxelCoords(2, v) = y;
+                voxelCoords(3, v) = z;
+                for (int n = 0; n < NTIMES; n++)
+                {
+                    data(n + 1, v) = VAL + 0.5 * VAL * (x + 1) * (n + 1) + 0.1 * ((n + v) % 3);
+                }
+                v++;
+            }
+        }
+    }
+
+    rundata->SetVoxelCoords(voxelCoords);
+    rundata->SetVoxelData("data", data);
+    rundata->Set("noise", "white");
+    rundata->Set("model", "poly");
+    rundata->Set("degree", "1");
+    rundata->Set("max-iterations", "20");
+    rundata->SetBool("save-free-energy");
+
+    // Free energy is only calculated for single start VB if it is needed
+    rundata->SetBool("print-free-energy");
+
+    if (GetParam() == "spatialvb")
+    {
+        // Only supported for voxelwise VB
+        rundata->Set("multistart", "4");
+        ASSERT_THROW(Run(), InvalidOptionValue);
+        return;
+    }
+
+    Run();
+    NEWMAT::Matrix mean1 = rundata->GetVoxelData("mean_c1");
+    NEWMAT::Matrix free1 = rundata->GetVoxelData("freeEnergy");
+
+    rundata->Set("multistart", "4");
+    Run();
+    NEWMAT::Matrix mean4 = rundata->GetVoxelData("mean_c1");
+    NEWMAT::Matrix free4 = rundata->GetVoxelData("freeEnergy");
+    NEWMAT::Matrix best = rundata->GetVoxelData("multistart_best");
+    ASSERT_EQ(VSIZE * VSIZE * VSIZE, best.Ncols());
+    for (int i = 1; i <= VSIZE * VSIZE * VSIZE; i++)
+    {
+        // The initial posterior is always the first start, so we cannot do worse
+        ASSERT_GE(free4(1, i), free1(1, i) - 1e-6);
+        ASSERT_NEAR(mean1(1, i), mean4(1, i), VAL * 0.01);
+        ASSERT_GE(best(1, i), 1);
+        ASSERT_LE(best(1, i), 4);
+    }
+
+    // Result should not depend on the number of threads
+    rundata->Set("num-threads", "3");
+    Run();
+    NEWMAT::Matrix mean4_threads = rundata->GetVoxelData("mean_c1");
+    NEWMAT::Matrix best_threads = rundata->GetVoxelData("multistart_best");
+    for (int i = 1; i <= VSIZE * VSIZE * VSIZE; i++)
+    {
+        ASSERT_EQ(mean4(1, i), mean4_threads(1, i));
+        ASSERT_EQ(best(1, i), best_threads(1, i));
+    }
+}
+
+// Mean iterations per voxel from the last voxelwise VB run in a log
+static double MeanIterations(const std::string &logtext)
+{
+    std::string key = "Vb::Mean iterations per voxel: ";
+    size_t pos = logtext.rfind(key);
+    if (pos == std::string::npos)
+        return -1;
+    return atof(logtext.c_str() + pos + key.size());
+}
+
+// Test warm starts from neighbouring voxels give the same result as
+// a cold start in no more iterations
+TEST_P(VbTest, WarmStart)
+{
+    int NTIMES = 10;
+    int VSIZE = 8;
+    float VAL = 7.32;
+
+    // Quadratic data whose coefficients vary smoothly across the
+    // volume, with a small amount of deterministic 'noise'
+    NEWMAT::Matrix voxelCoords, data;
+    data.ReSize(NTIMES, VSIZE * VSIZE * VSIZE);
+    voxelCoords.ReSize(3, VSIZE * VSIZE * VSIZE);
+    int v = 1;
+    for (int z = 0; z < VSIZE; z++)
+    {
+        for (int y = 0; y < VSIZE; y++)
+        {
+            for (int x = 0; x < VSIZE; x++)
+            {
+                voxelCoords(1, v) = x;
+                voxelCoords(2, v) = y;
+                voxelCoords(3, v) = z;
+                for (int n = 0; n < NTIMES; n++)
+                {
+                    data(n + 1, v) = VAL * (1 + 0.1 * x) + VAL * (1 + 0.05 * y) * (n + 1)
+                        + 0.1 * VAL * (1 + 0.02 * z) * (n + 1) * (n + 1)
+                        + 0.05 * ((7 * n + v) % 5);
+                }
+                v++;
+            }
+        }
+    }
+
+    rundata->SetVoxelCoords(voxelCoords);
+    rundata->SetVoxelData("data", data);
+    rundata->Set("noise", "white");
+    rundata->Set("model", "poly");
+    rundata->Set("degree", "2");
+    rundata->Set("convergence", "pointzeroone");
+    rundata->Set("max-iterations", "100");
+
+    if (GetParam() == "spatialvb")
+    {
+        // Only supported for voxelwise VB
+        rundata->Set("warm-start", "raster");
+        ASSERT_THROW(Run(), InvalidOptionValue);
+        return;
+    }
+
+    std::stringstream logtext;
+    log.StartLog(logtext);
+    Run();
+    double cold_its = MeanIterations(logtext.str());
+    NEWMAT::Matrix cold_mean = rundata->GetVoxelData("mean_c1");
+    ASSERT_GT(cold_its, 0);
+
+    const char *orders[] = { "raster", "hilbert" };
+    for (int i = 0; i < 2; i++)
+    {
+        logtext.str("");
+        rundata->Set("warm-start", orders[i]);
+        Run();
+        double its = MeanIterations(logtext.str());
+        ASSERT_GT(its, 0);
+        ASSERT_LE(its, cold_its);
+
+        NEWMAT::Matrix mean = rundata->GetVoxelData("mean_c1");
+        for (int j = 1; j <= VSIZE * VSIZE * VSIZE; j++)
+        {
+            ASSERT_NEAR(cold_mean(1, j), mean(1, j), VAL * 0.01);
+        }
+    }
+    log.StopLog();
+}
+
+// Test warm starts require a known voxel order
+TEST_P(VbTest, WarmStartBadOrder)
+{
+    NEWMAT::Matrix voxelCoords(3, 1), data(10, 1);
+    voxelCoords = 0;
+    data = 1;
+    rundata->SetVoxelCoords(voxelCoords);
+    rundata->SetVoxelData("data", data);
+    rundata->Set("noise", "white");
+    rundata->Set("model", "poly");
+    rundata->Set("degree", "0");
+    rundata->Set("warm-start", "spiral");
+    ASSERT_THROW(Run(), InvalidOptionValue);
+}
+
+// Test the bad voxel mask is output and marks only the voxel which could not be fitted
+TEST_P(VbTest, SaveBadVoxels)
+{
+    int NTIMES = 10;
+    int VSIZE = 3;
+    int BAD = 14;
+
+    NEWMAT::Matrix voxelCoords, data;
+    data.ReSize(NTIMES, VSIZE * VSIZE * VSIZE);
+    voxelCoords.ReSize(3, VSIZE * VSIZE * VSIZE);
+    int v = 1;
+    for (int z = 0; z < VSIZE; z++)
+    {
+        for (int y = 0; y < VSIZE; y++)
+        {
+            for (int x = 0; x < VSIZE; x++)
+            {
+                voxelCoords(1, v) = x;
+                voxelCoords(2, v) = y;
+                voxelCoords(3, v) = z;
+                for (int n = 0; n < NTIMES; n++)
+                {
+                    data(n + 1, v) = x + y * (n + 1) + 0.1 * ((n + v) % 3);
+                }
+                v++;
+            }
+        }
+    }
+
+    // Spatial VB does not recover from non-finite data so the bad voxel is
+    // only introduced for voxelwise VB
+    bool voxelwise = (GetParam() == "vb");
+    if (voxelwise)
+    {
+        for (int n = 1; n <= NTIMES; n++)
+        {
+            data(n, BAD) = std::numeric_limits<double>::quiet_NaN();
+        }
+    }
+
+    rundata->SetVoxelCoords(voxelCoords);
+    rundata->SetVoxelData("data", data);
+    rundata->Set("noise", "white");
+    rundata->Set("model", "poly");
+    rundata->Set("degree", "1");
+    rundata->SetBool("allow-bad-voxels");
+    rundata->SetBool("save-bad-voxels");
+    Run();
+
+    NEWMAT::Matrix bad = rundata->GetVoxelData("bad_voxels");
+    ASSERT_EQ(1, bad.Nrows());
+    ASSERT_EQ(VSIZE * VSIZE * VSIZE, bad.Ncols());
+    for (int i = 1; i <= VSIZE * VSIZE * VSIZE; i++)
+    {
+        ASSERT_EQ((voxelwise && (i == BAD)) ? 1 : 0, bad(1, i));
+    }
+}
+
+// Test reordering voxels for spatial VB gives the same result as the original order
+TEST_P(VbTest, SpatialOrder)
+{
+    int NTIMES = 10;
+    int VSIZE = 5;
+
+    NEWMAT::Matrix voxelCoords, data;
+    data.ReSize(NTIMES, VSIZE * VSIZE * VSIZE);
+    voxelCoords.ReSize(3, VSIZE * VSIZE * VSIZE);
+    int v = 1;
+    for (int z = 0; z < VSIZE; z++)
+    {
+        for (int y = 0; y < VSIZE; y++)
+        {
+            for (int x = 0; x < VSIZE; x++)
+            {
+                voxelCoords(1, v) = x;
+                voxelCoords(2, v) = y;
+                voxelCoords(3, v) = z;
+                for (int n = 0; n < NTIMES; n++)
+                {
+                    data(n + 1, v) = x + 0.5 * z * (n + 1) + 0.1 * ((n + v) % 3);
+                }
+                v++;
+            }
+        }
+    }
+
+    rundata->SetVoxelCoords(voxelCoords);
+    rundata->SetVoxelData("data", data);
+    rundata->Set("noise", "white");
+    rundata->Set("model", "poly");
+    rundata->Set("degree", "1");
+    rundata->Set("max-iterations", "50");
+    rundata->Set("param-spatial-priors", "M+");
+    rundata->Set("spatial-order", "morton");
+    if (GetParam() == "vb")
+    {
+        ASSERT_THROW(Run(), InvalidOptionValue);
+        return;
+    }
+    Run();
+    NEWMAT::Matrix mean0 = rundata->GetVoxelData("mean_c0");
+    NEWMAT::Matrix mean1 = rundata->GetVoxelData("mean_c1");
+
+    rundata->Set("spatial-order", "");
+    Run();
+    NEWMAT::Matrix ref0 = rundata->GetVoxelData("mean_c0");
+    NEWMAT::Matrix ref1 = rundata->GetVoxelData("mean_c1");
+    ASSERT_EQ(VSIZE * VSIZE * VSIZE, mean0.Ncols());
+    for (int i = 1; i <= VSIZE * VSIZE * VSIZE; i++)
+    {
+        ASSERT_NEAR(ref0(1, i), mean0(1, i), 0.01);
+        ASSERT_NEAR(ref1(1, i), mean1(1, i), 0.01);
+    }
+}
+
+// Test resuming spatial VB from a checkpoint gives the same result as an uninterrupted run
+TEST_P(VbTest, Checkpoint)
+{
+    int NTIMES = 10;
+    int VSIZE = 4;
+    string FILENAME = "temp_checkpoint";
+
+    NEWMAT::Matrix voxelCoords, data;
+    data.ReSize(NTIMES, VSIZE * VSIZE * VSIZE);
+    voxelCoords.ReSize(3, VSIZE * VSIZE * VSIZE);
+    int v = 1;
+    for (int z = 0; z < VSIZE; z++)
+    {
+        for (int y = 0; y < VSIZE; y++)
+        {
+            for (int x = 0; x < VSIZE; x++)
+            {
+                voxelCoords(1, v) = x;
+                voxelCoords(2, v) = y;
+                voxelCoords(3, v) = z;
+                for (int n = 0; n < NTIMES; n++)
+                {
+                    data(n + 1, v) = y + 0.3 * x * (n + 1) + 0.2 * ((n + v) % 3);
+                }
+                v++;
+            }
+        }
+    }
+
+    rundata->SetVoxelCoords(voxelCoords);
+    rundata->SetVoxelData("data", data);
+    rundata->Set("noise", "white");
+    rundata->Set("model", "poly");
+    rundata->Set("degree", "1");
+    rundata->Set("param-spatial-priors", "M+");
+    rundata->Set("max-iterations", "3");
+    rundata->Set("checkpoint", FILENAME);
+    if (GetParam() == "vb")
+    {
+        ASSERT_THROW(Run(), InvalidOptionValue);
+        return;
+    }
+
+    // Checkpoint is saved after iteration 2 as the run finishes after iteration 3
+    Run();
+
+    rundata->Set("checkpoint", "");
+    rundata->Set("max-iterations", "5");
+    rundata->Set("resume-from", FILENAME);
+    Run();
+    NEWMAT::Matrix mean0 = rundata->GetVoxelData("mean_c0");
+    NEWMAT::Matrix mean1 = rundata->GetVoxelData("mean_c1");
+
+    rundata->Set("resume-from", "");
+    Run();
+    NEWMAT::Matrix ref0 = rundata->GetVoxelData("mean_c0");
+    NEWMAT::Matrix ref1 = rundata->GetVoxelData("mean_c1");
+
+    // Checkpoint does not match a different model
+    rundata->Set("degree", "2");
+    rundata->Set("resume-from", FILENAME);
+    EXPECT_THROW(Run(), InvalidOptionValue);
+    remove(FILENAME.c_str());
+
+    ASSERT_EQ(VSIZE * VSIZE * VSIZE, mean0.Ncols());
+    for (int i = 1; i <= VSIZE * VSIZE * VSIZE; i++)
+    {
+        ASSERT_NEAR(ref0(1, i), mean0(1, i), 1e-6);
+        ASSERT_NEAR(ref1(1, i), mean1(1, i), 1e-6);
+    }
+}
+
 // Test restarting VB run
 TEST_P(VbTest, Restart)
 {
@@ -771,6 +1218,295 @@ TEST_P(VbTest, WhiteNoise)
     }
 }
 
+// Fit a linear function to a two-echo time series with a small amount of
+// deterministic 'noise' using the AR and white noise models, returning the
+// CPU time per voxel in ms for each
+static void FitTwoEchoes(FabberRunData &rundata, int ntimes, int nvoxels, float val,
+    NEWMAT::Matrix mean[2][2], double ms[2])
+{
+    NEWMAT::Matrix voxelCoords, data;
+    data.ReSize(ntimes, nvoxels);
+    voxelCoords.ReSize(3, nvoxels);
+    for (int v = 1; v <= nvoxels; v++)
+    {
+        voxelCoords(1, v) = (v - 1) % 10;
+        voxelCoords(2, v) = ((v - 1) / 10) % 10;
+        voxelCoords(3, v) = (v - 1) / 100;
+        for (int n = 0; n < ntimes; n++)
+        {
+            data(n + 1, v) = val + 0.1 * val * n + 0.01 * val * sin(double(n * v));
+        }
+    }
+
+    rundata.SetVoxelCoords(voxelCoords);
+    rundata.SetVoxelData("data", data);
+    rundata.Set("model", "poly");
+    rundata.Set("degree", "1");
+    rundata.Set("max-iterations", "10");
+    rundata.Set("num-echoes", "2");
+
+    const char *noise[] = { "white", "ar" };
+    for (int i = 0; i < 2; i++)
+    {
+        rundata.Set("noise", noise[i]);
+        clock_t start = clock();
+        rundata.Run();
+        ms[i] = 1000 * double(clock() - start) / CLOCKS_PER_SEC / nvoxels;
+        mean[i][0] = rundata.GetVoxelData("mean_c0");
+        mean[i][1] = rundata.GetVoxelData("mean_c1");
+    }
+}
+
+// Test the AR and white noise models agree with each other and with the
+// true parameters on a long two-echo time series
+TEST_P(VbTest, ArNoiseTwoEchoes)
+{
+    int NTIMES = 200; // interleaved, 100 for each echo
+    int NVOXELS = 100;
+    float VAL = 2;
+
+    NEWMAT::Matrix mean[2][2];
+    double ms[2];
+    FitTwoEchoes(*rundata, NTIMES, NVOXELS, VAL, mean, ms);
+    for (int i = 0; i < 2; i++)
+    {
+        ASSERT_EQ(NVOXELS, mean[i][0].Ncols());
+        ASSERT_EQ(NVOXELS, mean[i][1].Ncols());
+    }
+
+    for (int v = 1; v <= NVOXELS; v++)
+    {
+        ASSERT_NEAR(VAL, mean[0][0](1, v), 0.05);
+        ASSERT_NEAR(VAL, mean[1][0](1, v), 0.05);
+        ASSERT_NEAR(mean[0][0](1, v), mean[1][0](1, v), 0.05);
+        ASSERT_NEAR(mean[0][1](1, v), mean[1][1](1, v), 0.005);
+    }
+}
+
+// Benchmark of the cost per voxel of the AR and white noise models on the
+// same data. Run with --gtest_also_run_disabled_tests
+TEST_P(VbTest, DISABLED_ArNoiseCost)
+{
+    int NTIMES = 1000; // interleaved, 500 for each echo
+    int NVOXELS = 1000;
+    float VAL = 2;
+
+    NEWMAT::Matrix mean[2][2];
+    double ms[2];
+    FitTwoEchoes(*rundata, NTIMES, NVOXELS, VAL, mean, ms);
+    std::cout << GetParam() << ": CPU time per voxel with noise=white: " << ms[0]
+              << " ms, noise=ar: " << ms[1] << " ms" << std::endl;
+
+    for (int v = 1; v <= NVOXELS; v++)
+    {
+        ASSERT_NEAR(mean[0][0](1, v), mean[1][0](1, v), 0.05);
+        ASSERT_NEAR(mean[0][1](1, v), mean[1][1](1, v), 0.005);
+    }
+}
+
+// Test that each numerical differentiation method gives the same result for
+// a model which is linear in its parameters, and the Jacobian check diagnostic
+TEST_P(VbTest, FiniteDifferences)
+{
+    int NTIMES = 10;
+    int NVOXELS = 27;
+    float VAL = 3.5;
+
+    NEWMAT::Matrix voxelCoords, data;
+    data.ReSize(NTIMES, NVOXELS);
+    voxelCoords.ReSize(3, NVOXELS);
+    for (int v = 1; v <= NVOXELS; v++)
+    {
+        voxelCoords(1, v) = (v - 1) % 3;
+        voxelCoords(2, v) = ((v - 1) / 3) % 3;
+        voxelCoords(3, v) = (v - 1) / 9;
+        for (int n = 0; n < NTIMES; n++)
+        {
+            data(n + 1, v) = VAL + 0.5 * VAL * n * n + 0.01 * VAL * sin(double(n * v));
+        }
+    }
+
+    rundata->SetVoxelCoords(voxelCoords);
+    rundata->SetVoxelData("data", data);
+    rundata->Set("noise", "white");
+    rundata->Set("model", "poly");
+    rundata->Set("degree", "2");
+    Run();
+    NEWMAT::Matrix central = rundata->GetVoxelData("mean_c2");
+
+    const char *methods[] = { "forward", "richardson", "forward,central,richardson" };
+    for (int i = 0; i < 3; i++)
+    {
+        rundata->Set("fd-method", methods[i]);
+        rundata->SetBool("fd-adaptive", i == 2);
+        Run();
+        NEWMAT::Matrix mean = rundata->GetVoxelData("mean_c2");
+        for (int v = 1; v <= NVOXELS; v++)
+        {
+            ASSERT_NEAR(central(1, v), mean(1, v), VAL * 1e-4);
+        }
+    }
+
+    if (GetParam() == "vb")
+    {
+        std::stringstream logtext;
+        log.StartLog(logtext);
+        rundata->SetBool("jacobian-check");
+        Run();
+        log.StopLog();
+        ASSERT_NE(std::string::npos, logtext.str().find("Vb::Worst relative Jacobian errors"));
+    }
+
+    rundata->Set("fd-method", "forward,central");
+    ASSERT_THROW(Run(), InvalidOptionValue);
+    rundata->Set("fd-method", "backward");
+    ASSERT_THROW(Run(), InvalidOptionValue);
+}
+
+// Test that skipping the intermediate free energy calculations when they are
+// not printed does not change the result
+TEST_P(VbTest, LazyFreeEnergy)
+{
+    int NTIMES = 20;
+    int NVOXELS = 27;
+    float VAL = 2.5;
+
+    NEWMAT::Matrix voxelCoords, data;
+    data.ReSize(NTIMES, NVOXELS);
+    voxelCoords.ReSize(3, NVOXELS);
+    for (int v = 1; v <= NVOXELS; v++)
+    {
+        voxelCoords(1, v) = (v - 1) % 3;
+        voxelCoords(2, v) = ((v - 1) / 3) % 3;
+        voxelCoords(3, v) = (v - 1) / 9;
+        for (int n = 0; n < NTIMES; n++)
+        {
+            data(n + 1, v) = VAL + 0.5 * VAL * n + 0.1 * VAL * sin(double(n * v));
+        }
+    }
+
+    rundata->SetVoxelCoords(voxelCoords);
+    rundata->SetVoxelData("data", data);
+    rundata->Set("model", "poly");
+    rundata->Set("degree", "1");
+    rundata->Set("convergence", "trialmode");
+    rundata->Set("max-iterations", "10");
+    rundata->SetBool("save-free-energy");
+
+    const char *noise[] = { "white", "ar" };
+    for (int i = 0; i < 2; i++)
+    {
+        rundata->Set("noise", noise[i]);
+        for (int refresh = 1; refresh <= 3; refresh += 2)
+        {
+            rundata->Set("jacobian-refresh", stringify(refresh));
+            rundata->SetBool("print-free-energy", false);
+            Run();
+            NEWMAT::Matrix mean = rundata->GetVoxelData("mean_c1");
+            NEWMAT::Matrix free = rundata->GetVoxelData("freeEnergy");
+
+            rundata->SetBool("print-free-energy");
+            Run();
+            NEWMAT::Matrix mean_printed = rundata->GetVoxelData("mean_c1");
+            NEWMAT::Matrix free_printed = rundata->GetVoxelData("freeEnergy");
+            for (int v = 1; v <= NVOXELS; v++)
+            {
+                ASSERT_EQ(mean(1, v), mean_printed(1, v));
+                ASSERT_EQ(free(1, v), free_printed(1, v));
+            }
+        }
+    }
+}
+
+// Progress check which asks for the run to stop once a given voxel
+// (or spatial iteration) has been reached
+class CancelProgress : public ProgressCheck
+{
+public:
+    explicit CancelProgress(int stop_at)
+        : stop_at(stop_at)
+        , last_voxel(-1)
+        , last_iteration(-1)
+    {
+    }
+    void Progress(int voxel, int nVoxels)
+    {
+        last_voxel = voxel;
+    }
+    void Iteration(int iteration, double mean_F)
+    {
+        last_iteration = iteration;
+    }
+    bool Cancelled()
+    {
+        return last_voxel >= stop_at;
+    }
+    int stop_at, last_voxel, last_iteration;
+};
+
+// Test that a cancelled run stops early and still saves results for every voxel
+TEST_P(VbTest, Cancel)
+{
+    int NTIMES = 10;
+    int VSIZE = 3;
+    float VAL = 7.32;
+    int n_voxels = VSIZE * VSIZE * VSIZE;
+
+    NEWMAT::Matrix voxelCoords, data;
+    data.ReSize(NTIMES, n_voxels);
+    voxelCoords.ReSize(3, n_voxels);
+    int v = 1;
+    for (int z = 0; z < VSIZE; z++)
+    {
+        for (int y = 0; y < VSIZE; y++)
+        {
+            for (int x = 0; x < VSIZE; x++)
+            {
+                voxelCoords(1, v) = x;
+                voxelCoords(2, v) = y;
+                voxelCoords(3, v) = z;
+                for (int n = 0; n < NTIMES; n++)
+                {
+                    data(n + 1, v) = VAL;
+                }
+                v++;
+            }
+        }
+    }
+
+    rundata->SetVoxelCoords(voxelCoords);
+    rundata->SetVoxelData("data", data);
+    rundata->Set("noise", "white");
+    rundata->Set("model", "poly");
+    rundata->Set("degree", "0");
+    rundata->Set("max-iterations", "10");
+    rundata->Set("method", GetParam());
+
+    CancelProgress prog(2);
+    rundata->Run(&prog);
+
+    NEWMAT::Matrix mean = rundata->GetVoxelData("mean_c0");
+    ASSERT_EQ(mean.Nrows(), 1);
+    ASSERT_EQ(mean.Ncols(), n_voxels);
+    ASSERT_LT(prog.last_voxel, n_voxels);
+    if (GetParam() == "vb")
+    {
+        // Only the first two voxels were fitted
+        int nfitted = 0;
+        for (int i = 0; i < n_voxels; i++)
+        {
+            if (fabs(mean(1, i + 1) - VAL) < 0.01)
+                nfitted++;
+        }
+        ASSERT_EQ(2, nfitted);
+    }
+    else
+    {
+        // Stopped at the end of the third iteration
+        ASSERT_EQ(3, prog.last_iteration);
+    }
+}
+
 #ifdef __FABBER_MOTION
 // Turn motion correction on, but no motion to correct!
 TEST_P(VbTest, MotionCorNull)
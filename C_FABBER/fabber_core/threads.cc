@@ -0,0 +1,353 @@
+/*  threads.cc - Simple threading support for parallel calculations
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "threads.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <exception>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef NO_THREADS
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+Mutex::Mutex()
+{
+#ifndef NO_THREADS
+    pthread_mutex_init(&m_mutex, NULL);
+#endif
+}
+
+Mutex::~Mutex()
+{
+#ifndef NO_THREADS
+    pthread_mutex_destroy(&m_mutex);
+#endif
+}
+
+void Mutex::Lock()
+{
+#ifndef NO_THREADS
+    pthread_mutex_lock(&m_mutex);
+#endif
+}
+
+void Mutex::Unlock()
+{
+#ifndef NO_THREADS
+    pthread_mutex_unlock(&m_mutex);
+#endif
+}
+
+Thread::Thread()
+    : m_started(false)
+{
+}
+
+Thread::~Thread()
+{
+    assert(!m_started);
+}
+
+void Thread::Start()
+{
+    assert(!m_started);
+    m_error = "";
+#ifndef NO_THREADS
+    if (pthread_create(&m_thread, NULL, &Thread::Entry, this) != 0)
+    {
+        throw FabberInternalError("Failed to create thread");
+    }
+    m_started = true;
+#else
+    RunCatchingErrors();
+#endif
+}
+
+void Thread::Join()
+{
+#ifndef NO_THREADS
+    if (m_started)
+    {
+        pthread_join(m_thread, NULL);
+        m_started = false;
+    }
+#endif
+}
+
+void *Thread::Entry(void *thread)
+{
+    static_cast<Thread *>(thread)->RunCatchingErrors();
+    return NULL;
+}
+
+void Thread::RunCatchingErrors()
+{
+    try
+    {
+        Run();
+    }
+    catch (const exception &e)
+    {
+        m_error = e.what();
+        if (m_error == "")
+            m_error = "Unknown error";
+    }
+    catch (...)
+    {
+        m_error = "Unknown error";
+    }
+}
+
+namespace
+{
+/**
+ * Copy of an exception thrown in a worker thread, so it can be rethrown
+ * with its original type in the calling thread
+ */
+class StoredError
+{
+public:
+    virtual ~StoredError()
+    {
+    }
+    virtual void Rethrow() const = 0;
+};
+
+template <class E> class StoredErrorOf : public StoredError
+{
+public:
+    StoredErrorOf(const E &e)
+        : m_e(e)
+    {
+    }
+    virtual void Rethrow() const
+    {
+        throw m_e;
+    }
+
+private:
+    E m_e;
+};
+
+/**
+ * State shared by the threads used in ParallelFor
+ */
+struct ParallelForState
+{
+    ParallelForState(ParallelWork &work, int nitems, int chunk)
+        : work(work)
+        , nitems(nitems)
+        , chunk(chunk)
+        , next(0)
+        , failed(false)
+    {
+    }
+
+    /**
+     * Get the next chunk of items to process
+     *
+     * @return false if there is no more work to do
+     */
+    bool NextChunk(int &start, int &end)
+    {
+        ScopedLock lock(mutex);
+        if (failed || (next >= nitems))
+            return false;
+        start = next;
+        end = min(next + chunk, nitems);
+        next = end;
+        return true;
+    }
+
+    /** Stop handing out new items */
+    void Fail()
+    {
+        ScopedLock lock(mutex);
+        failed = true;
+    }
+
+    ParallelWork &work;
+    const int nitems;
+    const int chunk;
+    int next;
+    bool failed;
+    Mutex mutex;
+};
+
+class ParallelForThread : public Thread
+{
+public:
+    ParallelForThread(ParallelForState &state, int id)
+        : m_state(state)
+        , m_id(id)
+    {
+    }
+
+    /**
+     * Rethrow the exception thrown by Run(), if any. The most derived Fabber
+     * error type is kept, other standard exceptions become FabberInternalError
+     */
+    void RethrowError() const
+    {
+        if (m_stored.get())
+            m_stored->Rethrow();
+        else if (GetError() != "")
+            throw FabberInternalError(GetError());
+    }
+
+protected:
+    virtual void Run()
+    {
+        int start, end;
+        try
+        {
+            while (m_state.NextChunk(start, end))
+            {
+                for (int item = start; item < end; item++)
+                {
+                    m_state.work.Process(item, m_id);
+                }
+            }
+        }
+        catch (const MandatoryOptionMissing &e)
+        {
+            Store(e);
+        }
+        catch (const DataNotFound &e)
+        {
+            Store(e);
+        }
+        catch (const InvalidOptionValue &e)
+        {
+            Store(e);
+        }
+        catch (const FabberRunDataError &e)
+        {
+            Store(e);
+        }
+        catch (const FabberInternalError &e)
+        {
+            Store(e);
+        }
+        catch (const FabberError &e)
+        {
+            Store(e);
+        }
+        catch (const NEWMAT::Exception &e)
+        {
+            Store(e);
+        }
+        catch (...)
+        {
+            m_state.Fail();
+            throw;
+        }
+    }
+
+private:
+    // Called from a catch block. Rethrows so the message is also available from GetError()
+    template <class E> void Store(const E &e)
+    {
+        m_state.Fail();
+        m_stored.reset(new StoredErrorOf<E>(e));
+        throw;
+    }
+
+    ParallelForState &m_state;
+    int m_id;
+    std::auto_ptr<StoredError> m_stored;
+};
+}
+
+void ParallelFor(ParallelWork &work, int nitems, int nthreads, int chunk)
+{
+    nthreads = max(1, min(nthreads, (nitems + chunk - 1) / max(chunk, 1)));
+    if (nthreads <= 1)
+    {
+        for (int item = 0; item < nitems; item++)
+        {
+            work.Process(item, 0);
+        }
+        return;
+    }
+
+    ParallelForState state(work, nitems, max(chunk, 1));
+    vector<ParallelForThread *> threads;
+    string error;
+    for (int t = 0; t < nthreads; t++)
+    {
+        threads.push_back(new ParallelForThread(state, t));
+        try
+        {
+            threads[t]->Start();
+        }
+        catch (FabberError &e)
+        {
+            // Carry on with the threads we have
+            error = e.what();
+            delete threads[t];
+            threads.pop_back();
+            break;
+        }
+    }
+    if (threads.empty())
+    {
+        throw FabberInternalError(error);
+    }
+
+    int failed = -1;
+    for (unsigned int t = 0; t < threads.size(); t++)
+    {
+        threads[t]->Join();
+        if ((failed < 0) && (threads[t]->GetError() != ""))
+            failed = t;
+    }
+    try
+    {
+        if (failed >= 0)
+            threads[failed]->RethrowError();
+    }
+    catch (...)
+    {
+        for (unsigned int t = 0; t < threads.size(); t++)
+        {
+            delete threads[t];
+        }
+        throw;
+    }
+    for (unsigned int t = 0; t < threads.size(); t++)
+    {
+        delete threads[t];
+    }
+}
+
+int NumProcessors()
+{
+#if !defined(NO_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+    long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nprocs > 0)
+        return int(nprocs);
+#endif
+    return 1;
+}
+
+int GetNumThreads(FabberRunData &rundata)
+{
+#ifdef NO_THREADS
+    return 1;
+#else
+    int nthreads = rundata.GetIntDefault("num-threads", 1, 0);
+    if (nthreads == 0)
+        nthreads = NumProcessors();
+    return nthreads;
+#endif
+}
@@ -0,0 +1,158 @@
+/*  threads.h - Simple threading support for parallel calculations
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+#pragma once
+
+#include "rundata.h"
+
+#include <string>
+
+#ifndef NO_THREADS
+#include <pthread.h>
+#endif
+
+/**
+ * Mutual exclusion lock
+ *
+ * If built with NO_THREADS this does nothing
+ */
+class Mutex
+{
+public:
+    Mutex();
+    ~Mutex();
+    void Lock();
+    void Unlock();
+
+private:
+    // Not copyable
+    Mutex(const Mutex &);
+    Mutex &operator=(const Mutex &);
+
+#ifndef NO_THREADS
+    pthread_mutex_t m_mutex;
+#endif
+};
+
+/**
+ * Holds a lock on a mutex for as long as it is in scope
+ */
+class ScopedLock
+{
+public:
+    ScopedLock(Mutex &mutex)
+        : m_mutex(mutex)
+    {
+        m_mutex.Lock();
+    }
+    ~ScopedLock()
+    {
+        m_mutex.Unlock();
+    }
+
+private:
+    Mutex &m_mutex;
+};
+
+/**
+ * A thread of execution which runs the Run() method
+ *
+ * Exceptions thrown by Run() are caught and the message is available
+ * from GetError() after Join() returns. If built with NO_THREADS, Start()
+ * calls Run() directly.
+ */
+class Thread
+{
+public:
+    Thread();
+
+    /** The thread must have been joined before it is destroyed */
+    virtual ~Thread();
+
+    /** Start running the thread */
+    void Start();
+
+    /** Wait for the thread to finish. Does nothing if it was never started */
+    void Join();
+
+    /** @return Error message if Run() threw an exception, otherwise empty */
+    const std::string &GetError() const
+    {
+        return m_error;
+    }
+
+protected:
+    /** Subclasses implement this to do the work of the thread */
+    virtual void Run() = 0;
+
+private:
+    // Not copyable
+    Thread(const Thread &);
+    Thread &operator=(const Thread &);
+
+    static void *Entry(void *thread);
+    void RunCatchingErrors();
+
+#ifndef NO_THREADS
+    pthread_t m_thread;
+#endif
+    bool m_started;
+    std::string m_error;
+};
+
+/**
+ * Work which consists of independent items which can be processed in parallel
+ */
+class ParallelWork
+{
+public:
+    virtual ~ParallelWork()
+    {
+    }
+
+    /**
+     * Process a single item of work
+     *
+     * This will be called from multiple threads simultaneously so must
+     * not modify shared state without locking. Any per-thread state
+     * (e.g. a forward model instance) should be selected using the
+     * thread number.
+     *
+     * @param item Item to process, from 0 to nitems-1
+     * @param thread Thread number, from 0 to nthreads-1
+     */
+    virtual void Process(int item, int thread) = 0;
+};
+
+/**
+ * Process a set of work items using multiple threads
+ *
+ * Items are handed out to threads in chunks as they become free, so
+ * items which take different amounts of time are balanced between threads.
+ * This returns when all items have been processed. If any item throws an
+ * exception, no further items are started and the first error is rethrown
+ * once all threads have finished. Fabber errors and NEWMAT exceptions keep
+ * their type, anything else becomes a FabberInternalError with its message.
+ *
+ * @param work Work to process
+ * @param nitems Number of items
+ * @param nthreads Number of threads to use. If 1, all items are processed
+ *                 in the calling thread
+ * @param chunk Number of items to hand out at a time
+ */
+void ParallelFor(ParallelWork &work, int nitems, int nthreads, int chunk = 1);
+
+/**
+ * @return Number of processors available for running threads (at least 1)
+ */
+int NumProcessors();
+
+/**
+ * Get the number of threads to use from the num-threads option
+ *
+ * 0 means use one thread per processor. The default is 1 (no parallel
+ * processing). If built with NO_THREADS this always returns 1.
+ */
+int GetNumThreads(FabberRunData &rundata);
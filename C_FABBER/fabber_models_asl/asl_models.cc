@@ -76,10 +76,58 @@ NewInstanceFptr CALL get_new_instance_func(const char *name)
 namespace OXASL
 {
 // --- Kinetic curve functions ---
+// Batched evaluation defaults to calling the single TI version for each TI,
+// models override this where parameter extraction can be done once for all
+// TIs
+void AIFModel::kcblood_batch(ColumnVector &kc, const ColumnVector &tis, const double deltblood,
+    const ColumnVector &taub, const ColumnVector &T_1b, bool casl,
+    const ColumnVector &dispparam) const
+{
+    kc.ReSize(tis.Nrows());
+    for (int it = 1; it <= tis.Nrows(); it++)
+    {
+        kc(it) = kcblood(tis(it), deltblood, taub(it), T_1b(it), casl, dispparam);
+    }
+}
+
+void ResidModel::resid_batch(ColumnVector &r, const ColumnVector &tis, const double fcalib,
+    const double T_1, const double T_1b, const double lambda, const ColumnVector &residparam) const
+{
+    r.ReSize(tis.Nrows());
+    for (int it = 1; it <= tis.Nrows(); it++)
+    {
+        r(it) = resid(tis(it), fcalib, T_1, T_1b, lambda, residparam);
+    }
+}
+
+void TissueModel::kctissue_batch(ColumnVector &kc, const ColumnVector &tis, const double fcalib,
+    const double delttiss, const ColumnVector &tau, const ColumnVector &T_1b, const double T_1,
+    const double lambda, const bool casl, const ColumnVector &dispparam,
+    const ColumnVector &residparam) const
+{
+    kc.ReSize(tis.Nrows());
+    for (int it = 1; it <= tis.Nrows(); it++)
+    {
+        kc(it) = kctissue(
+            tis(it), fcalib, delttiss, tau(it), T_1b(it), T_1, lambda, casl, dispparam, residparam);
+    }
+}
+
+// Gamma dispersion kernel parameters s and p, shared by the gamma and GVF
+// models
+static void gamma_disp_params(const ColumnVector &dispparam, double &s, double &p)
+{
+    s = exp(dispparam(1));
+    double sp = exp(dispparam(2));
+    if (sp > 10)
+        sp = 10;
+    p = sp / s;
+}
+
 // Arterial
 
-double AIFModel_nodisp::kcblood(const double ti, const double deltblood, const double taub,
-    const double T_1b, const bool casl, const ColumnVector dispparam) const
+static double nodisp_kcblood(
+    const double ti, const double deltblood, const double taub, const double T_1b, const bool casl)
 {
     // Non dispersed arterial curve
     double kcblood = 0.0;
@@ -117,28 +165,33 @@ double AIFModel_nodisp::kcblood(const double ti, const double deltblood, const d
     return kcblood;
 }
 
+double AIFModel_nodisp::kcblood(const double ti, const double deltblood, const double taub,
+    const double T_1b, const bool casl, const ColumnVector dispparam) const
+{
+    return nodisp_kcblood(ti, deltblood, taub, T_1b, casl);
+}
+
+void AIFModel_nodisp::kcblood_batch(ColumnVector &kc, const ColumnVector &tis,
+    const double deltblood, const ColumnVector &taub, const ColumnVector &T_1b, bool casl,
+    const ColumnVector &dispparam) const
+{
+    kc.ReSize(tis.Nrows());
+    for (int it = 1; it <= tis.Nrows(); it++)
+    {
+        kc(it) = nodisp_kcblood(tis(it), deltblood, taub(it), T_1b(it), casl);
+    }
+}
+
 // NOTE: for cASL the version here is an over simplificaiton (just changing the
 // decay term and leaving the rest alone) since it ignores the fact that some
 // blood will be more delayed than the rest due to dispersion
-double AIFModel_gammadisp::kcblood(const double ti, const double deltblood, const double taub,
-    const double T_1b, const bool casl, const ColumnVector dispparam) const
+static double gammadisp_kcblood(const double ti, const double deltblood, const double taub,
+    const double T_1b, const bool casl, const double s, const double k,
+    const SpecialFunctions &sf)
 {
     // Gamma dispersed arterial curve (pASL)
     double kcblood = 0.0;
 
-    // extract dispersion parameters
-    double s;
-    double p;
-    s = (dispparam.Row(1)).AsScalar();
-    s = exp(s);
-    double sp = (dispparam.Row(2)).AsScalar();
-    sp = exp(sp);
-    if (sp > 10)
-        sp = 10;
-    p = sp / s;
-
-    double k = 1 + p * s;
-
     if (ti < deltblood)
     {
         kcblood = 0.0;
@@ -150,7 +203,7 @@ double AIFModel_gammadisp::kcblood(const double ti, const double deltblood, cons
         else
             kcblood = 2 * exp(-ti / T_1b);
 
-        kcblood *= (1 - igamc(k, s * (ti - deltblood)));
+        kcblood *= (1 - sf.Igamc(k, s * (ti - deltblood)));
     }
     else //(ti > deltblood + taub)
     {
@@ -158,28 +211,47 @@ double AIFModel_gammadisp::kcblood(const double ti, const double deltblood, cons
             kcblood = 2 * exp(-deltblood / T_1b);
         else
             kcblood = 2 * exp(-ti / T_1b);
-        kcblood *= (igamc(k, s * (ti - deltblood - taub)) - igamc(k, s * (ti - deltblood)));
+        kcblood *= (sf.Igamc(k, s * (ti - deltblood - taub))
+            - sf.Igamc(k, s * (ti - deltblood)));
     }
 
     return kcblood;
 }
 
-double AIFModel_gvf::kcblood(const double ti, const double deltblood, const double taub,
+double AIFModel_gammadisp::kcblood(const double ti, const double deltblood, const double taub,
     const double T_1b, const bool casl, const ColumnVector dispparam) const
 {
-    // GVF AIF shape
-    double kcblood = 0.0;
-
     // extract dispersion parameters
     double s;
     double p;
-    s = (dispparam.Row(1)).AsScalar();
-    s = exp(s);
-    double sp = (dispparam.Row(2)).AsScalar();
-    sp = exp(sp);
-    if (sp > 10)
-        sp = 10;
-    p = sp / s;
+    gamma_disp_params(dispparam, s, p);
+    double k = 1 + p * s;
+
+    return gammadisp_kcblood(ti, deltblood, taub, T_1b, casl, s, k, sf);
+}
+
+void AIFModel_gammadisp::kcblood_batch(ColumnVector &kc, const ColumnVector &tis,
+    const double deltblood, const ColumnVector &taub, const ColumnVector &T_1b, bool casl,
+    const ColumnVector &dispparam) const
+{
+    double s;
+    double p;
+    gamma_disp_params(dispparam, s, p);
+    double k = 1 + p * s;
+
+    kc.ReSize(tis.Nrows());
+    for (int it = 1; it <= tis.Nrows(); it++)
+    {
+        kc(it) = gammadisp_kcblood(tis(it), deltblood, taub(it), T_1b(it), casl, s, k, sf);
+    }
+}
+
+static double gvf_kcblood(const double ti, const double deltblood, const double taub,
+    const double T_1b, const bool casl, const double s, const double p,
+    const SpecialFunctions &sf)
+{
+    // GVF AIF shape
+    double kcblood = 0.0;
 
     // gamma variate arterial curve
     // NOTE:    taub does not directly affect the shape, jsut scale of this KC -
@@ -197,7 +269,7 @@ double AIFModel_gvf::kcblood(const double ti, const double deltblood, const doub
         else
             kcblood = 2 * exp(-ti / T_1b);
 
-        kcblood *= gvf(ti - deltblood, s, p);
+        kcblood *= sf.Gvf(ti - deltblood, s, p);
     }
     // we do not have bolus duration within the GVF AIF - the duration is
     // 'built' into the function shape
@@ -208,11 +280,37 @@ double AIFModel_gvf::kcblood(const double ti, const double deltblood, const doub
     return kcblood;
 }
 
+double AIFModel_gvf::kcblood(const double ti, const double deltblood, const double taub,
+    const double T_1b, const bool casl, const ColumnVector dispparam) const
+{
+    // extract dispersion parameters
+    double s;
+    double p;
+    gamma_disp_params(dispparam, s, p);
+
+    return gvf_kcblood(ti, deltblood, taub, T_1b, casl, s, p, sf);
+}
+
+void AIFModel_gvf::kcblood_batch(ColumnVector &kc, const ColumnVector &tis,
+    const double deltblood, const ColumnVector &taub, const ColumnVector &T_1b, bool casl,
+    const ColumnVector &dispparam) const
+{
+    double s;
+    double p;
+    gamma_disp_params(dispparam, s, p);
+
+    kc.ReSize(tis.Nrows());
+    for (int it = 1; it <= tis.Nrows(); it++)
+    {
+        kc(it) = gvf_kcblood(tis(it), deltblood, taub(it), T_1b(it), casl, s, p, sf);
+    }
+}
+
 // NOTE: for cASL the version here is an over simplificaiton (just changing the
 // decay term and leaving the rest alone) since it ignores the fact that some
 // blood will be more delayed than the rest due to dispersion
-double AIFModel_gaussdisp::kcblood(const double ti, const double deltblood, const double taub,
-    const double T_1b, const bool casl, const ColumnVector dispparam) const
+static double gaussdisp_kcblood(const double ti, const double deltblood, const double taub,
+    const double T_1b, const bool casl, const double sig1, const SpecialFunctions &sf)
 {
     // Gaussian dispersion arterial curve
     // after Hrabe & Lewis, MRM, 2004 for pASL
@@ -220,8 +318,6 @@ double AIFModel_gaussdisp::kcblood(const double ti, const double deltblood, cons
     double kcblood = 0.0;
     double sqrt2 = sqrt(2);
 
-    double sig1;
-    sig1 = exp((dispparam.Row(1)).AsScalar());
     double erf1;
     double erf2;
 
@@ -265,11 +361,30 @@ double AIFModel_gaussdisp::kcblood(const double ti, const double deltblood, cons
     if (erf2 < -5)
         erf2 = -5;
 
-    kcblood *= 0.5 * (MISCMATHS::erf(erf1) - MISCMATHS::erf(erf2));
+    kcblood *= 0.5 * (sf.Erf(erf1) - sf.Erf(erf2));
 
     return kcblood;
 }
 
+double AIFModel_gaussdisp::kcblood(const double ti, const double deltblood, const double taub,
+    const double T_1b, const bool casl, const ColumnVector dispparam) const
+{
+    return gaussdisp_kcblood(ti, deltblood, taub, T_1b, casl, exp(dispparam(1)), sf);
+}
+
+void AIFModel_gaussdisp::kcblood_batch(ColumnVector &kc, const ColumnVector &tis,
+    const double deltblood, const ColumnVector &taub, const ColumnVector &T_1b, bool casl,
+    const ColumnVector &dispparam) const
+{
+    double sig1 = exp(dispparam(1));
+
+    kc.ReSize(tis.Nrows());
+    for (int it = 1; it <= tis.Nrows(); it++)
+    {
+        kc(it) = gaussdisp_kcblood(tis(it), deltblood, taub(it), T_1b(it), casl, sig1, sf);
+    }
+}
+
 double AIFModel_spatialgaussdisp_alternate::kcblood(const double ti, const double deltblood,
     const double taub, const double T_1b, const bool casl, const ColumnVector dispparam) const
 {
@@ -319,7 +434,7 @@ double AIFModel_spatialgaussdisp_alternate::kcblood(const double ti, const doubl
     if (erf2 < -5)
         erf2 = -5;
 
-    kcblood *= 0.5 * (MISCMATHS::erf(erf1) - MISCMATHS::erf(erf2));
+    kcblood *= 0.5 * (sf.Erf(erf1) - sf.Erf(erf2));
 
     return kcblood;
 }
@@ -391,7 +506,7 @@ double AIFModel_spatialgaussdisp::kcblood(const double ti, const double deltbloo
         if (erf2 < -5)
             erf2 = -5;
 
-        kcblood *= 0.5 * (MISCMATHS::erf(erf1) - MISCMATHS::erf(erf2));
+        kcblood *= 0.5 * (sf.Erf(erf1) - sf.Erf(erf2));
     }
 
     return kcblood;
@@ -437,78 +552,84 @@ double AIFModel_spatialgaussdisp::kcblood(const double ti, const double deltbloo
  */
 //-----------------------------------------
 // Residue functions (these are primiarly specified for use with the numerical
-// tissue model)
-double ResidModel_wellmix::resid(const double ti, const double fcalib, const double T_1,
-    const double T_1b, const double lambda, const ColumnVector residparam) const
+// tissue model). Each is a kernel of the TI and of quantities which do not
+// depend on it, shared by the single and batched versions
+
+static double wellmix_resid_T1app(const double fcalib, const double T_1, const double lambda)
 {
     // Well mixed single compartment
     // Buxton (1998) model
-    double T_1app = 1 / (1 / T_1 + fcalib / lambda);
+    return 1 / (1 / T_1 + fcalib / lambda);
+}
+
+static double wellmix_resid(const double ti, const double T_1app)
+{
     return exp(-ti / T_1app);
 }
 
-double ResidModel_simple::resid(const double ti, const double fcalib, const double T_1,
-    const double T_1b, const double lambda, const ColumnVector residparam) const
+static double simple_resid(const double ti, const double T_1b)
 {
     // Simple impermeable comparment
     // decays with T1b
     return exp(-ti / T_1b);
-    ;
 }
 
-double ResidModel_imperm::resid(const double ti, const double fcalib, const double T_1,
-    const double T_1b, const double lambda, const ColumnVector residparam) const
+static double imperm_resid(const double ti, const double T_1b, const double transit)
 {
     // impermeable compartment with transit time
     // decays with T1b
-    double transit = (residparam.Row(1)).AsScalar();
     double resid = exp(-ti / T_1b);
     if (ti > transit)
         resid = 0.0;
     return resid;
 }
 
-double ResidModel_twocpt::resid(const double ti, const double fcalib, const double T_1,
-    const double T_1b, const double lambda, const ColumnVector residparam) const
+// Two compartment model - the simplest form of the two cpt model
+// No backflow from tissue to blood
+// no venous outflow
+// From Parkes & Tofts and also St. Lawrence 2000 - both models are the same
+// under these assumptions
+static void twocpt_resid_params(const ColumnVector &residparam, const double T_1,
+    const double T_1b, double &a, double &b)
 {
-    // Two compartment model - the simplest form of the two cpt model
-    // No backflow from tissue to blood
-    // no venous outflow
-    // From Parkes & Tofts and also St. Lawrence 2000 - both models are the same
-    // under these assumptions
     // extract residue function parameters
     double kw; // exchange rate = PS/vb
-    kw = (residparam.Row(1)).AsScalar();
+    kw = residparam(1);
     // double PS; double vb;
     // PS = (residparam.Row(1)).AsScalar();
     // vb = (residparam.Row(2)).AsScalar();
 
-    // calculate the residue function
-    double a = kw + 1 / T_1b;
-    double b = (kw * T_1 * T_1b) / (kw * T_1 * T_1b + (T_1 - T_1b));
+    a = kw + 1 / T_1b;
+    b = (kw * T_1 * T_1b) / (kw * T_1 * T_1b + (T_1 - T_1b));
+}
+
+static double twocpt_resid(const double ti, const double T_1, const double a, const double b)
+{
     return b * exp(-ti / T_1) + (1 - b) * exp(-a * ti);
 }
 
-double ResidModel_spa::resid(const double ti, const double fcalib, const double T_1,
-    const double T_1b, const double lambda, const ColumnVector residparam) const
+// Two compartment model - Single Pass Approximation from St. Lawrence
+// (2000)
+// No backflow from tissue to blood
+// label starts to leave the cappilliary after a capilliary transit time
+static void spa_resid_params(const ColumnVector &residparam, const double fcalib,
+    const double T_1, const double T_1b, double &tauc, double &a, double &b, double &ER)
 {
-    // Two compartment model - Single Pass Approximation from St. Lawrence
-    // (2000)
-    // No backflow from tissue to blood
-    // label starts to leave the cappilliary after a capilliary transit time
     // extract residue function parameters
     double PS;
     double vb;
-    double tauc;
-    PS = (residparam.Row(1)).AsScalar();
-    vb = (residparam.Row(2)).AsScalar();
-    tauc = (residparam.Row(3)).AsScalar();
+    PS = residparam(1);
+    vb = residparam(2);
+    tauc = residparam(3);
 
-    // calcualte residue function
-    double a = PS / vb + 1 / T_1b;
-    double b = (PS * T_1 * T_1b) / (PS * T_1 * T_1b + (T_1 - T_1b) * vb);
-    double ER = 1 - exp(-PS / fcalib - (1 / T_1b - 1 / T_1) * tauc);
+    a = PS / vb + 1 / T_1b;
+    b = (PS * T_1 * T_1b) / (PS * T_1 * T_1b + (T_1 - T_1b) * vb);
+    ER = 1 - exp(-PS / fcalib - (1 / T_1b - 1 / T_1) * tauc);
+}
 
+static double spa_resid(const double ti, const double T_1, const double tauc, const double a,
+    const double b, const double ER)
+{
     if (ti < tauc)
     {
         return b * exp(-ti / T_1) + (1 - b) * exp(-a * ti);
@@ -519,6 +640,100 @@ double ResidModel_spa::resid(const double ti, const double fcalib, const double
     }
 }
 
+double ResidModel_wellmix::resid(const double ti, const double fcalib, const double T_1,
+    const double T_1b, const double lambda, const ColumnVector residparam) const
+{
+    return wellmix_resid(ti, wellmix_resid_T1app(fcalib, T_1, lambda));
+}
+
+void ResidModel_wellmix::resid_batch(ColumnVector &r, const ColumnVector &tis,
+    const double fcalib, const double T_1, const double T_1b, const double lambda,
+    const ColumnVector &residparam) const
+{
+    double T_1app = wellmix_resid_T1app(fcalib, T_1, lambda);
+    r.ReSize(tis.Nrows());
+    for (int it = 1; it <= tis.Nrows(); it++)
+    {
+        r(it) = wellmix_resid(tis(it), T_1app);
+    }
+}
+
+double ResidModel_simple::resid(const double ti, const double fcalib, const double T_1,
+    const double T_1b, const double lambda, const ColumnVector residparam) const
+{
+    return simple_resid(ti, T_1b);
+}
+
+void ResidModel_simple::resid_batch(ColumnVector &r, const ColumnVector &tis,
+    const double fcalib, const double T_1, const double T_1b, const double lambda,
+    const ColumnVector &residparam) const
+{
+    r.ReSize(tis.Nrows());
+    for (int it = 1; it <= tis.Nrows(); it++)
+    {
+        r(it) = simple_resid(tis(it), T_1b);
+    }
+}
+
+double ResidModel_imperm::resid(const double ti, const double fcalib, const double T_1,
+    const double T_1b, const double lambda, const ColumnVector residparam) const
+{
+    return imperm_resid(ti, T_1b, residparam(1));
+}
+
+void ResidModel_imperm::resid_batch(ColumnVector &r, const ColumnVector &tis,
+    const double fcalib, const double T_1, const double T_1b, const double lambda,
+    const ColumnVector &residparam) const
+{
+    double transit = residparam(1);
+    r.ReSize(tis.Nrows());
+    for (int it = 1; it <= tis.Nrows(); it++)
+    {
+        r(it) = imperm_resid(tis(it), T_1b, transit);
+    }
+}
+
+double ResidModel_twocpt::resid(const double ti, const double fcalib, const double T_1,
+    const double T_1b, const double lambda, const ColumnVector residparam) const
+{
+    double a, b;
+    twocpt_resid_params(residparam, T_1, T_1b, a, b);
+    return twocpt_resid(ti, T_1, a, b);
+}
+
+void ResidModel_twocpt::resid_batch(ColumnVector &r, const ColumnVector &tis,
+    const double fcalib, const double T_1, const double T_1b, const double lambda,
+    const ColumnVector &residparam) const
+{
+    double a, b;
+    twocpt_resid_params(residparam, T_1, T_1b, a, b);
+    r.ReSize(tis.Nrows());
+    for (int it = 1; it <= tis.Nrows(); it++)
+    {
+        r(it) = twocpt_resid(tis(it), T_1, a, b);
+    }
+}
+
+double ResidModel_spa::resid(const double ti, const double fcalib, const double T_1,
+    const double T_1b, const double lambda, const ColumnVector residparam) const
+{
+    double tauc, a, b, ER;
+    spa_resid_params(residparam, fcalib, T_1, T_1b, tauc, a, b, ER);
+    return spa_resid(ti, T_1, tauc, a, b, ER);
+}
+
+void ResidModel_spa::resid_batch(ColumnVector &r, const ColumnVector &tis, const double fcalib,
+    const double T_1, const double T_1b, const double lambda, const ColumnVector &residparam) const
+{
+    double tauc, a, b, ER;
+    spa_resid_params(residparam, fcalib, T_1, T_1b, tauc, a, b, ER);
+    r.ReSize(tis.Nrows());
+    for (int it = 1; it <= tis.Nrows(); it++)
+    {
+        r(it) = spa_resid(tis(it), T_1, tauc, a, b, ER);
+    }
+}
+
 //----------------------------------
 // Tissue Model
 double TissueModel_nodisp_simple::kctissue(const double ti, const double fcalib,
@@ -779,26 +994,12 @@ double TissueModel_nodisp_spa::R(const double t1, const double t2, const double
     return b * ER / S * exp(-t3 / T_1) * (exp(S * t2) - exp(S * t1));
 }
 
-double TissueModel_gammadisp_wellmix::kctissue(const double ti, const double fcalib,
+static double gammadisp_wellmix_kctissue(const double ti, const double fcalib,
     const double delttiss, const double tau, const double T_1b, const double T_1,
-    const double lambda, const bool casl, const ColumnVector dispparam,
-    const ColumnVector residparam) const
+    const double lambda, const double s, const double p, const SpecialFunctions &sf)
 {
     double kctissue = 0.0;
 
-    assert(!casl); // only pASL at the moment!
-
-    // extract dispersion parameters
-    double s;
-    double p;
-    s = (dispparam.Row(1)).AsScalar();
-    s = exp(s);
-    double sp = (dispparam.Row(2)).AsScalar();
-    sp = exp(sp);
-    if (sp > 10)
-        sp = 10;
-    p = sp / s;
-
     double k = 1 + p * s;
     double T_1app = 1 / (1 / T_1 + fcalib / lambda);
     double A = T_1app - T_1b;
@@ -822,9 +1023,9 @@ double TissueModel_gammadisp_wellmix::kctissue(const double ti, const double fca
         kctissue = 2 * 1 / A * exp(-(T_1app * delttiss + (T_1app + T_1b) * ti) / (T_1app * T_1b))
             * T_1app * T_1b * pow(B, -k)
             * (exp(delttiss / T_1app + ti / T_1b) * pow(s * T_1app * T_1b, k)
-                           * (1 - igamc(k, B / (T_1app * T_1b) * (ti - delttiss)))
+                           * (1 - sf.Igamc(k, B / (T_1app * T_1b) * (ti - delttiss)))
                        + exp(delttiss / T_1b + ti / T_1app) * pow(B, k)
-                           * (-1 + igamc(k, s * (ti - delttiss))));
+                           * (-1 + sf.Igamc(k, s * (ti - delttiss))));
     }
     else //(ti > delttiss + tau)
     {
@@ -833,11 +1034,12 @@ double TissueModel_gammadisp_wellmix::kctissue(const double ti, const double fca
                        * (pow(s, k) * T_1app * T_1b
                                  * (-1
                                        + exp((-1 / T_1app + 1 / T_1b) * tau)
-                                           * (1 - igamc(k, B / (T_1app * T_1b) * (ti - delttiss)))
-                                       + igamc(k, B / (T_1app * T_1b) * (ti - delttiss - tau)))
+                                           * (1 - sf.Igamc(k, B / (T_1app * T_1b)
+                                                            * (ti - delttiss)))
+                                       + sf.Igamc(k, B / (T_1app * T_1b) * (ti - delttiss - tau)))
                              - exp(-A / (T_1app * T_1b) * (ti - delttiss - tau)) * C * B
-                                 * (igamc(k, s * (ti - delttiss - tau))
-                                       - igamc(k, s * (ti - delttiss)))));
+                                 * (sf.Igamc(k, s * (ti - delttiss - tau))
+                                       - sf.Igamc(k, s * (ti - delttiss)))));
 
         // if (isnan(kctissue(it))) { kctissue(it)=0.0; cout << "Warning NaN in
         // tissue KC"; }
@@ -846,6 +1048,40 @@ double TissueModel_gammadisp_wellmix::kctissue(const double ti, const double fca
     return kctissue;
 }
 
+double TissueModel_gammadisp_wellmix::kctissue(const double ti, const double fcalib,
+    const double delttiss, const double tau, const double T_1b, const double T_1,
+    const double lambda, const bool casl, const ColumnVector dispparam,
+    const ColumnVector residparam) const
+{
+    assert(!casl); // only pASL at the moment!
+
+    // extract dispersion parameters
+    double s;
+    double p;
+    gamma_disp_params(dispparam, s, p);
+
+    return gammadisp_wellmix_kctissue(ti, fcalib, delttiss, tau, T_1b, T_1, lambda, s, p, sf);
+}
+
+void TissueModel_gammadisp_wellmix::kctissue_batch(ColumnVector &kc, const ColumnVector &tis,
+    const double fcalib, const double delttiss, const ColumnVector &tau, const ColumnVector &T_1b,
+    const double T_1, const double lambda, const bool casl, const ColumnVector &dispparam,
+    const ColumnVector &residparam) const
+{
+    assert(!casl); // only pASL at the moment!
+
+    double s;
+    double p;
+    gamma_disp_params(dispparam, s, p);
+
+    kc.ReSize(tis.Nrows());
+    for (int it = 1; it <= tis.Nrows(); it++)
+    {
+        kc(it) = gammadisp_wellmix_kctissue(
+            tis(it), fcalib, delttiss, tau(it), T_1b(it), T_1, lambda, s, p, sf);
+    }
+}
+
 /*
  double kctissue_gvf(const double ti,const double delttiss,const double tau,
  const double T_1b,const double T_1app,const double s,const double p) {
@@ -907,88 +1143,105 @@ double TissueModel_aif_residue::kctissue(const double ti, const double fcalib,
     const double lambda, const bool casl, const ColumnVector dispparam,
     const ColumnVector residparam) const
 {
-    double kctissue = 0.0;
+    ColumnVector tis(1), taus(1), T_1bs(1), kc;
+    tis = ti;
+    taus = tau;
+    T_1bs = T_1b;
+    kctissue_batch(
+        kc, tis, fcalib, delttiss, taus, T_1bs, T_1, lambda, casl, dispparam, residparam);
+    return kc(1);
+}
 
+void TissueModel_aif_residue::kctissue_batch(ColumnVector &kc, const ColumnVector &tis,
+    const double fcalib, const double delttiss, const ColumnVector &tau, const ColumnVector &T_1b,
+    const double T_1, const double lambda, const bool casl, const ColumnVector &dispparam,
+    const ColumnVector &residparam) const
+{
     // calculate the appropraite time series for the aif and residue
     // assume that the aif is zero before TI=0 (true of most aif models under
     // sensible parameter values)
 
-    // OLD fixed number of discrete time points
-    // int nint = 10; //number of intervals for simpsons rule;
-    // int niti = 2*nint+1; //the number of time points to use in the
-    // integration - for simpsons rule follow the patttern (2*x)+1
-    // double delti = ti/(niti-1);
-
     // fixed time intervals for discretization (these discrete time points are
     // termed iti)
-    double delti = 0.1;           // time interval for the iti
-    double dti = fmod(ti, delti); // the time not covered by the iti
-    // double maxiti = ti - dti; //largest iti
-    int niti = floor(ti / delti) + 1; // number of iti (include the itit at 0)
-
-    ColumnVector aifts(niti);
-    ColumnVector rests(niti);
-    double iti;
-    // calacute aif and residue function for all the iti
-    for (int i = 0; i < niti; i++)
-    { // start from iTI = 0 and go up to iTI=niti*delti)
-        iti = i * delti;
-        aifts(i + 1) = aifmodel->kcblood(iti, delttiss, tau, T_1b, casl, dispparam);
-        rests(i + 1) = residmodel->resid(iti + dti, fcalib, T_1, T_1b, lambda,
-            residparam); // NB offset on this ready for when we reverse it
+    const double delti = 0.1; // time interval for the iti
+    int ntis = tis.Nrows();
+    kc.ReSize(ntis);
+
+    // The iti do not depend on the TI, so if the bolus duration and T1b are
+    // the same for every TI the aif only needs to be evaluated once, up to
+    // the largest TI
+    bool shared_aif = true;
+    for (int it = 2; it <= ntis; it++)
+    {
+        if ((tau(it) != tau(1)) || (T_1b(it) != T_1b(1)))
+            shared_aif = false;
     }
-    // cacualte the aif and residue at the TI
-    double aifti = aifmodel->kcblood(ti, delttiss, tau, T_1b, casl, dispparam);
-    // double resti = residmodel->resid(ti,fcalib,T_1,lambda,residparam);
 
-    // do convolution to get the value at this TI
-    ColumnVector prod(niti);
-    prod = SP(aifts, rests.Reverse());
-    double prodti = aifti; // becasue resti at time zero is 1
-
-    string integrate = "trapezoid";
-    // if (integrate == "rect") {}
-    // rect intergration
-    // nothing to do here - this is essentially done as the default option
-    if (integrate == "trapezoid")
+    ColumnVector aifts;
+    ColumnVector itis;
+    ColumnVector taus;
+    ColumnVector T_1bs;
+    if (shared_aif && (ntis > 0))
     {
-        ColumnVector trap(niti);
-        trap = 1;
-        trap(1) = 0.5;
-        trap(niti) = 0.5;
-        prod = SP(prod, trap);
+        int niti = floor(tis.Maximum() / delti) + 1;
+        itis.ReSize(niti);
+        for (int i = 0; i < niti; i++)
+        {
+            itis(i + 1) = i * delti;
+        }
+        taus.ReSize(niti);
+        taus = tau(1);
+        T_1bs.ReSize(niti);
+        T_1bs = T_1b(1);
+        aifmodel->kcblood_batch(aifts, itis, delttiss, taus, T_1bs, casl, dispparam);
     }
-    else if (integrate == "simpson")
+
+    // the aif at each TI
+    ColumnVector aifti;
+    aifmodel->kcblood_batch(aifti, tis, delttiss, tau, T_1b, casl, dispparam);
+
+    ColumnVector rests;
+    for (int it = 1; it <= ntis; it++)
     {
-        // simpson
-        // work out how many time points we can apply simpson to
-        int nsimp = floor((niti - 1) / 2) * 2 + 1;
+        double ti = tis(it);
+        double dti = fmod(ti, delti);     // the time not covered by the iti
+        int niti = floor(ti / delti) + 1; // number of iti (include the itit at 0)
 
-        ColumnVector simpson(niti);
-        simpson(1) = 1 / 3;
-        for (int h = 2; h < nsimp; h += 2)
+        itis.ReSize(niti);
+        for (int i = 0; i < niti; i++)
         {
-            simpson(h) = 4 / 3;
-            simpson(h + 1) = 2 / 3;
+            itis(i + 1) = i * delti;
         }
-        simpson(nsimp) = 1 / 3;
-
-        if (nsimp < niti)
+        if (!shared_aif)
         {
-            // we still have another time point to incorporate do this using
-            // trapezium rule
-            assert(niti - nsimp == 1);
-            simpson(nsimp) = simpson(nsimp) + 0.5;
-            simpson(niti) = 0.5;
+            taus.ReSize(niti);
+            taus = tau(it);
+            T_1bs.ReSize(niti);
+            T_1bs = T_1b(it);
+            aifmodel->kcblood_batch(aifts, itis, delttiss, taus, T_1bs, casl, dispparam);
         }
-        prod = SP(prod, simpson);
-    }
 
-    kctissue = prod.Sum() * delti; // NB must be multiplied by the timespacing
-    kctissue += (0.5 * prodti + 0.5 * prod(niti))
-        * dti; // plus the last bit (which we will do with trapezium rule)
+        // NB offset on the residue ready for when we reverse it
+        itis += dti;
+        residmodel->resid_batch(rests, itis, fcalib, T_1, T_1b(it), lambda, residparam);
 
-    return kctissue;
+        // do convolution to get the value at this TI using the trapezium rule
+        double integral = 0;
+        double last = 0;
+        for (int i = 1; i <= niti; i++)
+        {
+            double prod = aifts(i) * rests(niti + 1 - i);
+            if ((i == 1) || (i == niti))
+                prod *= 0.5;
+            integral += prod;
+            last = prod;
+        }
+
+        // NB must be multiplied by the timespacing, plus the last bit (which
+        // we will do with trapezium rule). The aif at the TI is used as is
+        // becasue the residue at time zero is 1
+        kc(it) = integral * delti + (0.5 * aifti(it) + 0.5 * last) * dti;
+    }
 }
 
 // --- useful general functions ---
@@ -996,20 +1249,13 @@ double icgf(const double a, const double x)
 {
     // incomplete gamma function with a=k, based on the incomplete gamma
     // integral
-
-    return MISCMATHS::gamma(a) * igamc(a, x);
+    return SpecialFunctions().Icgf(a, x);
 }
 
 double gvf(const double t, const double s, const double p)
 {
     // The Gamma Variate Function (correctly normalised for area under curve)
-    // Form of Rausch 2000
-    // NB this is basically a gamma pdf
-
-    if (t < 0)
-        return 0.0;
-    else
-        return pow(s, 1 + s * p) / MISCMATHS::gamma(1 + s * p) * pow(t, s * p) * exp(-s * t);
+    return SpecialFunctions().Gvf(t, s, p);
 }
 
 double numerical_integration(
@@ -9,6 +9,8 @@
 #if !defined(asl_models_h)
 #define asl_models_h
 
+#include "asl_special_funcs.h"
+
 #include "fabber_core/fwdmodel.h"
 #include "miscmaths/miscmaths.h"
 #include "miscmaths/miscprob.h"
@@ -42,15 +44,24 @@ public:
     // evaluate the model
     virtual double kcblood(const double ti, const double deltblood, const double taub,
         const double T_1b, bool casl, const ColumnVector dispparam) const = 0;
+    // evaluate the model for a set of TIs in one call. The bolus duration and
+    // T1 of blood are given for each TI to allow for multiple bolus durations
+    // and Look-Locker readout. kc is resized to the number of TIs
+    virtual void kcblood_batch(ColumnVector &kc, const ColumnVector &tis, const double deltblood,
+        const ColumnVector &taub, const ColumnVector &T_1b, bool casl,
+        const ColumnVector &dispparam) const;
     // report the number of dispersion parameters
     virtual int NumDisp() const = 0;
     // return default priors for the parameters
     virtual ColumnVector Priors() const { return priors; }
     virtual string Name() const = 0;
     virtual void SetPriorMean(int paramn, double value) { priors(paramn) = value; }
+    // select exact or tabulated special functions
+    virtual void SetSpecialFunctions(const SpecialFunctions &funcs) { sf = funcs; }
 protected:
     ColumnVector priors; // list of prior means and precisions - all means first
                          // then precisions
+    SpecialFunctions sf;
 };
 
 // Specific AIF models
@@ -59,6 +70,9 @@ class AIFModel_nodisp : public AIFModel
     // AIFModel_nodisp() {}
     virtual double kcblood(const double ti, const double deltblood, const double taub,
         const double T_1b, bool casl, const ColumnVector dispparam) const;
+    virtual void kcblood_batch(ColumnVector &kc, const ColumnVector &tis, const double deltblood,
+        const ColumnVector &taub, const ColumnVector &T_1b, bool casl,
+        const ColumnVector &dispparam) const;
     virtual int NumDisp() const { return 0; }
     virtual string Name() const { return "None"; }
 };
@@ -74,6 +88,9 @@ public:
     // corresponds to mean s~0.7 and p~0.1
     virtual double kcblood(const double ti, const double deltblood, const double taub,
         const double T_1b, bool casl, const ColumnVector dispparam) const;
+    virtual void kcblood_batch(ColumnVector &kc, const ColumnVector &tis, const double deltblood,
+        const ColumnVector &taub, const ColumnVector &T_1b, bool casl,
+        const ColumnVector &dispparam) const;
     virtual int NumDisp() const { return 2; }
     virtual string Name() const { return "Gamma dispersion kernel"; }
 };
@@ -89,6 +106,9 @@ public:
     // corresponds to mean s~0.7 and p~0.7
     virtual double kcblood(const double ti, const double deltblood, const double taub,
         const double T_1b, bool casl, const ColumnVector dispparam) const;
+    virtual void kcblood_batch(ColumnVector &kc, const ColumnVector &tis, const double deltblood,
+        const ColumnVector &taub, const ColumnVector &T_1b, bool casl,
+        const ColumnVector &dispparam) const;
     virtual int NumDisp() const { return 2; }
     virtual string Name() const { return "GVF"; }
 };
@@ -103,6 +123,9 @@ public:
     }
     virtual double kcblood(const double ti, const double deltblood, const double taub,
         const double T_1b, bool casl, const ColumnVector dispparam) const;
+    virtual void kcblood_batch(ColumnVector &kc, const ColumnVector &tis, const double deltblood,
+        const ColumnVector &taub, const ColumnVector &T_1b, bool casl,
+        const ColumnVector &dispparam) const;
     virtual int NumDisp() const { return 1; }
     virtual string Name() const { return "Gauss dispersion kernel"; }
 };
@@ -145,6 +168,10 @@ class ResidModel
 public:
     virtual double resid(const double ti, const double fcalib, const double T_1, const double T_1b,
         const double lambda, const ColumnVector residparam) const = 0;
+    // evaluate the residue function for a set of times in one call
+    virtual void resid_batch(ColumnVector &r, const ColumnVector &tis, const double fcalib,
+        const double T_1, const double T_1b, const double lambda,
+        const ColumnVector &residparam) const;
     // report the number of residue function parameters
     virtual int NumResid() const = 0;
     // return the default priors for the parameters
@@ -161,6 +188,9 @@ class ResidModel_wellmix : public ResidModel
 public:
     virtual double resid(const double ti, const double fcalib, const double T_1, const double T_1b,
         const double lambda, const ColumnVector residparam) const;
+    virtual void resid_batch(ColumnVector &r, const ColumnVector &tis, const double fcalib,
+        const double T_1, const double T_1b, const double lambda,
+        const ColumnVector &residparam) const;
 
     virtual int NumResid() const { return 0; }
     virtual string Name() const { return "Well mixed"; }
@@ -171,6 +201,9 @@ class ResidModel_simple : public ResidModel
 public:
     virtual double resid(const double ti, const double fcalib, const double T_1, const double T_1b,
         const double lambda, const ColumnVector residparam) const;
+    virtual void resid_batch(ColumnVector &r, const ColumnVector &tis, const double fcalib,
+        const double T_1, const double T_1b, const double lambda,
+        const ColumnVector &residparam) const;
 
     virtual int NumResid() const { return 0; }
     virtual string Name() const { return "Simple"; }
@@ -186,6 +219,9 @@ public:
     }
     virtual double resid(const double ti, const double fcalib, const double T_1, const double T_1b,
         const double lambda, const ColumnVector residparam) const;
+    virtual void resid_batch(ColumnVector &r, const ColumnVector &tis, const double fcalib,
+        const double T_1, const double T_1b, const double lambda,
+        const ColumnVector &residparam) const;
 
     virtual int NumResid() const { return 1; }
     virtual string Name() const { return "Impermeable"; }
@@ -201,6 +237,9 @@ public:
     }
     virtual double resid(const double ti, const double fcalib, const double T_1, const double T_1b,
         const double lambda, const ColumnVector residparam) const;
+    virtual void resid_batch(ColumnVector &r, const ColumnVector &tis, const double fcalib,
+        const double T_1, const double T_1b, const double lambda,
+        const ColumnVector &residparam) const;
 
     virtual int NumResid() const { return 1; }
     virtual string Name() const { return "Two comparment (no backflow, no venous output)"; }
@@ -216,6 +255,9 @@ public:
     }
     virtual double resid(const double ti, const double fcalib, const double T_1, const double T_1b,
         const double lambda, const ColumnVector residparam) const;
+    virtual void resid_batch(ColumnVector &r, const ColumnVector &tis, const double fcalib,
+        const double T_1, const double T_1b, const double lambda,
+        const ColumnVector &residparam) const;
 
     virtual int NumResid() const { return 3; }
     virtual string Name() const { return "Single Pass Approximation (2 compartment, no backflow)"; }
@@ -230,6 +272,12 @@ public:
     virtual double kctissue(const double ti, const double fcalib, const double delttiss,
         const double tau, const double T_1b, const double T_1, const double lambda, const bool casl,
         const ColumnVector dispparam, const ColumnVector residparam) const = 0;
+    // evaluate the model for a set of TIs in one call, bolus duration and T1
+    // of blood are given for each TI
+    virtual void kctissue_batch(ColumnVector &kc, const ColumnVector &tis, const double fcalib,
+        const double delttiss, const ColumnVector &tau, const ColumnVector &T_1b, const double T_1,
+        const double lambda, const bool casl, const ColumnVector &dispparam,
+        const ColumnVector &residparam) const;
     // report the number of dipersion parameters
     virtual int NumDisp() const = 0;
     // report the number of residue function parameters (beyond the normal ones)
@@ -240,10 +288,13 @@ public:
     virtual string Name() const = 0;
     virtual void SetDispPriorMean(int paramn, double value) { disppriors(paramn) = value; }
     virtual void SetResidPriorMean(int paramn, double value) { residpriors(paramn) = value; }
+    // select exact or tabulated special functions
+    virtual void SetSpecialFunctions(const SpecialFunctions &funcs) { sf = funcs; }
 protected:
     ColumnVector disppriors; // list of prior means and precisions - all means
                              // first then precisions
     ColumnVector residpriors;
+    SpecialFunctions sf;
 };
 
 // specific tissue models
@@ -342,6 +393,10 @@ public:
     virtual double kctissue(const double ti, const double fcalib, const double delttiss,
         const double tau, const double T_1b, const double T_1, const double lambda, const bool casl,
         const ColumnVector dispparam, const ColumnVector residparam) const;
+    virtual void kctissue_batch(ColumnVector &kc, const ColumnVector &tis, const double fcalib,
+        const double delttiss, const ColumnVector &tau, const ColumnVector &T_1b, const double T_1,
+        const double lambda, const bool casl, const ColumnVector &dispparam,
+        const ColumnVector &residparam) const;
     virtual int NumDisp() const { return 2; }
     virtual int NumResid() const { return 0; }
     virtual string Name() const { return "Gamma kernel dispersion | Well mixed"; }
@@ -367,6 +422,10 @@ public:
     virtual double kctissue(const double ti, const double fcalib, const double delttiss,
         const double tau, const double T_1b, const double T_1app, const double lambda,
         const bool casl, const ColumnVector dispparam, const ColumnVector residparam) const;
+    virtual void kctissue_batch(ColumnVector &kc, const ColumnVector &tis, const double fcalib,
+        const double delttiss, const ColumnVector &tau, const ColumnVector &T_1b, const double T_1,
+        const double lambda, const bool casl, const ColumnVector &dispparam,
+        const ColumnVector &residparam) const;
     virtual int NumDisp() const { return aifmodel->NumDisp(); }
     virtual int NumResid() const { return residmodel->NumResid(); }
     virtual string Name() const
@@ -0,0 +1,245 @@
+/* asl_special_funcs.cc Tabulated special functions for the ASL kinetic curve models
+
+ Copyright (C) 2017 University of Oxford */
+
+/* CCOPYRIGHT  */
+
+#include "asl_special_funcs.h"
+
+#include "miscmaths/miscmaths.h"
+#include "miscmaths/miscprob.h"
+
+#include <algorithm>
+#include <math.h>
+
+using namespace std;
+
+namespace OXASL
+{
+const double SpecialFunctionTables::ERF_XMAX = 6.0;
+const double SpecialFunctionTables::ERF_DX = 0.01;
+const double SpecialFunctionTables::IGAM_AMIN = 1.0;
+const double SpecialFunctionTables::IGAM_AMAX = 11.0;
+const double SpecialFunctionTables::IGAM_DA = 0.05;
+const double SpecialFunctionTables::IGAM_XMAX = 50.0;
+const double SpecialFunctionTables::IGAM_DX = 0.1;
+
+// Upper bound on |erf''''(x)| = 2/sqrt(pi) |12x - 8x^3| exp(-x^2), which
+// has its maximum of 4.4047 at x = 0.6568
+static const double ERF_D4_MAX = 4.405;
+
+/**
+ * Kummer's function M(1, a+1, x) for x >= 0
+ *
+ * All the terms are positive so the series is well conditioned. The sum
+ * of the terms excluding the first is also returned so that M - 1 can be
+ * used for small x without cancellation.
+ */
+static double kummer(double a, double x, double &tail)
+{
+    double term = 1;
+    tail = 0;
+    for (int n = 0; n < 10000; n++)
+    {
+        term *= x / (a + 1 + n);
+        tail += term;
+        if ((n > x) && (term < 1e-17 * tail))
+            break;
+    }
+    return 1 + tail;
+}
+
+double igamc_series(double a, double x)
+{
+    if (x <= 0)
+        return 1.0;
+    double tail;
+    double m = kummer(a, x, tail);
+    return 1 - exp(a * log(x) - x + log(m) - lgamma(a + 1));
+}
+
+static inline void hermite_weights(double t, double &h00, double &h10, double &h01, double &h11)
+{
+    double t2 = t * t;
+    double t3 = t2 * t;
+    h00 = 2 * t3 - 3 * t2 + 1;
+    h10 = t3 - 2 * t2 + t;
+    h01 = -2 * t3 + 3 * t2;
+    h11 = t3 - t2;
+}
+
+const SpecialFunctionTables &SpecialFunctionTables::Get()
+{
+    static SpecialFunctionTables tables;
+    return tables;
+}
+
+SpecialFunctionTables::SpecialFunctionTables()
+{
+    // erf - only tabulated for x >= 0 as it is an odd function
+    int nerf = int(ERF_XMAX / ERF_DX + 0.5) + 1;
+    m_erf.resize(nerf);
+    m_derf.resize(nerf);
+    for (int i = 0; i < nerf; i++)
+    {
+        double x = i * ERF_DX;
+        m_erf[i] = MISCMATHS::erf(x);
+        m_derf[i] = 2 / sqrt(M_PI) * exp(-x * x);
+    }
+    m_erf_bound = ERF_D4_MAX * pow(ERF_DX, 4) / 384;
+
+    // L(a, x) = log(M(1, a+1, x)) - log(Gamma(a+1)) and its x derivative
+    m_na = int((IGAM_AMAX - IGAM_AMIN) / IGAM_DA + 0.5) + 1;
+    m_nx = int(IGAM_XMAX / IGAM_DX + 0.5) + 1;
+    m_l.resize(m_na * m_nx);
+    m_dl.resize(m_na * m_nx);
+    for (int i = 0; i < m_na; i++)
+    {
+        double a = IGAM_AMIN + i * IGAM_DA;
+        double lg = lgamma(a + 1);
+        for (int j = 0; j < m_nx; j++)
+        {
+            double x = j * IGAM_DX;
+            double tail;
+            double m = kummer(a, x, tail);
+            m_l[i * m_nx + j] = log(m) - lg;
+            if (j == 0)
+                m_dl[i * m_nx + j] = 1 / (a + 1);
+            else
+                m_dl[i * m_nx + j] = 1 - a * tail / (x * m);
+        }
+    }
+
+    // Measure the error at the centre of each cell
+    double maxerr = 0;
+    for (int i = 0; i < m_na - 1; i++)
+    {
+        double a = IGAM_AMIN + (i + 0.5) * IGAM_DA;
+        for (int j = 0; j < m_nx - 1; j++)
+        {
+            double x = (j + 0.5) * IGAM_DX;
+            double err = fabs(Igamc(a, x) - igamc_series(a, x));
+            maxerr = max(err, maxerr);
+        }
+    }
+    m_igamc_bound = 2 * maxerr;
+}
+
+double SpecialFunctionTables::Erf(double x) const
+{
+    double ax = fabs(x);
+    double val;
+    if (ax >= ERF_XMAX)
+    {
+        val = 1.0;
+    }
+    else
+    {
+        double u = ax / ERF_DX;
+        int i = min(int(u), int(m_erf.size()) - 2);
+        double h00, h10, h01, h11;
+        hermite_weights(u - i, h00, h10, h01, h11);
+        val = h00 * m_erf[i] + h10 * ERF_DX * m_derf[i] + h01 * m_erf[i + 1]
+            + h11 * ERF_DX * m_derf[i + 1];
+    }
+    return x < 0 ? -val : val;
+}
+
+double SpecialFunctionTables::InterpolateL(double a, double x) const
+{
+    // Lagrange weights in a using the 4 nodes surrounding the cell
+    double u = (a - IGAM_AMIN) / IGAM_DA;
+    int i = min(max(int(u), 0), m_na - 2);
+    int i0 = min(max(i - 1, 0), m_na - 4);
+    double wa[4];
+    for (int k = 0; k < 4; k++)
+    {
+        wa[k] = 1;
+        for (int m = 0; m < 4; m++)
+        {
+            if (m != k)
+                wa[k] *= (u - (i0 + m)) / (k - m);
+        }
+    }
+
+    // Hermite weights in x
+    double v = x / IGAM_DX;
+    int j = min(int(v), m_nx - 2);
+    double h00, h10, h01, h11;
+    hermite_weights(v - j, h00, h10, h01, h11);
+
+    double l = 0;
+    for (int k = 0; k < 4; k++)
+    {
+        int idx = (i0 + k) * m_nx + j;
+        l += wa[k] * (h00 * m_l[idx] + h10 * IGAM_DX * m_dl[idx] + h01 * m_l[idx + 1]
+                         + h11 * IGAM_DX * m_dl[idx + 1]);
+    }
+    return l;
+}
+
+double SpecialFunctionTables::Igamc(double a, double x) const
+{
+    if (x <= 0)
+        return 1.0;
+    else if ((a < IGAM_AMIN) || (a > IGAM_AMAX) || (x > IGAM_XMAX))
+        return MISCMATHS::igamc(a, x);
+    else
+        return 1 - exp(a * log(x) - x + InterpolateL(a, x));
+}
+
+void SpecialFunctions::SetTabulated(bool tabulated)
+{
+    if (tabulated)
+        m_tables = &SpecialFunctionTables::Get();
+    else
+        m_tables = 0;
+}
+
+double SpecialFunctions::ErrorBound() const
+{
+    if (m_tables)
+        return max(m_tables->ErfErrorBound(), m_tables->IgamcErrorBound());
+    else
+        return 0;
+}
+
+double SpecialFunctions::Erf(double x) const
+{
+    if (m_tables)
+        return m_tables->Erf(x);
+    else
+        return MISCMATHS::erf(x);
+}
+
+double SpecialFunctions::Igamc(double a, double x) const
+{
+    if (m_tables)
+        return m_tables->Igamc(a, x);
+    else
+        return MISCMATHS::igamc(a, x);
+}
+
+double SpecialFunctions::Icgf(double a, double x) const
+{
+    // incomplete gamma function with a=k, based on the incomplete gamma
+    // integral
+    if (m_tables)
+        return exp(lgamma(a)) * m_tables->Igamc(a, x);
+    else
+        return MISCMATHS::gamma(a) * MISCMATHS::igamc(a, x);
+}
+
+double SpecialFunctions::Gvf(double t, double s, double p) const
+{
+    // The Gamma Variate Function (correctly normalised for area under curve)
+    // Form of Rausch 2000
+    // NB this is basically a gamma pdf
+    if (t < 0)
+        return 0.0;
+    else if (m_tables && (t > 0))
+        return exp((1 + s * p) * log(s) + s * p * log(t) - s * t - lgamma(1 + s * p));
+    else
+        return pow(s, 1 + s * p) / MISCMATHS::gamma(1 + s * p) * pow(t, s * p) * exp(-s * t);
+}
+}
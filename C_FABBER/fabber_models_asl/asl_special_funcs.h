@@ -0,0 +1,144 @@
+/*   asl_special_funcs.h Tabulated special functions for the ASL kinetic curve models
+
+ Copyright (C) 2017 University of Oxford */
+
+/*   CCOPYRIGHT   */
+
+#if !defined(asl_special_funcs_h)
+#define asl_special_funcs_h
+
+#include <vector>
+
+namespace OXASL
+{
+class SpecialFunctionTables;
+
+/**
+ * Special functions used by the dispersion kernels
+ *
+ * By default this simply forwards to MISCMATHS. If tabulation is enabled,
+ * erf and the regularised upper incomplete gamma function are instead
+ * interpolated from tables which are built once (on first use) and shared
+ * between all instances. Arguments outside the tabulated range always fall
+ * back to the exact functions. ErrorBound() gives the expected size of the
+ * largest error with respect to the exact values.
+ *
+ * The object is a lightweight handle which can be copied freely.
+ */
+class SpecialFunctions
+{
+public:
+    SpecialFunctions()
+        : m_tables(0)
+    {
+    }
+
+    /**
+     * Enable or disable the use of the interpolation tables
+     *
+     * The tables are built the first time this is called with true. This
+     * is not thread safe so should be done during model initialization
+     */
+    void SetTabulated(bool tabulated);
+
+    /** @return true if the interpolation tables are in use */
+    bool IsTabulated() const { return m_tables != 0; }
+    /**
+     * @return Estimate of the maximum absolute error of Erf/Igamc with respect
+     *         to the exact functions. This is a strict bound for Erf but not
+     *         for Igamc, see SpecialFunctionTables. Zero if tabulation is not
+     *         in use
+     */
+    double ErrorBound() const;
+
+    /** Error function */
+    double Erf(double x) const;
+
+    /** Regularised upper incomplete gamma function Q(a, x) */
+    double Igamc(double a, double x) const;
+
+    /** Upper incomplete gamma function (not regularised) Gamma(a) * Q(a, x) */
+    double Icgf(double a, double x) const;
+
+    /**
+     * Gamma variate function s^(1+sp) / Gamma(1+sp) * t^sp * exp(-st), i.e.
+     * the gamma pdf with shape 1+sp and rate s. Zero for t < 0.
+     */
+    double Gvf(double t, double s, double p) const;
+
+private:
+    const SpecialFunctionTables *m_tables;
+};
+
+/**
+ * Interpolation tables used by SpecialFunctions
+ *
+ * erf(x) is tabulated for 0 <= x <= ERF_XMAX using piecewise cubic Hermite
+ * interpolation with the exact derivative at the nodes. The interpolation
+ * error is then bounded by max|erf''''| h^4 / 384 which is computed from the
+ * node spacing. Beyond ERF_XMAX erf(x) is 1 to double precision.
+ *
+ * Q(a, x) is tabulated for IGAM_AMIN <= a <= IGAM_AMAX (the range of shape
+ * parameters k = 1 + sp which the dispersion models produce) and
+ * 0 <= x <= IGAM_XMAX. To avoid the x^a singularity of the derivatives at
+ * x = 0 the smooth function
+ *
+ *   L(a, x) = log(M(1, a+1, x)) - log(Gamma(a+1))
+ *
+ * is interpolated instead, where M is Kummer's function, and we use
+ *
+ *   Q(a, x) = 1 - exp(a log(x) - x + L(a, x))
+ *
+ * Interpolation is cubic Hermite in x (dL/dx is known exactly) and 4-point
+ * Lagrange in a. After building, the interpolant is compared with the
+ * exact value at the centre of every cell, which is where the error of
+ * both schemes peaks, and twice the maximum discrepancy is taken as an
+ * estimate of the maximum error. Unlike the erf bound this is not
+ * guaranteed, as the error is only sampled.
+ */
+class SpecialFunctionTables
+{
+public:
+    /** Get the shared tables, building them if required */
+    static const SpecialFunctionTables &Get();
+
+    double Erf(double x) const;
+    double Igamc(double a, double x) const;
+
+    /** @return Maximum absolute error of the interpolated erf */
+    double ErfErrorBound() const { return m_erf_bound; }
+    /** @return Estimated maximum absolute error of the interpolated incomplete gamma function */
+    double IgamcErrorBound() const { return m_igamc_bound; }
+    static const double ERF_XMAX;
+    static const double ERF_DX;
+    static const double IGAM_AMIN;
+    static const double IGAM_AMAX;
+    static const double IGAM_DA;
+    static const double IGAM_XMAX;
+    static const double IGAM_DX;
+
+private:
+    SpecialFunctionTables();
+
+    double InterpolateL(double a, double x) const;
+
+    std::vector<double> m_erf;
+    std::vector<double> m_derf;
+    double m_erf_bound;
+
+    int m_na, m_nx;
+    /** L(a, x) with x varying fastest */
+    std::vector<double> m_l;
+    /** dL/dx */
+    std::vector<double> m_dl;
+    double m_igamc_bound;
+};
+
+/**
+ * Exact upper regularised incomplete gamma function, computed from Kummer's
+ * series. Used to build and verify the tables
+ */
+double igamc_series(double a, double x);
+}
+
+#endif
@@ -61,7 +61,11 @@ static OptionSpec OPTIONS[] = {
     { "artardoff", OPT_BOOL, "Arterial ARD on", OPT_NONREQ, "" },
     { "wmardoff", OPT_BOOL, "WM ARD on", OPT_NONREQ, "" },
     { "ti<n>", OPT_FLOAT, "List of TI values", OPT_NONREQ, "" },
-    { "fa", OPT_FLOAT, "Flip angle in degrees", OPT_NONREQ, "30" }, { "" },
+    { "fa", OPT_FLOAT, "Flip angle in degrees", OPT_NONREQ, "30" },
+    { "tabulate", OPT_BOOL,
+        "Use tabulated erf and incomplete gamma functions in the dispersion kernels", OPT_NONREQ,
+        "" },
+    { "" },
 };
 
 void QuasarFwdModel::GetOptions(vector<OptionSpec> &opts) const
@@ -78,6 +82,12 @@ void QuasarFwdModel::Initialize(ArgsType &args)
     // specify command line parameters here
     // dispersion model
     disptype = args.ReadWithDefault("disp", "gamma");
+    // Arterial curves without dispersion or with gamma dispersion use the
+    // batched AIF models
+    if (disptype == "none")
+        art_model.reset(new OXASL::AIFModel_nodisp());
+    else if (disptype == "gamma")
+        art_model.reset(new OXASL::AIFModel_gammadisp());
 
     repeats = convertTo<int>(args.Read("repeats")); // number of repeats in data
     t1 = convertTo<double>(args.ReadWithDefault("t1", "1.3"));
@@ -146,6 +156,11 @@ void QuasarFwdModel::Initialize(ArgsType &args)
     if ((tissard || artard || wmard) && !ardoff)
         doard = true;
 
+    // interpolated special functions for the kinetic curves
+    sf.SetTabulated(args.ReadBool("tabulate"));
+    if (art_model.get())
+        art_model->SetSpecialFunctions(sf);
+
     // sort out ARD indices
     if (doard && tissard)
         ardindices.push_back(tiss_index());
@@ -211,6 +226,11 @@ void QuasarFwdModel::Initialize(ArgsType &args)
     {
         LOG << "ARD subsystem is enabled" << endl;
     }
+    if (sf.IsTabulated())
+    {
+        LOG << "Using tabulated special functions, estimated max error " << sf.ErrorBound()
+            << endl;
+    }
     if (infertiss)
     {
         LOG << "Infertting on tissue component " << endl;
@@ -818,6 +838,19 @@ void QuasarFwdModel::Evaluate(const ColumnVector &params, ColumnVector &result)
     thetis = tis;
     thetis += slicedt * coord_z; // account here for an increase in delay between slices
 
+    // Bolus duration and blood T1 at each TI for the arterial curve. The
+    // blood sees the Look-Locker pulses once it arrives in the readout region
+    ColumnVector taubv(thetis.Nrows());
+    taubv = taub;
+    ColumnVector T_1bv(thetis.Nrows());
+    for (int it = 1; it <= thetis.Nrows(); it++)
+    {
+        if (thetis(it) < deltll)
+            T_1bv(it) = T_1b;
+        else
+            T_1bv(it) = T_1ll;
+    }
+
     // generate the kinetic curves
     if (disptype == "none")
     {
@@ -827,7 +860,8 @@ void QuasarFwdModel::Evaluate(const ColumnVector &params, ColumnVector &result)
         if (inferwm)
             kcwm = kctissue_nodisp(thetis, deltwm, tauwm, T_1b, T_1appwm, deltll, T_1ll);
         if (inferart)
-            kcblood = kcblood_nodisp(thetis, deltblood, taub, T_1b, deltll, T_1ll);
+            art_model->kcblood_batch(
+                kcblood, thetis, deltblood, taubv, T_1bv, false, ColumnVector());
         // cout << kcblood << endl;
     }
     else if (disptype == "gamma")
@@ -838,7 +872,8 @@ void QuasarFwdModel::Evaluate(const ColumnVector &params, ColumnVector &result)
         if (inferwm)
             kcwm = kctissue_gammadisp(thetis, deltwm, tauwm, T_1b, T_1appwm, s, p, deltll, T_1ll);
         if (inferart)
-            kcblood = kcblood_gammadisp(thetis, deltblood, taub, T_1b, s, p, deltll, T_1ll);
+            art_model->kcblood_batch(kcblood, thetis, deltblood, taubv, T_1bv, false,
+                params.Rows(disp_index(), disp_index() + 1));
         // cout << kcblood << endl;
     }
     else if (disptype == "gvf")
@@ -1085,80 +1120,6 @@ void QuasarFwdModel::UpdateARD(const MVNDist &theta, MVNDist &thetaPrior, double
 
 // --- Kinetic curve functions ---
 // Arterial
-ColumnVector QuasarFwdModel::kcblood_nodisp(const ColumnVector &tis, float deltblood, float taub,
-    float T_1bin, float deltll, float T_1ll) const
-{
-    ColumnVector kcblood(tis.Nrows());
-    kcblood = 0.0;
-    float T_1b;
-    // Non dispersed arterial curve (pASL)
-    float ti = 0.0;
-    for (int it = 1; it <= tis.Nrows(); it++)
-    {
-        ti = tis(it);
-        if (ti < deltll)
-            T_1b = T_1bin;
-        else
-            T_1b = T_1ll;
-
-        if (ti < deltblood)
-        {
-            kcblood(it) = 2 * exp(-deltblood / T_1b)
-                * (0.98 * exp((ti - deltblood) / 0.05) + 0.02 * ti / deltblood);
-            // use a artifical lead in period for arterial bolus to improve
-            // model fitting
-        }
-        else if (ti >= deltblood && ti <= (deltblood + taub))
-        {
-            kcblood(it) = 2 * exp(-ti / T_1b);
-        }
-        else //(ti > deltblood + tau)
-        {
-            kcblood(it) = 2 * exp(-(deltblood + taub) / T_1b);
-            kcblood(it) *= (0.98 * exp(-(ti - deltblood - taub) / 0.05)
-                + 0.02 * (1 - (ti - deltblood - taub) / 5));
-            // artifical lead out period for taub model fitting
-            if (kcblood(it) < 0)
-                kcblood(it) = 0; // negative values are possible with the lead
-                                 // out period equation
-        }
-    }
-    return kcblood;
-}
-ColumnVector QuasarFwdModel::kcblood_gammadisp(const ColumnVector &tis, float deltblood, float taub,
-    float T_1bin, float s, float p, float deltll, float T_1ll) const
-{
-    ColumnVector kcblood(tis.Nrows());
-    kcblood = 0.0;
-    float T_1b;
-    // Gamma dispersed arterial curve (pASL)
-    float k = 1 + p * s;
-    float ti = 0.0;
-    for (int it = 1; it <= tis.Nrows(); it++)
-    {
-        ti = tis(it);
-        if (ti < deltll)
-            T_1b = T_1bin;
-        else
-            T_1b = T_1ll;
-        if (ti < deltblood)
-        {
-            kcblood(it) = 0.0;
-        }
-        else if (ti >= deltblood && ti <= (deltblood + taub))
-        {
-            kcblood(it) = 2 * exp(-ti / T_1b) * (1 - igamc(k, s * (ti - deltblood)));
-        }
-        else //(ti > deltblood + taub)
-        {
-            kcblood(it) = 2 * exp(-ti / T_1b)
-                * (igamc(k, s * (ti - deltblood - taub)) - igamc(k, s * (ti - deltblood)));
-        }
-        // if (isnan(kcblood(it))) { kcblood(it)=0.0; cout << "Warning NaN in
-        // blood KC"; }
-    }
-    return kcblood;
-}
 ColumnVector QuasarFwdModel::kcblood_gvf(const ColumnVector &tis, float deltblood, float taub,
     float T_1bin, float s, float p, float deltll, float T_1ll) const
 {
@@ -1217,8 +1178,8 @@ ColumnVector QuasarFwdModel::kcblood_gaussdisp(const ColumnVector &tis, float de
         else
             T_1b = T_1ll;
         kcblood(it) = 0.5 * exp(-ti / T_1b)
-            * (MISCMATHS::erf((ti - deltblood) / (sqrt2 * sig1))
-                          - MISCMATHS::erf((ti - deltblood + taub) / (sqrt2 * sig2)));
+            * (sf.Erf((ti - deltblood) / (sqrt2 * sig1))
+                          - sf.Erf((ti - deltblood + taub) / (sqrt2 * sig2)));
     }
     return kcblood;
 }
@@ -1298,9 +1259,9 @@ ColumnVector QuasarFwdModel::kctissue_gammadisp(const ColumnVector &tis, float d
             kctissue(it) = 2 * 1 / A
                 * exp(-(T_1app * delttiss + (T_1app + T_1b) * ti) / (T_1app * T_1b)) * T_1app * T_1b
                 * pow(B, -k) * (exp(delttiss / T_1app + ti / T_1b) * pow(s * T_1app * T_1b, k)
-                                       * (1 - igamc(k, B / (T_1app * T_1b) * (ti - delttiss)))
+                                       * (1 - sf.Igamc(k, B / (T_1app * T_1b) * (ti - delttiss)))
                                    + exp(delttiss / T_1b + ti / T_1app) * pow(B, k)
-                                       * (-1 + igamc(k, s * (ti - delttiss))));
+                                       * (-1 + sf.Igamc(k, s * (ti - delttiss))));
         }
         else //(ti > delttiss + tau)
         {
@@ -1310,11 +1271,11 @@ ColumnVector QuasarFwdModel::kctissue_gammadisp(const ColumnVector &tis, float d
                       * (pow(s, k) * T_1app * T_1b
                                 * (-1
                                       + exp((-1 / T_1app + 1 / T_1b) * tau)
-                                          * (1 - igamc(k, B / (T_1app * T_1b) * (ti - delttiss)))
-                                      + igamc(k, B / (T_1app * T_1b) * (ti - delttiss - tau)))
+                                          * (1 - sf.Igamc(k, B / (T_1app * T_1b) * (ti - delttiss)))
+                                      + sf.Igamc(k, B / (T_1app * T_1b) * (ti - delttiss - tau)))
                             - exp(-A / (T_1app * T_1b) * (ti - delttiss - tau)) * C * B
-                                * (igamc(k, s * (ti - delttiss - tau))
-                                      - igamc(k, s * (ti - delttiss)))));
+                                * (sf.Igamc(k, s * (ti - delttiss - tau))
+                                      - sf.Igamc(k, s * (ti - delttiss)))));
         }
         // if (isnan(kctissue(it))) { kctissue(it)=0.0; cout << "Warning NaN in
         // tissue KC"; }
@@ -1351,7 +1312,7 @@ ColumnVector QuasarFwdModel::kctissue_gvf(const ColumnVector &tis, float delttis
         else // if(ti >= delttiss && ti <= (delttiss + tau))
         {
             kctissue(it) = 2 * 1 / (B * C) * exp(-(ti - delttiss) / T_1app) * sps * T_1app * T_1b
-                * (1 - igamc(k, (s - 1 / T_1app - 1 / T_1b) * (ti - delttiss)));
+                * (1 - sf.Igamc(k, (s - 1 / T_1app - 1 / T_1b) * (ti - delttiss)));
         }
         // bolus duraiton is specified by the CVF AIF shape and is not an
         // explicit parameter
@@ -1386,10 +1347,10 @@ ColumnVector QuasarFwdModel::kctissue_gaussdisp(const ColumnVector &tis, float d
         float F = 2 * exp(-ti / T_1app);
         float u1 = (ti - delttiss) / (sqrt2 * sig1);
         float u2 = (ti - delttiss - tau) / (sqrt2 * sig2);
-        kctissue(it) = F / (2 * R) * ((MISCMATHS::erf(u1) - MISCMATHS::erf(u2)) * exp(R * ti)
-                                         - (1 + MISCMATHS::erf(u1 - (R * sig1) / sqrt2))
+        kctissue(it) = F / (2 * R) * ((sf.Erf(u1) - sf.Erf(u2)) * exp(R * ti)
+                                         - (1 + sf.Erf(u1 - (R * sig1) / sqrt2))
                                              * exp(R * (delttiss + (R * sig1 * sig1) / 2))
-                                         + (1 + MISCMATHS::erf(u2 - (R * sig2) / sqrt2))
+                                         + (1 + sf.Erf(u2 - (R * sig2) / sqrt2))
                                              * exp(R * (delttiss + tau + (R * sig2 * sig2) / 2)));
     }
     return kctissue;
@@ -1399,15 +1360,12 @@ float QuasarFwdModel::icgf(float a, float x) const
 {
     // incomplete gamma function with a=k, based on the incomplete gamma
     // integral
-    return MISCMATHS::gamma(a) * igamc(a, x);
+    return sf.Icgf(a, x);
 }
 float QuasarFwdModel::gvf(float t, float s, float p) const
 {
     // The Gamma Variate Function (correctly normalised for area under curve)
     // Form of Rausch 2000
     // NB this is basically a gamma pdf
-    if (t < 0)
-        return 0.0;
-    else
-        return pow(s, 1 + s * p) / MISCMATHS::gamma(1 + s * p) * pow(t, s * p) * exp(-s * t);
+    return sf.Gvf(t, s, p);
 }
@@ -7,8 +7,12 @@
 /*  CCOPYRIGHT */
 #pragma once
 
+#include "asl_models.h"
+#include "asl_special_funcs.h"
+
 #include "fabber_core/fwdmodel.h"
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -145,10 +149,6 @@ protected:
     NEWMAT::Matrix crushdir;
 
     // kinetic curve functions
-    NEWMAT::ColumnVector kcblood_nodisp(const NEWMAT::ColumnVector &tis, float deltblood,
-        float taub, float T_1b, float deltll, float T_1ll) const;
-    NEWMAT::ColumnVector kcblood_gammadisp(const NEWMAT::ColumnVector &tis, float deltblood,
-        float taub, float T_1b, float s, float p, float deltll, float T_1ll) const;
     NEWMAT::ColumnVector kcblood_gvf(const NEWMAT::ColumnVector &tis, float deltblood, float taub,
         float T_1b, float s, float p, float deltll, float T_1ll) const;
     NEWMAT::ColumnVector kcblood_gaussdisp(const NEWMAT::ColumnVector &tis, float deltblood,
@@ -168,6 +168,12 @@ protected:
     float icgf(float a, float x) const;
     float gvf(float t, float s, float p) const;
 
+    // erf and incomplete gamma, optionally tabulated
+    OXASL::SpecialFunctions sf;
+
+    // Arterial curve model for no dispersion and gamma dispersion
+    std::auto_ptr<OXASL::AIFModel> art_model;
+
 private:
     /** Auto-register with forward model factory. */
     static FactoryRegistration<FwdModelFactory, QuasarFwdModel> registration;
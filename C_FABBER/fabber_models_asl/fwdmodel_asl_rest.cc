@@ -75,7 +75,11 @@ static OptionSpec OPTIONS[] = {
     { "tau<n>", OPT_FLOAT, "List of tau values", OPT_NONREQ, "" },
     { "crush<n>", OPT_STR, "List of vascular crushing specifications values", OPT_NONREQ, "" },
     { "FA", OPT_FLOAT, "Look-Locker correction", OPT_NONREQ, "" },
-    { "facorr", OPT_BOOL, "Do FA correction", OPT_NONREQ, "" }, { "" },
+    { "facorr", OPT_BOOL, "Do FA correction", OPT_NONREQ, "" },
+    { "tabulate", OPT_BOOL,
+        "Use tabulated erf and incomplete gamma functions in the dispersion kernels", OPT_NONREQ,
+        "" },
+    { "" },
 };
 void ASLFwdModel::GetOptions(vector<OptionSpec> &opts) const
 {
@@ -662,38 +666,33 @@ void ASLFwdModel::Evaluate(const ColumnVector &params, ColumnVector &result) con
   artdir(2) = sin(bloodphi)*sin(bloodth);
   artdir(3) = cos(bloodphi);
   */
-    double kctissue;
-    kctissue = 0.0;
-    double kcblood;
-    kcblood = 0.0;
-    double kcwm;
-    kcwm = 0.0;
-    double kcpc = 0.0;
-    double kcpcwm = 0.0;
-    // Calcualte the Kinetic Model contirbutions at each TI
-    // loop over tis
-    double ti;
-    ColumnVector statcont(tis.Nrows()); // this stores the static tissue contribution at each TI
-    statcont = 0.0;
-    ColumnVector kctotal(tis.Nrows()); // this stores the total kinetic signal contribution
-    kctotal = 0.0;
+    // Calcualte the Kinetic Model contirbutions at all TIs
+    int ntis = tis.Nrows();
+    ColumnVector thetis(ntis);
+    ColumnVector tautissv(ntis);
+    ColumnVector tauwmv(ntis);
+    ColumnVector taubloodv(ntis);
+    ColumnVector T_1bv(ntis);
+    ColumnVector artweight(ntis);
+
+    // account here for an increase in the TI due to delays between slices
+    int thisz = coord_z; // the slice number
+    if (sliceband > 0)
+    {
+        // multiband setup in which we have specified the number of slices
+        // per band
+        div_t divresult;
+        divresult = div(coord_z, sliceband);
+        thisz = divresult.rem; // the number of sluices above the base of
+                               // this band (lowest slice in volume for
+                               // normal (non multi-band) data)
+    }
 
-    for (int it = 1; it <= tis.Nrows(); it++)
+    for (int it = 1; it <= ntis; it++)
     {
-        // account here for an increase in the TI due to delays between slices
-        int thisz = coord_z; // the slice number
-        if (sliceband > 0)
-        {
-            // multiband setup in which we have specified the number of slices
-            // per band
-            div_t divresult;
-            divresult = div(coord_z, sliceband);
-            thisz = divresult.rem; // the number of sluices above the base of
-                                   // this band (lowest slice in volume for
-                                   // normal (non multi-band) data)
-        }
-        ti = tis(it) + slicedt * thisz; // calcualte the actual TI for this
-                                        // slice
+        double ti = tis(it) + slicedt * thisz; // calcualte the actual TI for this
+                                               // slice
+        thetis(it) = ti;
         if (multitau)
         {
             // overwrite default tau value with the TI specific one
@@ -701,16 +700,20 @@ void ASLFwdModel::Evaluate(const ColumnVector &params, ColumnVector &result) con
             tauwm = tautiss;
             taublood = tautiss;
         }
+        tautissv(it) = tautiss;
+        tauwmv(it) = tauwm;
+        taubloodv(it) = taublood;
+
         // look-locker correction for arterial blood
         if (looklocker)
         {
             if (ti > deltll)
                 T_1b = T_1ll;
         }
+        T_1bv(it) = T_1b;
 
         // crushers
-        double artweight = 1.0;
-        artweight = 1.0 - crush(it); // arterial weight is opposte of crsuh extent
+        artweight(it) = 1.0 - crush(it); // arterial weight is opposte of crsuh extent
         /*
     if (artdir) {
       artweight = Sinc( 2 * bloodbv *
@@ -718,47 +721,59 @@ void ASLFwdModel::Evaluate(const ColumnVector &params, ColumnVector &result) con
     flow profile c.f. perfusion tensor imaging
     }
     */
-        // Tissue
-        if (inctiss)
-            kctissue = pvgm * ftiss
-                * tiss_model->kctissue(
-                      ti, f_calib, delttiss, tautiss, T_1b, T_1, lambda, casl, disptiss, residtiss);
-        // White matter
-        if (incwm)
-            kcwm = pvwm * fwm
-                * tiss_model->kctissue(
-                      ti, f_calibwm, deltwm, tauwm, T_1b, T_1wm, lamwm, casl, dispwm, residwm);
-        // Arterial
-        if (incart)
-            kcblood = artweight * fblood
-                * art_model->kcblood(ti, deltblood, taublood, T_1b, casl, dispart);
+    }
 
-        if (incpc)
+    ColumnVector statcont(ntis); // this stores the static tissue contribution at each TI
+    statcont = 0.0;
+    if (incstattiss)
+    {
+        // a simple static contirbution at all TIs
+        statcont = stattiss;
+    }
+
+    ColumnVector kctotal(ntis); // this stores the total kinetic signal contribution
+    kctotal = 0.0;
+    ColumnVector kc;
+
+    // Tissue
+    if (inctiss)
+    {
+        tiss_model->kctissue_batch(kc, thetis, f_calib, delttiss, tautissv, T_1bv, T_1, lambda,
+            casl, disptiss, residtiss);
+        kctotal += pvgm * ftiss * kc;
+    }
+    // Arterial
+    if (incart)
+    {
+        art_model->kcblood_batch(kc, thetis, deltblood, taubloodv, T_1bv, casl, dispart);
+        kctotal += fblood * SP(artweight, kc);
+    }
+    // White matter
+    if (incwm)
+    {
+        tiss_model->kctissue_batch(kc, thetis, f_calibwm, deltwm, tauwmv, T_1bv, T_1wm, lamwm,
+            casl, dispwm, residwm);
+        kctotal += pvwm * fwm * kc;
+    }
+    if (incpc)
+    {
+        // pre-capilliary component
+        // NB its arrival time is the tissue arrival time minus the pc
+        // transit time
+        if (inctiss)
         {
-            // pre-capilliary component
-            // NB its arrival time is the tissue arrival time minus the pc
-            // transit time
-            if (inctiss)
-                kcpc = pvgm * ftiss
-                    * pc_model->kctissue(ti, f_calib, delttiss - taupctiss, tautiss, T_1b, T_1,
-                          lambda, casl, disptiss, pcvec);
-            if (incwm)
-                kcpcwm = pvwm * fwm
-                    * pc_model->kctissue(ti, f_calibwm, deltwm - taupcwm, tauwm, T_1b, T_1, lamwm,
-                          casl, dispwm, pcvecwm);
-        }
-        // if (isnan(kctissue)) { kctissue=0; LOG << "Warning NaN in tissue
-        // curve at TI:" << ti << " with f:" << ftiss << " delt:" << delttiss <<
-        // " tau:" << tau << " T1:" << T_1 << " T1b:" << T_1b << endl; }
-        // total kinetic contribution
-        kctotal(it) = kctissue + kcblood + kcwm + kcpc + kcpcwm;
-        // static tissue contribution
-        if (incstattiss)
+            pc_model->kctissue_batch(kc, thetis, f_calib, delttiss - taupctiss, tautissv, T_1bv,
+                T_1, lambda, casl, disptiss, pcvec);
+            kctotal += pvgm * ftiss * kc;
+        }
+        if (incwm)
         {
-            // a simple static contirbution at all TIs
-            statcont(it) = stattiss;
+            pc_model->kctissue_batch(kc, thetis, f_calibwm, deltwm - taupcwm, tauwmv, T_1bv, T_1,
+                lamwm, casl, dispwm, pcvecwm);
+            kctotal += pvwm * fwm * kc;
         }
     }
+
     // Assemble result
     if (hadamard)
     {
@@ -1454,8 +1469,18 @@ void ASLFwdModel::Initialize(ArgsType &args)
             }
         }
 
+        // interpolated special functions for the kinetic curves if requested
+        SpecialFunctions funcs;
+        funcs.SetTabulated(args.ReadBool("tabulate"));
+        art_model->SetSpecialFunctions(funcs);
+        tiss_model->SetSpecialFunctions(funcs);
+        pc_model->SetSpecialFunctions(funcs);
+
         // add information about the parameters to the log
         LOG << "Inference using resting state ASL model" << endl;
+        if (funcs.IsTabulated())
+            LOG << "Using tabulated special functions, estimated max error " << funcs.ErrorBound()
+                << endl;
         LOG << "INCLUSIONS:" << endl;
         if (inctiss)
             LOG << "Tissue" << endl;
@@ -63,7 +63,11 @@ static OptionSpec OPTIONS[] = {
     { "bolus_<n>", OPT_FLOAT, "Whether the bolus is on or off. E.g --bolus_1=1 --bolus_2=0. n<=7",
         OPT_NONREQ, "" },
     { "slice_shift", OPT_FLOAT, "Slice shifting factor (default: 1)", OPT_NONREQ, "" },
-    { "fa", OPT_FLOAT, "Flip angle in degrees", OPT_NONREQ, "30" }, { "" },
+    { "fa", OPT_FLOAT, "Flip angle in degrees", OPT_NONREQ, "30" },
+    { "tabulate", OPT_BOOL,
+        "Use tabulated erf and incomplete gamma functions in the dispersion kernels", OPT_NONREQ,
+        "" },
+    { "" },
 };
 
 void TurboQuasarFwdModel::GetOptions(vector<OptionSpec> &opts) const
@@ -170,6 +174,9 @@ void TurboQuasarFwdModel::Initialize(ArgsType &args)
     if ((tissard || artard || wmard) && !ardoff)
         doard = true;
 
+    // interpolated special functions for the kinetic curves
+    sf.SetTabulated(args.ReadBool("tabulate"));
+
     /* if (infertrailing) {
   if (!infertau) {
     // do not permit trailing edge inference without inferring on bolus length
@@ -276,6 +283,11 @@ void TurboQuasarFwdModel::Initialize(ArgsType &args)
     {
         LOG << "ARD subsystem is enabled" << endl;
     }
+    if (sf.IsTabulated())
+    {
+        LOG << "Using tabulated special functions, estimated max error " << sf.ErrorBound()
+            << endl;
+    }
     if (infertiss)
     {
         LOG << "Infertting on tissue component " << endl;
@@ -1405,15 +1417,15 @@ ColumnVector TurboQuasarFwdModel::kcblood_gammadisp(const ColumnVector &tis, flo
             {
                 kcblood(it) = kcblood(it)
                     + 2 * exp(-(ti - bolus_time_passed) / T_1b)
-                        * (1 - igamc(k, s * ((ti - bolus_time_passed) - deltblood)));
+                        * (1 - sf.Igamc(k, s * ((ti - bolus_time_passed) - deltblood)));
             }
             else //(ti > deltblood + taub)
             {
                 kcblood(it) = kcblood(it)
                     + 2 * exp(-(ti - bolus_time_passed) / T_1b)
-                        * (igamc(k,
+                        * (sf.Igamc(k,
                                s * ((ti - bolus_time_passed) - deltblood - current_bolus_duration))
-                              - igamc(k, s * ((ti - bolus_time_passed) - deltblood)));
+                              - sf.Igamc(k, s * ((ti - bolus_time_passed) - deltblood)));
             }
             // if (isnan(kcblood(it))) { kcblood(it)=0.0; cout << "Warning NaN
             // in blood KC"; }
@@ -1607,8 +1619,8 @@ ColumnVector TurboQuasarFwdModel::kcblood_gaussdisp(const ColumnVector &tis, flo
                 T_1b = T_1ll;
 
             kcblood(it) = 0.5 * exp(-(ti - bolus_time_passed) / T_1b)
-                * (MISCMATHS::erf(((ti - bolus_time_passed) - deltblood) / (sqrt2 * sig1))
-                              - MISCMATHS::erf(
+                * (sf.Erf(((ti - bolus_time_passed) - deltblood) / (sqrt2 * sig1))
+                              - sf.Erf(
                                     ((ti - bolus_time_passed) - deltblood + current_bolus_duration)
                                     / (sqrt2 * sig2)));
         }
@@ -1855,10 +1867,10 @@ ColumnVector TurboQuasarFwdModel::kctissue_gammadisp(const ColumnVector &tis, fl
                         * T_1app * T_1b * pow(B, -k)
                         * (exp(delttiss / T_1app + (ti - bolus_time_passed) / T_1b)
                                   * pow(s * T_1app * T_1b, k)
-                                  * (1 - igamc(k, B / (T_1app * T_1b)
+                                  * (1 - sf.Igamc(k, B / (T_1app * T_1b)
                                                  * ((ti - bolus_time_passed) - delttiss)))
                               + exp(delttiss / T_1b + (ti - bolus_time_passed) / T_1app) * pow(B, k)
-                                  * (-1 + igamc(k, s * ((ti - bolus_time_passed) - delttiss))));
+                                  * (-1 + sf.Igamc(k, s * ((ti - bolus_time_passed) - delttiss))));
             }
             else //(ti > delttiss + tau)
             {
@@ -1871,18 +1883,18 @@ ColumnVector TurboQuasarFwdModel::kctissue_gammadisp(const ColumnVector &tis, fl
                                         * (-1
                                               + exp((-1 / T_1app + 1 / T_1b)
                                                     * current_bolus_duration)
-                                                  * (1 - igamc(k, B / (T_1app * T_1b)
+                                                  * (1 - sf.Igamc(k, B / (T_1app * T_1b)
                                                                  * ((ti - bolus_time_passed)
                                                                        - delttiss)))
-                                              + igamc(k, B / (T_1app * T_1b)
+                                              + sf.Igamc(k, B / (T_1app * T_1b)
                                                         * ((ti - bolus_time_passed) - delttiss
                                                               - current_bolus_duration)))
                                     - exp(-A / (T_1app * T_1b)
                                           * ((ti - bolus_time_passed) - delttiss
                                                 - current_bolus_duration))
-                                        * C * B * (igamc(k, s * ((ti - bolus_time_passed) - delttiss
+                                        * C * B * (sf.Igamc(k, s * ((ti - bolus_time_passed) - delttiss
                                                                     - current_bolus_duration))
-                                                      - igamc(k, s * ((ti - bolus_time_passed)
+                                                      - sf.Igamc(k, s * ((ti - bolus_time_passed)
                                                                          - delttiss)))));
             }
             // if (isnan(kctissue(it))) { kctissue(it)=0.0; cout << "Warning NaN
@@ -1998,7 +2010,7 @@ ColumnVector TurboQuasarFwdModel::kctissue_gvf(const ColumnVector &tis, float de
             {
                 kctissue(it) = kctissue(it)
                     + 2 * 1 / (B * C) * exp(-((ti - bolus_time_passed) - delttiss) / T_1app) * sps
-                        * T_1app * T_1b * (1 - igamc(k, (s - 1 / T_1app - 1 / T_1b)
+                        * T_1app * T_1b * (1 - sf.Igamc(k, (s - 1 / T_1app - 1 / T_1b)
                                                        * ((ti - bolus_time_passed) - delttiss)))
                         * current_bolus_duration;
             }
@@ -2105,10 +2117,10 @@ ColumnVector TurboQuasarFwdModel::kctissue_gaussdisp(const ColumnVector &tis, fl
 
             kctissue(it) = kctissue(it)
                 + F / (2 * R)
-                    * ((MISCMATHS::erf(u1) - MISCMATHS::erf(u2)) * exp(R * (ti - bolus_time_passed))
-                          - (1 + MISCMATHS::erf(u1 - (R * sig1) / sqrt2))
+                    * ((sf.Erf(u1) - sf.Erf(u2)) * exp(R * (ti - bolus_time_passed))
+                          - (1 + sf.Erf(u1 - (R * sig1) / sqrt2))
                               * exp(R * (delttiss + (R * sig1 * sig1) / 2))
-                          + (1 + MISCMATHS::erf(u2 - (R * sig2) / sqrt2))
+                          + (1 + sf.Erf(u2 - (R * sig2) / sqrt2))
                               * exp(R * (delttiss + tau + (R * sig2 * sig2) / 2)));
         }
 
@@ -2124,7 +2136,7 @@ float TurboQuasarFwdModel::icgf(float a, float x) const
     // incomplete gamma function with a=k, based on the incomplete gamma
     // integral
 
-    return MISCMATHS::gamma(a) * igamc(a, x);
+    return sf.Icgf(a, x);
 }
 
 float TurboQuasarFwdModel::gvf(float t, float s, float p) const
@@ -2133,8 +2145,5 @@ float TurboQuasarFwdModel::gvf(float t, float s, float p) const
     // Form of Rausch 2000
     // NB this is basically a gamma pdf
 
-    if (t < 0)
-        return 0.0;
-    else
-        return pow(s, 1 + s * p) / MISCMATHS::gamma(1 + s * p) * pow(t, s * p) * exp(-s * t);
+    return sf.Gvf(t, s, p);
 }
@@ -7,6 +7,8 @@
 
 /*  CCOPYRIGHT */
 
+#include "asl_special_funcs.h"
+
 #include "fabber_core/fwdmodel.h"
 
 #include <string>
@@ -195,6 +197,9 @@ protected: // Constants
     float icgf(float a, float x) const;
     float gvf(float t, float s, float p) const;
 
+    // erf and incomplete gamma, optionally tabulated
+    OXASL::SpecialFunctions sf;
+
 private:
     /** Auto-register with forward model factory. */
     static FactoryRegistration<FwdModelFactory, TurboQuasarFwdModel> registration;
@@ -0,0 +1,53 @@
+// Tests for the ASL kinetic curve models
+
+#include "gtest/gtest.h"
+
+#include "asl_models.h"
+
+#include <newmat.h>
+
+using namespace OXASL;
+using NEWMAT::ColumnVector;
+
+namespace
+{
+// Check that the batched residue function gives the same values as evaluating
+// it one TI at a time. The TIs span the transit times of the models
+void CheckResidBatch(const ResidModel &model, const ColumnVector &residparam)
+{
+    const double fcalib = 0.01, T_1 = 1.3, T_1b = 1.65, lambda = 0.9;
+    ColumnVector tis(40);
+    for (int it = 1; it <= tis.Nrows(); it++)
+    {
+        tis(it) = 0.1 * it;
+    }
+
+    ColumnVector r;
+    model.resid_batch(r, tis, fcalib, T_1, T_1b, lambda, residparam);
+    ASSERT_EQ(tis.Nrows(), r.Nrows());
+    for (int it = 1; it <= tis.Nrows(); it++)
+    {
+        ASSERT_EQ(model.resid(tis(it), fcalib, T_1, T_1b, lambda, residparam), r(it))
+            << model.Name() << " at TI=" << tis(it);
+    }
+}
+
+TEST(AslModelsTest, ResidBatch)
+{
+    ColumnVector none;
+    CheckResidBatch(ResidModel_wellmix(), none);
+    CheckResidBatch(ResidModel_simple(), none);
+
+    ColumnVector transit(1);
+    transit << 1.5;
+    CheckResidBatch(ResidModel_imperm(), transit);
+
+    ColumnVector kw(1);
+    kw << 0.8;
+    CheckResidBatch(ResidModel_twocpt(), kw);
+
+    ColumnVector spa(3);
+    spa << 0.02 << 0.03 << 2;
+    CheckResidBatch(ResidModel_spa(), spa);
+}
+}
@@ -0,0 +1,58 @@
+// Tests for the tabulated special functions used by the ASL dispersion kernels
+
+#include "gtest/gtest.h"
+
+#include "asl_special_funcs.h"
+
+#include "miscmaths/miscmaths.h"
+
+#include <math.h>
+
+using namespace OXASL;
+
+namespace
+{
+// Test the tabulated erf against the exact function at points spaced more
+// finely than, and not aligned with, the table nodes, including points beyond
+// the end of the table
+TEST(AslSpecialFuncsTest, Erf)
+{
+    SpecialFunctions sf;
+    sf.SetTabulated(true);
+    double bound = SpecialFunctionTables::Get().ErfErrorBound();
+    ASSERT_GT(bound, 0);
+    for (double x = -7; x <= 7; x += 0.00037)
+    {
+        ASSERT_LE(fabs(sf.Erf(x) - MISCMATHS::erf(x)), bound) << "x=" << x;
+    }
+}
+
+// Test the tabulated incomplete gamma function against the exact function
+// over the tabulated range of a and x, and just beyond the end of the x range
+TEST(AslSpecialFuncsTest, Igamc)
+{
+    SpecialFunctions sf;
+    sf.SetTabulated(true);
+    double bound = sf.ErrorBound();
+    ASSERT_GT(bound, 0);
+    for (double a = SpecialFunctionTables::IGAM_AMIN; a <= SpecialFunctionTables::IGAM_AMAX;
+         a += 0.0237)
+    {
+        for (double x = 0; x <= SpecialFunctionTables::IGAM_XMAX + 1; x += 0.0431)
+        {
+            ASSERT_LE(fabs(sf.Igamc(a, x) - MISCMATHS::igamc(a, x)), bound)
+                << "a=" << a << " x=" << x;
+        }
+    }
+}
+
+// Test that the exact functions are used when tabulation is not enabled
+TEST(AslSpecialFuncsTest, NotTabulated)
+{
+    SpecialFunctions sf;
+    ASSERT_FALSE(sf.IsTabulated());
+    ASSERT_EQ(0, sf.ErrorBound());
+    ASSERT_EQ(MISCMATHS::erf(0.3), sf.Erf(0.3));
+    ASSERT_EQ(MISCMATHS::igamc(2.5, 1.7), sf.Igamc(2.5, 1.7));
+}
+}
@@ -61,20 +61,9 @@ void FreqShiftFwdModel::Initialize(ArgsType &args)
     prec_CSF = convertTo<double>(args.ReadWithDefault("precCSF","1e-1"));
     prec_DF = convertTo<double>(args.ReadWithDefault("precDF","1e-1"));
 
-    
-    string tau_temp; 
-
-    while (true)
-    {
-        int N = taus.Nrows()+1;
-        tau_temp = args.ReadWithDefault("tau"+stringify(N), "stop!");
-        if (tau_temp == "stop!") break;
-
-        ColumnVector tmp(1);
-        tmp = convertTo<double>(tau_temp);
-        taus &= tmp;
-
-    }
+    // tau values may be given as tau1=X, tau2=X and so on, as a comma separated list or
+    // as a matrix file
+    taus = args.GetColumnVector("tau");
 
     // get scan information
     TE = convertTo<double>(args.ReadWithDefault("TE", "0.082"));
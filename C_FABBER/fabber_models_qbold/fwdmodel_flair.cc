@@ -51,27 +51,14 @@ void FlairFwdModel::Initialize(ArgsType &args)
     prec_lam = convertTo<double>(args.ReadWithDefault("preclam","1e-1"));
     prec_M0  = convertTo<double>(args.ReadWithDefault("precM0","1e-6"));
 
-    // temporary holders for input values
-    string TI_temp;
-
     // Read TR, TE
     TR = convertTo<double>(args.ReadWithDefault("TR","3.000"));
     TE = convertTo<double>(args.ReadWithDefault("TE","0.082"));
 
 
-    // this parses through the input args for tau1=X, tau2=X and so on, until it reaches a tau
-    // that isn't supplied in the argument, and it adds all these to the ColumnVector taus
-    while (true)
-    {
-        int N = TIs.Nrows()+1;
-        TI_temp = args.ReadWithDefault("TI"+stringify(N), "stop!");
-        if (TI_temp == "stop!") break;
-
-        ColumnVector tmp(1);
-        tmp = convertTo<double>(TI_temp);
-        TIs &= tmp;
-
-    }
+    // TI values may be given as TI1=X, TI2=X and so on, as a comma separated list or
+    // as a matrix file
+    TIs = args.GetColumnVector("TI");
 
     // add information to the log
     LOG << "Inference using development model" << endl;    
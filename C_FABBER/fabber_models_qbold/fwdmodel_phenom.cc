@@ -76,18 +76,8 @@ void PhenomFwdModel::Initialize(ArgsType &args)
  
     if (tau_temp == "nope")
     {
-        // since there is no tau_start, read through individual taus as before:
-        while (true)
-        {
-            int N = taus.Nrows()+1;
-            tau_temp = args.ReadWithDefault("tau"+stringify(N), "stop!");
-            if (tau_temp == "stop!") break;
-
-            ColumnVector tmp(1);
-            tmp = convertTo<double>(tau_temp);
-            taus &= tmp;
-
-        }
+        // since there is no tau_start, read taus as a list, comma separated values or a file
+        taus = args.GetColumnVector("tau");
     } // if (tau_temp == "nope") 
 
     else
@@ -97,15 +87,19 @@ void PhenomFwdModel::Initialize(ArgsType &args)
         tau_end   = convertTo<double>(args.ReadWithDefault("tau_end", "0.064"));;
         tau_step  = convertTo<double>(args.ReadWithDefault("tau_step", "0.004"));;
 
-        // generate a column-vector of taus
-        double tau_val = tau_start;
+        // generate a column-vector of taus, sized once up front
+        int n_taus = 0;
+        for (double tau_val = tau_start; tau_val <= tau_end + 0.0001; tau_val += tau_step)
+        {
+            n_taus++;
+        }
 
         // populate the taus vector
-        while (tau_val <= tau_end + 0.0001)
+        taus.ReSize(n_taus);
+        double tau_val = tau_start;
+        for (int i = 1; i <= n_taus; i++)
         {
-            ColumnVector tmp(1);
-            tmp = tau_val;
-            taus &= tmp;
+            taus(i) = tau_val;
             tau_val += tau_step;
         }
         
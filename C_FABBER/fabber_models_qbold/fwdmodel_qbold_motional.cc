@@ -54,47 +54,37 @@ void MotionalFwdModel::Initialize(ArgsType &args)
     infer_S0  = args.ReadBool("inferS0");
     infer_lam = args.ReadBool("inferlam");
 
-    // temporary holders for input values
-    string tau_temp;
-    string TE_temp; 
-
     // First read tau values, since these will always be specified
 
-    // this parses through the input args for tau1=X, tau2=X and so on, until it reaches a tau
-    // that isn't supplied in the argument, and it adds all these to the ColumnVector taus
-    while (true)
-    {
-        int N = taus.Nrows()+1;
-        tau_temp = args.ReadWithDefault("tau"+stringify(N), "stop!");
-        if (tau_temp == "stop!") break;
-
-        ColumnVector tmp(1);
-        tmp = convertTo<double>(tau_temp);
-        taus &= tmp;
+    // tau values may be given as tau1=X, tau2=X and so on, as a comma separated list or
+    // as a matrix file
+    taus = args.GetColumnVector("tau");
 
+    // Then read TE values. A single TE (or a list of TEs, one for each tau) may be given,
+    // otherwise TE1, TE2, etc. are read, defaulting to 0.082 for any that are missing
+    TEvals.ReSize(taus.Nrows());
+    if (args.HaveKey("TE"))
+    {
+        ColumnVector TE_list = args.GetColumnVector("TE");
+        if (TE_list.Nrows() == 1)
+        {
+            TEvals = TE_list(1);
+        }
+        else if (TE_list.Nrows() == taus.Nrows())
+        {
+            TEvals = TE_list;
+        }
+        else
+        {
+            throw InvalidOptionValue("TE", args.GetString("TE"), "Must give a single TE or one for each tau");
+        }
     }
-
-    // Then read TE values
-
-    // see if there is a single TE specified
-    TE_temp = args.ReadWithDefault("TE","noTE");
-
-    // now loop through the number of tau values, and assign each one a TE
-    for (int i = 1; i <= taus.Nrows(); i++)
+    else
     {
-        // see if there is an input called "TE"
-        TE_temp = args.ReadWithDefault("TE","noTE");
-
-        // if there is no "TE", read TE1, TE2, etc.
-        if (TE_temp == "noTE")
+        for (int i = 1; i <= taus.Nrows(); i++)
         {
-            TE_temp = args.ReadWithDefault("TE"+stringify(i), "0.082");
+            TEvals(i) = args.GetDoubleDefault("TE"+stringify(i), 0.082);
         }
-
-        ColumnVector tmp(1);
-        tmp = convertTo<double>(TE_temp);
-        TEvals &= tmp;
-
     }
 
 
@@ -54,24 +54,11 @@ void sqBOLDFwdModel::Initialize(ArgsType &args)
 
     SR = convertTo<double>(args.ReadWithDefault("SR","1.0"));
 
-    // temporary holders for input values
-    string tau_temp;
-
     // First read tau values, since these will always be specified
 
-    // this parses through the input args for tau1=X, tau2=X and so on, until it reaches a tau
-    // that isn't supplied in the argument, and it adds all these to the ColumnVector taus
-    while (true)
-    {
-        int N = taus.Nrows()+1;
-        tau_temp = args.ReadWithDefault("tau"+stringify(N), "stop!");
-        if (tau_temp == "stop!") break;
-
-        ColumnVector tmp(1);
-        tmp = convertTo<double>(tau_temp);
-        taus &= tmp;
-
-    }
+    // tau values may be given as tau1=X, tau2=X and so on, as a comma separated list or
+    // as a matrix file
+    taus = args.GetColumnVector("tau");
 
     // add information to the log
     LOG << "Inference using development model" << endl;    
@@ -58,25 +58,11 @@ void TrustFwdModel::Initialize(ArgsType &args)
         infer_R2b = false;
     }
 
-    // temporary holders for input values
-    string TE_temp; 
-
-
     // First read tau values, since these will always be specified
 
-    // this parses through the input args for tau1=X, tau2=X and so on, until it reaches a tau
-    // that isn't supplied in the argument, and it adds all these to the ColumnVector taus
-    while (true)
-    {
-        int N = TEs.Nrows()+1;
-        TE_temp = args.ReadWithDefault("TE"+stringify(N), "stop!");
-        if (TE_temp == "stop!") break;
-
-        ColumnVector tmp(1);
-        tmp = convertTo<double>(TE_temp);
-        TEs &= tmp;
-
-    }
+    // TE values may be given as TE1=X, TE2=X and so on, as a comma separated list or
+    // as a matrix file
+    TEs = args.GetColumnVector("TE");
 
     // add information to the log
     LOG << "Inference using development model" << endl;